@@ -0,0 +1,284 @@
+/*
+ * Replays a trace recorded by bask_server record=<prefix> through the KSM
+ * engine, without a NIC or RDMA, e.g.
+ *   ./bask_replay /tmp/bask.0.trace no_pre_hash_opt
+ * and reports engine throughput, metadata footprint and per-phase latencies.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <xxhash.h>
+#include "ksm_engine.h"
+#include "bask_trace.h"
+
+// Engine errors are fatal here, there is no host to wait for
+void debug_stop(void) {
+    exit(1);
+}
+
+static long max_rss_kb(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static gint count_stable_item(gpointer key, gpointer value, gpointer data) {
+    if (((rmap_item*)value)->state == Stable) {
+        *(int*)data += 1;
+    }
+    return FALSE;
+}
+
+static void* alloc_pages(uint64_t num_pages) {
+    void* buf = malloc(num_pages * PAGE_SIZE);
+    if (!buf) {
+        fprintf(stderr, "[Replay] malloc for %lu pages failed.\n", (unsigned long)num_pages);
+    }
+    return buf;
+}
+
+int main(int argc, char **argv)
+{
+    struct ksm_metadata metadata;
+    struct ksm_log_table log_table;
+    struct worker_job work;
+    struct bask_trace_record rec;
+    struct bask_trace* trace;
+
+    struct shadow_pte* va2dma_map = NULL;
+    uint64_t entry_cnt = 0;
+    int mm_id = -1;
+
+    void* page_buf[2] = { NULL, NULL };
+    uint64_t page_buf_cap[2] = { 0, 0 };
+    int cur_buf = 0;
+
+    struct ksm_event_log* errors = NULL;
+    uint64_t* ids = NULL;
+
+    unsigned long total_pages = 0, total_logs = 0, iter_pages = 0;
+    uint64_t scan_ns = 0, iter_scan_ns = 0, start;
+    int iterations = 0, max_iterations = 0, ret;
+    unsigned int hot_region_pct = 0;
+
+    // Stable items and engine time up to every iteration, for the convergence point
+    int* stable_items = NULL;
+    uint64_t* engine_ns = NULL;
+
+    setbuf(stdout, NULL);
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <trace> [debug=1] [no_skip_opt] [no_pre_hash_opt] [old] [iters=<n>] [hot_regions=<pct>]\n", argv[0]);
+        return 1;
+    }
+
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "debug=1", 7) == 0) {
+            debug = 1;
+        } else if (strncmp(argv[i], "no_skip_opt", 11) == 0) {
+            smart_scan_opt = 0;
+        } else if (strncmp(argv[i], "no_pre_hash_opt", 15) == 0) {
+            pre_hash_opt = 0;
+        } else if (strncmp(argv[i], "old", 3) == 0) {
+            ksm_ops = cmp_and_merge_one_old;
+            smart_scan_opt = 0;
+            pre_hash_opt = 0;
+        } else if (strncmp(argv[i], "iters=", 6) == 0) {
+            max_iterations = atoi(argv[i] + 6);
+        } else if (strncmp(argv[i], "hot_regions=", 12) == 0) {
+            hot_region_pct = atoi(argv[i] + 12);
+        } else {
+            printf("Unknown argument: %s\n", argv[i]);
+        }
+    }
+
+    trace = bask_trace_open(argv[1]);
+    if (!trace) {
+        return 1;
+    }
+    printf("[Replay] %s: %s pages, no_skip_opt=%d, no_pre_hash_opt=%d\n", argv[1],
+        trace->flags & BASK_TRACE_FULL_PAGES ? "full" : "content id", !smart_scan_opt, !pre_hash_opt);
+
+    long base_rss_kb = max_rss_kb();
+
+    memset(&metadata, 0, sizeof(metadata));
+    memset(&log_table, 0, sizeof(log_table));
+    if (ksm_metadata_init(&metadata, &log_table) ||
+        init_pre_hash_pair_table(&metadata.pre_hash, &metadata.stats)) {
+        return 1;
+    }
+    // What the host would ask for, the trace still holds the pages it would have skipped
+    metadata.hot_region_pct = hot_region_pct;
+
+    while ((ret = bask_trace_next(trace, &rec)) > 0) {
+        switch (rec.type) {
+            case BASK_TRACE_ITER_START:
+                if (max_iterations && iterations >= max_iterations) {
+                    goto done;
+                }
+                metadata.iteration = rec.arg;
+                clear_log_table(&log_table);
+                iter_pages = 0;
+                iter_scan_ns = 0;
+                break;
+            case BASK_TRACE_ERRORS:
+                errors = realloc(errors, MAX(rec.cnt, 1) * sizeof(*errors));
+                if (!errors || bask_trace_read_payload(trace, errors, sizeof(*errors), rec.cnt)) {
+                    ret = -1;
+                    goto done;
+                }
+                for (uint64_t j = 0; j < rec.cnt; j++) {
+                    ksm_apply_error_log(&metadata, &log_table, &errors[j], j);
+                }
+                break;
+            case BASK_TRACE_MM:
+                free(va2dma_map);
+                va2dma_map = calloc(MAX(rec.cnt, 1), sizeof(*va2dma_map));
+                if (!va2dma_map || bask_trace_read_payload(trace, va2dma_map, sizeof(*va2dma_map), rec.cnt)) {
+                    ret = -1;
+                    goto done;
+                }
+                mm_id = rec.mm_id;
+                entry_cnt = rec.cnt;
+                // Recorded from a host with dirty tracking on
+                for (uint64_t j = 0; j < rec.cnt && !metadata.dirty_tracking; j++) {
+                    metadata.dirty_tracking = va2dma_map[j].va & SHADOW_PTE_UNCHANGED;
+                }
+                break;
+            case BASK_TRACE_PAGES:
+                if (rec.mm_id != mm_id || rec.arg + rec.cnt > entry_cnt) {
+                    fprintf(stderr, "[Replay] Pages of mm %d [%lu, +%lu) outside the map of mm %d\n",
+                        rec.mm_id, (unsigned long)rec.arg, (unsigned long)rec.cnt, mm_id);
+                    ret = -1;
+                    goto done;
+                }
+
+                // Two buffers, as on the server the pre-hash worker may still look at the last one
+                cur_buf ^= 1;
+                if (page_buf_cap[cur_buf] < rec.cnt) {
+                    free(page_buf[cur_buf]);
+                    page_buf[cur_buf] = alloc_pages(rec.cnt);
+                    page_buf_cap[cur_buf] = page_buf[cur_buf] ? rec.cnt : 0;
+                    if (!page_buf[cur_buf]) {
+                        ret = -1;
+                        goto done;
+                    }
+                }
+
+                if (trace->flags & BASK_TRACE_FULL_PAGES) {
+                    if (bask_trace_read_payload(trace, page_buf[cur_buf], PAGE_SIZE, rec.cnt)) {
+                        ret = -1;
+                        goto done;
+                    }
+                } else {
+                    ids = realloc(ids, MAX(rec.cnt, 1) * sizeof(*ids));
+                    if (!ids || bask_trace_read_payload(trace, ids, sizeof(*ids), rec.cnt)) {
+                        ret = -1;
+                        goto done;
+                    }
+                    for (uint64_t j = 0; j < rec.cnt; j++) {
+                        bask_trace_fill_page((char*)page_buf[cur_buf] + j * PAGE_SIZE, ids[j]);
+                    }
+                }
+
+                memset(&work, 0, sizeof(work));
+                work.metadata = &metadata;
+                work.log_table = &log_table;
+                work.mm_id = mm_id;
+                work.va2dma_map = va2dma_map;
+                work.pages_buf = page_buf[cur_buf];
+                work.num_pages = rec.cnt;
+                work.idx_adjust = rec.arg;
+
+                start = bask_stats_now();
+                ksm_scan_pages(&work);
+                iter_scan_ns += bask_stats_now() - start;
+                iter_pages += rec.cnt;
+                break;
+            case BASK_TRACE_ITER_END:
+                start = bask_stats_now();
+                ksm_finish_iteration(&metadata, &log_table);
+                iter_scan_ns += bask_stats_now() - start;
+
+                total_pages += iter_pages;
+                total_logs += log_table.cnt;
+                scan_ns += iter_scan_ns;
+
+                stable_items = realloc(stable_items, (iterations + 1) * sizeof(*stable_items));
+                engine_ns = realloc(engine_ns, (iterations + 1) * sizeof(*engine_ns));
+                if (!stable_items || !engine_ns) {
+                    ret = -1;
+                    goto done;
+                }
+                stable_items[iterations] = 0;
+                g_tree_foreach(metadata.rmap_tree, count_stable_item, &stable_items[iterations]);
+                engine_ns[iterations] = scan_ns;
+
+                printf("[Replay] iter %d, pages, %lu, logs, %d, rmap_items, %d, stable_items, %d, stable_nodes, %d, unstable_nodes, %d, skipped, %lu, broken, %lu, ms, %.2f\n",
+                    metadata.iteration, iter_pages, log_table.cnt, g_tree_nnodes(metadata.rmap_tree), stable_items[iterations],
+                    g_hash_table_size(metadata.stable_hash_table), g_hash_table_size(metadata.unstable_hash_table),
+                    metadata.stats.skipped_cnt, metadata.stats.broken_merges, iter_scan_ns / 1000000.0);
+
+                bask_stats_gauge(0, BASK_GAUGE_RMAP_ITEMS, g_tree_nnodes(metadata.rmap_tree));
+                bask_stats_gauge(0, BASK_GAUGE_STABLE_NODES, g_hash_table_size(metadata.stable_hash_table));
+                bask_stats_gauge(0, BASK_GAUGE_UNSTABLE_NODES, g_hash_table_size(metadata.unstable_hash_table));
+                bask_stats_gauge(0, BASK_GAUGE_LOG_CAPACITY, log_table.capacity);
+
+                iterations += 1;
+                memset(&metadata.stats, 0, sizeof(metadata.stats));
+                break;
+            default:
+                fprintf(stderr, "[Replay] Unknown record type %u\n", rec.type);
+                ret = -1;
+                goto done;
+        }
+    }
+
+done:
+    if (ret < 0) {
+        fprintf(stderr, "[Replay] Truncated or corrupt trace, stopping after %d iterations\n", iterations);
+    }
+
+    int items = g_tree_nnodes(metadata.rmap_tree);
+    // Page buffers are the NIC's read buffers, not metadata
+    long page_buf_kb = (page_buf_cap[0] + page_buf_cap[1]) * PAGE_SIZE / 1024;
+    long rss_kb = max_rss_kb() - base_rss_kb - page_buf_kb;
+
+    printf("[Replay] iterations, %d, pages, %lu, logs, %lu, engine_s, %.3f, pages_per_s, %.0f\n",
+        iterations, total_pages, total_logs, scan_ns / 1e9, scan_ns ? total_pages * 1e9 / scan_ns : 0.0);
+    printf("[Replay] rmap_items, %d, stable_nodes, %d, page_buf_kb, %ld, max_rss_growth_kb, %ld, bytes_per_item, %.1f, sizeof rmap_item, %zu, stable_node, %zu\n",
+        items, g_hash_table_size(metadata.stable_hash_table), page_buf_kb, rss_kb,
+        items ? rss_kb * 1024.0 / items : 0.0, sizeof(rmap_item), sizeof(struct stable_node));
+
+    // Convergence: first iteration within 1% of the most Stable items seen
+    int max_stable = 0, converge_iter = -1;
+    for (int i = 0; i < iterations; i++) {
+        max_stable = MAX(max_stable, stable_items[i]);
+    }
+    for (int i = 0; i < iterations && max_stable; i++) {
+        if (stable_items[i] >= max_stable * 0.99) {
+            converge_iter = i;
+            break;
+        }
+    }
+    printf("[Replay] max_stable_items, %d, converge_iter, %d, converge_s, %.3f\n", max_stable, converge_iter,
+        converge_iter >= 0 ? engine_ns[converge_iter] / 1e9 : 0.0);
+    bask_stats_dump(stdout);
+
+    stop_pre_hash_pair_table(&metadata.pre_hash);
+    ksm_metadata_destroy(&metadata, &log_table);
+    bask_trace_close(trace);
+    free(page_buf[0]);
+    free(page_buf[1]);
+    free(va2dma_map);
+    free(errors);
+    free(ids);
+    free(stable_items);
+    free(engine_ns);
+    return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,335 @@
+#ifndef BASK_STATS_H
+#define BASK_STATS_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * Server statistics: every thread records into its own histograms and
+ * counters, so the hot path never takes a lock or bounces a cache line.
+ * Only the owner thread writes a slot (plain relaxed load + store), readers
+ * merge all threads on demand. Thread slots live for the whole process, so
+ * totals survive tenant threads coming and going.
+ */
+
+enum bask_phase {
+    BASK_PHASE_RDMA_READ,
+    BASK_PHASE_HASH,
+    BASK_PHASE_LOOKUP,
+    BASK_PHASE_MERGE,       // one page through ksm_ops, the merge decision
+    BASK_PHASE_LOG_INSERT,
+    BASK_PHASE_PRUNE,
+    BASK_PHASE_NUM,
+};
+
+static const char *bask_phase_str[BASK_PHASE_NUM] = {
+    "rdma_read", "hash", "lookup", "merge", "log_insert", "prune",
+};
+
+enum bask_counter {
+    BASK_CNT_BYTES_READ,
+    BASK_CNT_PAGES_SCANNED,
+    BASK_CNT_PAGES_SKIPPED,
+    BASK_CNT_LOGS,
+    BASK_CNT_NUM,
+};
+
+static const char *bask_counter_str[BASK_CNT_NUM] = {
+    "bytes_read", "pages_scanned", "pages_skipped", "logs",
+};
+
+// Table sizes, last value per tenant
+enum bask_gauge {
+    BASK_GAUGE_RMAP_ITEMS,
+    BASK_GAUGE_STABLE_NODES,
+    BASK_GAUGE_UNSTABLE_NODES,
+    BASK_GAUGE_LOG_CAPACITY,
+    BASK_GAUGE_NUM,
+};
+
+static const char *bask_gauge_str[BASK_GAUGE_NUM] = {
+    "rmap_items", "stable_nodes", "unstable_nodes", "log_capacity",
+};
+
+#define BASK_STATS_MAX_TENANTS 16
+
+/*
+ * HDR-style buckets: one group per power of two, each split into
+ * BASK_HIST_SUB linear sub-buckets, so quantiles are within 1/BASK_HIST_SUB
+ * of the recorded value over the whole 64-bit range.
+ */
+#define BASK_HIST_SUB_BITS 4
+#define BASK_HIST_SUB (1 << BASK_HIST_SUB_BITS)
+#define BASK_HIST_BUCKETS (64 * BASK_HIST_SUB)
+
+struct bask_hist {
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[BASK_HIST_BUCKETS];
+};
+
+struct bask_thread_stats {
+    struct bask_thread_stats *next;
+    struct bask_hist phases[BASK_PHASE_NUM];
+    _Atomic uint64_t counters[BASK_CNT_NUM];
+};
+
+static pthread_mutex_t bask_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bask_thread_stats *bask_stats_threads;
+static __thread struct bask_thread_stats *bask_stats_tls;
+static _Atomic uint64_t bask_stats_gauges[BASK_STATS_MAX_TENANTS][BASK_GAUGE_NUM];
+
+static inline uint64_t bask_stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline int bask_hist_index(uint64_t v)
+{
+    if (v < BASK_HIST_SUB) {
+        return v;
+    }
+    int shift = 63 - __builtin_clzll(v) - BASK_HIST_SUB_BITS;
+    return (shift + 1) * BASK_HIST_SUB + ((v >> shift) & (BASK_HIST_SUB - 1));
+}
+
+// Largest value that lands in bucket idx
+static inline uint64_t bask_hist_value(int idx)
+{
+    if (idx < BASK_HIST_SUB) {
+        return idx;
+    }
+    int shift = idx / BASK_HIST_SUB - 1;
+    uint64_t base = BASK_HIST_SUB | (idx % BASK_HIST_SUB);
+    return ((base + 1) << shift) - 1;
+}
+
+// Single writer: no read-modify-write instruction needed
+static inline void bask_stats_add(_Atomic uint64_t *v, uint64_t d)
+{
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + d, memory_order_relaxed);
+}
+
+static struct bask_thread_stats *bask_stats_self_slow(void)
+{
+    struct bask_thread_stats *ts = calloc(1, sizeof(*ts));
+    if (!ts) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&bask_stats_lock);
+    ts->next = bask_stats_threads;
+    bask_stats_threads = ts;
+    pthread_mutex_unlock(&bask_stats_lock);
+
+    bask_stats_tls = ts;
+    return ts;
+}
+
+static inline struct bask_thread_stats *bask_stats_self(void)
+{
+    return bask_stats_tls ? bask_stats_tls : bask_stats_self_slow();
+}
+
+static inline void bask_stats_record(enum bask_phase phase, uint64_t ns)
+{
+    struct bask_thread_stats *ts = bask_stats_self();
+    if (!ts) {
+        return;
+    }
+
+    struct bask_hist *h = &ts->phases[phase];
+    bask_stats_add(&h->buckets[bask_hist_index(ns)], 1);
+    bask_stats_add(&h->sum, ns);
+    if (ns > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+        atomic_store_explicit(&h->max, ns, memory_order_relaxed);
+    }
+}
+
+static inline void bask_stats_since(enum bask_phase phase, uint64_t start_ns)
+{
+    bask_stats_record(phase, bask_stats_now() - start_ns);
+}
+
+static inline void bask_stats_count(enum bask_counter counter, uint64_t n)
+{
+    struct bask_thread_stats *ts = bask_stats_self();
+    if (ts) {
+        bask_stats_add(&ts->counters[counter], n);
+    }
+}
+
+static inline void bask_stats_gauge(int tenant, enum bask_gauge gauge, uint64_t value)
+{
+    if (tenant >= 0 && tenant < BASK_STATS_MAX_TENANTS) {
+        atomic_store_explicit(&bask_stats_gauges[tenant][gauge], value, memory_order_relaxed);
+    }
+}
+
+// Bucket upper bound, capped by the largest value actually recorded
+static uint64_t bask_hist_quantile(const uint64_t *buckets, uint64_t count, uint64_t max, double q)
+{
+    uint64_t rank = (uint64_t)(q * count + 0.5), seen = 0;
+
+    rank = rank ? rank : 1;
+    for (int i = 0; i < BASK_HIST_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return bask_hist_value(i) < max ? bask_hist_value(i) : max;
+        }
+    }
+    return 0;
+}
+
+// Merge every thread's slot and print one line per phase, counter and gauge
+static void bask_stats_dump(FILE *out)
+{
+    static uint64_t buckets[BASK_HIST_BUCKETS];
+    static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+    struct bask_thread_stats *ts;
+
+    pthread_mutex_lock(&dump_lock);
+    fprintf(out, "# phase <name> count <n> mean_ns <ns> p50_ns <ns> p90_ns <ns> p99_ns <ns> p999_ns <ns> max_ns <ns>\n");
+
+    for (int p = 0; p < BASK_PHASE_NUM; p++) {
+        uint64_t count = 0, sum = 0, max = 0;
+
+        memset(buckets, 0, sizeof(buckets));
+        pthread_mutex_lock(&bask_stats_lock);
+        for (ts = bask_stats_threads; ts; ts = ts->next) {
+            struct bask_hist *h = &ts->phases[p];
+            for (int i = 0; i < BASK_HIST_BUCKETS; i++) {
+                buckets[i] += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+            }
+            sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+            uint64_t m = atomic_load_explicit(&h->max, memory_order_relaxed);
+            max = m > max ? m : max;
+        }
+        pthread_mutex_unlock(&bask_stats_lock);
+
+        // Count from the buckets, so quantiles stay consistent with a racing writer
+        for (int i = 0; i < BASK_HIST_BUCKETS; i++) {
+            count += buckets[i];
+        }
+
+        fprintf(out, "phase %s count %lu mean_ns %lu p50_ns %lu p90_ns %lu p99_ns %lu p999_ns %lu max_ns %lu\n",
+            bask_phase_str[p], (unsigned long)count, (unsigned long)(count ? sum / count : 0),
+            (unsigned long)bask_hist_quantile(buckets, count, max, 0.5),
+            (unsigned long)bask_hist_quantile(buckets, count, max, 0.9),
+            (unsigned long)bask_hist_quantile(buckets, count, max, 0.99),
+            (unsigned long)bask_hist_quantile(buckets, count, max, 0.999),
+            (unsigned long)max);
+    }
+
+    for (int c = 0; c < BASK_CNT_NUM; c++) {
+        uint64_t total = 0;
+
+        pthread_mutex_lock(&bask_stats_lock);
+        for (ts = bask_stats_threads; ts; ts = ts->next) {
+            total += atomic_load_explicit(&ts->counters[c], memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&bask_stats_lock);
+        fprintf(out, "counter %s %lu\n", bask_counter_str[c], (unsigned long)total);
+    }
+
+    for (int t = 0; t < BASK_STATS_MAX_TENANTS; t++) {
+        for (int g = 0; g < BASK_GAUGE_NUM; g++) {
+            uint64_t v = atomic_load_explicit(&bask_stats_gauges[t][g], memory_order_relaxed);
+            if (v) {
+                fprintf(out, "gauge %d %s %lu\n", t, bask_gauge_str[g], (unsigned long)v);
+            }
+        }
+    }
+    pthread_mutex_unlock(&dump_lock);
+}
+
+/*
+ * Text endpoint on a Unix socket: every connection gets one dump and is
+ * closed, e.g. `socat - UNIX-CONNECT:/tmp/bask_stats.sock`.
+ */
+static void *bask_stats_server(void *arg)
+{
+    int listen_fd = (int)(intptr_t)arg;
+
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // Out of fds or memory: wait for some to be freed instead of spinning
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                sleep(1);
+                continue;
+            }
+            perror("[Stats] accept");
+            break;
+        }
+
+        FILE *out = fdopen(fd, "w");
+        if (!out) {
+            close(fd);
+            continue;
+        }
+        bask_stats_dump(out);
+        fclose(out);
+    }
+    close(listen_fd);
+    return NULL;
+}
+
+static int bask_stats_start_server(const char *path)
+{
+    struct sockaddr_un addr;
+    pthread_t thread;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "[Stats] Socket path too long: %s\n", path);
+        return -1;
+    }
+
+    // A reader that hangs up mid-dump must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("[Stats] socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 4)) {
+        perror("[Stats] bind/listen");
+        close(fd);
+        return -1;
+    }
+
+    if (pthread_create(&thread, NULL, bask_stats_server, (void *)(intptr_t)fd)) {
+        fprintf(stderr, "[Stats] Failed to start stats thread\n");
+        close(fd);
+        return -1;
+    }
+    pthread_detach(thread);
+
+    printf("[Stats] Serving stats on %s\n", path);
+    return 0;
+}
+
+#endif
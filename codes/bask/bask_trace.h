@@ -0,0 +1,213 @@
+#ifndef BASK_TRACE_H
+#define BASK_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xxhash.h>
+
+#include "ksm_engine.h"
+
+/*
+ * Trace of what one tenant fed into the KSM engine, written by the server
+ * with record=<prefix> and played back by bask_replay without RDMA.
+ *
+ * A file is a bask_trace_header followed by records. Every record is a
+ * bask_trace_record and cnt payload elements:
+ *   ITER_START  arg = iteration
+ *   ERRORS      cnt struct ksm_event_log, the host's error table
+ *   MM          mm_id, cnt struct shadow_pte, the mm's va2dma_map as sent,
+ *               SHADOW_PTE_UNCHANGED and SHADOW_PTE_THP tags included
+ *   PAGES       mm_id, arg = index of the first page in the map, cnt pages
+ *   ITER_END    arg = scanned pages
+ * PAGES carry a uint64_t content id per page, or the full pages when the
+ * header has BASK_TRACE_FULL_PAGES. Equal pages get equal ids, 0 is the zero
+ * page, so replay rebuilds a page with the same merge outcome from its id.
+ * Pages tagged unchanged were not read and are recorded as zero pages.
+ */
+
+#define BASK_TRACE_MAGIC "BASKTRC1"
+#define BASK_TRACE_VERSION 1
+
+#define BASK_TRACE_FULL_PAGES 0x1
+
+struct bask_trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+};
+
+enum bask_trace_type {
+    BASK_TRACE_ITER_START = 1,
+    BASK_TRACE_ERRORS,
+    BASK_TRACE_MM,
+    BASK_TRACE_PAGES,
+    BASK_TRACE_ITER_END,
+};
+
+struct bask_trace_record {
+    uint32_t type;
+    int32_t mm_id;
+    uint64_t arg;
+    uint64_t cnt;
+};
+
+struct bask_trace {
+    FILE *file;
+    uint32_t flags;
+    int failed;
+};
+
+static inline uint64_t bask_trace_page_id(const void *page)
+{
+    const uint64_t *words = page;
+
+    for (int i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+        if (words[i]) {
+            uint64_t id = XXH3_64bits(page, PAGE_SIZE);
+            return id ? id : 1;
+        }
+    }
+    return 0;
+}
+
+// Deterministic page for a content id, distinct ids give distinct pages
+static inline void bask_trace_fill_page(void *page, uint64_t id)
+{
+    uint64_t *words = page, x = id;
+
+    if (!id) {
+        memset(page, 0, PAGE_SIZE);
+        return;
+    }
+    for (int i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+        // splitmix64
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        words[i] = z ^ (z >> 31);
+    }
+    words[0] = id;
+}
+
+static struct bask_trace *bask_trace_create(const char *path, uint32_t flags)
+{
+    struct bask_trace_header header;
+    struct bask_trace *trace = calloc(1, sizeof(*trace));
+
+    if (!trace) {
+        return NULL;
+    }
+    trace->file = fopen(path, "wb");
+    if (!trace->file) {
+        perror("[Trace] fopen");
+        free(trace);
+        return NULL;
+    }
+    trace->flags = flags;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BASK_TRACE_MAGIC, sizeof(header.magic));
+    header.version = BASK_TRACE_VERSION;
+    header.flags = flags;
+    if (fwrite(&header, sizeof(header), 1, trace->file) != 1) {
+        trace->failed = 1;
+    }
+    return trace;
+}
+
+static struct bask_trace *bask_trace_open(const char *path)
+{
+    struct bask_trace_header header;
+    struct bask_trace *trace = calloc(1, sizeof(*trace));
+
+    if (!trace) {
+        return NULL;
+    }
+    trace->file = fopen(path, "rb");
+    if (!trace->file) {
+        perror("[Trace] fopen");
+        free(trace);
+        return NULL;
+    }
+
+    if (fread(&header, sizeof(header), 1, trace->file) != 1 ||
+        memcmp(header.magic, BASK_TRACE_MAGIC, sizeof(header.magic)) ||
+        header.version != BASK_TRACE_VERSION) {
+        fprintf(stderr, "[Trace] %s is not a version %d trace\n", path, BASK_TRACE_VERSION);
+        fclose(trace->file);
+        free(trace);
+        return NULL;
+    }
+    trace->flags = header.flags;
+    return trace;
+}
+
+static void bask_trace_close(struct bask_trace *trace)
+{
+    if (!trace) {
+        return;
+    }
+    if (trace->failed) {
+        fprintf(stderr, "[Trace] Write failed, the trace is truncated\n");
+    }
+    fclose(trace->file);
+    free(trace);
+}
+
+// A failed write marks the trace and drops everything after it
+static void bask_trace_write(struct bask_trace *trace, enum bask_trace_type type, int mm_id,
+    uint64_t arg, uint64_t cnt, const void *payload, size_t elem_size)
+{
+    struct bask_trace_record rec = { type, mm_id, arg, cnt };
+
+    if (trace->failed) {
+        return;
+    }
+    if (fwrite(&rec, sizeof(rec), 1, trace->file) != 1 ||
+        (cnt && fwrite(payload, elem_size, cnt, trace->file) != cnt)) {
+        trace->failed = 1;
+    }
+}
+
+static void bask_trace_write_pages(struct bask_trace *trace, int mm_id, uint64_t first_idx,
+    const void *pages, uint64_t num_pages)
+{
+    uint64_t *ids;
+
+    if (trace->flags & BASK_TRACE_FULL_PAGES) {
+        bask_trace_write(trace, BASK_TRACE_PAGES, mm_id, first_idx, num_pages, pages, PAGE_SIZE);
+        return;
+    }
+
+    ids = malloc(num_pages * sizeof(*ids));
+    if (!ids) {
+        trace->failed = 1;
+        return;
+    }
+    for (uint64_t i = 0; i < num_pages; i++) {
+        ids[i] = bask_trace_page_id((const char *)pages + i * PAGE_SIZE);
+    }
+    bask_trace_write(trace, BASK_TRACE_PAGES, mm_id, first_idx, num_pages, ids, sizeof(*ids));
+    free(ids);
+}
+
+// Returns 1 with rec filled, 0 at the end of the trace, -1 on a short record
+static int bask_trace_next(struct bask_trace *trace, struct bask_trace_record *rec)
+{
+    size_t n = fread(rec, 1, sizeof(*rec), trace->file);
+
+    if (n == 0 && feof(trace->file)) {
+        return 0;
+    }
+    return n == sizeof(*rec) ? 1 : -1;
+}
+
+// Payload of the record just returned by bask_trace_next
+static int bask_trace_read_payload(struct bask_trace *trace, void *buf, size_t elem_size, uint64_t cnt)
+{
+    return fread(buf, elem_size, cnt, trace->file) == cnt ? 0 : -1;
+}
+
+#endif
@@ -0,0 +1,208 @@
+/*
+ * Synthetic VM memory for bask_replay: writes a content id trace of a set of
+ * VMs scanned for a number of iterations, e.g.
+ *   ./bask_workload vms=8 pages=1048576 dup=0.3 volatile=0.05 | ./bask_replay /dev/stdin
+ *
+ * Every page starts as a zero page, a copy of the same page in VM 0 (clone),
+ * a page of a shared pool picked with Zipf popularity (libraries, page cache),
+ * or unique content. A fixed hot set of pages is rewritten with fresh unique
+ * content at every iteration with probability write_prob.
+ *
+ * There is no host to apply merges, so a page's kpfn is derived from its
+ * content, as if the host had already merged equal pages. Stable items keep a
+ * matching pfn and a rewrite shows up as a mapping change, like a COW break.
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xxhash.h>
+#include "ksm_engine.h"
+#include "bask_trace.h"
+
+#define WORKLOAD_VA_BASE 0x10000000UL
+#define POOL_ID_BASE (1ULL << 62)
+
+struct workload {
+    int vms;
+    uint64_t pages;         // per VM
+    int iters;
+    double zero;
+    double dup;
+    uint64_t pool;
+    double skew;
+    double clone;
+    double hot;             // fraction of pages in the write hot set
+    double write_prob;
+    uint64_t seed;
+};
+
+static uint64_t rng_state;
+
+void debug_stop(void) {
+    exit(1);
+}
+
+static uint64_t rng_next(void) {
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double rng_double(void) {
+    return (rng_next() >> 11) * (1.0 / (1ULL << 53));
+}
+
+// Cumulative Zipf distribution over the shared pool
+static double* zipf_cdf(uint64_t n, double skew) {
+    double sum = 0, *cdf = malloc(n * sizeof(double));
+    if (!cdf) {
+        return NULL;
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        sum += 1.0 / pow(i + 1, skew);
+        cdf[i] = sum;
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        cdf[i] /= sum;
+    }
+    return cdf;
+}
+
+static uint64_t zipf_pick(const double* cdf, uint64_t n) {
+    double r = rng_double();
+    uint64_t lo = 0, hi = n - 1;
+    while (lo < hi) {
+        uint64_t mid = (lo + hi) / 2;
+        if (cdf[mid] < r) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static unsigned long content_kpfn(uint64_t id) {
+    return id + 1;
+}
+
+int main(int argc, char **argv)
+{
+    struct workload w = {
+        .vms = 4, .pages = 262144, .iters = 10,
+        .zero = 0.1, .dup = 0.3, .pool = 0, .skew = 1.0, .clone = 0,
+        .hot = 0.05, .write_prob = 0.5, .seed = 1,
+    };
+    const char* out = "/dev/stdout";
+    uint64_t next_unique = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "vms=", 4) == 0) {
+            w.vms = MAX(atoi(argv[i] + 4), 1);
+        } else if (strncmp(argv[i], "pages=", 6) == 0) {
+            w.pages = MAX(strtoull(argv[i] + 6, NULL, 10), 1);
+        } else if (strncmp(argv[i], "iters=", 6) == 0) {
+            w.iters = atoi(argv[i] + 6);
+        } else if (strncmp(argv[i], "zero=", 5) == 0) {
+            w.zero = atof(argv[i] + 5);
+        } else if (strncmp(argv[i], "dup=", 4) == 0) {
+            w.dup = atof(argv[i] + 4);
+        } else if (strncmp(argv[i], "pool=", 5) == 0) {
+            w.pool = strtoull(argv[i] + 5, NULL, 10);
+        } else if (strncmp(argv[i], "skew=", 5) == 0) {
+            w.skew = atof(argv[i] + 5);
+        } else if (strncmp(argv[i], "clone=", 6) == 0) {
+            w.clone = atof(argv[i] + 6);
+        } else if (strncmp(argv[i], "volatile=", 9) == 0) {
+            w.hot = atof(argv[i] + 9);
+        } else if (strncmp(argv[i], "write_prob=", 11) == 0) {
+            w.write_prob = atof(argv[i] + 11);
+        } else if (strncmp(argv[i], "seed=", 5) == 0) {
+            w.seed = strtoull(argv[i] + 5, NULL, 10);
+        } else if (strncmp(argv[i], "out=", 4) == 0) {
+            out = argv[i] + 4;
+        } else {
+            fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (!w.pool) {
+        w.pool = MAX(w.pages / 64, 1);
+    }
+    rng_state = w.seed;
+
+    fprintf(stderr, "[Workload] vms=%d pages=%lu iters=%d zero=%.2f dup=%.2f pool=%lu skew=%.2f clone=%.2f volatile=%.2f write_prob=%.2f\n",
+        w.vms, (unsigned long)w.pages, w.iters, w.zero, w.dup, (unsigned long)w.pool, w.skew, w.clone, w.hot, w.write_prob);
+
+    double* cdf = zipf_cdf(w.pool, w.skew);
+    uint64_t* ids = malloc(w.vms * w.pages * sizeof(uint64_t));
+    struct shadow_pte* map = malloc(w.pages * sizeof(struct shadow_pte));
+    if (!cdf || !ids || !map) {
+        fprintf(stderr, "[Workload] Out of memory for %lu pages\n", (unsigned long)(w.vms * w.pages));
+        return 1;
+    }
+
+    // Initial images, VM 0 first so that clones can copy it
+    for (int vm = 0; vm < w.vms; vm++) {
+        uint64_t* vm_ids = ids + vm * w.pages;
+        for (uint64_t p = 0; p < w.pages; p++) {
+            double r = rng_double();
+            if (vm > 0 && rng_double() < w.clone) {
+                vm_ids[p] = ids[p];
+            } else if (r < w.zero) {
+                vm_ids[p] = 0;
+            } else if (r < w.zero + w.dup) {
+                vm_ids[p] = POOL_ID_BASE | zipf_pick(cdf, w.pool);
+            } else {
+                vm_ids[p] = next_unique++;
+            }
+        }
+    }
+
+    struct bask_trace* trace = bask_trace_create(out, 0);
+    if (!trace) {
+        return 1;
+    }
+
+    uint64_t hot_pages = w.hot * w.pages;
+    for (int iter = 0; iter < w.iters; iter++) {
+        bask_trace_write(trace, BASK_TRACE_ITER_START, -1, iter, 0, NULL, 0);
+
+        for (int vm = 0; vm < w.vms; vm++) {
+            uint64_t* vm_ids = ids + vm * w.pages;
+
+            // The hot set is the head of every VM, rewritten between scans
+            if (iter > 0) {
+                for (uint64_t p = 0; p < hot_pages; p++) {
+                    if (rng_double() < w.write_prob) {
+                        vm_ids[p] = next_unique++;
+                    }
+                }
+            }
+
+            for (uint64_t p = 0; p < w.pages; p++) {
+                map[p].va = WORKLOAD_VA_BASE + p * PAGE_SIZE;
+                map[p].kpfn = content_kpfn(vm_ids[p]);
+            }
+            bask_trace_write(trace, BASK_TRACE_MM, vm, 0, w.pages, map, sizeof(*map));
+
+            for (uint64_t first = 0; first < w.pages; first += MAX_PAGES_IN_SGL) {
+                uint64_t n = MIN(w.pages - first, MAX_PAGES_IN_SGL);
+                bask_trace_write(trace, BASK_TRACE_PAGES, vm, first, n, vm_ids + first, sizeof(uint64_t));
+            }
+        }
+
+        bask_trace_write(trace, BASK_TRACE_ITER_END, -1, w.vms * w.pages, 0, NULL, 0);
+    }
+
+    int failed = trace->failed;
+    bask_trace_close(trace);
+    free(cdf);
+    free(ids);
+    free(map);
+    return failed ? 1 : 0;
+}
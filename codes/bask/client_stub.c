@@ -3,6 +3,8 @@
 #include <linux/export.h>
 #include <linux/wait.h>
 #include <linux/inet.h>
+#include <linux/random.h>
+#include <linux/mutex.h>
 #include "linux/dma-direction.h"
 #include "linux/scatterlist.h"
 #include "rdma/ib_verbs.h"
@@ -58,6 +60,38 @@ void debug_stop(void) {
 	}
 }
 
+/*
+ * Dataplane results. Every receive is copied out and reposted by the CQ
+ * handler: synchronous results land in styx_sync_rx, the in-flight
+ * asynchronous batch gets its results and completion callback directly.
+ * Two receive buffers are posted once async submission is in use, and a
+ * result may land in either of them.
+ */
+static struct batch_operation_result styx_sync_rx;
+
+static struct {
+	bool setup;
+	bool inflight;
+	int id;
+	struct styx_batch *batch;
+
+	struct ib_send_wr inv_wr;
+	struct ib_reg_wr reg_wr;
+	struct ib_send_wr send_wr;
+	struct ib_sge desc_sgl;
+	u64 desc_dma_addr;
+	struct batch_operation_descriptor desc_tx __aligned(16);
+
+	struct ib_recv_wr recv_wr;
+	struct ib_sge result_sgl;
+	u64 result_dma_addr;
+	struct batch_operation_result result_rx __aligned(16);
+
+	struct scatterlist *sgt;
+	struct ib_mr *mr;
+	bool mr_valid;
+} styx_async;
+
 int ksm_rdma_cma_event_handler(struct rdma_cm_id *cma_id,
 				   struct rdma_cm_event *event)
 {
@@ -126,14 +160,65 @@ int ksm_rdma_cma_event_handler(struct rdma_cm_id *cma_id,
 	return 0;
 }
 
+/*
+ * With global_rkey=1 the PD exposes all host memory to the NIC under one
+ * rkey, so dataplane ops name their pages by DMA address and skip the
+ * per-op REG_MR and LOCAL_INV. Like the MR path, which already maps
+ * page_to_phys(), this needs the IOMMU off or in passthrough.
+ */
+static inline bool ksm_rdma_styx_global_rkey(struct ksm_cb *cb)
+{
+	return cb->pd->flags & IB_PD_UNSAFE_GLOBAL_RKEY;
+}
+
+/* Returns 1 when the receive completed an asynchronous batch */
+static int ksm_rdma_styx_recv(struct ksm_cb *cb, struct ib_wc *wc) {
+	const struct ib_recv_wr *bad_wr;
+	struct ib_recv_wr *recv_wr = &cb->single_op_recv_wr;
+	struct batch_operation_result *rx = &cb->single_op_result_rx;
+	struct styx_batch *batch;
+	int i, ret;
+
+	if (wc->wr_id == WR_RECV_ASYNC_RESULT) {
+		recv_wr = &styx_async.recv_wr;
+		rx = &styx_async.result_rx;
+	}
+
+	DEBUG_LOG("Recved result: cmd %d, id %d\n", rx->cmd, rx->id);
+
+	batch = READ_ONCE(styx_async.inflight) && rx->cmd == PAGE_BATCH && rx->id == styx_async.id ?
+		styx_async.batch : NULL;
+	if (batch) {
+		for (i = 0; i < batch->op_cnt; i++)
+			batch->ops[i].value = rx->results[i].value;
+	} else {
+		memcpy(&styx_sync_rx, rx, sizeof(styx_sync_rx));
+	}
+
+	ret = ib_post_recv(cb->qp, recv_wr, &bad_wr);
+	if (ret) {
+		printk(KERN_ERR PFX "post recv error: %d\n", ret);
+		return ret;
+	}
+
+	if (!batch)
+		return 0;
+
+	WRITE_ONCE(styx_async.inflight, false);
+	/* Publishes the values above to the waiter */
+	smp_store_release(&batch->status, 0);
+	if (batch->done)
+		batch->done(batch);
+	return 1;
+}
+
 int ksm_rdma_client_recv(struct ksm_cb *cb, struct ib_wc *wc) {
 	switch (ksm_offload_mode) {
 		case KSM_OFFLOAD:
 			DEBUG_LOG("Recved result: scanned %d, merged %d\n", cb->result_desc.total_scanned_cnt, cb->result_desc.log_cnt);
 			break;
 		case SINGLE_OPERATION_OFFLOAD:
-			DEBUG_LOG("Recved result: cmd %d, id %d\n", cb->single_op_result_rx.cmd, cb->single_op_result_rx.id);
-			break;
+			return ksm_rdma_styx_recv(cb, wc);
 		default:
 			printk(KERN_ERR PFX "Invalid mode state %d\n", ksm_offload_mode);
 			break;
@@ -173,6 +258,10 @@ void ksm_rdma_cq_event_handler(struct ib_cq *cq, void *ctx)
 				ksm_wr_tag_str(wc.wr_id), wc.wr_id, wc.status, wc.opcode, wc.byte_len);
 		}
 
+		/* Chained ahead of an async batch send or signaled to free the send queue, nobody waits for it */
+		if (wc.wr_id == WR_ASYNC_REG_MR || wc.wr_id == WR_SEND_REAP)
+			continue;
+
 		if (wc.wr_id == WR_REG_MR) {
 			DEBUG_LOG("IB_WC_REG_MR: %d", IB_WC_REG_MR);
 			cb->state = KSM_MEM_REG_COMPLETE;
@@ -208,10 +297,12 @@ void ksm_rdma_cq_event_handler(struct ib_cq *cq, void *ctx)
 
 			ret = ksm_rdma_client_recv(cb, &wc);
 
-			if (ret) {
+			if (ret < 0) {
 				printk(KERN_ERR PFX "recv wc error: %d\n", ret);
 				goto error;
 			}
+			if (ret > 0)
+				break;
 
 			// memset(&cb->result_desc, 0, sizeof(struct result_desc));
 			// ret = ib_post_recv(cb->qp, &cb->result_recv_wr, &bad_wr);
@@ -312,7 +403,7 @@ int ksm_cb_setup_qp(struct ksm_cb* cb, struct rdma_cm_id* cm_id) {
 	int ret;
 	struct ib_cq_init_attr attr = {0};
 
-	cb->pd = ib_alloc_pd(cm_id->device, 0);
+	cb->pd = ib_alloc_pd(cm_id->device, global_rkey ? IB_PD_UNSAFE_GLOBAL_RKEY : 0);
 	if (IS_ERR(cb->pd)) {
 		printk(KERN_ERR PFX "ib_alloc_pd failed\n");
 		return PTR_ERR(cb->pd);
@@ -378,15 +469,32 @@ err1:
 	return ret;
 }
 
+/*
+ * The server keeps its page READs in flight on our QPs, offer as many as the
+ * device can serve instead of letting them run one at a time.
+ */
+static u8 ksm_read_responder_resources(struct ksm_cb *cb)
+{
+	return clamp_t(int, cb->pd->device->attrs.max_qp_rd_atom, 1, U8_MAX);
+}
+
 int ksm_connect_client(struct ksm_cb *cb)
 {
 	struct rdma_conn_param conn_param;
+	struct ksm_conn_private priv = {
+		.magic = KSM_CONN_MAGIC,
+		.session = cb->session,
+		.lane = 0,
+		.nr_lanes = cb->nr_lanes,
+	};
 	int ret;
 
 	memset(&conn_param, 0, sizeof conn_param);
-	conn_param.responder_resources = 1;
+	conn_param.responder_resources = ksm_read_responder_resources(cb);
 	conn_param.initiator_depth = 1;
 	conn_param.retry_count = 10;
+	conn_param.private_data = &priv;
+	conn_param.private_data_len = sizeof(priv);
 
 	ret = rdma_connect(cb->cm_id, &conn_param);
 	if (ret) {
@@ -419,13 +527,13 @@ int ksm_cb_setup_buffer(struct ksm_cb* cb) {
 		return -1;
     }
 
-	cb->single_op_desc_dma_addr =  ib_dma_map_single(cb->pd->device, &cb->single_op_desc_tx, sizeof(struct operation_descriptor), DMA_BIDIRECTIONAL);
+	cb->single_op_desc_dma_addr =  ib_dma_map_single(cb->pd->device, &cb->single_op_desc_tx, sizeof(cb->single_op_desc_tx), DMA_BIDIRECTIONAL);
 	if (ib_dma_mapping_error(cb->pd->device, cb->single_op_desc_dma_addr)) {
         pr_err("Failed to map single\n");
 		return -1;
     }
 
-	cb->single_op_result_dma_addr = ib_dma_map_single(cb->pd->device, &cb->single_op_result_rx, sizeof(struct operation_result), DMA_BIDIRECTIONAL);
+	cb->single_op_result_dma_addr = ib_dma_map_single(cb->pd->device, &cb->single_op_result_rx, sizeof(cb->single_op_result_rx), DMA_BIDIRECTIONAL);
 	if (ib_dma_mapping_error(cb->pd->device, cb->single_op_desc_dma_addr)) {
         pr_err("Failed to map single\n");
 		return -1;
@@ -460,9 +568,15 @@ int ksm_cb_setup_buffer(struct ksm_cb* cb) {
 	cb->single_op_send_wr.sg_list = &cb->single_op_desc_sgl;
 	cb->single_op_send_wr.num_sge = 1;
 	cb->single_op_send_wr.opcode = IB_WR_SEND;
+	/* No REG_MR left to free send queue slots with the global rkey, so signal the sends */
+	if (ksm_rdma_styx_global_rkey(cb)) {
+		cb->single_op_send_wr.wr_id = WR_SEND_REAP;
+		cb->single_op_send_wr.send_flags = IB_SEND_SIGNALED;
+	}
 
 	cb->single_op_result_sgl.addr = cb->single_op_result_dma_addr;
-	cb->single_op_result_sgl.length = sizeof(struct operation_result);
+	/* Large enough for a batch result, single results only fill results[0] */
+	cb->single_op_result_sgl.length = sizeof(cb->single_op_result_rx);
 	cb->single_op_result_sgl.lkey = cb->pd->local_dma_lkey;
 
 	cb->single_op_recv_wr.wr_id = WR_RECV_SINGLE_RESULT;
@@ -473,6 +587,195 @@ int ksm_cb_setup_buffer(struct ksm_cb* cb) {
 	return 0;
 }
 
+int ksm_lane_cma_event_handler(struct rdma_cm_id *cma_id,
+				   struct rdma_cm_event *event)
+{
+	struct ksm_lane *lane = cma_id->context;
+	int ret;
+
+	DEBUG_LOG("lane cma_event type %d cma_id %p\n", event->event, cma_id);
+
+	switch (event->event) {
+	case RDMA_CM_EVENT_ADDR_RESOLVED:
+		lane->state = KSM_ADDR_RESOLVED;
+		ret = rdma_resolve_route(cma_id, 2000);
+		if (ret) {
+			printk(KERN_ERR PFX "lane rdma_resolve_route error %d\n", ret);
+			lane->state = KSM_ERROR;
+			wake_up_interruptible(&lane->sem);
+		}
+		break;
+
+	case RDMA_CM_EVENT_ROUTE_RESOLVED:
+		lane->state = KSM_ROUTE_RESOLVED;
+		wake_up_interruptible(&lane->sem);
+		break;
+
+	case RDMA_CM_EVENT_ESTABLISHED:
+		lane->state = KSM_CONNECTED;
+		wake_up_interruptible(&lane->sem);
+		break;
+
+	default:
+		printk(KERN_ERR PFX "lane cma event %d, error %d\n", event->event,
+		       event->status);
+		lane->state = KSM_ERROR;
+		wake_up_interruptible(&lane->sem);
+		break;
+	}
+	return 0;
+}
+
+/*
+ * Lanes only serve RDMA READs issued by the server, so no WR is ever posted
+ * on them. They share the main PD (the rkeys we hand out must be valid on
+ * every lane) and the main CQ, which never sees a lane completion.
+ */
+static int ksm_connect_lane(struct ksm_cb *cb, struct ksm_lane *lane, int idx)
+{
+	struct ib_qp_init_attr init_attr;
+	struct rdma_conn_param conn_param;
+	struct sockaddr_in sin4;
+	struct ksm_conn_private priv = {
+		.magic = KSM_CONN_MAGIC,
+		.session = cb->session,
+		.lane = idx,
+		.nr_lanes = cb->nr_lanes,
+	};
+	int ret;
+
+	lane->state = KSM_IDLE;
+	init_waitqueue_head(&lane->sem);
+
+	lane->cm_id = rdma_create_id(&init_net, ksm_lane_cma_event_handler, lane, RDMA_PS_TCP, IB_QPT_RC);
+	if (IS_ERR(lane->cm_id)) {
+		ret = PTR_ERR(lane->cm_id);
+		lane->cm_id = NULL;
+		return ret;
+	}
+
+	memset(&sin4, 0, sizeof(sin4));
+	sin4.sin_family = AF_INET;
+	memcpy((void *)&sin4.sin_addr.s_addr, cb->addr, 4);
+	sin4.sin_port = cb->port;
+
+	ret = rdma_resolve_addr(lane->cm_id, NULL, (struct sockaddr *)&sin4, 2000);
+	if (ret)
+		goto err;
+
+	wait_event_interruptible(lane->sem, lane->state >= KSM_ROUTE_RESOLVED);
+	if (lane->state != KSM_ROUTE_RESOLVED) {
+		ret = -EINTR;
+		goto err;
+	}
+
+	if (lane->cm_id->device != cb->pd->device) {
+		printk(KERN_ERR PFX "lane %d resolved to another device\n", idx);
+		ret = -EXDEV;
+		goto err;
+	}
+
+	memset(&init_attr, 0, sizeof(init_attr));
+	init_attr.send_cq = cb->cq;
+	init_attr.recv_cq = cb->cq;
+	init_attr.cap.max_send_wr = 1;
+	init_attr.cap.max_recv_wr = 1;
+	init_attr.cap.max_recv_sge = 1;
+	init_attr.cap.max_send_sge = 1;
+	init_attr.qp_type = IB_QPT_RC;
+	init_attr.sq_sig_type = IB_SIGNAL_REQ_WR;
+
+	ret = rdma_create_qp(lane->cm_id, cb->pd, &init_attr);
+	if (ret)
+		goto err;
+
+	memset(&conn_param, 0, sizeof conn_param);
+	conn_param.responder_resources = ksm_read_responder_resources(cb);
+	conn_param.initiator_depth = 1;
+	conn_param.retry_count = 10;
+	conn_param.private_data = &priv;
+	conn_param.private_data_len = sizeof(priv);
+
+	lane->state = KSM_CONNECT_REQUEST;
+	ret = rdma_connect(lane->cm_id, &conn_param);
+	if (ret)
+		goto err_qp;
+
+	wait_event_interruptible(lane->sem, lane->state >= KSM_CONNECTED);
+	if (lane->state != KSM_CONNECTED) {
+		ret = -ECONNREFUSED;
+		goto err_qp;
+	}
+
+	return 0;
+
+err_qp:
+	rdma_destroy_qp(lane->cm_id);
+err:
+	rdma_destroy_id(lane->cm_id);
+	lane->cm_id = NULL;
+	return ret;
+}
+
+/* The cb whose lanes are up, for module exit */
+static struct ksm_cb *lanes_cb;
+static DEFINE_MUTEX(lanes_mutex);
+
+/* Best effort: the server reads over whatever lanes came up */
+static void ksm_connect_lanes(struct ksm_cb *cb)
+{
+	int i, ret;
+
+	if (!cb->nr_lanes)
+		return;
+
+	cb->lanes = kcalloc(cb->nr_lanes, sizeof(struct ksm_lane), GFP_KERNEL);
+	if (!cb->lanes) {
+		cb->nr_lanes = 0;
+		return;
+	}
+
+	for (i = 0; i < cb->nr_lanes; i++) {
+		ret = ksm_connect_lane(cb, &cb->lanes[i], i + 1);
+		if (ret) {
+			printk(KERN_ERR PFX "lane %d connect failed: %d\n", i + 1, ret);
+			break;
+		}
+	}
+	pr_info("Connected %d/%d lanes\n", i, cb->nr_lanes);
+	cb->nr_lanes = i;
+	lanes_cb = cb;
+}
+
+/*
+ * Called once the server is gone and on module exit. The lanes share the main
+ * CQ and PD, so only their QPs and cm_ids are torn down here.
+ */
+static void ksm_disconnect_lanes(struct ksm_cb *cb)
+{
+	int i;
+
+	mutex_lock(&lanes_mutex);
+	if (!cb || !cb->lanes)
+		goto out;
+
+	for (i = 0; i < cb->nr_lanes; i++) {
+		struct ksm_lane *lane = &cb->lanes[i];
+
+		rdma_disconnect(lane->cm_id);
+		rdma_destroy_qp(lane->cm_id);
+		rdma_destroy_id(lane->cm_id);
+		lane->cm_id = NULL;
+	}
+	pr_info("Disconnected %d lanes\n", cb->nr_lanes);
+
+	kfree(cb->lanes);
+	cb->lanes = NULL;
+	cb->nr_lanes = 0;
+out:
+	mutex_unlock(&lanes_mutex);
+}
+
 void ksm_rdma_create_connection(struct ksm_cb* cb) {
 	const struct ib_recv_wr *bad_wr;
 	int ret;
@@ -483,6 +786,9 @@ void ksm_rdma_create_connection(struct ksm_cb* cb) {
 		return;
 	}
 	
+	cb->nr_lanes = clamp(lanes, 0, MAX_LANES - 1);
+	cb->session = get_random_u32();
+
 	do {
 		ret = ksm_cb_setup_client(cb);
 		if (ret) {
@@ -538,6 +844,7 @@ void ksm_rdma_create_connection(struct ksm_cb* cb) {
 			goto err1;
 		} else {
 			pr_info("Connect Done\n");
+			ksm_connect_lanes(cb);
 			return;
 		}
 
@@ -597,6 +904,7 @@ struct result_table* ksm_rdma_result_recv(struct ksm_cb *cb, unsigned long* ksm_
 
 	int i, tables_cnt, this_size;
 	struct ksm_event_log* entries;
+	u64 arrived_ns;
 
 	if (!cb) {
 		printk(KERN_ERR PFX "cb is NULL\n");
@@ -611,14 +919,20 @@ struct result_table* ksm_rdma_result_recv(struct ksm_cb *cb, unsigned long* ksm_
 	if (cb->state != KSM_RDMA_RECV_COMPLETE) {
 		printk(KERN_ERR PFX "wait for RECV_COMPLETE state %d\n",
 			cb->state);
+		/* The server went away, its end of the lanes is gone too */
+		if (cb->state == KSM_ERROR)
+			ksm_disconnect_lanes(cb);
 		return NULL;
 	}
+	arrived_ns = ktime_get_ns();
 
 	result_table = kmalloc(sizeof(struct result_table), GFP_KERNEL);
 	if (!result_table) {
 		pr_err("Failed to allocate result_table\n");
 		return NULL;
 	}
+	result_table->arrived_ns = arrived_ns;
+	result_table->pcie_read_bytes = cb->result_desc.pcie_read_bytes;
 
 	*ksm_pages_scanned += cb->result_desc.total_scanned_cnt;
 	
@@ -642,7 +956,7 @@ struct result_table* ksm_rdma_result_recv(struct ksm_cb *cb, unsigned long* ksm_
 		return NULL;
 	}
 
-	pr_info("[KSM] TABLES CNT: %d\n", tables_cnt);
+	DEBUG_LOG("[KSM] TABLES CNT: %d\n", tables_cnt);
 
 	for (i = 0; i < tables_cnt; i++) {
 		this_size = (i == tables_cnt - 1) ? cb->result_desc.log_cnt - i * MAX_RESULT_TABLE_ENTRIES : MAX_RESULT_TABLE_ENTRIES;
@@ -721,7 +1035,7 @@ struct result_table* ksm_rdma_result_recv(struct ksm_cb *cb, unsigned long* ksm_
 		       ret);
 	}
 
-	pr_info("Received result table with %d merge trials\n", result_table->total_cnt);
+	DEBUG_LOG("Received result table with %d merge trials\n", result_table->total_cnt);
 
 	return result_table;
 }
@@ -766,10 +1080,17 @@ int ksm_rdma_reg_mr(struct ksm_cb* cb, struct ib_mr* mr, int access) {
 				ksm_wr_tag_str(wc.wr_id), wc.wr_id, wc.status, wc.opcode, wc.byte_len);
 		}
 
+		/* Chained ahead of an async batch send, nobody waits for it */
+		if (wc.wr_id == WR_ASYNC_REG_MR)
+			continue;
+
 		if (wc.wr_id == WR_REG_MR) {
 			DEBUG_LOG("IB_WC_REG_MR: %d", IB_WC_REG_MR);
 			cb->state = KSM_MEM_REG_COMPLETE;
 			return err;
+		} else if (wc.opcode == IB_WC_RECV && ksm_rdma_client_recv(cb, &wc) >= 0) {
+			/* Only an async batch result can be pending while we register */
+			continue;
 		} else {
 			printk(KERN_ERR PFX "reg mr cq completion with unexpected wr_id %s(%Lx) status %d opcode %d vender_err %x\n\n",
 				ksm_wr_tag_str(wc.wr_id), wc.wr_id, wc.status, wc.opcode, wc.vendor_err);
@@ -831,6 +1152,7 @@ static int __init client_bridge_init(void)
 static void __exit client_bridge_exit(void)
 {
 	DEBUG_LOG("client_bridge_exit\n");
+	ksm_disconnect_lanes(lanes_cb);
 }
 
 
@@ -839,12 +1161,67 @@ static struct ib_mr* styx_memcmp_mr = NULL;
 static struct scatterlist *styx_hash_sgt = NULL;
 static struct ib_mr* styx_hash_mr = NULL;
 
+/*
+ * Single op against the global rkey: the op names its pages by DMA address,
+ * so there is no MR to program before the send nor to invalidate after it.
+ */
+static union operation_value ksm_rdma_styx_single_global(struct ksm_cb* cb, enum operation_cmd cmd,
+							 struct page *page1, struct page *page2) {
+	const struct ib_send_wr *bad_send_wr;
+	struct batch_operation_descriptor *desc = &cb->single_op_desc_tx;
+	union operation_value result = { 0 };
+	int err;
+
+	desc->cmd = cmd;
+	desc->id = iteration++;
+	desc->page_num = page2 ? 2 : 1;
+	desc->iova = 0;
+	desc->rkey = cb->pd->unsafe_global_rkey;
+	desc->op_cnt = 1;
+	desc->flags = STYX_OP_PHYS_ADDR;
+	desc->ops[0].cmd = cmd;
+	desc->ops[0].page_idx[0] = 0;
+	desc->ops[0].addr[0] = page_to_phys(page1);
+	if (page2) {
+		desc->ops[0].page_idx[1] = 1;
+		desc->ops[0].addr[1] = page_to_phys(page2);
+	}
+	cb->single_op_desc_sgl.length = offsetof(struct batch_operation_descriptor, ops) + sizeof(struct batch_op);
+
+	cb->state = KSM_CONNECTED;
+	err = ib_post_send(cb->qp, &cb->single_op_send_wr, &bad_send_wr);
+	if (err) {
+		printk(KERN_ERR PFX "ib_post_send failed: %d\n", err);
+		debug_stop();
+	}
+
+	DEBUG_TIME_START(rdma_wait_time);
+	wait_event_interruptible(cb->sem, cb->state >= KSM_RDMA_RECV_COMPLETE);
+	DEBUG_TIME_END(rdma_wait_time);
+
+	if (cb->state != KSM_RDMA_RECV_COMPLETE) {
+		printk(KERN_ERR PFX "wait for RECV_COMPLETE state %d\n",
+			cb->state);
+		debug_stop();
+	}
+
+	result = styx_sync_rx.results[0];
+
+	if (iteration % 100000 == 0) {
+		print_time_and_reset();
+	}
+
+	return result;
+}
+
 int ksm_rdma_styx_memcmp(struct ksm_cb* cb, struct page *page1, struct page *page2) {
 	const struct ib_send_wr *bad_send_wr;
-	const struct ib_recv_wr *bad_recv_wr;
 	int nents, err;
 	int result;
 
+	if (ksm_rdma_styx_global_rkey(cb))
+		return ksm_rdma_styx_single_global(cb, PAGE_COMPARE, page1, page2).value;
+
 	DEBUG_TIME_START(total_memcmp_time);
 
 	if (!styx_memcmp_sgt) {
@@ -897,6 +1274,8 @@ int ksm_rdma_styx_memcmp(struct ksm_cb* cb, struct page *page1, struct page *pag
 	}
 
 	cb->single_op_desc_tx.cmd = PAGE_COMPARE;
+	cb->single_op_desc_tx.flags = 0;
+	cb->single_op_desc_sgl.length = offsetof(struct batch_operation_descriptor, ops);
 	cb->single_op_desc_tx.id = iteration++;
 	cb->single_op_desc_tx.page_num = 2;
 	cb->single_op_desc_tx.iova = styx_memcmp_mr->iova;
@@ -923,14 +1302,7 @@ int ksm_rdma_styx_memcmp(struct ksm_cb* cb, struct page *page1, struct page *pag
 		debug_stop();
 	}
 
-	result = cb->single_op_result_rx.value;
-
-	memset(&cb->single_op_result_rx, 0, sizeof(struct operation_result));
-	err = ib_post_recv(cb->qp, &cb->single_op_recv_wr, &bad_recv_wr);
-	if (err) {
-		printk(KERN_ERR PFX "post recv error: %d\n", 
-		       err);
-	}
+	result = styx_sync_rx.results[0].value;
 
 	ksm_rdma_invalidate_mr(cb, styx_memcmp_mr);
 
@@ -951,10 +1323,12 @@ int ksm_rdma_styx_memcmp(struct ksm_cb* cb, struct page *page1, struct page *pag
 
 unsigned long long ksm_rdma_styx_hash(struct ksm_cb* cb, struct page *page) {
 	const struct ib_send_wr *bad_send_wr;
-	const struct ib_recv_wr *bad_recv_wr;
 	int nents, err;
 	unsigned long long result;
 
+	if (ksm_rdma_styx_global_rkey(cb))
+		return ksm_rdma_styx_single_global(cb, PAGE_HASH, page, NULL).xxhash;
+
 	DEBUG_TIME_START(total_hash_time);
 
 	if (!styx_hash_sgt) {
@@ -1001,6 +1375,8 @@ unsigned long long ksm_rdma_styx_hash(struct ksm_cb* cb, struct page *page) {
 	}
 
 	cb->single_op_desc_tx.cmd = PAGE_HASH;
+	cb->single_op_desc_tx.flags = 0;
+	cb->single_op_desc_sgl.length = offsetof(struct batch_operation_descriptor, ops);
 	cb->single_op_desc_tx.id = iteration++;
 	cb->single_op_desc_tx.page_num = 1;
 	cb->single_op_desc_tx.iova = styx_hash_mr->iova;
@@ -1028,14 +1404,7 @@ unsigned long long ksm_rdma_styx_hash(struct ksm_cb* cb, struct page *page) {
 		debug_stop();
 	}
 
-	result = cb->single_op_result_rx.value;
-
-	memset(&cb->single_op_result_rx, 0, sizeof(struct operation_result));
-	err = ib_post_recv(cb->qp, &cb->single_op_recv_wr, &bad_recv_wr);
-	if (err) {
-		printk(KERN_ERR PFX "post recv error: %d\n", 
-		       err);
-	}
+	result = styx_sync_rx.results[0].value;
 
 	ksm_rdma_invalidate_mr(cb, styx_hash_mr);
 	// pr_info("Operation id %llu -> Result: %llx", iteration - 1, result);
@@ -1054,6 +1423,295 @@ unsigned long long ksm_rdma_styx_hash(struct ksm_cb* cb, struct page *page) {
 	return result;
 }
 
+static struct scatterlist *styx_batch_sgt = NULL;
+static struct ib_mr* styx_batch_mr = NULL;
+
+/* Lay the batch pages out in @sgt and point each op at its pages, returns the page count */
+static int ksm_rdma_styx_fill_batch(struct batch_operation_descriptor *desc,
+				    struct scatterlist *sgt, struct styx_batch *batch)
+{
+	int i, j, nents = 0;
+
+	memset(sgt, 0, sizeof(struct scatterlist) * MAX_BATCH_OPS * 2);
+	for (i = 0; i < batch->op_cnt; i++) {
+		struct styx_batch_op *op = &batch->ops[i];
+		int page_cnt = op->cmd == PAGE_COMPARE ? 2 : 1;
+
+		desc->ops[i].cmd = op->cmd;
+		for (j = 0; j < page_cnt; j++) {
+			sgt[nents].length = PAGE_SIZE;
+			sgt[nents].offset = 0;
+			sgt[nents].dma_address = page_to_phys(op->pages[j]);
+			sgt[nents].dma_length = PAGE_SIZE;
+			desc->ops[i].addr[j] = sgt[nents].dma_address;
+			desc->ops[i].page_idx[j] = nents++;
+		}
+	}
+	sg_mark_end(&sgt[nents - 1]);
+
+	return nents;
+}
+
+/*
+ * Run up to MAX_BATCH_OPS compares/hashes in one round trip: all pages go
+ * into a single MR registration and the server returns one result vector.
+ */
+int ksm_rdma_styx_batch(struct ksm_cb* cb, struct styx_batch *batch) {
+	const struct ib_send_wr *bad_send_wr;
+	struct batch_operation_descriptor *desc = &cb->single_op_desc_tx;
+	int i, nents, err;
+
+	if (batch->op_cnt <= 0 || batch->op_cnt > MAX_BATCH_OPS)
+		return -EINVAL;
+
+	DEBUG_TIME_START(total_hash_time);
+
+	if (!styx_batch_sgt) {
+		styx_batch_sgt = kcalloc(MAX_BATCH_OPS * 2, sizeof(struct scatterlist), GFP_KERNEL);
+		if (!styx_batch_sgt) {
+			pr_err("Failed to allocate sg_table\n");
+			return -ENOMEM;
+		}
+	}
+	if (!styx_batch_mr && !ksm_rdma_styx_global_rkey(cb)) {
+		styx_batch_mr = ib_alloc_mr(cb->pd, IB_MR_TYPE_MEM_REG, MAX_BATCH_OPS * 2);
+		if (IS_ERR(styx_batch_mr)) {
+			pr_err("Failed to allocated mr");
+			styx_batch_mr = NULL;
+			return -ENOMEM;
+		}
+	}
+
+	DEBUG_TIME_START(rdma_send_time);
+
+	nents = ksm_rdma_styx_fill_batch(desc, styx_batch_sgt, batch);
+
+	if (ksm_rdma_styx_global_rkey(cb)) {
+		desc->iova = 0;
+		desc->rkey = cb->pd->unsafe_global_rkey;
+		desc->flags = STYX_OP_PHYS_ADDR;
+	} else {
+		err = ib_map_mr_sg(styx_batch_mr, styx_batch_sgt, nents, NULL, PAGE_SIZE);
+		if (err != nents) {
+			pr_err("ib_map_mr_sg failed %d vs %d\n", err, nents);
+			return -EIO;
+		}
+
+		err = ksm_rdma_reg_mr(cb, styx_batch_mr, IB_ACCESS_LOCAL_WRITE | IB_ACCESS_REMOTE_READ);
+		if (err) {
+			pr_err("Failed to register mr: %d\n", err);
+			return err;
+		}
+
+		desc->iova = styx_batch_mr->iova;
+		desc->rkey = styx_batch_mr->rkey;
+		desc->flags = 0;
+	}
+
+	desc->cmd = PAGE_BATCH;
+	desc->id = iteration++;
+	desc->page_num = nents;
+	desc->op_cnt = batch->op_cnt;
+	cb->single_op_desc_sgl.length = offsetof(struct batch_operation_descriptor, ops) + batch->op_cnt * sizeof(struct batch_op);
+
+	cb->state = KSM_CONNECTED;
+	err = ib_post_send(cb->qp, &cb->single_op_send_wr, &bad_send_wr);
+	if (err) {
+		printk(KERN_ERR PFX "ib_post_send failed: %d\n", err);
+		debug_stop();
+	}
+
+	DEBUG_TIME_END(rdma_send_time);
+
+	DEBUG_TIME_START(rdma_wait_time);
+	wait_event_interruptible(cb->sem, cb->state >= KSM_RDMA_RECV_COMPLETE);
+	DEBUG_TIME_END(rdma_wait_time);
+
+	DEBUG_TIME_END(irq_switch_time);
+	DEBUG_TIME_START(rdma_recv_time);
+
+	if (cb->state != KSM_RDMA_RECV_COMPLETE) {
+		printk(KERN_ERR PFX "wait for RECV_COMPLETE state %d\n",
+			cb->state);
+		debug_stop();
+	}
+
+	for (i = 0; i < batch->op_cnt; i++)
+		batch->ops[i].value = styx_sync_rx.results[i].value;
+
+	if (!ksm_rdma_styx_global_rkey(cb))
+		ksm_rdma_invalidate_mr(cb, styx_batch_mr);
+
+	DEBUG_TIME_END(rdma_recv_time);
+
+	DEBUG_TIME_END(total_hash_time);
+
+	if (iteration % 100000 == 0) {
+		print_time_and_reset();
+	}
+
+	return 0;
+}
+
+static int ksm_rdma_styx_async_setup(struct ksm_cb *cb)
+{
+	const struct ib_recv_wr *bad_wr;
+	struct ib_device *dev = cb->pd->device;
+	int ret;
+
+	styx_async.sgt = kcalloc(MAX_BATCH_OPS * 2, sizeof(struct scatterlist), GFP_KERNEL);
+	if (!styx_async.sgt)
+		return -ENOMEM;
+
+	if (!ksm_rdma_styx_global_rkey(cb)) {
+		styx_async.mr = ib_alloc_mr(cb->pd, IB_MR_TYPE_MEM_REG, MAX_BATCH_OPS * 2);
+		if (IS_ERR(styx_async.mr)) {
+			ret = PTR_ERR(styx_async.mr);
+			goto err_sgt;
+		}
+	}
+
+	styx_async.desc_dma_addr = ib_dma_map_single(dev, &styx_async.desc_tx, sizeof(styx_async.desc_tx), DMA_BIDIRECTIONAL);
+	if (ib_dma_mapping_error(dev, styx_async.desc_dma_addr)) {
+		ret = -ENOMEM;
+		goto err_mr;
+	}
+
+	styx_async.result_dma_addr = ib_dma_map_single(dev, &styx_async.result_rx, sizeof(styx_async.result_rx), DMA_BIDIRECTIONAL);
+	if (ib_dma_mapping_error(dev, styx_async.result_dma_addr)) {
+		ret = -ENOMEM;
+		goto err_desc;
+	}
+
+	styx_async.desc_sgl.addr = styx_async.desc_dma_addr;
+	styx_async.desc_sgl.lkey = cb->pd->local_dma_lkey;
+
+	styx_async.send_wr.wr_id = WR_SEND_SINGLE_RESULT;
+	styx_async.send_wr.sg_list = &styx_async.desc_sgl;
+	styx_async.send_wr.num_sge = 1;
+	styx_async.send_wr.opcode = IB_WR_SEND;
+	if (ksm_rdma_styx_global_rkey(cb)) {
+		styx_async.send_wr.wr_id = WR_SEND_REAP;
+		styx_async.send_wr.send_flags = IB_SEND_SIGNALED;
+	}
+
+	styx_async.result_sgl.addr = styx_async.result_dma_addr;
+	styx_async.result_sgl.length = sizeof(styx_async.result_rx);
+	styx_async.result_sgl.lkey = cb->pd->local_dma_lkey;
+
+	styx_async.recv_wr.wr_id = WR_RECV_ASYNC_RESULT;
+	styx_async.recv_wr.sg_list = &styx_async.result_sgl;
+	styx_async.recv_wr.num_sge = 1;
+
+	/* Second landing buffer, so an async result and a sync one can both be in flight */
+	ret = ib_post_recv(cb->qp, &styx_async.recv_wr, &bad_wr);
+	if (ret)
+		goto err_result;
+
+	styx_async.setup = true;
+	return 0;
+
+err_result:
+	ib_dma_unmap_single(dev, styx_async.result_dma_addr, sizeof(styx_async.result_rx), DMA_BIDIRECTIONAL);
+err_desc:
+	ib_dma_unmap_single(dev, styx_async.desc_dma_addr, sizeof(styx_async.desc_tx), DMA_BIDIRECTIONAL);
+err_mr:
+	if (styx_async.mr)
+		ib_dereg_mr(styx_async.mr);
+err_sgt:
+	styx_async.mr = NULL;
+	kfree(styx_async.sgt);
+	styx_async.sgt = NULL;
+	return ret;
+}
+
+/*
+ * Post a batch and return right away; batch->done() runs from the CQ
+ * handler when the results are in. One batch can be in flight at a time,
+ * synchronous operations may still be issued meanwhile. Invalidate, REG_MR
+ * and SEND go out as one chain, so no per-batch wait on the registration.
+ */
+int ksm_rdma_styx_batch_submit(struct ksm_cb* cb, struct styx_batch *batch) {
+	const struct ib_send_wr *bad_wr;
+	struct batch_operation_descriptor *desc = &styx_async.desc_tx;
+	struct ib_send_wr *first_wr;
+	int nents, err;
+
+	if (batch->op_cnt <= 0 || batch->op_cnt > MAX_BATCH_OPS)
+		return -EINVAL;
+
+	if (READ_ONCE(styx_async.inflight))
+		return -EBUSY;
+
+	if (!styx_async.setup) {
+		err = ksm_rdma_styx_async_setup(cb);
+		if (err) {
+			pr_err("Failed to set up async dataplane: %d\n", err);
+			return err;
+		}
+	}
+
+	nents = ksm_rdma_styx_fill_batch(desc, styx_async.sgt, batch);
+
+	desc->cmd = PAGE_BATCH;
+	desc->id = iteration++;
+	desc->page_num = nents;
+	desc->op_cnt = batch->op_cnt;
+	styx_async.desc_sgl.length = offsetof(struct batch_operation_descriptor, ops) + batch->op_cnt * sizeof(struct batch_op);
+
+	if (ksm_rdma_styx_global_rkey(cb)) {
+		desc->iova = 0;
+		desc->rkey = cb->pd->unsafe_global_rkey;
+		desc->flags = STYX_OP_PHYS_ADDR;
+		first_wr = &styx_async.send_wr;
+	} else {
+		err = ib_map_mr_sg(styx_async.mr, styx_async.sgt, nents, NULL, PAGE_SIZE);
+		if (err != nents) {
+			pr_err("ib_map_mr_sg failed %d vs %d\n", err, nents);
+			return -EIO;
+		}
+
+		desc->iova = styx_async.mr->iova;
+		desc->rkey = styx_async.mr->rkey;
+		desc->flags = 0;
+
+		memset(&styx_async.reg_wr, 0, sizeof(styx_async.reg_wr));
+		styx_async.reg_wr.wr.wr_id = WR_ASYNC_REG_MR;
+		styx_async.reg_wr.wr.opcode = IB_WR_REG_MR;
+		/* Signaled so the send queue gets reclaimed, the CQ handler drops it */
+		styx_async.reg_wr.wr.send_flags = IB_SEND_SIGNALED;
+		styx_async.reg_wr.wr.next = &styx_async.send_wr;
+		styx_async.reg_wr.mr = styx_async.mr;
+		styx_async.reg_wr.key = styx_async.mr->rkey;
+		styx_async.reg_wr.access = IB_ACCESS_LOCAL_WRITE | IB_ACCESS_REMOTE_READ;
+
+		memset(&styx_async.inv_wr, 0, sizeof(styx_async.inv_wr));
+		styx_async.inv_wr.wr_id = WR_INVALIDATE_MR;
+		styx_async.inv_wr.opcode = IB_WR_LOCAL_INV;
+		styx_async.inv_wr.ex.invalidate_rkey = styx_async.mr->rkey;
+		styx_async.inv_wr.next = &styx_async.reg_wr.wr;
+
+		first_wr = styx_async.mr_valid ? &styx_async.inv_wr : &styx_async.reg_wr.wr;
+	}
+
+	styx_async.batch = batch;
+	styx_async.id = desc->id;
+	batch->status = -EINPROGRESS;
+	WRITE_ONCE(styx_async.inflight, true);
+
+	err = ib_post_send(cb->qp, first_wr, &bad_wr);
+	if (err) {
+		printk(KERN_ERR PFX "ib_post_send failed: %d\n", err);
+		WRITE_ONCE(styx_async.inflight, false);
+		batch->status = err;
+		return err;
+	}
+	if (styx_async.mr)
+		styx_async.mr_valid = true;
+
+	return 0;
+}
+
 module_init(client_bridge_init);
 module_exit(client_bridge_exit);
 
@@ -1064,6 +1722,12 @@ MODULE_LICENSE("GPL");
 module_param(debug, int, 0);
 MODULE_PARM_DESC(debug, "Debug level (0=none, 1=all)");
 
+module_param(lanes, int, 0);
+MODULE_PARM_DESC(lanes, "Extra RC connections the server stripes reads over (0=single QP)");
+
+module_param(global_rkey, int, 0);
+MODULE_PARM_DESC(global_rkey, "Dataplane ops read host pages through the PD's global rkey instead of per-op MRs");
+
 EXPORT_SYMBOL(ksm_rdma_create_connection);
 EXPORT_SYMBOL(ksm_rdma_meta_send);
 EXPORT_SYMBOL(ksm_rdma_result_recv);
@@ -1071,6 +1735,8 @@ EXPORT_SYMBOL(ksm_rdma_reg_mr);
 
 EXPORT_SYMBOL(ksm_rdma_styx_memcmp);
 EXPORT_SYMBOL(ksm_rdma_styx_hash);
+EXPORT_SYMBOL(ksm_rdma_styx_batch);
+EXPORT_SYMBOL(ksm_rdma_styx_batch_submit);
 EXPORT_SYMBOL(ksm_offload_mode);
 
 EXPORT_SYMBOL(ksm_rdma_huge_alloc_init);
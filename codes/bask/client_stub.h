@@ -15,6 +15,8 @@ struct result_table {
 	struct ksm_event_log **entry_tables;
 	int tables_cnt;
 	int total_cnt;
+	u64 arrived_ns;		/* ktime when the server's result descriptor was seen */
+	u64 pcie_read_bytes;	/* copied out, result_desc is cleared for the next iteration */
 };
 
 struct error_table {
@@ -24,6 +26,31 @@ struct error_table {
 	int capacity;
 };
 
+/* Host side of a dataplane batch, results are filled in place */
+struct styx_batch_op {
+	enum operation_cmd cmd;
+	struct page *pages[2];
+	int value;	/* memcmp result or 32-bit checksum */
+};
+
+struct styx_batch {
+	int op_cnt;
+	/*
+	 * Asynchronous submission only: called from the CQ handler (atomic
+	 * context) once the results are in, status is 0 on success.
+	 */
+	void (*done)(struct styx_batch *batch);
+	void *private;
+	int status;
+	struct styx_batch_op ops[MAX_BATCH_OPS];
+};
+
+struct ksm_lane {
+	enum ksm_rdma_state state;
+	wait_queue_head_t sem;
+	struct rdma_cm_id *cm_id;
+};
+
 struct ksm_cb {
 	enum ksm_rdma_state state;
 	wait_queue_head_t sem;
@@ -57,13 +84,17 @@ struct ksm_cb {
 	struct ib_mr *single_op_desc_mr;
 	struct ib_sge single_op_desc_sgl;
 	u64          single_op_desc_dma_addr;
-	struct operation_descriptor single_op_desc_tx __aligned(16);
+	struct batch_operation_descriptor single_op_desc_tx __aligned(16);
 
 	struct ib_recv_wr single_op_recv_wr;
 	struct ib_mr *single_op_result_mr;
 	struct ib_sge single_op_result_sgl;
 	u64          single_op_result_dma_addr;
-	struct operation_result single_op_result_rx __aligned(16);
+	struct batch_operation_result single_op_result_rx __aligned(16);
+
+	struct ksm_lane *lanes;	/* extra connections for server reads */
+	int nr_lanes;
+	u32 session;
 
 	int tag;
 };
@@ -126,6 +157,8 @@ static int debug = 0;
 #define DEBUG_LOG(fmt, args...) do { if (debug) pr_info(fmt, ##args); } while (0)
 
 static u64 iteration = 1;
+static int lanes = 0;
+static int global_rkey = 0;
 
 void ksm_rdma_create_connection(struct ksm_cb* cb);
 int ksm_rdma_meta_send(struct ksm_cb* cb);
@@ -135,6 +168,8 @@ int ksm_rdma_invalidate_mr(struct ksm_cb* cb, struct ib_mr* mr);
 
 int ksm_rdma_styx_memcmp(struct ksm_cb* cb, struct page *page1, struct page *page2);
 unsigned long long ksm_rdma_styx_hash(struct ksm_cb* cb, struct page *page);
+int ksm_rdma_styx_batch(struct ksm_cb* cb, struct styx_batch *batch);
+int ksm_rdma_styx_batch_submit(struct ksm_cb* cb, struct styx_batch *batch);
 
 /* RDMA stub function declaration */
 u64 mlx_ib_dma_map_page(struct ib_device *dev, struct page *page, unsigned long offset, size_t size, enum dma_data_direction direction);
@@ -3,89 +3,416 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
 #include <x86intrin.h>
+#endif
 #include <xxhash.h>
+#include "ksm_engine.h"
+
+/*
+ * Cost of every per-page primitive of the BASK pipeline, on the host or on
+ * the BF2 cores, with warm and cold caches, as CSV on stdout, e.g.
+ *   ./function_cost items=4194304 > bf2.csv
+ * Warm samples time BATCH back to back ops over a few hot keys, cold samples
+ * time one op on a random key after the caches were thrashed.
+ */
 
 #define COMPARE_SIZE 4096  // 4KB page size
 #define ITERATIONS 1000
+#define COLD_ITERATIONS 200
+#define BATCH 64
+#define WARM_KEYS 64
+#define NR_PAGES 1024
 #define CACHE_FLUSH_SIZE 64 * 1024 * 1024  // 64MB to force L3 eviction
 
-void flush_cache(unsigned char *flush_buffer, size_t size) {
-    memset(flush_buffer, 0, size); // Overwrite to force eviction
+#if defined(__x86_64__) || defined(__i386__)
+#define BENCH_ARCH "x86_64"
+#elif defined(__aarch64__)
+#define BENCH_ARCH "aarch64"
+#else
+#define BENCH_ARCH "unknown"
+#endif
+
+struct bench_ctx {
+    struct ksm_metadata meta;
+    struct ksm_log_table log_table;
+    unsigned long items;
+
+    unsigned char *pages;           // NR_PAGES random pages
+    unsigned char *zero_page;
+    hash_pair *page_hashes;
+
+    rmap_item *rmap_items;          // all in meta.rmap_tree
+    struct shadow_pte *ptes;
+    struct stable_node *stable_nodes;   // all in meta.stable_hash_table
+    unsigned long nr_stable;
+    rmap_item *unstable_items;      // all in meta.unstable_hash_table
+    unsigned long nr_unstable;
+    rmap_item *spare_items;         // not in any table, for inserts
+    struct stable_node *spare_nodes;
+
+    void *undo[BATCH];
+    unsigned long keys[BATCH];
+};
+
+struct bench {
+    const char *name;
+    unsigned long (*nr_keys)(struct bench_ctx *ctx);
+    void (*op)(struct bench_ctx *ctx, unsigned long key, int slot);
+    // Untimed, puts the tables back after op
+    void (*undo)(struct bench_ctx *ctx, unsigned long key, int slot);
+};
+
+static unsigned long zero_hash;
+static uint64_t rng_state = 1;
+
+void debug_stop(void) {
+    exit(1);
+}
+
+static uint64_t rng_next(void) {
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static hash_pair random_hash_pair(void) {
+    hash_pair hash;
+    hash.first_hash.low64 = rng_next();
+    hash.first_hash.high64 = rng_next();
+    hash.second_hash.low64 = rng_next();
+    hash.second_hash.high64 = rng_next();
+    return hash;
+}
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline void flush_line(const void *p) {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_clflush(p);
+#elif defined(__aarch64__)
+    asm volatile("dc civac, %0" :: "r"(p) : "memory");
+#endif
+}
+
+static inline void flush_fence(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    asm volatile("mfence" ::: "memory");
+#elif defined(__aarch64__)
+    asm volatile("dsb ish" ::: "memory");
+#else
+    __sync_synchronize();
+#endif
+}
+
+/*
+ * Writing a buffer larger than the LLC evicts the tables on any CPU, the
+ * explicit line flush then makes sure the page itself comes from DRAM.
+ */
+void flush_cache(unsigned char *flush_buffer, size_t size, const void *target, size_t target_size) {
     for (size_t i = 0; i < size; i += 64) {
-        _mm_clflush(&flush_buffer[i]);  // Flush each cache line
+        flush_buffer[i] += 1;
     }
-    asm volatile("mfence" ::: "memory");  // Ensure completion
+    for (size_t i = 0; target && i < target_size; i += 64) {
+        flush_line((const char *)target + i);
+    }
+    flush_fence();
 }
 
-long measure_memcmp(unsigned char *buffer1, unsigned char *buffer2, unsigned char *flush_buffer, int flush) {
-    struct timespec start, end;
-    long total_time = 0;
+// Zero/same-filled detection, word by word with an early exit on the first mismatch
+static int page_same_filled(const void *page, unsigned long *value) {
+    const unsigned long *words = page;
+    unsigned long first = words[0];
 
-    for (int i = 0; i < ITERATIONS; i++) {
-        if (flush) flush_cache(flush_buffer, CACHE_FLUSH_SIZE);
+    for (int i = 1; i < PAGE_SIZE / sizeof(unsigned long); i++) {
+        if (words[i] != first) {
+            return 0;
+        }
+    }
+    *value = first;
+    return 1;
+}
+
+static unsigned char *bench_page(struct bench_ctx *ctx, unsigned long key) {
+    return ctx->pages + (key % NR_PAGES) * PAGE_SIZE;
+}
 
-        clock_gettime(CLOCK_MONOTONIC, &start);
-        volatile int result = memcmp(buffer1, buffer2, COMPARE_SIZE);
-        clock_gettime(CLOCK_MONOTONIC, &end);
+///////////////////////////////////////////////////////////////////////////////////
+//////////////////////////* Primitives */////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////
 
-        total_time += (end.tv_sec * 1e9 + end.tv_nsec) - (start.tv_sec * 1e9 + start.tv_nsec);
+static unsigned long nr_pages_keys(struct bench_ctx *ctx) { return NR_PAGES; }
+static unsigned long nr_rmap_keys(struct bench_ctx *ctx) { return ctx->items; }
+static unsigned long nr_stable_keys(struct bench_ctx *ctx) { return ctx->nr_stable; }
+static unsigned long nr_unstable_keys(struct bench_ctx *ctx) { return ctx->nr_unstable; }
+static unsigned long nr_spare_keys(struct bench_ctx *ctx) { return BATCH; }
+static unsigned long nr_one_key(struct bench_ctx *ctx) { return 1; }
+
+static void op_memcmp(struct bench_ctx *ctx, unsigned long key, int slot) {
+    volatile int result = memcmp(bench_page(ctx, key), bench_page(ctx, key + 1), COMPARE_SIZE);
+    (void)result;
+}
+
+static void op_xxh64(struct bench_ctx *ctx, unsigned long key, int slot) {
+    volatile XXH64_hash_t hash = XXH64(bench_page(ctx, key), COMPARE_SIZE, 0);
+    (void)hash;
+}
+
+static void op_calculate_hash_pair(struct bench_ctx *ctx, unsigned long key, int slot) {
+    volatile hash_pair hash = calculate_hash_pair(NULL, bench_page(ctx, key));
+    (void)hash;
+}
+
+static void op_compare_hash_pair(struct bench_ctx *ctx, unsigned long key, int slot) {
+    hash_pair copy = ctx->page_hashes[key % NR_PAGES];
+    volatile int equal = compare_hash_pair_equal(&ctx->page_hashes[key % NR_PAGES], &copy);
+    (void)equal;
+}
+
+static void op_stable_lookup(struct bench_ctx *ctx, unsigned long key, int slot) {
+    volatile struct stable_node *node = cmp_with_stable(&ctx->meta, NULL, ctx->stable_nodes[key].page_hash);
+    (void)node;
+}
+
+static void op_stable_insert(struct bench_ctx *ctx, unsigned long key, int slot) {
+    insert_stable_node(&ctx->meta, &ctx->spare_nodes[slot]);
+}
+
+static void undo_stable_insert(struct bench_ctx *ctx, unsigned long key, int slot) {
+    g_hash_table_remove(ctx->meta.stable_hash_table, &ctx->spare_nodes[slot]);
+}
+
+static void op_unstable_lookup(struct bench_ctx *ctx, unsigned long key, int slot) {
+    ctx->undo[slot] = cmp_with_unstable(&ctx->meta, &ctx->unstable_items[key]);
+}
+
+static void undo_unstable_lookup(struct bench_ctx *ctx, unsigned long key, int slot) {
+    if (ctx->undo[slot]) {
+        insert_unstable_node(&ctx->meta, ctx->undo[slot]);
     }
-    return total_time / ITERATIONS;
 }
 
-long measure_xxhash(unsigned char *buffer, unsigned char *flush_buffer, int flush) {
-    struct timespec start, end;
-    long total_time = 0;
+static void op_unstable_insert(struct bench_ctx *ctx, unsigned long key, int slot) {
+    insert_unstable_node(&ctx->meta, &ctx->spare_items[slot]);
+}
+
+static void undo_unstable_insert(struct bench_ctx *ctx, unsigned long key, int slot) {
+    g_hash_table_remove(ctx->meta.unstable_hash_table, &ctx->spare_items[slot]);
+}
+
+static void op_rmap_lookup(struct bench_ctx *ctx, unsigned long key, int slot) {
+    volatile rmap_item *item = lookup_rmap_item(&ctx->meta, ctx->rmap_items[key].mm_id, &ctx->ptes[key]);
+    (void)item;
+}
+
+static void op_insert_ksm_log(struct bench_ctx *ctx, unsigned long key, int slot) {
+    log_stable_merge(&ctx->log_table, &ctx->rmap_items[key], &ctx->stable_nodes[key % ctx->nr_stable]);
+}
+
+static void undo_insert_ksm_log(struct bench_ctx *ctx, unsigned long key, int slot) {
+    ctx->log_table.cnt -= 1;
+}
+
+static void op_zero_xxh64(struct bench_ctx *ctx, unsigned long key, int slot) {
+    volatile int zero = XXH64(ctx->zero_page, PAGE_SIZE, 0) == zero_hash;
+    (void)zero;
+}
+
+static void op_same_filled_zero(struct bench_ctx *ctx, unsigned long key, int slot) {
+    unsigned long value;
+    volatile int same = page_same_filled(ctx->zero_page, &value);
+    (void)same;
+}
+
+static void op_same_filled_random(struct bench_ctx *ctx, unsigned long key, int slot) {
+    unsigned long value;
+    volatile int same = page_same_filled(bench_page(ctx, key), &value);
+    (void)same;
+}
+
+static const struct bench benches[] = {
+    { "memcmp_4k",              nr_pages_keys,    op_memcmp,              NULL },
+    { "xxh64_4k",               nr_pages_keys,    op_xxh64,               NULL },
+    { "calculate_hash_pair",    nr_pages_keys,    op_calculate_hash_pair, NULL },
+    { "compare_hash_pair_equal", nr_pages_keys,   op_compare_hash_pair,   NULL },
+    { "stable_lookup",          nr_stable_keys,   op_stable_lookup,       NULL },
+    { "stable_insert",          nr_spare_keys,    op_stable_insert,       undo_stable_insert },
+    { "unstable_lookup",        nr_unstable_keys, op_unstable_lookup,     undo_unstable_lookup },
+    { "unstable_insert",        nr_spare_keys,    op_unstable_insert,     undo_unstable_insert },
+    { "rmap_lookup",            nr_rmap_keys,     op_rmap_lookup,         NULL },
+    { "insert_ksm_log",         nr_rmap_keys,     op_insert_ksm_log,      undo_insert_ksm_log },
+    { "zero_detect_xxh64",      nr_one_key,       op_zero_xxh64,          NULL },
+    { "same_filled_zero",       nr_one_key,       op_same_filled_zero,    NULL },
+    { "same_filled_random",     nr_pages_keys,    op_same_filled_random,  NULL },
+};
+
+///////////////////////////////////////////////////////////////////////////////////
+//////////////////////////* Harness *////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////
+
+static int setup(struct bench_ctx *ctx) {
+    unsigned long i;
+
+    ctx->nr_stable = MAX(ctx->items / 4, 1);
+    ctx->nr_unstable = MAX(ctx->items / 4, 1);
+
+    ctx->pages = aligned_alloc(64, (size_t)NR_PAGES * PAGE_SIZE);
+    ctx->zero_page = aligned_alloc(64, PAGE_SIZE);
+    ctx->page_hashes = calloc(NR_PAGES, sizeof(hash_pair));
+    ctx->rmap_items = calloc(ctx->items, sizeof(rmap_item));
+    ctx->ptes = calloc(ctx->items, sizeof(struct shadow_pte));
+    ctx->stable_nodes = calloc(ctx->nr_stable, sizeof(struct stable_node));
+    ctx->unstable_items = calloc(ctx->nr_unstable, sizeof(rmap_item));
+    ctx->spare_items = calloc(BATCH, sizeof(rmap_item));
+    ctx->spare_nodes = calloc(BATCH, sizeof(struct stable_node));
+    if (!ctx->pages || !ctx->zero_page || !ctx->page_hashes || !ctx->rmap_items || !ctx->ptes ||
+        !ctx->stable_nodes || !ctx->unstable_items || !ctx->spare_items || !ctx->spare_nodes) {
+        return -1;
+    }
+
+    if (ksm_metadata_init(&ctx->meta, &ctx->log_table)) {
+        return -1;
+    }
+    // Room for a whole batch of log inserts without a realloc in the timed region
+    ctx->log_table.entries = realloc(ctx->log_table.entries, 2 * BATCH * sizeof(struct ksm_event_log));
+    ctx->log_table.capacity = 2 * BATCH;
+    if (!ctx->log_table.entries) {
+        return -1;
+    }
+
+    for (i = 0; i < (unsigned long)NR_PAGES * PAGE_SIZE / sizeof(uint64_t); i++) {
+        ((uint64_t *)ctx->pages)[i] = rng_next();
+    }
+    memset(ctx->zero_page, 0, PAGE_SIZE);
+    zero_hash = XXH64(ctx->zero_page, PAGE_SIZE, 0);
+    for (i = 0; i < NR_PAGES; i++) {
+        ctx->page_hashes[i] = calculate_hash_pair(NULL, bench_page(ctx, i));
+    }
+
+    for (i = 0; i < ctx->items; i++) {
+        rmap_item *item = &ctx->rmap_items[i];
+        item->mm_id = i % 8;
+        item->va = 0x10000000UL + (i / 8) * PAGE_SIZE;
+        item->state = Volatile;
+        ctx->ptes[i].va = item->va;
+        ctx->ptes[i].kpfn = i + 1;
+        g_tree_insert(ctx->meta.rmap_tree, item, item);
+    }
+
+    for (i = 0; i < ctx->nr_stable; i++) {
+        struct stable_node *node = &ctx->stable_nodes[i];
+        node->page_hash = random_hash_pair();
+        node->pfn = i + 1;
+        node->shared_cnt = 2;
+        insert_stable_node(&ctx->meta, node);
+    }
+
+    for (i = 0; i < ctx->nr_unstable; i++) {
+        ctx->unstable_items[i].old_hash = random_hash_pair();
+        ctx->unstable_items[i].state = Unstable;
+        insert_unstable_node(&ctx->meta, &ctx->unstable_items[i]);
+    }
+
+    for (i = 0; i < BATCH; i++) {
+        ctx->spare_items[i].old_hash = random_hash_pair();
+        ctx->spare_nodes[i].page_hash = random_hash_pair();
+    }
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, const char *cache, unsigned long items, uint64_t *samples, int n) {
+    uint64_t sum = 0;
+
+    qsort(samples, n, sizeof(*samples), cmp_u64);
+    for (int i = 0; i < n; i++) {
+        sum += samples[i];
+    }
+    printf("%s,%s,%s,%lu,%d,%.1f,%lu,%lu\n", BENCH_ARCH, name, cache, items, n,
+        (double)sum / n, (unsigned long)samples[n / 2], (unsigned long)samples[n * 99 / 100]);
+}
+
+// Per-op time of a batch of ops over WARM_KEYS keys that stay in cache
+static void run_warm(struct bench_ctx *ctx, const struct bench *b, uint64_t *samples) {
+    unsigned long nr_keys = b->nr_keys(ctx);
 
     for (int i = 0; i < ITERATIONS; i++) {
-        if (flush) flush_cache(flush_buffer, CACHE_FLUSH_SIZE);
+        for (int j = 0; j < BATCH; j++) {
+            ctx->keys[j] = ((unsigned long)i * BATCH + j) % MIN(nr_keys, WARM_KEYS);
+        }
 
-        clock_gettime(CLOCK_MONOTONIC, &start);
-        volatile XXH64_hash_t hash = XXH64(buffer, COMPARE_SIZE, 0);
-        clock_gettime(CLOCK_MONOTONIC, &end);
+        uint64_t start = now_ns();
+        for (int j = 0; j < BATCH; j++) {
+            b->op(ctx, ctx->keys[j], j);
+        }
+        samples[i] = (now_ns() - start) / BATCH;
 
-        total_time += (end.tv_sec * 1e9 + end.tv_nsec) - (start.tv_sec * 1e9 + start.tv_nsec);
+        for (int j = BATCH - 1; b->undo && j >= 0; j--) {
+            b->undo(ctx, ctx->keys[j], j);
+        }
     }
-    return total_time / ITERATIONS;
 }
 
-int main() {
-    // Allocate memory
-    unsigned char *buffer1 = aligned_alloc(64, COMPARE_SIZE);
-    unsigned char *buffer2 = aligned_alloc(64, COMPARE_SIZE);
-    unsigned char *flush_buffer = malloc(CACHE_FLUSH_SIZE);
+// One op on a random key, after the caches were thrashed
+static void run_cold(struct bench_ctx *ctx, const struct bench *b, uint64_t *samples, unsigned char *flush_buffer) {
+    unsigned long nr_keys = b->nr_keys(ctx);
 
-    if (!buffer1 || !buffer2 || !flush_buffer) {
-        perror("Memory allocation failed");
-        return 1;
+    for (int i = 0; i < COLD_ITERATIONS; i++) {
+        unsigned long key = rng_next() % nr_keys;
+
+        flush_cache(flush_buffer, CACHE_FLUSH_SIZE, bench_page(ctx, key), PAGE_SIZE);
+
+        uint64_t start = now_ns();
+        b->op(ctx, key, 0);
+        samples[i] = now_ns() - start;
+
+        if (b->undo) {
+            b->undo(ctx, key, 0);
+        }
     }
+}
+
+int main(int argc, char **argv) {
+    struct bench_ctx ctx;
+    static uint64_t samples[ITERATIONS];
+    unsigned char *flush_buffer = malloc(CACHE_FLUSH_SIZE);
 
-    // Initialize buffers
-    memset(buffer1, 'A', COMPARE_SIZE);
-    memset(buffer2, 'A', COMPARE_SIZE);
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.items = 1 << 20;
+    pre_hash_opt = 0;
 
-    // Introduce differences across multiple cache lines
-    for (size_t i = 0; i < COMPARE_SIZE; i += 512) {
-        buffer2[i] = 'B';
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "items=", 6) == 0) {
+            ctx.items = MAX(strtoul(argv[i] + 6, NULL, 10), 1);
+        } else {
+            fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+            return 1;
+        }
     }
 
-    // Measure performance
-    long memcmp_time_flush = measure_memcmp(buffer1, buffer2, flush_buffer, 1);
-    long memcmp_time_no_flush = measure_memcmp(buffer1, buffer2, flush_buffer, 0);
-    long xxhash_time_flush = measure_xxhash(buffer1, flush_buffer, 1);
-    long xxhash_time_no_flush = measure_xxhash(buffer1, flush_buffer, 0);
+    if (!flush_buffer || setup(&ctx)) {
+        perror("Memory allocation failed");
+        return 1;
+    }
+    memset(flush_buffer, 0, CACHE_FLUSH_SIZE);
 
-    // Print results in nanoseconds
-    printf("memcmp (4KB, cache flushed):     %ld ns\n", memcmp_time_flush);
-    printf("memcmp (4KB, no cache flush):    %ld ns\n", memcmp_time_no_flush);
-    printf("xxHash (4KB, cache flushed):     %ld ns\n", xxhash_time_flush);
-    printf("xxHash (4KB, no cache flush):    %ld ns\n", xxhash_time_no_flush);
+    printf("arch,primitive,cache,table_items,samples,mean_ns,p50_ns,p99_ns\n");
+    for (int i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        run_warm(&ctx, &benches[i], samples);
+        report(benches[i].name, "warm", ctx.items, samples, ITERATIONS);
+        run_cold(&ctx, &benches[i], samples, flush_buffer);
+        report(benches[i].name, "cold", ctx.items, samples, COLD_ITERATIONS);
+    }
 
-    // Free memory
-    free(buffer1);
-    free(buffer2);
     free(flush_buffer);
-
     return 0;
 }
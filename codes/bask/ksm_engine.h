@@ -0,0 +1,1905 @@
+#ifndef KSM_ENGINE_H
+#define KSM_ENGINE_H
+
+/*
+ * The KSM engine of the BASK server: rmap items, the stable and unstable
+ * tables, merge decisions and the log of merges sent back to the host. Nothing
+ * in here touches RDMA, so bask_replay can drive it from a recorded trace.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <xxhash.h>
+#include <glib.h>
+
+#include "rdma_common.h"
+#include "bask_stats.h"
+
+struct rdma_cb;
+struct ibv_mr;
+
+#define GROW_FACTOR 2
+#define PAGE_SIZE 4096
+
+#define MAX_PAGE_SHARING 256
+
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+
+#define RMAP_PRUNE_MARGIN 1000
+
+extern void debug_stop(void);
+
+enum item_state {
+    None = 0,
+    Volatile,
+    Unstable,
+    Stable
+};
+
+typedef struct {
+    XXH128_hash_t first_hash;
+    XXH128_hash_t second_hash;
+} hash_pair;
+
+typedef struct {
+    int mm_id;
+    short last_access;
+    short age;
+    uint64_t va;
+    unsigned long pfn;
+    unsigned long old_pfn;
+    // XXH64_hash_t oldchecksum;
+    hash_pair old_hash;
+    enum item_state state;
+    unsigned short volatility_score;
+    unsigned short skip_cnt;
+    union {
+       // struct unstable_node* unstable_node;
+        struct stable_node* stable_node;
+    };
+} rmap_item;
+
+enum node_chain_type {
+    HEAD,
+    CHAIN,
+};
+
+struct stable_node {
+    hash_pair page_hash;
+    // void* page_buf_head;
+    // XXH64_hash_t checksum;
+    int shared_cnt;
+    unsigned long pfn;
+    GTree *sharing_item_tree;
+    struct {
+        enum node_chain_type type;
+        struct stable_node *next;
+        struct stable_node *prev;
+    } chain;
+};
+
+// struct unstable_node {
+//     // hash_pair page_hash;
+//     // XXH64_hash_t checksum;
+//     rmap_item *item;
+//     // struct {
+//     //    unsigned int rkey;
+//     //    dma_addr_t addr;
+//     // } rdma_desc;
+// };
+
+enum working_status {
+    NO_WORKER,
+    WORKER_READY,
+    DATA_READY,
+    IN_PROGRESS,
+    WORK_DONE,
+    STOP,
+    EXIT,
+};
+
+struct ksm_iter_stats {
+    unsigned long skipped_cnt;
+    unsigned long volatile_items_cnt;
+    unsigned long highly_volatile_but_stable_merged_cnt;
+    unsigned long highly_volatile_but_unstable_merged_cnt;
+    unsigned long broken_merges;
+    unsigned long hash_collision_cnt;
+    unsigned long hash_collision_cnt_max;
+    unsigned long pre_hash_hit_cnt;
+    unsigned long pre_hash_miss_cnt;
+    unsigned long quota_skipped_cnt;
+    unsigned long unchanged_cnt;            // handled from old_hash, not read
+    unsigned long unchanged_deferred_cnt;   // not read, but old_hash could not stand in for it
+    unsigned long thp_subpages_cnt;         // subpages of PMD-mapped THPs, matched but not merged
+};
+
+struct pre_hash_ctx {
+    pthread_spinlock_t lock;
+    sem_t ready;
+    enum working_status status;
+    void* base_ptr;
+    int max_idx;
+    char* chunk;
+    atomic_int curr_idx;
+    pthread_t thread_id;
+    struct ksm_iter_stats* stats;
+};
+
+struct ksm_metadata {
+    // GHashTable* rmap_table;
+    GTree *rmap_tree;
+    GHashTable* stable_hash_table;
+    // GTree* stable_tree;
+    struct {
+        struct rdma_cb* cb;
+        void* temp_buf;
+        struct ibv_mr* temp_buf_mr;
+    } rdma_buf;
+    GHashTable* unstable_hash_table;
+
+    int iteration;
+    unsigned long total_accessed_cnt;
+    unsigned long max_rmap_items; // Tenant memory quota, 0 means unlimited
+    unsigned int hot_region_pct;  // Set by the host, 0 means no region feedback
+    unsigned int dirty_tracking;  // Set by the host, pages may be tagged SHADOW_PTE_UNCHANGED
+    GHashTable* region_table;     // struct region_stat per (mm_id, 2MB region)
+    GHashTable* thp_table;        // struct thp_stat per (mm_id, THP) of this iteration
+    GHashTable* thp_seen_table;   // THP subpage items of this iteration, by old_hash
+    struct ksm_iter_stats stats;
+    struct pre_hash_ctx pre_hash;
+};
+
+/*
+ * Write activity of one HOT_REGION_SHIFT region of an mm. A region whose
+ * scanned pages mostly changed is reported to the host, which then leaves it
+ * out of the shadow mm for backoff iterations, doubling while it stays hot.
+ */
+struct region_stat {
+    int mm_id;
+    uint64_t region;            // va >> HOT_REGION_SHIFT
+    unsigned int scanned;       // pages of this iteration
+    unsigned int changed;
+    unsigned short backoff;     // last reported backoff, 0 once the region cooled down
+    int until;                  // last iteration the host skips it
+    int last_seen;
+};
+
+#define REGION_MIN_PAGES 32
+#define REGION_MAX_BACKOFF 32
+#define REGION_IDLE_ITERS 64
+
+/*
+ * Subpages of one PMD-mapped THP with a match. The host splits the huge page
+ * once enough of them would merge, and the subpages come back as plain pages.
+ */
+struct thp_stat {
+    int mm_id;
+    uint64_t region;            // va >> HOT_REGION_SHIFT, a PMD as for hot regions
+    unsigned short stable;
+    unsigned short zero;
+    unsigned short dup;
+};
+
+struct ksm_log_table {
+    struct ksm_event_log* entries;
+    int cnt;
+    int capacity;
+};
+
+struct worker_job {
+    struct ksm_metadata* metadata;
+    struct ksm_log_table* log_table;
+    int mm_id;
+    struct shadow_pte * va2dma_map;
+    void* pages_buf;
+    uint64_t num_pages;
+    uint64_t idx_adjust;
+    unsigned long rkey;
+    dma_addr_t pages_addr;
+    enum working_status status;
+};
+
+static int debug = 0;
+#define DEBUG_LOG(fmt, ...) \
+    do { if (debug) fprintf(stdout, "[DEBUG] " fmt , ##__VA_ARGS__); } while (0)
+
+#define ERR_LOG_AND_STOP(fmt, ...) \
+    do { fprintf(stderr, "[ERROR] " fmt , ##__VA_ARGS__); debug_stop(); } while (0)
+
+#define THREAD_POOL_MAX 5
+static GThreadPool* table_cleaner_pool = NULL;
+
+static gint active_jobs = 0;
+
+static hash_pair null_hash = {
+    .first_hash = {0, 0},
+    .second_hash = {0, 0}
+};
+
+static int pre_hash_opt = 1;
+static int smart_scan_opt = 1;
+
+#define PRE_HASH_ON pre_hash_opt
+#define SMART_SCAN_ON smart_scan_opt
+
+struct timer {
+    unsigned long count;
+    unsigned long time_sum;
+    struct timespec curr_time;
+};
+
+struct timer big_hash_timer = {0, 0, {0, 0}};
+struct timer ksm_operation_timer = {0, 0, {0, 0}};
+
+#define MEASURE_TIME 1
+
+// The timers are process-wide and unlocked, a multi-tenant server turns them off
+static int measure_time_on = 1;
+
+#ifdef MEASURE_TIME
+#define START_TIMER(timer) \
+    do { \
+        if (measure_time_on) { \
+            clock_gettime(CLOCK_MONOTONIC, &(timer).curr_time); \
+        } \
+    } while (0)
+
+#define END_TIMER(timer) \
+    do { \
+        if (measure_time_on) { \
+            struct timespec end_time; \
+            clock_gettime(CLOCK_MONOTONIC, &end_time); \
+            unsigned long duration = (end_time.tv_sec * 1000000000UL + end_time.tv_nsec) \
+                                    - ((timer).curr_time.tv_sec * 1000000000UL + (timer).curr_time.tv_nsec); \
+            (timer).time_sum += duration; \
+            (timer).count += 1; \
+            (timer).curr_time.tv_sec = 0; \
+            (timer).curr_time.tv_nsec = 0; \
+        } \
+    } while (0)
+
+#define IS_TIMER_START(timer) \
+    ((timer).curr_time.tv_sec != 0 || (timer).curr_time.tv_nsec != 0)
+
+#define ABORT_TIMER(timer) \
+    do { \
+        (timer).curr_time.tv_sec = 0; \
+        (timer).curr_time.tv_nsec = 0; \
+    } while (0)
+
+#define PRINT_AND_RESET_TIMER(timer, msg) \
+    do { \
+        if ((timer).count > 0) { \
+            printf("[BASK Breakdown], %s, %.2f, us avg, total, %lu, count\n", msg, ((double) (timer).time_sum / (double) (timer).count) / 1000.00, (timer).count); \
+        } \
+        (timer).count = 0; \
+        (timer).time_sum = 0; \
+        (timer).curr_time.tv_sec = 0; \
+        (timer).curr_time.tv_nsec = 0; \
+    } while (0)
+#else
+#define START_TIMER(timer)
+#define END_TIMER(timer)
+#define PRINT_AND_RESET_TIMER(timer, msg)
+#endif
+
+short skip_volatile(short volatility_score, short age) {
+    if (volatility_score > 0) {
+        int grace_score = volatility_score + age;
+
+        if (grace_score < 3) {
+            return 1;
+        } else if (grace_score == 3) {
+            return 2;
+        } else if (grace_score == 4) {
+            return 4;
+        } else
+            return 8;
+    }
+
+    return 0;
+}
+
+int should_skip_item(rmap_item* item) {
+    if (!SMART_SCAN_ON) return FALSE;
+
+    if (item->state == None || item->state == Stable) {
+        return FALSE;
+    }
+    
+    if (item->skip_cnt > 0) {
+        item->skip_cnt -= 1;
+        return TRUE;
+    } else {
+        item->skip_cnt = skip_volatile(item->volatility_score, item->age);
+    }
+
+    return FALSE;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+//////////////////////////* Hash pair Related Functions *//////////////////////////
+///////////////////////////////////////////////////////////////////////////////////
+
+void* pre_hash_worker(void * arg);
+
+#define PRE_HASH_NUM 16384
+
+int init_pre_hash_pair_table(struct pre_hash_ctx* ctx, struct ksm_iter_stats* stats) {
+    ctx->chunk = malloc(PRE_HASH_NUM * sizeof(hash_pair));
+    if (!ctx->chunk) {
+        fprintf(stderr, "[KSM] Failed to allocate memory for pre_hash_pair_chunk\n");
+        return -1;
+    }
+    ctx->stats = stats;
+    ctx->base_ptr = NULL;
+    ctx->max_idx = 0;
+    atomic_store(&ctx->curr_idx, 0);
+    pthread_spin_init(&ctx->lock, PTHREAD_PROCESS_PRIVATE);
+    sem_init(&ctx->ready, 0, 0);
+    ctx->status = WORKER_READY;
+
+    if (pthread_create(&ctx->thread_id, NULL, pre_hash_worker, ctx)) {
+        fprintf(stderr, "[KSM] Failed to create pre hash worker\n");
+        free(ctx->chunk);
+        ctx->chunk = NULL;
+        ctx->status = NO_WORKER;
+        return -1;
+    }
+
+    return 0;
+}
+
+void start_pre_hash_pair_table(struct pre_hash_ctx* ctx, void* base_ptr, int max_idx) {
+    while (1) {
+        pthread_spin_lock(&ctx->lock);
+        if ((ctx->status == WORKER_READY) || (ctx->status == WORK_DONE)) {
+            ctx->base_ptr = base_ptr;
+            atomic_store(&ctx->curr_idx, 0);
+            ctx->max_idx = max_idx;
+            ctx->status = DATA_READY;
+            
+            pthread_spin_unlock(&ctx->lock);
+            sem_post(&ctx->ready);
+            break;
+        } else if (ctx->status == IN_PROGRESS) {
+            ctx->status = STOP;
+            pthread_spin_unlock(&ctx->lock);
+        } else {
+            pthread_spin_unlock(&ctx->lock);
+        }
+    }
+}
+
+void stop_pre_hash_pair_table(struct pre_hash_ctx* ctx) {
+    if (ctx->status == NO_WORKER) {
+        return;
+    }
+
+    pthread_spin_lock(&ctx->lock);
+    ctx->status = EXIT;
+    pthread_spin_unlock(&ctx->lock);
+    sem_post(&ctx->ready);
+
+    pthread_join(ctx->thread_id, NULL);
+    pthread_spin_destroy(&ctx->lock);
+    sem_destroy(&ctx->ready);
+    free(ctx->chunk);
+    ctx->chunk = NULL;
+    ctx->status = NO_WORKER;
+}
+
+void* pre_hash_worker(void * arg) {
+    struct pre_hash_ctx* ctx = (struct pre_hash_ctx*)arg;
+    int i;
+
+    while (1) {
+        // Sleep until a new chunk is handed over instead of spinning while idle
+        sem_wait(&ctx->ready);
+
+        pthread_spin_lock(&ctx->lock);
+        
+        if (ctx->status == EXIT) {
+            pthread_spin_unlock(&ctx->lock);
+            return NULL;
+        } else if (ctx->status == DATA_READY) {
+            ctx->status = IN_PROGRESS;
+            pthread_spin_unlock(&ctx->lock);
+
+            memset(ctx->chunk, 0, PRE_HASH_NUM * sizeof(hash_pair));
+            
+            for (i = 0; i < ctx->max_idx; i++) {
+                pthread_spin_lock(&ctx->lock);
+                if (ctx->status == STOP || ctx->status == EXIT) {
+                    pthread_spin_unlock(&ctx->lock);
+                    break;
+                }
+                pthread_spin_unlock(&ctx->lock);
+
+                hash_pair* hash = &((hash_pair*)ctx->chunk)[i];
+                void* page_buf = (char*)ctx->base_ptr + i * PAGE_SIZE;
+
+                hash->first_hash = XXH3_128bits_withSeed(&page_buf[0], 2048, 0);
+                hash->second_hash = XXH3_128bits_withSeed(&page_buf[2048], 2048, 0);
+
+                atomic_fetch_add(&ctx->curr_idx, 1);
+            }
+
+            pthread_spin_lock(&ctx->lock);
+            if (ctx->status == EXIT) {
+                pthread_spin_unlock(&ctx->lock);
+                return NULL;
+            }
+            ctx->status = WORK_DONE;
+            pthread_spin_unlock(&ctx->lock);
+        } else {
+            pthread_spin_unlock(&ctx->lock);
+        }
+    }
+}
+
+hash_pair* lookup_pre_hash_pair(struct pre_hash_ctx* ctx, const void* page_buf) {
+    if (!PRE_HASH_ON || !ctx || !ctx->chunk) return NULL;
+
+    unsigned long page_idx = ((uintptr_t)page_buf - (uintptr_t)ctx->base_ptr) / PAGE_SIZE;
+    int idx = atomic_load(&ctx->curr_idx);
+
+    if (page_idx >= PRE_HASH_NUM) {
+        printf("[KSM] Invalid page idx for pre_hash_pair: %ld, curr_idx: %d, hit count: %lu, miss count: %lu\n", page_idx, idx, ctx->stats->pre_hash_hit_cnt, ctx->stats->pre_hash_miss_cnt);
+        printf("page buf vs base ptr: %lx - %lx\n", (uintptr_t)page_buf, (uintptr_t)ctx->base_ptr);
+        debug_stop();
+    }
+    
+    if (page_idx < idx) {
+        ctx->stats->pre_hash_hit_cnt++;
+        return &((hash_pair*)ctx->chunk)[page_idx];
+    } else {
+        ctx->stats->pre_hash_miss_cnt++;
+        return NULL;
+    }
+}
+
+hash_pair calculate_hash_pair(struct pre_hash_ctx* ctx, const void* page_buf) {
+    uint64_t start = bask_stats_now();
+    hash_pair* pre_hash = lookup_pre_hash_pair(ctx, page_buf);
+    hash_pair hash;
+
+    if (pre_hash) {
+        hash = *pre_hash;
+    } else {
+        // TODO: 4KB twice with different seed?
+        hash.first_hash = XXH3_128bits_withSeed(&page_buf[0], 2048, 0);
+        hash.second_hash = XXH3_128bits_withSeed(&page_buf[2048], 2048, 0);
+    }
+
+    bask_stats_since(BASK_PHASE_HASH, start);
+    return hash;
+}
+
+int compare_hash_pair_equal(const hash_pair* hash1, const hash_pair* hash2) {
+    if (hash1->first_hash.high64 == hash2->first_hash.high64 &&
+        hash1->first_hash.low64 == hash2->first_hash.low64 &&
+        hash1->second_hash.high64 == hash2->second_hash.high64 &&
+        hash1->second_hash.low64 == hash2->second_hash.low64) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+#define PRINT_HASH_PAIR(hash) \
+    hash.first_hash.high64, hash.first_hash.low64, hash.second_hash.high64, hash.second_hash.low64
+
+///////////////////////////////////////////////////////////////////////////////////
+//////////////////////////* Log Table Related Functions *//////////////////////////
+///////////////////////////////////////////////////////////////////////////////////
+
+static void insert_ksm_log(struct ksm_log_table* table, struct ksm_event_log* entry) {
+    uint64_t start = bask_stats_now();
+
+    if (table->cnt >= table->capacity) {
+        int new_capacity = table->capacity * GROW_FACTOR;
+        struct ksm_event_log* new_table = realloc(table->entries, new_capacity * sizeof(struct ksm_event_log));
+        if (!new_table) {
+            fprintf(stderr, "[KSM] Failed to grow log table: %x\n", new_capacity);
+            return;
+        }
+
+        table->entries = new_table;
+        table->capacity = new_capacity;
+    }
+
+    DEBUG_LOG("Insert new to log table: %d\n", table->cnt);
+
+    table->entries[table->cnt] = *entry;
+
+    switch (entry->type) {
+        case DPU_STABLE_MERGE:
+        case DPU_UNSTABLE_MERGE:
+        case DPU_STALE_STABLE_NODE:
+        case DPU_ITEM_STATE_CHANGE:
+        case DPU_HOT_REGION:
+        case DPU_THP_SUMMARY:
+        case DPU_VERIFY_SAME:
+        case DPU_VERIFY_DIFF:
+            break;
+
+        default:
+            ERR_LOG_AND_STOP("[KSM] Invalid log type: %d\n", entry->type);
+            break;
+    }
+
+    table->cnt += 1;
+    bask_stats_count(BASK_CNT_LOGS, 1);
+    bask_stats_since(BASK_PHASE_LOG_INSERT, start);
+}
+
+static void clear_log_table(struct ksm_log_table* table) {
+    memset(table->entries, 0, table->capacity * sizeof(struct ksm_event_log));
+    table->cnt = 0;
+}
+
+static void log_stable_merge(struct ksm_log_table* log_table,
+    rmap_item* item, struct stable_node* stable_node) 
+{
+    struct ksm_event_log result_entry;
+    memset(&result_entry, 0, sizeof(result_entry));
+    result_entry.type = DPU_STABLE_MERGE;
+    result_entry.stable_merge.from_mm_id = item->mm_id;
+    result_entry.stable_merge.from_va = item->va;
+    result_entry.stable_merge.kpfn = stable_node->pfn;
+    result_entry.stable_merge.shared_cnt = stable_node->shared_cnt;
+    insert_ksm_log(log_table, &result_entry);
+}
+
+static void log_item_state_change(struct ksm_log_table* log_table,
+    rmap_item* item, struct stable_node* prelinked_node) 
+{
+    struct ksm_event_log result_entry;
+    memset(&result_entry, 0, sizeof(result_entry));
+    result_entry.type = DPU_ITEM_STATE_CHANGE;
+    result_entry.stable_merge.from_mm_id = item->mm_id;
+    result_entry.stable_merge.from_va = item->va;
+    result_entry.stable_merge.kpfn = prelinked_node->pfn;
+    result_entry.stable_merge.shared_cnt = prelinked_node->shared_cnt;
+    insert_ksm_log(log_table, &result_entry);
+}
+
+static void log_unstable_merge(struct ksm_log_table* log_table,
+    rmap_item* from_item, rmap_item* to_item)
+{
+    struct ksm_event_log result_entry;
+    memset(&result_entry, 0, sizeof(result_entry));
+    result_entry.type = DPU_UNSTABLE_MERGE;
+    // Both items already carry the stable node's hash
+    result_entry.fp = (uint32_t)from_item->old_hash.first_hash.low64;
+    result_entry.unstable_merge.from_mm_id = from_item->mm_id;
+    result_entry.unstable_merge.from_va = from_item->va;
+    result_entry.unstable_merge.to_mm_id = to_item->mm_id;
+    result_entry.unstable_merge.to_va = to_item->va;
+    insert_ksm_log(log_table, &result_entry);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////* Item State Related *//////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void insert_item_to_node(struct stable_node* node, rmap_item* item) {
+    switch (item->state) {
+        case None:
+        case Stable:
+            ERR_LOG_AND_STOP( "[KSM] Cannot insert to stable node: Invalid item state: %d\n", item->state);
+            break;
+        default:
+            break;
+    }
+
+    item->state = Stable;
+    item->old_hash = node->page_hash;
+    item->old_pfn = item->pfn;
+    item->pfn = node->pfn;
+    item->stable_node = node;
+
+    node->shared_cnt += 1;
+    g_tree_insert(node->sharing_item_tree, item, item);
+}
+
+static void remove_item_from_node(struct stable_node* node, rmap_item* item) {
+    node->shared_cnt -= 1;
+    g_tree_remove(node->sharing_item_tree, item);
+}
+
+static void reset_item_state(rmap_item* item) {
+    item->state = Volatile;
+    item->pfn = item->old_pfn;
+    item->old_pfn = 0;
+    item->old_hash = null_hash;
+    item->stable_node = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////* GTree Function Arguments related *//////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////
+
+gint rmap_item_compare(gconstpointer a, gconstpointer b) {
+    rmap_item *item1 = (rmap_item *)a;
+    rmap_item *item2 = (rmap_item *)b;
+
+    if (item1->mm_id < item2->mm_id) {
+        return -1;
+    } else if (item1->mm_id > item2->mm_id) {
+        return 1;
+    } else {
+        if (item1->va < item2->va) {
+            return -1;
+        } else if (item1->va > item2->va) {
+            return 1;
+        } else {
+            return 0;
+        }
+    }
+}
+
+gint page_buf_compare(gconstpointer a, gconstpointer b) {
+    return memcmp(a, b, PAGE_SIZE);
+}
+
+gint free_stable_node(gpointer key, gpointer value, gpointer user_data) {
+    struct stable_node *node = (struct stable_node *)value;
+    struct stable_node *next;
+
+    while (node) {
+        next = node->chain.next;
+        g_tree_destroy(node->sharing_item_tree);
+        
+        free(node);
+
+        node = next;
+    }   
+    
+    return 0;
+}
+
+gint free_rmap_item(gpointer key, gpointer value, gpointer user_data) {
+    rmap_item *item = (rmap_item *)value;
+
+    free(item);
+
+    return 0;
+}
+
+gint reset_each_item_state(gpointer key, gpointer value, gpointer data) {
+    rmap_item* item = (rmap_item*)value;
+    int* undo_cnt = (int*)data;
+
+    if (item->state != Stable) {
+        fprintf(stderr, "[KSM] Invalid item state: %d\n", item->state);
+        return -1;
+    }
+
+    DEBUG_LOG("[KSM] Undo stable merge for item: %llx(%d) from node %lu\n", item->va, item->mm_id, item->stable_node->pfn);
+
+    reset_item_state(item);
+    item->volatility_score += 1;
+
+    *undo_cnt += 1;
+
+    return 0;
+}
+
+gint update_item_checksum(gpointer key, gpointer value, gpointer data) {
+    rmap_item* item = (rmap_item*)value;
+    hash_pair* hash = (hash_pair*)data;
+
+    if (item->state != Stable) {
+        ERR_LOG_AND_STOP("[KSM] Invalid item state during checksum update: %d\n", item->state);
+        return -1;
+    }
+
+    item->old_hash = *hash;
+
+    return 0;
+}
+
+// void unstable_node_free (void *data) {
+//     struct unstable_node *node = (struct unstable_node *)data;
+
+//     node->item->state = Volatile;
+//     node->item->unstable_node = NULL;
+
+//     free(node);
+
+//     return;
+// }
+
+// void cleaner_destroy_unstable_bucket(gpointer data, gpointer user_data) {
+//     struct unstable_node *node = (struct unstable_node *)data;
+//     unstable_node_free(node);
+
+//     g_atomic_int_dec_and_test(&active_jobs);
+// }
+
+///////////////////////////////////////////////////////////////////////////
+//////////////////////////* Stable Tree Related *//////////////////////////
+///////////////////////////////////////////////////////////////////////////
+guint stable_node_hash(gconstpointer v) {
+    const struct stable_node* node = (struct stable_node*) v;
+    return node->page_hash.first_hash.high64 ^ node->page_hash.first_hash.low64 ^
+           node->page_hash.second_hash.high64 ^ node->page_hash.second_hash.low64;
+}
+
+gboolean stable_node_equal(gconstpointer a, gconstpointer b){
+    const struct stable_node* node_a = (struct stable_node*) a;
+    const struct stable_node* node_b = (struct stable_node*) b;
+
+    return compare_hash_pair_equal(&node_a->page_hash, &node_b->page_hash);
+}
+
+static struct stable_node* cmp_with_stable(struct ksm_metadata *ksm_meta, void* item_buf, hash_pair hash) {
+    struct stable_node lookup_node = {
+        .page_hash = hash,
+    };
+
+    struct stable_node* stable_node = g_hash_table_lookup(ksm_meta->stable_hash_table, &lookup_node);
+
+    if (stable_node) {
+        if (stable_node->shared_cnt < MAX_PAGE_SHARING) {
+            return stable_node;
+        }else{
+            struct stable_node* node_dup = stable_node->chain.next;
+
+            while (node_dup) {
+                if (node_dup->shared_cnt < MAX_PAGE_SHARING) {
+                    return node_dup;
+                }
+                node_dup = node_dup->chain.next;
+            }
+
+           return NULL;
+        }
+    } else{
+        return NULL;
+    }
+}
+
+static void insert_stable_node(struct ksm_metadata* ksm_meta, struct stable_node* new_node) {
+    struct stable_node* existing_node = g_hash_table_lookup(ksm_meta->stable_hash_table, new_node);
+    if (existing_node) {
+        while (existing_node->chain.next) {
+            existing_node = existing_node->chain.next;
+        }
+        existing_node->chain.next = new_node;
+        
+        new_node->chain.type = CHAIN;
+        new_node->chain.next = NULL;
+        new_node->chain.prev = existing_node;
+    } else {
+        new_node->chain.type = HEAD;
+        new_node->chain.next = NULL;
+        new_node->chain.prev = NULL;
+
+        g_hash_table_insert(ksm_meta->stable_hash_table, new_node, new_node);
+    }
+}
+
+static void remove_stable_node_no_item(struct ksm_metadata* metadata, struct stable_node *node) {
+    switch (node->chain.type) {
+        case HEAD:
+            if (node->chain.next) {
+                if (node->chain.prev) {
+                    ERR_LOG_AND_STOP("[KSM] Invalid chain type for stable node.\n");
+                }
+
+                struct stable_node* next_node = node->chain.next;
+                next_node->chain.type = HEAD;
+                next_node->chain.prev = NULL;
+                g_hash_table_remove(metadata->stable_hash_table, node);
+                g_hash_table_insert(metadata->stable_hash_table, next_node, next_node);
+            } else {
+                g_hash_table_remove(metadata->stable_hash_table, node);
+            }
+
+            g_tree_destroy(node->sharing_item_tree);
+            free(node);
+
+            break;
+        case CHAIN:
+            if (node->chain.prev) {
+                struct stable_node* prev_node = node->chain.prev;
+                struct stable_node* next_node = node->chain.next;
+
+                prev_node->chain.next = next_node;
+
+                if (next_node) {
+                    next_node->chain.prev = prev_node;
+                }
+
+            } else {
+                ERR_LOG_AND_STOP("[KSM] Invalid chain type for stable node.\n");
+            }
+
+            g_tree_destroy(node->sharing_item_tree);
+            free(node);
+
+            break;
+        default:
+            ERR_LOG_AND_STOP("[KSM] Invalid chain type for stable node.\n");
+            break;
+    }
+}
+
+static void remove_stale_node_and_log(struct ksm_metadata* metadata, 
+    struct stable_node* node, 
+    rmap_item* last_item, 
+    struct ksm_log_table* log_table) 
+{
+    struct ksm_event_log result_entry;
+    memset(&result_entry, 0, sizeof(result_entry));
+    result_entry.type = DPU_STALE_STABLE_NODE;
+    result_entry.stale_node.last_mm_id = last_item->mm_id;
+    result_entry.stale_node.last_va = last_item->va;
+    result_entry.stale_node.kpfn = node->pfn;
+    insert_ksm_log(log_table, &result_entry);
+
+    remove_stable_node_no_item(metadata, node);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//////////////////////////* Unstable Tree Related *//////////////////////////
+/////////////////////////////////////////////////////////////////////////////
+
+guint unstable_node_hash(gconstpointer v) {
+    const rmap_item* node = (rmap_item*) v;
+    return node->old_hash.first_hash.high64  ^ node->old_hash.first_hash.low64 ^
+           node->old_hash.second_hash.high64 ^ node->old_hash.second_hash.low64;
+}
+
+gboolean unstable_node_equal(gconstpointer a, gconstpointer b){
+    const rmap_item* node_a = (rmap_item*) a;
+    const rmap_item* node_b = (rmap_item*) b;
+
+    return compare_hash_pair_equal(&node_a->old_hash, &node_b->old_hash);
+}
+
+static rmap_item* cmp_with_unstable(struct ksm_metadata *ksm_meta, rmap_item* item) {
+    // struct unstable_node lookup_node = {
+    //     .item = item,
+    // };
+    rmap_item* node = g_hash_table_lookup(ksm_meta->unstable_hash_table, item);
+
+    if (node) {
+        g_hash_table_remove(ksm_meta->unstable_hash_table, node);
+    }
+
+    return node;
+}
+
+static void insert_unstable_node(struct ksm_metadata* ksm_meta, rmap_item* new_node) {
+    rmap_item* existing_node = g_hash_table_lookup(ksm_meta->unstable_hash_table, new_node);
+    if (existing_node) {
+        ERR_LOG_AND_STOP("[KSM] Collision occured Unstable node already exists.\n");
+    }
+
+    g_hash_table_insert(ksm_meta->unstable_hash_table, new_node, new_node);
+}
+
+void update_item_state(gpointer key, gpointer value, gpointer user_data) {
+    rmap_item *node = (rmap_item *)value;
+    node->state = Volatile;
+}
+
+static void clean_up_unstable_tree(struct ksm_metadata* ksm_meta) {
+    // GHashTableIter iter;
+    // gpointer key, value;
+    // g_hash_table_iter_init(&iter, ksm_meta->unstable_hash_table);
+
+    // if (g_atomic_int_get(&active_jobs) > 0) {
+    //     ERR_LOG_AND_STOP("[KSM] Unstable tree cleanup already in progress.\n");
+    // }
+
+    // while (g_hash_table_iter_next(&iter, &key, &value)) {
+    //     g_atomic_int_inc(&active_jobs);
+    //     g_thread_pool_push(table_cleaner_pool, value, NULL);
+    // }
+
+    // while ((g_atomic_int_get(&active_jobs) > 0) || (g_thread_pool_unprocessed(table_cleaner_pool) > 0)) {
+    //     g_usleep(10000); // sleep 10ms
+    // }
+
+    g_hash_table_foreach(ksm_meta->unstable_hash_table, update_item_state, NULL);
+
+    g_hash_table_remove_all(ksm_meta->unstable_hash_table);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//////////////////////////* Hot Region Related */////////////////////////////
+/////////////////////////////////////////////////////////////////////////////
+guint region_hash(gconstpointer v) {
+    const struct region_stat* r = v;
+    return (guint)(r->region ^ (r->region >> 32)) ^ ((guint)r->mm_id * 0x9e3779b1u);
+}
+
+gboolean region_equal(gconstpointer a, gconstpointer b) {
+    const struct region_stat* r_a = a;
+    const struct region_stat* r_b = b;
+    return r_a->region == r_b->region && r_a->mm_id == r_b->mm_id;
+}
+
+static struct region_stat* lookup_region(struct ksm_metadata* metadata, int mm_id, uint64_t va) {
+    struct region_stat lookup, *r;
+    lookup.mm_id = mm_id;
+    lookup.region = va >> HOT_REGION_SHIFT;
+
+    r = g_hash_table_lookup(metadata->region_table, &lookup);
+    if (!r) {
+        r = calloc(1, sizeof(*r));
+        if (!r) {
+            fprintf(stderr, "[KSM] calloc for region failed.\n");
+            return NULL;
+        }
+        r->mm_id = mm_id;
+        r->region = lookup.region;
+        r->until = -1;
+        g_hash_table_insert(metadata->region_table, r, r);
+    }
+    r->last_seen = metadata->iteration;
+    return r;
+}
+
+// The host is not exporting the item's region, so it is not gone either
+static int item_in_skipped_region(struct ksm_metadata* metadata, rmap_item* item) {
+    struct region_stat lookup, *r;
+
+    if (!metadata->region_table || !g_hash_table_size(metadata->region_table)) {
+        return 0;
+    }
+    lookup.mm_id = item->mm_id;
+    lookup.region = item->va >> HOT_REGION_SHIFT;
+    r = g_hash_table_lookup(metadata->region_table, &lookup);
+    // One iteration of slack, the host counts its iterations on its own
+    return r && r->until + 1 >= metadata->iteration;
+}
+
+static void log_hot_region(struct ksm_log_table* log_table, struct region_stat* r) {
+    struct ksm_event_log result_entry;
+    memset(&result_entry, 0, sizeof(result_entry));
+    result_entry.type = DPU_HOT_REGION;
+    result_entry.hot_region.mm_id = r->mm_id;
+    result_entry.hot_region.va = r->region << HOT_REGION_SHIFT;
+    result_entry.hot_region.backoff = r->backoff;
+    insert_ksm_log(log_table, &result_entry);
+}
+
+typedef struct {
+    struct ksm_metadata* metadata;
+    struct ksm_log_table* log_table;
+    int reported;
+} RegionContext;
+
+// Report regions that were hot this iteration and forget the long idle ones
+gboolean finish_region(gpointer key, gpointer value, gpointer data) {
+    RegionContext* ctx = data;
+    struct region_stat* r = value;
+    int iteration = ctx->metadata->iteration;
+
+    if (!r->scanned) {
+        return iteration - r->last_seen > REGION_IDLE_ITERS + r->backoff;
+    }
+
+    if (r->scanned >= REGION_MIN_PAGES &&
+        r->changed * 100 >= r->scanned * ctx->metadata->hot_region_pct) {
+        r->backoff = r->backoff ? MIN(r->backoff * 2, REGION_MAX_BACKOFF) : 1;
+        r->until = iteration + r->backoff;
+        log_hot_region(ctx->log_table, r);
+        ctx->reported += 1;
+    } else {
+        r->backoff = 0;
+    }
+
+    r->scanned = 0;
+    r->changed = 0;
+    return FALSE;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//////////////////////////* THP Related *////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////
+guint thp_stat_hash(gconstpointer v) {
+    const struct thp_stat* thp = v;
+    return (guint)(thp->region ^ (thp->region >> 32)) ^ ((guint)thp->mm_id * 0x9e3779b1u);
+}
+
+gboolean thp_stat_equal(gconstpointer a, gconstpointer b) {
+    const struct thp_stat* thp_a = a;
+    const struct thp_stat* thp_b = b;
+    return thp_a->region == thp_b->region && thp_a->mm_id == thp_b->mm_id;
+}
+
+static int page_is_zero(const void* page) {
+    const uint64_t* words = page;
+
+    for (int i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+        if (words[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Match a THP subpage without merging it, as a merge would split the huge
+ * page. The hash is kept in old_hash, so the page can merge right away once
+ * the host split it and it comes back unchanged.
+ */
+static void thp_scan_subpage(struct ksm_metadata* metadata, struct ksm_log_table* log_table,
+    const void* page, rmap_item* item) {
+    struct thp_stat lookup, *thp;
+    struct stable_node* node;
+
+    if (item->state == Stable) {
+        // Collapsed into a huge page since it was merged
+        node = item->stable_node;
+        remove_item_from_node(node, item);
+        reset_item_state(item);
+        if (node->shared_cnt == 0) {
+            remove_stale_node_and_log(metadata, node, item, log_table);
+        } else {
+            log_item_state_change(log_table, item, node);
+        }
+        metadata->stats.broken_merges += 1;
+    }
+
+    lookup.mm_id = item->mm_id;
+    lookup.region = item->va >> HOT_REGION_SHIFT;
+    thp = g_hash_table_lookup(metadata->thp_table, &lookup);
+    if (!thp) {
+        thp = calloc(1, sizeof(*thp));
+        if (!thp) {
+            fprintf(stderr, "[KSM] calloc for THP failed.\n");
+            return;
+        }
+        thp->mm_id = lookup.mm_id;
+        thp->region = lookup.region;
+        g_hash_table_insert(metadata->thp_table, thp, thp);
+    }
+    metadata->stats.thp_subpages_cnt += 1;
+
+    if (page_is_zero(page)) {
+        thp->zero += 1;
+        item->old_hash = null_hash;
+        return;
+    }
+
+    item->old_hash = calculate_hash_pair(&metadata->pre_hash, page);
+    if (cmp_with_stable(metadata, (void*)page, item->old_hash)) {
+        thp->stable += 1;
+    } else if (g_hash_table_lookup(metadata->unstable_hash_table, item) ||
+               g_hash_table_lookup(metadata->thp_seen_table, item)) {
+        // The first of two equal THP subpages only counts once the other one was split
+        thp->dup += 1;
+    } else {
+        g_hash_table_insert(metadata->thp_seen_table, item, item);
+    }
+}
+
+static void log_thp_summary(struct ksm_log_table* log_table, struct thp_stat* thp) {
+    struct ksm_event_log result_entry;
+    memset(&result_entry, 0, sizeof(result_entry));
+    result_entry.type = DPU_THP_SUMMARY;
+    result_entry.thp_summary.mm_id = thp->mm_id;
+    result_entry.thp_summary.va = thp->region << HOT_REGION_SHIFT;
+    result_entry.thp_summary.stable = thp->stable;
+    result_entry.thp_summary.zero = thp->zero;
+    result_entry.thp_summary.dup = thp->dup;
+    insert_ksm_log(log_table, &result_entry);
+}
+
+// Answer to the host's HOST_VERIFY_PAIR, the pair is echoed back
+static void log_verify_pair(struct ksm_log_table* log_table, struct ksm_event_log* pair, int same) {
+    struct ksm_event_log result_entry = *pair;
+    result_entry.type = same ? DPU_VERIFY_SAME : DPU_VERIFY_DIFF;
+    insert_ksm_log(log_table, &result_entry);
+}
+
+// Report every THP with a match, the table only covers one iteration
+gboolean finish_thp(gpointer key, gpointer value, gpointer data) {
+    RegionContext* ctx = data;
+    struct thp_stat* thp = value;
+
+    if (thp->stable || thp->zero || thp->dup) {
+        log_thp_summary(ctx->log_table, thp);
+        ctx->reported += 1;
+    }
+    return TRUE;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//////////////////////////* Rmap Tree Related *//////////////////////////////
+/////////////////////////////////////////////////////////////////////////////
+guint rmap_hash(gconstpointer v) {
+    rmap_item* item = (rmap_item*)v;
+    unsigned long hash_target = item->va | (item->mm_id & 0xFFF);
+
+    if ((item->va & 0xFFF) != 0) {
+        ERR_LOG_AND_STOP("[KSM] Invalid item: mm_id=%d, va=%llx\n", item->mm_id, item->va);
+    }
+
+    return hash_target;
+}
+
+gboolean rmap_equal(gconstpointer a, gconstpointer b) {
+    const rmap_item *item_a = a;
+    const rmap_item *item_b = b;
+    return (item_a->va == item_b->va) && (item_a->mm_id == item_b->mm_id);
+}
+
+typedef struct {
+    GTree *Tree;
+    GList *keys_to_remove;
+    int iteration;
+    struct ksm_metadata* metadata;
+} RemoveContext;
+
+gint collect_keys_to_remove(gpointer key, gpointer value, gpointer data) {
+    RemoveContext *ctx = (RemoveContext *)data;
+    rmap_item *item = (rmap_item *)value;
+    
+    if (item->last_access < ctx->iteration - 1 && !item_in_skipped_region(ctx->metadata, item)) {
+        switch (item->state) {
+            case None:
+            case Unstable:
+                ERR_LOG_AND_STOP("[KSM] Invalid state for item: %d\n", item->state);
+                break;
+            case Volatile:
+                break;
+            case Stable:
+                if (!item->stable_node) {
+                    ERR_LOG_AND_STOP("[KSM] Invalid stable node for item: %llx(%d)\n", item->va, item->mm_id);
+                }
+
+                break;
+        }
+        ctx->keys_to_remove = g_list_prepend(ctx->keys_to_remove, key);
+    }
+
+    return FALSE; // continue iteration
+}
+
+static void prune_rmap_tree(struct ksm_metadata* ksm_meta, struct ksm_log_table* log_table) {
+    RemoveContext ctx;
+    ctx.Tree = ksm_meta->rmap_tree;
+    ctx.keys_to_remove = NULL;
+    ctx.iteration = ksm_meta->iteration;
+    ctx.metadata = ksm_meta;
+    int cnt = 0;
+
+    g_tree_foreach(ksm_meta->rmap_tree, collect_keys_to_remove, &ctx);
+
+    for (GList *l = ctx.keys_to_remove; l != NULL; l = l->next) {
+        rmap_item* item = l->data;
+
+        if (item->state == Stable && item->stable_node) {
+            remove_item_from_node(item->stable_node, item);
+            if (item->stable_node->shared_cnt == 0) {
+                remove_stale_node_and_log(ksm_meta, item->stable_node, item, log_table);
+            }
+        }
+
+        g_tree_remove(ctx.Tree, item);
+        free(item);
+        cnt ++;
+    }
+
+    g_list_free(ctx.keys_to_remove);
+
+    printf("[KSM] Cleaned up %d items from rmap tree.\n", cnt);
+}
+
+static void prune_metadata(struct ksm_metadata* ksm_meta, struct ksm_log_table* log_table) {
+    printf("[KSM] Cleaning up unstable tree...\n");
+    clean_up_unstable_tree(ksm_meta);
+
+    if (g_tree_nnodes(ksm_meta->rmap_tree) - ksm_meta->total_accessed_cnt > RMAP_PRUNE_MARGIN) {
+        printf("[KSM] We have %lu unaccessed items. Cleaning up...\n", g_tree_nnodes(ksm_meta->rmap_tree) - ksm_meta->total_accessed_cnt);
+        prune_rmap_tree(ksm_meta, log_table);
+    }
+}
+
+// page is NULL when the host saw it unchanged, then the last hash still holds
+static hash_pair page_hash_or_old(struct ksm_metadata* metadata, const void* page, rmap_item* item) {
+    return page ? calculate_hash_pair(&metadata->pre_hash, page) : item->old_hash;
+}
+
+static int rmap_quota_exceeded(struct ksm_metadata* metadata) {
+    return metadata->max_rmap_items && g_tree_nnodes(metadata->rmap_tree) >= metadata->max_rmap_items;
+}
+
+rmap_item* lookup_rmap_item(struct ksm_metadata* metadata, int mm_id, struct shadow_pte* pte) {
+    rmap_item lookup_item, *item;
+    lookup_item.mm_id = mm_id;
+    lookup_item.va = pte->va & ~SHADOW_PTE_FLAGS;
+
+    item = g_tree_lookup(metadata->rmap_tree, &lookup_item);
+    if (!item) {
+        if (rmap_quota_exceeded(metadata)) {
+            return NULL;
+        }
+
+        DEBUG_LOG("[KSM] New rmap item: mm_id=%d, va=%llx\n", mm_id, lookup_item.va);
+        item = (rmap_item*) malloc(sizeof(rmap_item));
+        if (!item) {
+            fprintf(stderr, "[Server] malloc for item failed.\n");
+            return NULL;
+        }
+
+        item->state = Volatile;
+        item->mm_id = mm_id;
+        item->va = lookup_item.va;
+        item->old_hash = null_hash;
+        item->age = 0;
+        
+        if (metadata->rmap_tree == NULL) {
+            ERR_LOG_AND_STOP("[KSM] rmap tree is null while lookup\n");
+        }
+        g_tree_insert(metadata->rmap_tree, item, item);
+    }
+
+    metadata->total_accessed_cnt += 1;
+    item->last_access = metadata->iteration;
+    item->pfn = pte->kpfn;
+    
+    return item;
+}
+
+int cmp_and_merge_one(struct ksm_metadata* metadata, struct ksm_log_table* log_table,
+    void* page, rmap_item* curr_item, unsigned int rkey, dma_addr_t addr) {
+    // XXH64_hash_t curr_checksum;
+    // XXH64_hash_t node_checksum;
+    struct stable_node* stable_node, *chain_node;
+    rmap_item* unstable_node;
+    struct ksm_event_log result_entry;
+    hash_pair curr_hash;
+    hash_pair node_hash;
+
+again:
+    switch (curr_item->state) {
+        case None:
+        case Unstable:
+            ERR_LOG_AND_STOP( "[KSM] Invalid state for item : %d\n", curr_item->state);
+            break;
+        
+        case Stable:
+            DEBUG_LOG("[KSM] Already merged stable item.\n");
+            
+            struct stable_node* curr_node = curr_item->stable_node;
+            if (curr_node->pfn != curr_item->pfn) {
+                DEBUG_LOG("[KSM] PFN mismatch implies mapping change: %lu vs %lu\n", curr_node->pfn, curr_item->pfn);
+
+                remove_item_from_node(curr_node, curr_item);
+                reset_item_state(curr_item);
+                
+                if (curr_node->shared_cnt == 0) {
+                    remove_stale_node_and_log(metadata, curr_node, curr_item, log_table);
+                } else {
+                    log_item_state_change(log_table, curr_item, curr_node);
+                }
+
+                curr_item->volatility_score += 1;
+                metadata->stats.broken_merges += 1;
+
+                goto again;
+            } else {
+                /* Additional error check logic required to avoid stale stable node */
+                // PFN이 안 바뀌었는데, checksum이 달라진 경우 (리눅스 Page fault는 항상 새 page로 변경함)
+                // => unstable merge가 성공한 시점에서, page contents는 지금 checksum이 올바름
+                START_TIMER(big_hash_timer);
+                curr_hash = page_hash_or_old(metadata, page, curr_item);
+                END_TIMER(big_hash_timer);
+
+                if (!compare_hash_pair_equal(&curr_hash, &curr_item->old_hash)) {
+                    if (!compare_hash_pair_equal(&curr_item->old_hash, &curr_node->page_hash)) {
+                        ERR_LOG_AND_STOP( "[KSM] Checksum mismatch in Stable item: %lx%lx%lx%lx vs %lx%lx%lx%lx and node %lx%lx%lx%lx\n",
+                            PRINT_HASH_PAIR(curr_item->old_hash),
+                            PRINT_HASH_PAIR(curr_hash),
+                            PRINT_HASH_PAIR(curr_node->page_hash));
+                    }
+
+                    if (curr_node->chain.type == HEAD) {
+                        g_hash_table_remove(metadata->stable_hash_table, curr_node);
+
+                        curr_node->page_hash = curr_hash;
+                        g_tree_foreach(curr_node->sharing_item_tree, update_item_checksum, &curr_hash);
+
+                        chain_node = curr_node->chain.next;
+                        while (chain_node) {
+                            chain_node->page_hash = curr_hash;
+                            g_tree_foreach(chain_node->sharing_item_tree, update_item_checksum, &curr_hash);
+
+                            chain_node = chain_node->chain.next;
+                        }
+
+                        g_hash_table_insert(metadata->stable_hash_table, curr_node, curr_node);
+                        
+                        DEBUG_LOG("Head Node checksum updated: %lx%lx%lx%lx\n", PRINT_HASH_PAIR(curr_node->page_hash));
+                    }else{
+                        if (!curr_node->chain.prev) {
+                            ERR_LOG_AND_STOP("[KSM] Invalid stable node type: %d\n", curr_node->chain.type);
+                        }
+
+                        while (curr_node->chain.prev) {
+                            curr_node = curr_node->chain.prev;
+                        }
+
+                        if (curr_node->chain.type != HEAD) {
+                            ERR_LOG_AND_STOP("[KSM] Invalid stable node type: %d\n", curr_node->chain.type);
+                        }
+
+                        g_hash_table_remove(metadata->stable_hash_table, curr_node);
+                        
+                        curr_node->page_hash = curr_hash;
+                        g_tree_foreach(curr_node->sharing_item_tree, update_item_checksum, &curr_hash);
+
+                        chain_node = curr_node->chain.next;
+                        while (chain_node) {
+                            chain_node->page_hash = curr_hash;
+                            g_tree_foreach(chain_node->sharing_item_tree, update_item_checksum, &curr_hash);
+
+                            chain_node = chain_node->chain.next;
+                        }
+
+                        g_hash_table_insert(metadata->stable_hash_table, curr_node, curr_node);
+                        
+                        DEBUG_LOG("Chain Node checksum updated: %lx%lx%lx%lx\n", PRINT_HASH_PAIR(curr_node->page_hash));
+                    }
+                }
+            }
+
+            if (curr_item->volatility_score > 0) {
+                curr_item->volatility_score -= 1;
+            }
+            
+            break;
+
+        case Volatile:
+            DEBUG_LOG("[KSM] Volatile item.\n");
+            metadata->stats.volatile_items_cnt += 1;
+            curr_item->age += 1;
+
+            if (should_skip_item(curr_item)) {
+                DEBUG_LOG("[KSM] Skipping volatile item: %llx(%d) skip count: %d\n", curr_item->va, curr_item->mm_id, curr_item->skip_cnt);
+                metadata->stats.skipped_cnt += 1;
+                bask_stats_count(BASK_CNT_PAGES_SKIPPED, 1);
+                return 0;
+            } else {
+                DEBUG_LOG("[KSM] Not Skipped volatile item: %llx(%d) skip count: %d\n", curr_item->va, curr_item->mm_id, curr_item->skip_cnt);
+            }
+
+            START_TIMER(big_hash_timer);
+            curr_hash = page_hash_or_old(metadata, page, curr_item);
+            END_TIMER(big_hash_timer);
+
+            if (compare_hash_pair_equal(&curr_item->old_hash, &curr_hash)) {
+                if (curr_item->volatility_score > 0) {
+                    curr_item->volatility_score -= 1;
+                }
+
+                // Try to find a match in stable nodes
+                stable_node = cmp_with_stable(metadata, page, curr_hash);
+
+                if (stable_node) {
+                    if (stable_node->shared_cnt >= MAX_PAGE_SHARING) {
+                        ERR_LOG_AND_STOP( "[KSM] Invalid shared count for stable node: %d\n", stable_node->shared_cnt);
+                    }
+
+                    if (curr_item->volatility_score > 0) {
+                        metadata->stats.highly_volatile_but_stable_merged_cnt += 1;
+                    }
+
+                    // Merge with stable node                
+                    insert_item_to_node(stable_node, curr_item);
+                    log_stable_merge(log_table, curr_item, stable_node);
+
+                    DEBUG_LOG("[KSM] %llx(%d) Merged with stable node %lu Shared count: %d\n", curr_item->va, curr_item->mm_id, stable_node->pfn, stable_node->shared_cnt);
+                }else{
+                    curr_item->old_hash = curr_hash;
+                    // Checksum matches with old checksum
+                    // Try to find a match in unstable nodes
+                    unstable_node = cmp_with_unstable(metadata,  curr_item);
+                    if (unstable_node) {
+                        // Merge with unstable node. Promote to stable
+                        stable_node = (struct stable_node*) malloc(sizeof(struct stable_node));
+                        if (!stable_node) {
+                            fprintf(stderr, "[Server] malloc for stable_node failed.\n");
+                            return -1;
+                        }
+                        memset(stable_node, 0, sizeof(struct stable_node));
+
+                        stable_node->shared_cnt = 0;
+                        stable_node->page_hash = curr_hash;
+                        stable_node->pfn = curr_item->pfn;
+                        stable_node->sharing_item_tree = g_tree_new(rmap_item_compare);
+                        
+                        insert_stable_node(metadata, stable_node);
+
+                        insert_item_to_node(stable_node, unstable_node);
+                        insert_item_to_node(stable_node, curr_item);
+
+                        log_unstable_merge(log_table, curr_item, unstable_node);
+
+                        if (curr_item->volatility_score > 0 || unstable_node->volatility_score > 0) {
+                            metadata->stats.highly_volatile_but_unstable_merged_cnt += 1;
+                        }
+
+                        DEBUG_LOG("[KSM] %llx(%d) and %llx(%d) Merged into stable node %lu Shared count: %d\n", curr_item->va, curr_item->mm_id, unstable_node->va, unstable_node->mm_id, stable_node->pfn, stable_node->shared_cnt);
+
+                    }else{
+                        curr_item->old_hash = curr_hash;                        
+                        curr_item->state = Unstable;
+                        insert_unstable_node(metadata, curr_item);                                
+                    }
+                }
+            } else {
+                if (!compare_hash_pair_equal(&curr_item->old_hash, &null_hash)) {
+                    curr_item->volatility_score += 1;
+                }
+
+                curr_item->old_hash = curr_hash;
+            }
+
+            break;
+    }
+
+    return 0;
+}
+
+int cmp_and_merge_one_old(struct ksm_metadata* metadata, struct ksm_log_table* log_table,
+    void* page, rmap_item* curr_item, unsigned int rkey, dma_addr_t addr) {
+    struct stable_node* stable_node, *chain_node;
+    rmap_item* unstable_node;
+    struct ksm_event_log result_entry;
+    hash_pair curr_hash;
+    hash_pair node_hash;
+
+again:
+    switch (curr_item->state) {
+        case None:
+        case Unstable:
+            ERR_LOG_AND_STOP( "[KSM] Invalid state for item : %d\n", curr_item->state);
+            break;
+        
+        case Stable:
+            DEBUG_LOG("[KSM] Already merged stable item.\n");
+            
+            struct stable_node* curr_node = curr_item->stable_node;
+            if (curr_node->pfn != curr_item->pfn) {
+                DEBUG_LOG("[KSM] PFN mismatch implies mapping change: %lu vs %lu\n", curr_node->pfn, curr_item->pfn);
+
+                remove_item_from_node(curr_node, curr_item);
+                reset_item_state(curr_item);
+                
+                if (curr_node->shared_cnt == 0) {
+                    remove_stale_node_and_log(metadata, curr_node, curr_item, log_table);
+                } else {
+                    log_item_state_change(log_table, curr_item, curr_node);
+                }
+
+                goto again;
+            } else {
+                /* Additional error check logic required to avoid stale stable node */
+                // PFN이 안 바뀌었는데, checksum이 달라진 경우 (리눅스 Page fault는 항상 새 page로 변경함)
+                // => unstable merge가 성공한 시점에서, page contents는 지금 checksum이 올바름
+                START_TIMER(big_hash_timer);
+                curr_hash = calculate_hash_pair(&metadata->pre_hash, page);
+                END_TIMER(big_hash_timer);
+
+                if (!compare_hash_pair_equal(&curr_hash, &curr_item->old_hash)) {
+                    if (!compare_hash_pair_equal(&curr_item->old_hash, &curr_node->page_hash)) {
+                        ERR_LOG_AND_STOP( "[KSM] Checksum mismatch in Stable item: %lx%lx%lx%lx vs %lx%lx%lx%lx and node %lx%lx%lx%lx\n",
+                            PRINT_HASH_PAIR(curr_item->old_hash),
+                            PRINT_HASH_PAIR(curr_hash),
+                            PRINT_HASH_PAIR(curr_node->page_hash));
+                    }
+
+                    if (curr_node->chain.type == HEAD) {
+                        g_hash_table_remove(metadata->stable_hash_table, curr_node);
+
+                        curr_node->page_hash = curr_hash;
+                        g_tree_foreach(curr_node->sharing_item_tree, update_item_checksum, &curr_hash);
+
+                        chain_node = curr_node->chain.next;
+                        while (chain_node) {
+                            chain_node->page_hash = curr_hash;
+                            g_tree_foreach(chain_node->sharing_item_tree, update_item_checksum, &curr_hash);
+
+                            chain_node = chain_node->chain.next;
+                        }
+
+                        g_hash_table_insert(metadata->stable_hash_table, curr_node, curr_node);
+                        
+                        DEBUG_LOG("Head Node checksum updated: %lx%lx%lx%lx\n", PRINT_HASH_PAIR(curr_node->page_hash));
+                    }else{
+                        if (!curr_node->chain.prev) {
+                            ERR_LOG_AND_STOP("[KSM] Invalid stable node type: %d\n", curr_node->chain.type);
+                        }
+
+                        while (curr_node->chain.prev) {
+                            curr_node = curr_node->chain.prev;
+                        }
+
+                        if (curr_node->chain.type != HEAD) {
+                            ERR_LOG_AND_STOP("[KSM] Invalid stable node type: %d\n", curr_node->chain.type);
+                        }
+
+                        g_hash_table_remove(metadata->stable_hash_table, curr_node);
+                        
+                        curr_node->page_hash = curr_hash;
+                        g_tree_foreach(curr_node->sharing_item_tree, update_item_checksum, &curr_hash);
+
+                        chain_node = curr_node->chain.next;
+                        while (chain_node) {
+                            chain_node->page_hash = curr_hash;
+                            g_tree_foreach(chain_node->sharing_item_tree, update_item_checksum, &curr_hash);
+
+                            chain_node = chain_node->chain.next;
+                        }
+
+                        g_hash_table_insert(metadata->stable_hash_table, curr_node, curr_node);
+                        
+                        DEBUG_LOG("Chain Node checksum updated: %lx%lx%lx%lx\n", PRINT_HASH_PAIR(curr_node->page_hash));
+                    }
+                }
+            }
+
+            break;
+            
+        case Volatile:
+            DEBUG_LOG("[KSM] Volatile item.\n");
+            START_TIMER(big_hash_timer);
+            curr_hash = calculate_hash_pair(&metadata->pre_hash, page);
+            END_TIMER(big_hash_timer);
+            // Try to find a match in stable nodes
+            stable_node = cmp_with_stable(metadata, page, curr_hash);
+
+            if (stable_node) {
+                if (stable_node->shared_cnt >= MAX_PAGE_SHARING) {
+                    ERR_LOG_AND_STOP( "[KSM] Invalid shared count for stable node: %d\n", stable_node->shared_cnt);
+                }
+
+                // Merge with stable node                
+                insert_item_to_node(stable_node, curr_item);
+                log_stable_merge(log_table, curr_item, stable_node);
+
+                DEBUG_LOG("[KSM] %llx(%d) Merged with stable node %lu Shared count: %d\n", curr_item->va, curr_item->mm_id, stable_node->pfn, stable_node->shared_cnt);
+            }else{
+                // curr_checksum = XXH64(page, PAGE_SIZE, 0);
+
+                if (compare_hash_pair_equal(&curr_item->old_hash, &curr_hash)) {
+                    curr_item->old_hash = curr_hash;
+                    // Checksum matches with old checksum
+                    // Try to find a match in unstable nodes
+                    unstable_node = cmp_with_unstable(metadata,  curr_item);
+                    if (unstable_node) {
+                        if (!compare_hash_pair_equal(&unstable_node->old_hash, &curr_hash)) {
+                            ERR_LOG_AND_STOP("[KSM] Checksum mismatch: %lx%lx%lx%lx vs %lx%lx%lx%lx", 
+                                PRINT_HASH_PAIR(unstable_node->old_hash), PRINT_HASH_PAIR(curr_hash));
+                        }
+
+                        // Merge with unstable node. Promote to stable
+                        stable_node = (struct stable_node*) malloc(sizeof(struct stable_node));
+                        if (!stable_node) {
+                            fprintf(stderr, "[Server] malloc for stable_node failed.\n");
+                            return -1;
+                        }
+                        memset(stable_node, 0, sizeof(struct stable_node));
+
+                        stable_node->shared_cnt = 0;
+                        stable_node->page_hash = curr_hash;
+                        stable_node->pfn = curr_item->pfn;
+                        stable_node->sharing_item_tree = g_tree_new(rmap_item_compare);
+                        
+                        insert_stable_node(metadata, stable_node);
+
+                        insert_item_to_node(stable_node, unstable_node);
+                        insert_item_to_node(stable_node, curr_item);
+
+                        log_unstable_merge(log_table, curr_item, unstable_node);
+
+                        DEBUG_LOG("[KSM] %llx(%d) and %llx(%d) Merged into stable node %lu Shared count: %d\n", curr_item->va, curr_item->mm_id, unstable_node->va, unstable_node->mm_id, stable_node->pfn, stable_node->shared_cnt);
+
+                        // free(unstable_node);
+                    }else{
+                        curr_item->old_hash = curr_hash;
+                        // Insert as new unstable node
+                        // unstable_node = (struct unstable_node*) malloc(sizeof(struct unstable_node));
+                        // if (!unstable_node) {
+                        //     fprintf(stderr, "[Server] malloc for unstable_node failed.\n");
+                        //     return -1;
+                        // }
+                        // unstable_node->item = curr_item;
+                        
+                        curr_item->state = Unstable;
+                        // curr_item->unstable_node = unstable_node;
+                        insert_unstable_node(metadata, curr_item);                                
+                    }
+
+                } else {
+                    // Not a merge candidate
+                    curr_item->old_hash = curr_hash;
+                }
+            }
+
+            break;
+    }
+
+    return 0;
+}
+
+static int (*ksm_ops)(struct ksm_metadata* metadata, struct ksm_log_table* log_table,
+    void* page, rmap_item* curr_item, unsigned int rkey, dma_addr_t addr)  = cmp_and_merge_one;
+
+// Whether an unchanged page that was not read can go through the engine on its old hash
+static int can_reuse_old_hash(rmap_item* item) {
+    if (ksm_ops != cmp_and_merge_one || compare_hash_pair_equal(&item->old_hash, &null_hash)) {
+        return 0;
+    }
+    // A broken merge needs the page's content
+    return item->state != Stable || item->stable_node->pfn == item->pfn;
+}
+
+int ksm_metadata_init(struct ksm_metadata* metadata, struct ksm_log_table* log_table) {
+    metadata->rmap_tree = g_tree_new(rmap_item_compare);
+    metadata->stable_hash_table = g_hash_table_new(stable_node_hash, stable_node_equal);
+    metadata->unstable_hash_table = g_hash_table_new(unstable_node_hash, unstable_node_equal);
+    metadata->region_table = g_hash_table_new_full(region_hash, region_equal, NULL, free);
+    metadata->thp_table = g_hash_table_new_full(thp_stat_hash, thp_stat_equal, NULL, free);
+    metadata->thp_seen_table = g_hash_table_new(unstable_node_hash, unstable_node_equal);
+
+    log_table->entries = calloc(1024, sizeof(struct ksm_event_log));
+    log_table->capacity = 1024;
+    if (!log_table->entries) {
+        fprintf(stderr, "[KSM] calloc for log table failed.\n");
+        return -1;
+    }
+    return 0;
+}
+
+void ksm_metadata_destroy(struct ksm_metadata* metadata, struct ksm_log_table* log_table) {
+    if (metadata->stable_hash_table) {
+        g_hash_table_foreach(metadata->stable_hash_table,  (GHFunc) free_stable_node, NULL);
+        g_hash_table_destroy(metadata->stable_hash_table);
+        metadata->stable_hash_table = NULL;
+    }
+    
+    if (metadata->unstable_hash_table) {
+        g_hash_table_destroy(metadata->unstable_hash_table);
+        metadata->unstable_hash_table = NULL;
+    }
+
+    if (metadata->region_table) {
+        g_hash_table_destroy(metadata->region_table);
+        metadata->region_table = NULL;
+    }
+
+    if (metadata->thp_table) {
+        g_hash_table_destroy(metadata->thp_table);
+        metadata->thp_table = NULL;
+    }
+
+    if (metadata->thp_seen_table) {
+        g_hash_table_destroy(metadata->thp_seen_table);
+        metadata->thp_seen_table = NULL;
+    }
+
+    if (metadata->rmap_tree) {
+        g_tree_foreach(metadata->rmap_tree, free_rmap_item, NULL);
+        g_tree_destroy(metadata->rmap_tree);
+        metadata->rmap_tree = NULL;
+    }
+
+    if (log_table->entries) {
+        free(log_table->entries);
+        log_table->entries = NULL;
+    }
+}
+
+// Run every page of one job through the engine, pages_buf holds them back to back
+void ksm_scan_pages(struct worker_job* work) {
+    uint64_t i, idx;
+    void* page;
+    struct region_stat* region = NULL;
+    unsigned short score;
+    unsigned long skipped;
+    int unchanged;
+
+    for (i = 0; i < work->num_pages; i++) {
+        page = (char*)work->pages_buf + i * PAGE_SIZE;
+
+        if (PRE_HASH_ON) {
+            if (i % PRE_HASH_NUM == 0) {
+            int diff = work->num_pages - i;
+            int max_idx = diff > PRE_HASH_NUM ? PRE_HASH_NUM : diff;
+            start_pre_hash_pair_table(&work->metadata->pre_hash, page, max_idx);
+            }
+        }
+
+        idx = work->idx_adjust + i;
+        
+        DEBUG_LOG("[KSM Worker] working on va: %lx (%llu-th)\n", work->va2dma_map[idx].va, idx);
+        
+START_TIMER(ksm_operation_timer);
+        uint64_t op_start = bask_stats_now();
+        rmap_item* curr_item = lookup_rmap_item(work->metadata, work->mm_id, &work->va2dma_map[idx]);
+        bask_stats_since(BASK_PHASE_LOOKUP, op_start);
+        if (!curr_item) {
+            if (rmap_quota_exceeded(work->metadata)) {
+                // Out of this tenant's share of NIC memory, leave the page untracked
+                work->metadata->stats.quota_skipped_cnt += 1;
+ABORT_TIMER(ksm_operation_timer);
+                continue;
+            }
+            ERR_LOG_AND_STOP("[KSM] Failed to lookup rmap item.\n");
+        }
+
+        if (work->va2dma_map[idx].va & SHADOW_PTE_THP) {
+            op_start = bask_stats_now();
+            thp_scan_subpage(work->metadata, work->log_table, page, curr_item);
+            bask_stats_since(BASK_PHASE_MERGE, op_start);
+            bask_stats_count(BASK_CNT_PAGES_SCANNED, 1);
+END_TIMER(ksm_operation_timer);
+            continue;
+        }
+
+        unchanged = work->va2dma_map[idx].va & SHADOW_PTE_UNCHANGED;
+        if (unchanged) {
+            // The page was not read, pages_buf only holds zeros for it
+            if (!can_reuse_old_hash(curr_item)) {
+                work->metadata->stats.unchanged_deferred_cnt += 1;
+ABORT_TIMER(ksm_operation_timer);
+                continue;
+            }
+            work->metadata->stats.unchanged_cnt += 1;
+        }
+
+        op_start = bask_stats_now();
+        score = curr_item->volatility_score;
+        skipped = work->metadata->stats.skipped_cnt;
+        int err = ksm_ops(work->metadata, work->log_table, unchanged ? NULL : page, curr_item, work->rkey, work->pages_addr + i * PAGE_SIZE);
+        if (err) {
+            ERR_LOG_AND_STOP("[KSM] cmp_and_merge_one failed.\n");
+        }
+        bask_stats_since(BASK_PHASE_MERGE, op_start);
+
+        if (work->metadata->dirty_tracking && !unchanged && work->metadata->stats.skipped_cnt != skipped) {
+            // Written but skipped: the old hash is stale and must not stand in for the page later
+            curr_item->old_hash = null_hash;
+        }
+
+        if (work->metadata->hot_region_pct) {
+            // Pages come in va order, so the region rarely changes between two of them
+            if (!region || region->mm_id != work->mm_id || region->region != curr_item->va >> HOT_REGION_SHIFT) {
+                region = lookup_region(work->metadata, work->mm_id, curr_item->va);
+            }
+            if (region) {
+                // A new hash, a broken merge or a skip for past volatility
+                region->scanned += 1;
+                region->changed += curr_item->volatility_score > score || work->metadata->stats.skipped_cnt != skipped;
+            }
+        }
+        bask_stats_count(BASK_CNT_PAGES_SCANNED, 1);
+END_TIMER(ksm_operation_timer);
+    }
+}
+
+// Undo what the host could not apply, idx is the entry's position for the logs
+void ksm_apply_error_log(struct ksm_metadata* metadata, struct ksm_log_table* log_table,
+    struct ksm_event_log* entry, int idx) {
+    int undo_cnt;
+    rmap_item lookup_item, *item, *from_item;
+    struct stable_node* curr_node;
+
+    switch (entry->type) {
+        case HOST_STALE_STABLE_NODE:
+            ERR_LOG_AND_STOP( "[KSM][%d-th] HOST_STALE_STABLE_NODE: %lu\n", idx, entry->stale_node.kpfn);
+            break;
+        case HOST_NO_STABLE_NODE:
+            ERR_LOG_AND_STOP( "[KSM][%d-th] HOST_NO_STABLE_NODE - currently unreachable\n", idx);
+            break;
+        case HOST_MERGE_ONE_FAILED:
+        DEBUG_LOG("[KSM][%d-th] HOST_MERGE_ONE_FAILED: %llx(%d) -> %lu\n", idx,
+            entry->stable_merge.from_va, entry->stable_merge.from_mm_id, entry->stable_merge.kpfn);
+            
+            lookup_item.mm_id = entry->stable_merge.from_mm_id;
+            lookup_item.va = entry->stable_merge.from_va;
+
+            item = g_tree_lookup(metadata->rmap_tree, &lookup_item);
+            if (!item) {
+                ERR_LOG_AND_STOP( "[KSM] lookup_rmap_item failed: %d->%llx\n", lookup_item.mm_id, lookup_item.va);
+            }
+
+            curr_node = item->stable_node;
+            if (!curr_node) {
+                ERR_LOG_AND_STOP( "[KSM] Invalid stable node for item in merge one: %llx(%d)\n", entry->stable_merge.from_va, entry->stable_merge.from_mm_id);
+            }
+
+            if (curr_node->pfn != entry->stable_merge.kpfn) {
+                ERR_LOG_AND_STOP( "[KSM] Unexpected pfn while undoing stable merge: %lu vs %lu\n", curr_node->pfn, entry->stable_merge.kpfn);
+            }
+
+            if (curr_node->shared_cnt < 1) {
+                ERR_LOG_AND_STOP("[KSM] Invalid shared count for stable node: %lu - %d\n", curr_node->pfn, curr_node->shared_cnt);
+            }
+
+            remove_item_from_node(curr_node, item);
+            reset_item_state(item);
+            item->volatility_score += 1;
+
+            if (curr_node->shared_cnt == 0) {
+                remove_stale_node_and_log(metadata, curr_node, item, log_table);
+            }
+
+            break;
+        case HOST_MERGE_TWO_FAILED:
+            DEBUG_LOG("[KSM][%d-th] HOST_MERGE_TWO_FAILED: %llx(%d) -> %llx(%d)\n", idx,
+            entry->unstable_merge.from_va, entry->unstable_merge.from_mm_id, entry->unstable_merge.to_va, entry->unstable_merge.to_mm_id);
+
+            undo_cnt = 0;
+            lookup_item.mm_id = entry->unstable_merge.from_mm_id;
+            lookup_item.va = entry->unstable_merge.from_va;
+            from_item = g_tree_lookup(metadata->rmap_tree, &lookup_item);
+            if (!from_item) {
+                ERR_LOG_AND_STOP( "[KSM] lookup_rmap_item failed: %d->%llx\n", lookup_item.mm_id, lookup_item.va);
+            }
+
+            curr_node = from_item->stable_node;
+            if (!curr_node) {
+                ERR_LOG_AND_STOP( "[KSM] Invalid stable node for item in merge two: %llx(%d)\n", entry->unstable_merge.from_va, entry->unstable_merge.from_mm_id);
+            }
+            
+            g_tree_foreach(curr_node->sharing_item_tree, reset_each_item_state, &undo_cnt);
+            
+            DEBUG_LOG("    Undo merge related to stable node %lu - %d\n", curr_node->pfn, undo_cnt);
+
+            remove_stable_node_no_item(metadata, curr_node);
+            break;
+        default:
+            ERR_LOG_AND_STOP( "[KSM] Invalid event type: %d\n", entry->type);
+            break;
+    }
+}
+
+// End of a scan round: report hash collisions, hot regions and THPs, drop items the host no longer maps
+void ksm_finish_iteration(struct ksm_metadata* metadata, struct ksm_log_table* log_table) {
+    printf("[KSM] Hash collision occured: %lu, at most node %lu\n", metadata->stats.hash_collision_cnt, metadata->stats.hash_collision_cnt_max);
+    metadata->stats.hash_collision_cnt = 0;
+    metadata->stats.hash_collision_cnt_max = 0;
+
+    if (metadata->hot_region_pct) {
+        RegionContext ctx = { metadata, log_table, 0 };
+        g_hash_table_foreach_remove(metadata->region_table, finish_region, &ctx);
+        printf("[KSM] Hot regions: %d reported, %u tracked\n", ctx.reported, g_hash_table_size(metadata->region_table));
+    }
+
+    if (g_hash_table_size(metadata->thp_table)) {
+        RegionContext ctx = { metadata, log_table, 0 };
+        unsigned int thps = g_hash_table_size(metadata->thp_table);
+        g_hash_table_remove_all(metadata->thp_seen_table);
+        g_hash_table_foreach_remove(metadata->thp_table, finish_thp, &ctx);
+        printf("[KSM] THPs: %u scanned, %d with matches reported, %lu subpages\n", thps, ctx.reported,
+            metadata->stats.thp_subpages_cnt);
+    }
+
+    uint64_t prune_start = bask_stats_now();
+    prune_metadata(metadata, log_table);
+    bask_stats_since(BASK_PHASE_PRUNE, prune_start);
+
+    metadata->total_accessed_cnt = 0;
+}
+
+#endif
@@ -21,6 +21,22 @@
 #define SERVER_IP "10.0.25.100"
 #define SERVER_PORT 10103
 
+/*
+ * A host may open extra RC connections ("lanes") next to its main one so the
+ * server can spread page-table and page reads over several QPs. Every
+ * connection carries this as CM private data; lanes are matched to their main
+ * connection by session.
+ */
+#define KSM_CONN_MAGIC 0x4b534d4c
+#define MAX_LANES 8
+
+struct ksm_conn_private {
+	uint32_t magic;
+	uint32_t session;
+	int lane;		/* 0 is the main connection */
+	int nr_lanes;	/* extra lanes the host will open */
+};
+
 #define MAX_MM_DESCS 32
 
 #define MAX_PAGES_DESCS 512
@@ -61,10 +77,17 @@ struct error_table_descriptor {
 	struct error_table_desc_entry entries[MAX_PAGES_DESCS];
 };
 
+/* read_rate_mbps that turns the server's read shaping off for the iteration */
+#define READ_RATE_UNSHAPED (~0ULL)
+
 struct metadata_descriptor {
     uint64_t pt_cnt;
     struct shadow_pt_descriptor pt_descs[MAX_MM_DESCS];
 	struct error_table_descriptor et_descs;
+	uint64_t read_rate_mbps;	/* NIC read shaping for this iteration, 0 keeps the server's rate, READ_RATE_UNSHAPED lifts it */
+	uint32_t hot_region_pct;	/* % of changed pages that makes a region hot, 0 disables DPU_HOT_REGION */
+	uint32_t dirty_tracking;	/* the host clears pte dirty bits, va may carry SHADOW_PTE_UNCHANGED */
+	struct error_table_descriptor vt_descs;	/* HOST_VERIFY_PAIR entries, only set in a verify round */
 };
 
 enum ksm_wr_tag {
@@ -81,6 +104,9 @@ enum ksm_wr_tag {
 	WR_SEND_SINGLE_RESULT,
 	WR_RECV_SINGLE_RESULT,
 	WR_INVALIDATE_MR,
+	WR_ASYNC_REG_MR,
+	WR_RECV_ASYNC_RESULT,
+	WR_SEND_REAP,
 };
 
 const char *ksm_wr_tag_str(enum ksm_wr_tag tag) {
@@ -109,6 +135,14 @@ const char *ksm_wr_tag_str(enum ksm_wr_tag tag) {
         return "WR_SEND_SINGLE_RESULT";
 	case WR_RECV_SINGLE_RESULT:
         return "WR_RECV_SINGLE_RESULT";
+	case WR_INVALIDATE_MR:
+        return "WR_INVALIDATE_MR";
+	case WR_ASYNC_REG_MR:
+        return "WR_ASYNC_REG_MR";
+	case WR_RECV_ASYNC_RESULT:
+        return "WR_RECV_ASYNC_RESULT";
+	case WR_SEND_REAP:
+        return "WR_SEND_REAP";
 	default:
 		return "WR_UNKNOWN";
 	}
@@ -141,11 +175,27 @@ enum event_tag {
 	HOST_NO_STABLE_NODE,
 	HOST_MERGE_ONE_FAILED,
 	HOST_MERGE_TWO_FAILED,
+	DPU_HOT_REGION,
+	DPU_THP_SUMMARY,
+	HOST_VERIFY_PAIR,
+	DPU_VERIFY_SAME,
+	DPU_VERIFY_DIFF,
 };
 
+/* In shadow_pte.va: the pte stayed clean since the last export of the same page */
+#define SHADOW_PTE_UNCHANGED 0x1UL
+/* In shadow_pte.va: a subpage of a PMD-mapped THP, reported with DPU_THP_SUMMARY instead of merged */
+#define SHADOW_PTE_THP 0x2UL
+#define SHADOW_PTE_FLAGS (SHADOW_PTE_UNCHANGED | SHADOW_PTE_THP)
+
+/* Granularity of the server's volatility feedback, a PMD with 4K pages */
+#define HOT_REGION_SHIFT 21
+
 // WARNING: Make it 32 byte size
 struct ksm_event_log {
 	enum event_tag type;
+	/* DPU_UNSTABLE_MERGE: fingerprint of the merged content, in the padding */
+	uint32_t fp;
 	union {
 		// Unstable merge related
 		struct {
@@ -167,6 +217,25 @@ struct ksm_event_log {
 			unsigned long kpfn;
 			int last_mm_id;
 		} stale_node;
+		// Write-hot region the host leaves out of the next backoff iterations
+		struct {
+			uint64_t va;
+			int mm_id;
+			int backoff;
+		} hot_region;
+		// Subpages of a PMD-mapped THP with a match, for the host's split decision
+		struct {
+			uint64_t va;
+			int mm_id;
+			unsigned short stable;	/* equal to a stable node */
+			unsigned short zero;
+			unsigned short dup;	/* equal to another scanned page */
+		} thp_summary;
+		// Two pages the host write-protected, for the NIC to compare before it merges them
+		struct {
+			uint64_t addr[2];
+			uint32_t rkey[2];
+		} verify_pair;
 	};
 };
 
@@ -177,12 +246,13 @@ struct result_desc {
 	int log_cnt;
 	uint64_t rkey;
 	uint64_t result_table_addr;
-	uint64_t pad;
+	uint64_t pcie_read_bytes;	/* host memory read by the NIC this iteration */
 };
 
 enum operation_cmd {
     PAGE_COMPARE,
     PAGE_HASH,
+    PAGE_BATCH,
 };
 
 struct operation_descriptor {
@@ -202,6 +272,44 @@ struct operation_result {
 	};
 };
 
+#define MAX_BATCH_OPS 64
+
+/* rkey is the host PD's global rkey, pages are read from ops[].addr */
+#define STYX_OP_PHYS_ADDR	0x1
+
+struct batch_op {
+	enum operation_cmd cmd;	/* PAGE_COMPARE or PAGE_HASH */
+	int page_idx[2];		/* pages within the batch MR */
+	uint64_t addr[2];		/* host DMA address of each page with STYX_OP_PHYS_ADDR */
+};
+
+/*
+ * Leading fields match operation_descriptor and operation_result, so a
+ * single operation is a batch without ops and its result is results[0].
+ * Only the used part of ops[] and results[] goes on the wire.
+ */
+struct batch_operation_descriptor {
+	enum operation_cmd cmd;
+	int id;
+	uint64_t rkey;
+	uint64_t iova;
+	uint64_t page_num;
+	int op_cnt;
+	int flags;
+	struct batch_op ops[MAX_BATCH_OPS];
+};
+
+union operation_value {
+	uint64_t xxhash;
+	int value;
+};
+
+struct batch_operation_result {
+	enum operation_cmd cmd;
+	int id;
+	union operation_value results[MAX_BATCH_OPS];
+};
+
 enum offload_mode {
 	NO_OFFLOAD = 0,
     SINGLE_OPERATION_OFFLOAD = 1,
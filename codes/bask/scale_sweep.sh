@@ -0,0 +1,34 @@
+#!/usr/bin/env bash
+# Sweep bask_replay over synthetic hosts of growing size and write volatility.
+# Usage: ./scale_sweep.sh [out.csv] [extra bask_replay options, e.g. no_skip_opt]
+set -euo pipefail
+
+OUT=${1:-scale_sweep.csv}
+shift || true
+
+VMS=${VMS:-8}
+ITERS=${ITERS:-10}
+SCALES=${SCALES:-"1048576 4194304 16777216 67108864"}   # tracked pages, 1M..64M
+VOLATILITY=${VOLATILITY:-"0.01 0.05 0.2"}             # hot set fraction
+DUP=${DUP:-"0.3"}
+
+cd "$(dirname "$0")"
+
+# [Replay] lines are "key, value, key, value, ..."
+field() { grep "^\[Replay\] $1" <<< "$log" | sed 's/^\[Replay\] //' | tr -d ' ' | awk -F, -v k="$2" '{ for (i = 1; i < NF; i++) if ($i == k) print $(i + 1) }'; }
+
+echo "pages,vms,dup,volatile,pages_per_s,engine_s,rmap_items,max_rss_growth_kb,bytes_per_item,max_stable_items,converge_iter,converge_s" > "$OUT"
+
+for pages in $SCALES; do
+    for vol in $VOLATILITY; do
+        for dup in $DUP; do
+            log=$(./bask_workload vms="$VMS" pages=$((pages / VMS)) iters="$ITERS" dup="$dup" volatile="$vol" \
+                | ./bask_replay /dev/stdin "$@")
+
+            echo "$pages,$VMS,$dup,$vol,$(field iterations pages_per_s),$(field iterations engine_s)," \
+                 "$(field rmap_items rmap_items),$(field rmap_items max_rss_growth_kb),$(field rmap_items bytes_per_item)," \
+                 "$(field max_stable max_stable_items),$(field max_stable converge_iter),$(field max_stable converge_s)" \
+                | tr -d ' ' | tee -a "$OUT"
+        done
+    done
+done
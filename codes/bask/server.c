@@ -5,6 +5,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <glob.h>
+#include <limits.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/types.h>
@@ -17,12 +20,6 @@
 #include "server.h"
 #include "glib.h"
 
-struct timer {
-    unsigned long count;
-    unsigned long time_sum;
-    struct timespec curr_time;
-};
-
 struct timer read_4k_timer = {0, 0, {0, 0}};
 struct timer read_8k_timer = {0, 0, {0, 0}};
 struct timer memcmp_timer = {0, 0, {0, 0}};
@@ -30,56 +27,10 @@ struct timer hash_timer = {0, 0, {0, 0}};
 struct timer total_timer = {0, 0, {0, 0}};
 
 struct timer rdma_read_timer = {0, 0, {0, 0}};
-struct timer big_hash_timer = {0, 0, {0, 0}};
 struct timer revert_timer = {0, 0, {0, 0}};
-struct timer ksm_operation_timer = {0, 0, {0, 0}};
 struct timer total_snic_timer = {0, 0, {0, 0}};
 struct timer rdma_read_wait_timer = {0, 0, {0, 0}};
 
-#define MEASURE_TIME 1
-
-#ifdef MEASURE_TIME
-#define START_TIMER(timer) \
-    do { \
-        clock_gettime(CLOCK_MONOTONIC, &(timer).curr_time); \
-    } while (0)
-
-#define END_TIMER(timer) \
-    do { \
-        struct timespec end_time; \
-        clock_gettime(CLOCK_MONOTONIC, &end_time); \
-        unsigned long duration = (end_time.tv_sec * 1000000000UL + end_time.tv_nsec) \
-                                - ((timer).curr_time.tv_sec * 1000000000UL + (timer).curr_time.tv_nsec); \
-        (timer).time_sum += duration; \
-        (timer).count += 1; \
-        (timer).curr_time.tv_sec = 0; \
-        (timer).curr_time.tv_nsec = 0; \
-    } while (0)
-
-#define IS_TIMER_START(timer) \
-    ((timer).curr_time.tv_sec != 0 || (timer).curr_time.tv_nsec != 0)
-
-#define ABORT_TIMER(timer) \
-    do { \
-        (timer).curr_time.tv_sec = 0; \
-        (timer).curr_time.tv_nsec = 0; \
-    } while (0)
-
-#define PRINT_AND_RESET_TIMER(timer, msg) \
-    do { \
-        if ((timer).count > 0) { \
-            printf("[BASK Breakdown], %s, %.2f, us avg, total, %lu, count\n", msg, ((double) (timer).time_sum / (double) (timer).count) / 1000.00, (timer).count); \
-        } \
-        (timer).count = 0; \
-        (timer).time_sum = 0; \
-        (timer).curr_time.tv_sec = 0; \
-        (timer).curr_time.tv_nsec = 0; \
-    } while (0)
-#else
-#define START_TIMER(timer)
-#define END_TIMER(timer)
-#define PRINT_AND_RESET_TIMER(timer, msg)
-#endif
 
 void print_bask_timer(void) {
     PRINT_AND_RESET_TIMER(rdma_read_timer, "RDMA Read");
@@ -93,13 +44,9 @@ void print_bask_timer(void) {
 // Forward declarations
 static void cleanup_rdma_cb(struct rdma_cb *cb);
 
-rmap_item* lookup_rmap_item(struct ksm_metadata* metadata, int mm_id, struct shadow_pte* pte);
-int cmp_and_merge_one(struct ksm_metadata* metadata, struct ksm_log_table* merge_table,
-    void* page, rmap_item* curr_item, unsigned int rkey, dma_addr_t addr);
 int do_handle_error(struct rdma_cb* cb, struct error_table_descriptor* et_desc);
+int do_verify_pairs(struct rdma_cb* cb, struct error_table_descriptor* vt_desc);
 
-static int (*ksm_ops)(struct ksm_metadata* metadata, struct ksm_log_table* log_table,
-    void* page, rmap_item* curr_item, unsigned int rkey, dma_addr_t addr)  = cmp_and_merge_one;
 static unsigned long zero_hash = 0;
 
 void debug_stop(void) {
@@ -114,9 +61,37 @@ static void die(const char *reason)
     exit(EXIT_FAILURE);
 }
 
+static void cleanup_rdma_lane(struct rdma_lane *lane)
+{
+    atomic_store(&lane->ready, 0);
+    if (lane->conn_id) {
+        if (lane->qp) {
+            rdma_destroy_qp(lane->conn_id);
+            lane->qp = NULL;
+        }
+        rdma_disconnect(lane->conn_id);
+        rdma_destroy_id(lane->conn_id);
+        lane->conn_id = NULL;
+    }
+    if (lane->cq) {
+        ibv_destroy_cq(lane->cq);
+        lane->cq = NULL;
+    }
+    if (lane->comp_chan) {
+        ibv_destroy_comp_channel(lane->comp_chan);
+        lane->comp_chan = NULL;
+    }
+}
+
 static void cleanup_rdma_cb(struct rdma_cb *cb)
 {
     DEBUG_LOG("Cleaning up resources...");
+    // Extra lanes, lanes[0] only aliases the main connection below
+    for (int i = 1; i < MAX_LANES; i++) {
+        cleanup_rdma_lane(&cb->lanes[i]);
+    }
+    memset(&cb->lanes[0], 0, sizeof(cb->lanes[0]));
+
     // Disconnect/destroy connection ID
     if (cb->conn_id) {
         if (cb->qp) {
@@ -127,11 +102,6 @@ static void cleanup_rdma_cb(struct rdma_cb *cb)
         rdma_destroy_id(cb->conn_id);
         cb->conn_id = NULL;
     }
-    // Listening ID
-    if (cb->listen_id) {
-        rdma_destroy_id(cb->listen_id);
-        cb->listen_id = NULL;
-    }
     // Memory region
     if (cb->md_desc_mr) {
         ibv_dereg_mr(cb->md_desc_mr);
@@ -141,93 +111,165 @@ static void cleanup_rdma_cb(struct rdma_cb *cb)
         ibv_dereg_mr(cb->ksm_result_mr);
         cb->ksm_result_mr = NULL;
     }
-    // Metadata
-    if (cb->metadata.stable_hash_table) {
-        g_hash_table_foreach(cb->metadata.stable_hash_table,  (GHFunc) free_stable_node, NULL);
-        g_hash_table_destroy(cb->metadata.stable_hash_table);
-        cb->metadata.stable_hash_table = NULL;
+    if (cb->single_op_desc_mr) {
+        ibv_dereg_mr(cb->single_op_desc_mr);
+        cb->single_op_desc_mr = NULL;
     }
-    
-    if (cb->metadata.unstable_hash_table) {
-        g_hash_table_destroy(cb->metadata.unstable_hash_table);
-        cb->metadata.unstable_hash_table = NULL;
+    if (cb->single_op_result_mr) {
+        ibv_dereg_mr(cb->single_op_result_mr);
+        cb->single_op_result_mr = NULL;
     }
-
-    if (cb->metadata.rmap_tree) {
-        g_tree_foreach(cb->metadata.rmap_tree, free_rmap_item, NULL);
-        g_tree_destroy(cb->metadata.rmap_tree);
-        cb->metadata.rmap_tree = NULL;
+    if (cb->metadata.rdma_buf.temp_buf_mr) {
+        ibv_dereg_mr(cb->metadata.rdma_buf.temp_buf_mr);
+        cb->metadata.rdma_buf.temp_buf_mr = NULL;
     }
-
-    // Merge table
-    if (cb->log_table.entries) {
-        free(cb->log_table.entries);
-        cb->log_table.entries = NULL;
+    if (cb->metadata.rdma_buf.temp_buf) {
+        free(cb->metadata.rdma_buf.temp_buf);
+        cb->metadata.rdma_buf.temp_buf = NULL;
     }
+    // Metadata and merge table
+    ksm_metadata_destroy(&cb->metadata, &cb->log_table);
+
+    bask_trace_close(cb->trace);
+    cb->trace = NULL;
 
-    if (cb->comp_chan) {
-        ibv_destroy_comp_channel(cb->comp_chan);
-        cb->comp_chan = NULL;
-    }
     // CQ
     if (cb->cq) {
         ibv_destroy_cq(cb->cq);
         cb->cq = NULL;
     }
+    if (cb->comp_chan) {
+        ibv_destroy_comp_channel(cb->comp_chan);
+        cb->comp_chan = NULL;
+    }
+    if (cb->recv_cq) {
+        ibv_destroy_cq(cb->recv_cq);
+        cb->recv_cq = NULL;
+    }
+    if (cb->recv_comp_chan) {
+        ibv_destroy_comp_channel(cb->recv_comp_chan);
+        cb->recv_comp_chan = NULL;
+    }
     // PD
     if (cb->pd) {
         ibv_dealloc_pd(cb->pd);
         cb->pd = NULL;
     }
+}
+
+static void cleanup_rdma_server(struct rdma_server *server)
+{
+    // Listening ID
+    if (server->listen_id) {
+        rdma_destroy_id(server->listen_id);
+        server->listen_id = NULL;
+    }
     // Event channel
-    if (cb->ec) {
-        rdma_destroy_event_channel(cb->ec);
-        cb->ec = NULL;
+    if (server->ec) {
+        rdma_destroy_event_channel(server->ec);
+        server->ec = NULL;
     }
 }
 
+/*
+ * Busy-poll budget before arming the CQ and sleeping on the completion channel.
+ * Negative keeps polling forever (the previous behavior).
+ */
+static long poll_budget_ns = 100 * 1000;
+
+#define CQ_SLEEP_TIMEOUT_MS 100
+
 // Utility to wait for one CQ event and poll for a completion
-static int wait_cq_event_and_poll(struct rdma_cb *cb, const char *tag)
+static int wait_lane_cq_event_and_poll(struct rdma_cb *cb, struct ibv_cq *cq, struct ibv_comp_channel *comp_chan,
+    enum cq_phase phase, const char *tag)
 {
     struct ibv_wc wc;
-    struct ibv_cq *ev_cq = cb->cq;
-    memset(&wc, 0, sizeof(wc));
-
+    struct ibv_cq *ev_cq = cq;
+    struct cq_wait_stats *stats = &cb->cq_stats[phase];
+    struct pollfd pfd;
+    unsigned long start, now, sleep_start;
+    unsigned long spins = 0;
+    void *ev_ctx;
     int n;
 
-    // Poll CQ for fixed times
-    // for (int i = 0; i < 100; i++) {
-    //     n = ibv_poll_cq(ev_cq, 1, &wc);
-    //     if (n > 0) {
-    //         goto success;
-    //     }
-    // }
+    memset(&wc, 0, sizeof(wc));
+    stats->waits += 1;
+    start = get_time_ns();
 
+    // Busy-poll for a bounded budget first: most page reads complete within it
     while (1) {
         n = ibv_poll_cq(ev_cq, 1, &wc); 
         if (n > 0) {
+            stats->poll_ns += get_time_ns() - start;
             goto success;
         }
+
+        if (atomic_load(&cb->stopping)) {
+            return -1;
+        }
+
+        if (poll_budget_ns >= 0 && (++spins % 64) == 0 &&
+            get_time_ns() - start >= (unsigned long)poll_budget_ns) {
+            break;
+        }
     }
+    stats->poll_ns += get_time_ns() - start;
+    stats->sleeps += 1;
 
     // Go to interrupt mode
-    if (ibv_req_notify_cq(ev_cq, 0)) {
-        fprintf(stderr, "%s: ibv_req_notify_cq failed\n", tag);
-        return -1;
-    }
+    pfd.fd = comp_chan->fd;
+    pfd.events = POLLIN;
 
-    void *ev_ctx;
-    if (ibv_get_cq_event(cb->comp_chan, &ev_cq, &ev_ctx)) {
-        fprintf(stderr, "%s: ibv_get_cq_event failed\n", tag);
-        return -1;
-    }
-    ibv_ack_cq_events(ev_cq, 1);
+    while (1) {
+        if (ibv_req_notify_cq(ev_cq, 0)) {
+            fprintf(stderr, "%s: ibv_req_notify_cq failed\n", tag);
+            return -1;
+        }
+
+        // A completion may have landed before the CQ was armed
+        n = ibv_poll_cq(ev_cq, 1, &wc);
+        if (n > 0) {
+            goto success;
+        }
+
+        sleep_start = get_time_ns();
+        do {
+            if (atomic_load(&cb->stopping)) {
+                stats->sleep_ns += get_time_ns() - sleep_start;
+                return -1;
+            }
+            n = poll(&pfd, 1, CQ_SLEEP_TIMEOUT_MS);
+        } while (n == 0 || (n < 0 && errno == EINTR));
+
+        now = get_time_ns();
+        stats->sleep_ns += now - sleep_start;
+
+        if (n < 0) {
+            fprintf(stderr, "%s: poll on completion channel failed: %s\n", tag, strerror(errno));
+            return -1;
+        }
+
+        if (ibv_get_cq_event(comp_chan, &ev_cq, &ev_ctx)) {
+            fprintf(stderr, "%s: ibv_get_cq_event failed\n", tag);
+            return -1;
+        }
+        ibv_ack_cq_events(ev_cq, 1);
 
-    do {
+        // Stale events from a previous arm carry no completion, sleep again
         n = ibv_poll_cq(ev_cq, 1, &wc);
-    } while (n == 0);
+        if (n > 0) {
+            stats->wakeup_ns += get_time_ns() - now;
+            goto success;
+        }
+    }
 
 success:
+    if (wc.status == IBV_WC_WR_FLUSH_ERR || atomic_load(&cb->stopping)) {
+        // Connection is going away, the tenant thread will exit
+        DEBUG_LOG("%s: flushed while disconnecting\n", tag);
+        return -1;
+    }
+
     if (wc.status != IBV_WC_SUCCESS) {
         fprintf(stderr, "%s: completion with status=%d(%s)\n", tag, wc.status, ibv_wc_status_str(wc.status));
         fprintf(stderr, "  wr_id=%s(%lu)\n  opcode=%d\n  bytes=%d\n", 
@@ -242,721 +284,787 @@ success:
     return 0;
 }
 
-int rdma_read_memory(struct rdma_cb* cb, struct ibv_mr* mr, uint32_t rkey, dma_addr_t addr, uint32_t length, void* buf) {
-    struct ibv_send_wr read_wr, *bad_wr = NULL;
-    struct ibv_sge sge;
-    int ret = 0;
+static int wait_cq_event_and_poll(struct rdma_cb *cb, enum cq_phase phase, const char *tag)
+{
+    return wait_lane_cq_event_and_poll(cb, cb->cq, cb->comp_chan, phase, tag);
+}
 
-START_TIMER(rdma_read_timer);
-    memset(&sge, 0, sizeof(sge));
-    sge.addr = (uintptr_t) buf;
-    sge.length = length;
-    sge.lkey = mr->lkey;
+static int wait_recv_cq_event_and_poll(struct rdma_cb *cb, enum cq_phase phase, const char *tag)
+{
+    return wait_lane_cq_event_and_poll(cb, cb->recv_cq, cb->recv_comp_chan, phase, tag);
+}
 
-    memset(&read_wr, 0, sizeof(read_wr));
-    read_wr.wr_id = WR_READ_PAGE;
-    read_wr.opcode = IBV_WR_RDMA_READ;
-    read_wr.sg_list = &sge;
-    read_wr.num_sge = 1;
-    read_wr.send_flags = IBV_SEND_SIGNALED;
-    read_wr.wr.rdma.remote_addr = addr;
-    read_wr.wr.rdma.rkey = rkey;
+static void print_and_reset_cq_wait_stats(struct rdma_cb *cb)
+{
+    for (int i = 0; i < CQ_PHASE_NUM; i++) {
+        struct cq_wait_stats *stats = &cb->cq_stats[i];
+        if (stats->waits == 0) continue;
+
+        printf("[CQ Wait] %d, %s, waits, %lu, poll_ms, %.3f, sleeps, %lu, sleep_ms, %.3f, avg_wakeup_us, %.2f\n",
+            cb->tenant.id, cq_phase_str[i], stats->waits, stats->poll_ns / 1000000.0,
+            stats->sleeps, stats->sleep_ns / 1000000.0,
+            stats->sleeps ? (double)stats->wakeup_ns / stats->sleeps / 1000.0 : 0.0);
+    }
+    memset(cb->cq_stats, 0, sizeof(cb->cq_stats));
+}
 
-    DEBUG_LOG("[Server] Reading memory from %llx, size %d\n", addr, length);
+// BlueField PCIe byte counters, the ones pcie_bw_mon.sh samples
+static char pcie_counter_dir[PATH_MAX];
+static const char *pcie_in_counters[] = { "IN_P_BYTE_CNT", "IN_NP_BYTE_CNT", "IN_C_BYTE_CNT" };
 
-    if (ibv_post_send(cb->qp, &read_wr, &bad_wr)) {
-        fprintf(stderr, "[Server] ibv_post_send failed.\n");
-        return -1;
+static void find_pcie_counters(void)
+{
+    glob_t names;
+    char name[32];
+
+    if (glob("/sys/class/hwmon/*/name", 0, NULL, &names)) {
+        printf("[Server] No hwmon devices, reporting RDMA read bytes as PCIe traffic\n");
+        return;
     }
 
-    ret = wait_cq_event_and_poll(cb, "[SERVER MEMORY READ]");
-END_TIMER(rdma_read_timer);
-    return ret;
-}
+    for (size_t i = 0; i < names.gl_pathc && !pcie_counter_dir[0]; i++) {
+        FILE *f = fopen(names.gl_pathv[i], "r");
+        if (!f) {
+            continue;
+        }
+        if (fgets(name, sizeof(name), f) && strncmp(name, "bfperf", 6) == 0) {
+            // Strip the trailing "name" to get the hwmon directory
+            snprintf(pcie_counter_dir, sizeof(pcie_counter_dir), "%.*s/pcie0",
+                (int)(strlen(names.gl_pathv[i]) - strlen("/name")), names.gl_pathv[i]);
+        }
+        fclose(f);
+    }
+    globfree(&names);
 
-int rdma_read_page(struct rdma_cb* cb, struct ibv_mr* mr, uint32_t rkey, dma_addr_t addr, void* buf) {
-    int ret = rdma_read_memory(cb, mr, rkey, addr, PAGE_SIZE, buf);
-    return ret;
+    if (pcie_counter_dir[0]) {
+        printf("[Server] PCIe counters: %s\n", pcie_counter_dir);
+    } else {
+        printf("[Server] No bfperf counters, reporting RDMA read bytes as PCIe traffic\n");
+    }
 }
 
-static pthread_mutex_t page_worker_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t page_worker_cond = PTHREAD_COND_INITIALIZER;
-
-static struct worker_job worker_todo = {
-    .metadata = NULL,
-    .log_table = NULL,
-    .mm_id = -1,
-    .va2dma_map = NULL,
-    .pages_buf = NULL,
-    .num_pages = 0,
-    .idx_adjust = 0,
-    .rkey = 0,
-    .pages_addr = 0,
-    .status = NO_WORKER
-};
-
-void* ksm_page_worker(void * arg) {
-    uint64_t i, idx;
-    rmap_item* curr_item;
-    int err;
-    void* page;
+static uint64_t read_pcie_in_bytes(void)
+{
+    char path[PATH_MAX + 32], val[32];
+    uint64_t sum = 0;
 
-    struct worker_job* work = (struct worker_job*)(&worker_todo);
+    if (!pcie_counter_dir[0]) {
+        return 0;
+    }
 
-    while(1) {
-        pthread_mutex_lock(&page_worker_mutex);
+    for (size_t i = 0; i < sizeof(pcie_in_counters) / sizeof(pcie_in_counters[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", pcie_counter_dir, pcie_in_counters[i]);
+        FILE *f = fopen(path, "r");
+        if (!f) {
+            continue;
+        }
+        if (fgets(val, sizeof(val), f)) {
+            sum += strtoull(val, NULL, 0);
+        }
+        fclose(f);
+    }
+    return sum;
+}
 
-        // while (work->status != DATA_READY) {
-        //     pthread_cond_wait(&worker_cond, &worker_mutex);
-        // }
+// Read shaping defaults, a host can override the rate per iteration
+static uint64_t read_rate_mbps = 0;
+static uint64_t read_burst_kb = 1024;
+// Unix socket serving bask_stats_dump() text, off unless set
+static const char* stats_sock_path = NULL;
+// record=<prefix> writes every tenant's engine input to <prefix>.<tenant>.trace for bask_replay
+static const char* record_prefix = NULL;
+static int record_full_pages = 0;
 
-        if (work->status == DATA_READY) {
-            for (i = 0; i < work->num_pages; i++) {
-                page = (char*)work->pages_buf + i * PAGE_SIZE;
-
-                if (PRE_HASH_ON) {
-                    if (i % PRE_HASH_NUM == 0) {
-                    int diff = work->num_pages - i;
-                    int max_idx = diff > PRE_HASH_NUM ? PRE_HASH_NUM : diff;
-                    start_pre_hash_pair_table(page, max_idx);
-                    }
-                }
+static void read_shaper_init(struct read_shaper *shaper)
+{
+    pthread_mutex_init(&shaper->lock, NULL);
+    shaper->rate = read_rate_mbps * 1000 * 1000;
+    shaper->burst = read_burst_kb * 1024;
+    shaper->tokens = shaper->burst;
+    shaper->last_ns = shaper->period_start_ns = get_time_ns();
+}
 
-                idx = work->idx_adjust + i;
-                
-                DEBUG_LOG("[KSM Worker] working on va: %lx (%llu-th)\n", work->va2dma_map[idx].va, idx);
-                
-START_TIMER(ksm_operation_timer);
-                rmap_item* curr_item = lookup_rmap_item(work->metadata, work->mm_id, &work->va2dma_map[idx]);
-                if (!curr_item) {
-                    ERR_LOG_AND_STOP("[KSM] Failed to lookup rmap item.\n");
-                }
+static void read_shaper_set_rate(struct read_shaper *shaper, uint64_t rate_mbps)
+{
+    pthread_mutex_lock(&shaper->lock);
+    shaper->rate = rate_mbps * 1000 * 1000;
+    pthread_mutex_unlock(&shaper->lock);
+}
 
-                int err = ksm_ops(work->metadata, work->log_table, page, curr_item, work->rkey, work->pages_addr + i * PAGE_SIZE);
-                if (err) {
-                    ERR_LOG_AND_STOP("[KSM] cmp_and_merge_one failed.\n");
-                }
-END_TIMER(ksm_operation_timer);
-            }
+/*
+ * Reserve @bytes from the bucket and sleep off any deficit outside the lock,
+ * so concurrent readers queue behind each other instead of all bursting once
+ * the bucket refills.
+ */
+static void read_shaper_acquire(struct read_shaper *shaper, uint64_t bytes)
+{
+    unsigned long now, wait_ns = 0;
+
+    pthread_mutex_lock(&shaper->lock);
+    shaper->period_bytes += bytes;
+    if (shaper->rate) {
+        now = get_time_ns();
+        shaper->tokens += (double)(now - shaper->last_ns) * shaper->rate / 1e9;
+        if (shaper->tokens > shaper->burst) {
+            shaper->tokens = shaper->burst;
+        }
+        shaper->last_ns = now;
 
-            work->status = WORK_DONE;
-START_TIMER(rdma_read_wait_timer);
+        shaper->tokens -= bytes;
+        if (shaper->tokens < 0) {
+            wait_ns = -shaper->tokens * 1e9 / shaper->rate;
+            shaper->throttled_ns += wait_ns;
         }
-        pthread_mutex_unlock(&page_worker_mutex);
+    }
+    pthread_mutex_unlock(&shaper->lock);
+
+    if (wait_ns) {
+        struct timespec ts = { .tv_sec = wait_ns / 1000000000UL, .tv_nsec = wait_ns % 1000000000UL };
+        while (nanosleep(&ts, &ts) && errno == EINTR);
     }
 }
 
-static int do_ksm_v3(struct rdma_cb* cb, struct metadata_descriptor* meta_desc) {
-    int scanned_cnt = 0, i, j, err;
-    struct shadow_pt_descriptor* pt_desc;
-    struct shadow_pt* pt;
-    struct ibv_send_wr read_wr, *bad_wr = NULL;
-    struct ibv_sge sge;
-    struct ibv_mr *map_mr;
+// Largest READ a shaped reader may post at once, a burst in whole pages, 0 when unshaped
+static uint32_t read_shaper_segment(struct read_shaper *shaper)
+{
+    uint64_t seg = 0;
 
-    struct shadow_pte* va2dma_map;
-    
-    struct ibv_mr *page_mr;
-    void *page_buf, *page;
-    dma_addr_t page_addr;
+    pthread_mutex_lock(&shaper->lock);
+    if (shaper->rate) {
+        seg = MAX(shaper->burst / PAGE_SIZE, 1) * PAGE_SIZE;
+    }
+    pthread_mutex_unlock(&shaper->lock);
+    return MIN(seg, UINT32_MAX / PAGE_SIZE * PAGE_SIZE);
+}
 
-    rmap_item* curr_item;
+static void print_and_reset_read_shaper(struct rdma_cb *cb)
+{
+    struct read_shaper *shaper = &cb->shaper;
+    unsigned long now = get_time_ns();
+
+    pthread_mutex_lock(&shaper->lock);
+    if (shaper->period_bytes) {
+        unsigned long elapsed = MAX(now - shaper->period_start_ns, 1UL);
+        printf("[Read Shaper] %d, requested_mbps, %lu, achieved_mbps, %.1f, read_mb, %.1f, throttled_ms, %.3f\n",
+            cb->tenant.id, (unsigned long)(shaper->rate / 1000 / 1000),
+            (double)shaper->period_bytes * 1000 / elapsed, shaper->period_bytes / 1000000.0,
+            shaper->throttled_ns / 1000000.0);
+    }
+    shaper->period_start_ns = now;
+    shaper->period_bytes = 0;
+    shaper->throttled_ns = 0;
+    pthread_mutex_unlock(&shaper->lock);
+}
 
-    void *prev_page_buf = NULL;
-    struct ibv_mr *prev_page_mr;
-   
-    for (i = 0; i < meta_desc->pt_cnt; i++) {
-        pt_desc = &meta_desc->pt_descs[i];
+/*
+ * Split a read into page-aligned segments, one per connected lane, post them
+ * all and then reap each lane's CQ. With a single lane this is one READ.
+ * Under read shaping the segments are at most a burst long, and each one is
+ * reserved from the bucket right before it is posted.
+ */
+int rdma_read_memory(struct rdma_cb* cb, enum cq_phase phase, struct ibv_mr* mr, uint32_t rkey, dma_addr_t addr, uint32_t length, void* buf) {
+    struct ibv_send_wr read_wr, *bad_wr = NULL;
+    struct ibv_sge sge;
+    struct rdma_lane *lanes[MAX_LANES];
+    int posted[MAX_LANES] = { 0 };
+    uint32_t seg, shaped_seg, offset;
+    int nr_lanes = 0, n = 0;
+    int ret = 0;
+    uint64_t start = bask_stats_now();
 
-        printf("[Server] KSM working on %d-th mm: %d\n", i, pt_desc->mm_id);
-        
-        pt = (struct shadow_pt*) malloc(sizeof(struct shadow_pt));
-        if (!pt) {
-            fprintf(stderr, "[Server] malloc for pt failed.\n");
-            return -1;
+START_TIMER(rdma_read_timer);
+    for (int i = 0; i < MAX_LANES; i++) {
+        if (atomic_load(&cb->lanes[i].ready)) {
+            lanes[nr_lanes++] = &cb->lanes[i];
         }
+    }
+    if (nr_lanes == 0) {
+        fprintf(stderr, "[Server] No connected lane to read from.\n");
+        return -1;
+    }
 
-        pt->mm_id = pt_desc->mm_id;
-        pt->entry_cnt = pt_desc->entry_cnt;
-
-        va2dma_map = (struct shadow_pte*) calloc(pt->entry_cnt, sizeof(struct shadow_pte));
-        if (!va2dma_map) {
-            fprintf(stderr, "[Server] calloc for va2dma_map failed.\n");
-            return -1;
-        }
+    seg = DIV_ROUND_UP(DIV_ROUND_UP(length, nr_lanes), PAGE_SIZE) * PAGE_SIZE;
+    shaped_seg = read_shaper_segment(&cb->shaper);
+    if (shaped_seg && shaped_seg < seg) {
+        seg = shaped_seg;
+    }
 
-        pt->va2dma_map = va2dma_map;
+    DEBUG_LOG("[Server] Reading memory from %llx, size %d over %d lanes\n", addr, length, nr_lanes);
 
-        map_mr = ibv_reg_mr(cb->pd, va2dma_map, sizeof(struct shadow_pte) * pt->entry_cnt,
-                            IBV_ACCESS_LOCAL_WRITE);
+    for (offset = 0; offset < length; offset += seg) {
+        int lane = n++ % nr_lanes;
 
-        if (!map_mr) {
-            fprintf(stderr, "[Server] ibv_reg_mr for pt->va2dma_map failed.\n");
-            return -1;
+        // Keep the send queue from overflowing on a long shaped read
+        if (posted[lane] == MAX_SEND_WR / 2) {
+            for (int l = 0; l < nr_lanes; l++) {
+                for (; posted[l] > 0; posted[l]--) {
+                    if (wait_lane_cq_event_and_poll(cb, lanes[l]->cq, lanes[l]->comp_chan, phase, "[SERVER MEMORY READ]")) {
+                        ret = -1;
+                    }
+                }
+            }
+            if (ret) {
+                break;
+            }
         }
 
-        // Read the page table
+        read_shaper_acquire(&cb->shaper, MIN(seg, length - offset));
+
         memset(&sge, 0, sizeof(sge));
-        sge.addr = (uintptr_t) va2dma_map;
-        sge.length = sizeof(struct shadow_pte) * pt->entry_cnt;
-        sge.lkey = map_mr->lkey;
+        sge.addr = (uintptr_t) buf + offset;
+        sge.length = MIN(seg, length - offset);
+        sge.lkey = mr->lkey;
 
         memset(&read_wr, 0, sizeof(read_wr));
-        read_wr.wr_id = WR_READ_MAP;
+        read_wr.wr_id = phase == CQ_PHASE_PT_READ ? WR_READ_MAP : WR_READ_PAGE;
         read_wr.opcode = IBV_WR_RDMA_READ;
         read_wr.sg_list = &sge;
         read_wr.num_sge = 1;
         read_wr.send_flags = IBV_SEND_SIGNALED;
-        read_wr.wr.rdma.remote_addr = pt_desc->pt_base_addr;
-        read_wr.wr.rdma.rkey = pt_desc->map_rkey;
+        read_wr.wr.rdma.remote_addr = addr + offset;
+        read_wr.wr.rdma.rkey = rkey;
 
-        if (ibv_post_send(cb->qp, &read_wr, &bad_wr)) {
-            fprintf(stderr, "[Server] ibv_post_send failed.\n");
-            return -1;
+        if (ibv_post_send(lanes[lane]->qp, &read_wr, &bad_wr)) {
+            fprintf(stderr, "[Server] ibv_post_send failed on lane %d.\n", lane);
+            ret = -1;
+            break;
         }
+        posted[lane]++;
+    }
 
-        if (wait_cq_event_and_poll(cb, "[SERVER PT READ]")) {
-            fprintf(stderr, "[Server] wait_cq_event_and_poll failed.\n");
-            fprintf(stderr, "[Server] Failed to read pt %llx\n", pt_desc->pt_base_addr);
-            return -1;
+    // Reap every posted segment, even after a failure, so no stale completion is left behind
+    for (int l = 0; l < nr_lanes; l++) {
+        for (; posted[l] > 0; posted[l]--) {
+            if (wait_lane_cq_event_and_poll(cb, lanes[l]->cq, lanes[l]->comp_chan, phase, "[SERVER MEMORY READ]")) {
+                ret = -1;
+            }
         }
+    }
+    if (!ret) {
+        cb->rdma_read_bytes += length;
+        bask_stats_count(BASK_CNT_BYTES_READ, length);
+    }
+    bask_stats_since(BASK_PHASE_RDMA_READ, start);
+END_TIMER(rdma_read_timer);
+    return ret;
+}
 
-        if (pt->va2dma_map[0].va == 0) {
-            fprintf(stderr, "[Server] Invalid page table read.\n");
-            return -1;
-        }
+int rdma_read_page(struct rdma_cb* cb, struct ibv_mr* mr, uint32_t rkey, dma_addr_t addr, void* buf) {
+    int ret = rdma_read_memory(cb, CQ_PHASE_PAGE_READ, mr, rkey, addr, PAGE_SIZE, buf);
+    return ret;
+}
 
-        int sgl_nums = DIV_ROUND_UP(pt->entry_cnt, MAX_PAGES_IN_SGL);
+// Post one READ of length bytes at host DMA address addr into buf + slot on lanes[lane]
+static int post_page_run(struct rdma_cb* cb, struct rdma_lane *lane, struct ibv_mr* mr, uint32_t rkey,
+    uint64_t addr, uint64_t slot, uint32_t length, void* buf) {
+    struct ibv_send_wr read_wr, *bad_wr = NULL;
+    struct ibv_sge sge;
 
-        for (int sgl_idx = 0; sgl_idx < sgl_nums; sgl_idx++) {
-            unsigned long long this_sgl_size = sgl_idx == (sgl_nums - 1) ? pt->entry_cnt - sgl_idx * MAX_PAGES_IN_SGL : MAX_PAGES_IN_SGL;
-            page_buf = malloc(PAGE_SIZE * this_sgl_size);
-            if (!page_buf) {
-                fprintf(stderr, "[Server] calloc for page_buf failed.\n");
-                return -1;
-            }
-            memset(page_buf, 0, PAGE_SIZE * this_sgl_size);
-            DEBUG_LOG("[Server] Reading pages batched size %llu\n", PAGE_SIZE * this_sgl_size);
-        
-            page_mr = ibv_reg_mr(cb->pd, page_buf, PAGE_SIZE * this_sgl_size, IBV_ACCESS_LOCAL_WRITE);
-            if (!page_mr) {
-                fprintf(stderr, "[Server] ibv_reg_mr for page_buf failed.\n");
-                return -1;
-            }
+    read_shaper_acquire(&cb->shaper, length);
 
-            page_addr = pt_desc->desc_entries[sgl_idx].pages_base_addr;
-            if (rdma_read_memory(cb, page_mr, pt_desc->desc_entries[sgl_idx].pages_rkey, page_addr, PAGE_SIZE * this_sgl_size, page_buf)) {
-                fprintf(stderr, "[Server][%d] rdma failed for dma addr %llx, size %llu\n", iteration, page_addr, PAGE_SIZE * this_sgl_size);
-                return -1;
-            }
+    memset(&sge, 0, sizeof(sge));
+    sge.addr = (uintptr_t) buf + slot;
+    sge.length = length;
+    sge.lkey = mr->lkey;
 
-            while (1) {
-                pthread_mutex_lock(&page_worker_mutex);
-                if ((worker_todo.status == WORK_DONE) || (worker_todo.status == WORKER_READY)) {
-                    scanned_cnt += worker_todo.num_pages;
-
-                    worker_todo.metadata = &cb->metadata;
-                    worker_todo.log_table = &cb->log_table;
-                    worker_todo.mm_id = pt->mm_id;
-                    worker_todo.va2dma_map = pt->va2dma_map;
-                    worker_todo.pages_buf = page_buf;
-                    worker_todo.num_pages = this_sgl_size;
-                    worker_todo.idx_adjust = sgl_idx * MAX_PAGES_IN_SGL;
-                    worker_todo.rkey = pt_desc->desc_entries[sgl_idx].pages_rkey;
-                    worker_todo.pages_addr = pt_desc->desc_entries[sgl_idx].pages_base_addr;
-                    worker_todo.status = DATA_READY;
-                    
-                    if (IS_TIMER_START(rdma_read_wait_timer)) {
-                        END_TIMER(rdma_read_wait_timer);
-                    }
+    memset(&read_wr, 0, sizeof(read_wr));
+    read_wr.wr_id = WR_READ_PAGE;
+    read_wr.opcode = IBV_WR_RDMA_READ;
+    read_wr.sg_list = &sge;
+    read_wr.num_sge = 1;
+    read_wr.send_flags = IBV_SEND_SIGNALED;
+    read_wr.wr.rdma.remote_addr = addr;
+    read_wr.wr.rdma.rkey = rkey;
 
-                    // pthread_cond_signal(&worker_cond);
-                    pthread_mutex_unlock(&page_worker_mutex);
-                    break;
-                } else {
-                    pthread_mutex_unlock(&page_worker_mutex);
-                }
-            }
+    if (ibv_post_send(lane->qp, &read_wr, &bad_wr)) {
+        return -1;
+    }
+    cb->rdma_read_bytes += length;
+    bask_stats_count(BASK_CNT_BYTES_READ, length);
+    return 0;
+}
 
-            if (prev_page_buf) {
-                ibv_dereg_mr(prev_page_mr);
-                free(prev_page_buf);
-            }
+/*
+ * Pages named by host DMA address under the global rkey, spread over the lanes.
+ * A page that follows the previous one both in host memory and in buf extends
+ * its READ instead of taking one of its own.
+ */
+static int rdma_read_page_list(struct rdma_cb* cb, enum cq_phase phase, struct ibv_mr* mr,
+    const struct batch_operation_descriptor *desc, void* buf) {
+    struct rdma_lane *lanes[MAX_LANES];
+    int posted[MAX_LANES] = { 0 };
+    int nr_lanes = 0, n = 0;
+    int ret = 0;
+    uint64_t run_addr = 0, run_slot = 0;
+    uint32_t run_len = 0;
+    uint64_t start = bask_stats_now();
 
-            prev_page_buf = page_buf;
-            prev_page_mr = page_mr;
+START_TIMER(rdma_read_timer);
+    for (int i = 0; i < MAX_LANES; i++) {
+        if (atomic_load(&cb->lanes[i].ready)) {
+            lanes[nr_lanes++] = &cb->lanes[i];
         }
+    }
+    if (nr_lanes == 0) {
+        fprintf(stderr, "[Server] No connected lane to read from.\n");
+        return -1;
+    }
+
+    for (int i = 0; i < desc->op_cnt && !ret; i++) {
+        const struct batch_op *op = &desc->ops[i];
+        int page_cnt = op->cmd == PAGE_COMPARE ? 2 : 1;
 
-        while (1) {
-            pthread_mutex_lock(&page_worker_mutex);
-            if (worker_todo.status == WORK_DONE) {
-                ABORT_TIMER(rdma_read_wait_timer);
+        for (int j = 0; j < page_cnt; j++) {
+            uint64_t slot = (uint64_t) op->page_idx[j] * PAGE_SIZE;
+
+            if (op->page_idx[j] < 0 || op->page_idx[j] >= desc->page_num) {
+                fprintf(stderr, "[Server] Invalid page index %d of %llu\n", op->page_idx[j], desc->page_num);
+                ret = -1;
                 break;
-            } else {
-                pthread_mutex_unlock(&page_worker_mutex);
             }
-        }
-        scanned_cnt += worker_todo.num_pages;
 
-        worker_todo.metadata = NULL;
-        worker_todo.log_table = NULL;
-        worker_todo.mm_id = -1;
-        worker_todo.va2dma_map = NULL;
-        worker_todo.pages_buf = NULL;
-        worker_todo.num_pages = 0;
-        worker_todo.idx_adjust = 0;
-        worker_todo.status = WORKER_READY;
+            if (run_len && op->addr[j] == run_addr + run_len && slot == run_slot + run_len) {
+                run_len += PAGE_SIZE;
+                continue;
+            }
 
-        pthread_mutex_unlock(&page_worker_mutex);
+            if (run_len) {
+                int lane = n++ % nr_lanes;
 
-        if (prev_page_buf) {
-            ibv_dereg_mr(prev_page_mr);
-            free(prev_page_buf);
-            prev_page_buf = NULL;
+                if (post_page_run(cb, lanes[lane], mr, desc->rkey, run_addr, run_slot, run_len, buf)) {
+                    fprintf(stderr, "[Server] ibv_post_send failed on lane %d.\n", lane);
+                    ret = -1;
+                    break;
+                }
+                posted[lane]++;
+            }
+            run_addr = op->addr[j];
+            run_slot = slot;
+            run_len = PAGE_SIZE;
         }
+    }
 
-        ibv_dereg_mr(map_mr);
-        free(pt->va2dma_map);
-        free(pt);
+    if (!ret && run_len) {
+        int lane = n++ % nr_lanes;
 
-        printf("[KSM] Current Metadata status: %d items, %d stable nodes, %d unstable nodes\n",
-            g_tree_nnodes(cb->metadata.rmap_tree), g_hash_table_size(cb->metadata.stable_hash_table), g_hash_table_size(cb->metadata.unstable_hash_table));
+        if (post_page_run(cb, lanes[lane], mr, desc->rkey, run_addr, run_slot, run_len, buf)) {
+            fprintf(stderr, "[Server] ibv_post_send failed on lane %d.\n", lane);
+            ret = -1;
+        } else {
+            posted[lane]++;
+        }
     }
-    printf("[KSM] Hash collision occured: %lu, at most node %lu\n", hash_collision_cnt, hash_collision_cnt_max);
-    hash_collision_cnt = 0;
-    hash_collision_cnt_max = 0;
 
-    prune_metadata(&cb->metadata, &cb->log_table);
+    for (int i = 0; i < nr_lanes; i++) {
+        for (int j = 0; j < posted[i]; j++) {
+            if (wait_lane_cq_event_and_poll(cb, lanes[i]->cq, lanes[i]->comp_chan, phase, "[SERVER PAGE LIST READ]")) {
+                ret = -1;
+            }
+        }
+    }
+    bask_stats_since(BASK_PHASE_RDMA_READ, start);
+END_TIMER(rdma_read_timer);
+    return ret;
+}
 
-    total_accessed_cnt = 0;
-    return scanned_cnt;
+// Fetch the pages of a dataplane request into buf, back to back in page index order
+static int rdma_read_desc_pages(struct rdma_cb* cb, enum cq_phase phase, struct ibv_mr* mr,
+    const struct batch_operation_descriptor *desc, void* buf) {
+    if (desc->flags & STYX_OP_PHYS_ADDR) {
+        return rdma_read_page_list(cb, phase, mr, desc, buf);
+    }
+    return rdma_read_memory(cb, phase, mr, desc->rkey, desc->iova, PAGE_SIZE * desc->page_num, buf);
 }
 
-rmap_item* lookup_rmap_item(struct ksm_metadata* metadata, int mm_id, struct shadow_pte* pte) {
-    rmap_item lookup_item, *item;
-    lookup_item.mm_id = mm_id;
-    lookup_item.va = pte->va;
-
-    item = g_tree_lookup(metadata->rmap_tree, &lookup_item);
-    if (!item) {
-        DEBUG_LOG("[KSM] New rmap item: mm_id=%d, va=%lx\n", mm_id, pte->va);
-        item = (rmap_item*) malloc(sizeof(rmap_item));
-        if (!item) {
-            fprintf(stderr, "[Server] malloc for item failed.\n");
-            return NULL;
-        }
+/*
+ * Read only the pages of one SGL chunk the host did not tag SHADOW_PTE_UNCHANGED,
+ * one READ per run of them, into the same slots of buf. Runs separated by a few
+ * unchanged pages are read as one. Returns the number of pages read, -1 on error.
+ */
+#define CHANGED_RUN_GAP 4
 
-        item->state = Volatile;
-        item->mm_id = mm_id;
-        item->va = pte->va;
-        item->old_hash = null_hash;
-        item->age = 0;
-        
-        if (metadata->rmap_tree == NULL) {
-            ERR_LOG_AND_STOP("[KSM] rmap tree is null while lookup\n");
+static long rdma_read_changed_pages(struct rdma_cb* cb, struct ibv_mr* mr, uint32_t rkey, dma_addr_t addr,
+    const struct shadow_pte* map, uint64_t num_pages, void* buf) {
+    struct ibv_send_wr read_wr, *bad_wr = NULL;
+    struct ibv_sge sge;
+    struct rdma_lane *lanes[MAX_LANES];
+    int posted[MAX_LANES] = { 0 };
+    int nr_lanes = 0, n = 0, ret = 0;
+    uint64_t i = 0, first, last;
+    long pages_read = 0;
+    uint64_t start = bask_stats_now();
+
+START_TIMER(rdma_read_timer);
+    for (int l = 0; l < MAX_LANES; l++) {
+        if (atomic_load(&cb->lanes[l].ready)) {
+            lanes[nr_lanes++] = &cb->lanes[l];
         }
-        g_tree_insert(metadata->rmap_tree, item, item);
+    }
+    if (nr_lanes == 0) {
+        fprintf(stderr, "[Server] No connected lane to read from.\n");
+        return -1;
     }
 
-    total_accessed_cnt += 1;
-    item->last_access = iteration;
-    item->pfn = pte->kpfn;
-    
-    return item;
-}
-
-int cmp_and_merge_one(struct ksm_metadata* metadata, struct ksm_log_table* log_table,
-    void* page, rmap_item* curr_item, unsigned int rkey, dma_addr_t addr) {
-    // XXH64_hash_t curr_checksum;
-    // XXH64_hash_t node_checksum;
-    struct stable_node* stable_node, *chain_node;
-    rmap_item* unstable_node;
-    struct ksm_event_log result_entry;
-    hash_pair curr_hash;
-    hash_pair node_hash;
-
-again:
-    switch (curr_item->state) {
-        case None:
-        case Unstable:
-            ERR_LOG_AND_STOP( "[KSM] Invalid state for item : %d\n", curr_item->state);
+    while (i < num_pages && !ret) {
+        while (i < num_pages && (map[i].va & SHADOW_PTE_UNCHANGED)) {
+            i++;
+        }
+        if (i == num_pages) {
             break;
-        
-        case Stable:
-            DEBUG_LOG("[KSM] Already merged stable item.\n");
-            
-            struct stable_node* curr_node = curr_item->stable_node;
-            if (curr_node->pfn != curr_item->pfn) {
-                DEBUG_LOG("[KSM] PFN mismatch implies mapping change: %lu vs %lu\n", curr_node->pfn, curr_item->pfn);
+        }
 
-                remove_item_from_node(curr_node, curr_item);
-                reset_item_state(curr_item);
-                
-                if (curr_node->shared_cnt == 0) {
-                    remove_stale_node_and_log(metadata, curr_node, curr_item, log_table);
-                } else {
-                    log_item_state_change(log_table, curr_item, curr_node);
-                }
+        first = last = i;
+        while (++i < num_pages) {
+            if (!(map[i].va & SHADOW_PTE_UNCHANGED)) {
+                last = i;
+            } else if (i - last > CHANGED_RUN_GAP) {
+                break;
+            }
+        }
+        i = last + 1;
 
-                curr_item->volatility_score += 1;
-                broken_merges += 1;
+        int lane = n++ % nr_lanes;
+        uint32_t length = (last - first + 1) * PAGE_SIZE;
 
-                goto again;
-            } else {
-                /* Additional error check logic required to avoid stale stable node */
-                // PFN이 안 바뀌었는데, checksum이 달라진 경우 (리눅스 Page fault는 항상 새 page로 변경함)
-                // => unstable merge가 성공한 시점에서, page contents는 지금 checksum이 올바름
-                START_TIMER(big_hash_timer);
-                curr_hash = calculate_hash_pair(page);
-                END_TIMER(big_hash_timer);
-
-                if (!compare_hash_pair_equal(&curr_hash, &curr_item->old_hash)) {
-                    if (!compare_hash_pair_equal(&curr_item->old_hash, &curr_node->page_hash)) {
-                        ERR_LOG_AND_STOP( "[KSM] Checksum mismatch in Stable item: %lx%lx%lx%lx vs %lx%lx%lx%lx and node %lx%lx%lx%lx\n",
-                            PRINT_HASH_PAIR(curr_item->old_hash),
-                            PRINT_HASH_PAIR(curr_hash),
-                            PRINT_HASH_PAIR(curr_node->page_hash));
+        // Keep the send queue from overflowing on a fragmented chunk
+        if (posted[lane] == MAX_SEND_WR / 2) {
+            for (int l = 0; l < nr_lanes; l++) {
+                for (; posted[l] > 0; posted[l]--) {
+                    if (wait_lane_cq_event_and_poll(cb, lanes[l]->cq, lanes[l]->comp_chan, CQ_PHASE_PAGE_READ, "[SERVER CHANGED PAGE READ]")) {
+                        ret = -1;
                     }
+                }
+            }
+            if (ret) {
+                break;
+            }
+        }
 
-                    if (curr_node->chain.type == HEAD) {
-                        g_hash_table_remove(metadata->stable_hash_table, curr_node);
+        read_shaper_acquire(&cb->shaper, length);
 
-                        curr_node->page_hash = curr_hash;
-                        g_tree_foreach(curr_node->sharing_item_tree, update_item_checksum, &curr_hash);
+        memset(&sge, 0, sizeof(sge));
+        sge.addr = (uintptr_t) buf + first * PAGE_SIZE;
+        sge.length = length;
+        sge.lkey = mr->lkey;
 
-                        chain_node = curr_node->chain.next;
-                        while (chain_node) {
-                            chain_node->page_hash = curr_hash;
-                            g_tree_foreach(chain_node->sharing_item_tree, update_item_checksum, &curr_hash);
+        memset(&read_wr, 0, sizeof(read_wr));
+        read_wr.wr_id = WR_READ_PAGE;
+        read_wr.opcode = IBV_WR_RDMA_READ;
+        read_wr.sg_list = &sge;
+        read_wr.num_sge = 1;
+        read_wr.send_flags = IBV_SEND_SIGNALED;
+        read_wr.wr.rdma.remote_addr = addr + first * PAGE_SIZE;
+        read_wr.wr.rdma.rkey = rkey;
 
-                            chain_node = chain_node->chain.next;
-                        }
+        if (ibv_post_send(lanes[lane]->qp, &read_wr, &bad_wr)) {
+            fprintf(stderr, "[Server] ibv_post_send failed on lane %d.\n", lane);
+            ret = -1;
+            break;
+        }
+        posted[lane]++;
+        pages_read += last - first + 1;
+        cb->rdma_read_bytes += length;
+        bask_stats_count(BASK_CNT_BYTES_READ, length);
+    }
 
-                        g_hash_table_insert(metadata->stable_hash_table, curr_node, curr_node);
-                        
-                        DEBUG_LOG("Head Node checksum updated: %lx%lx%lx%lx\n", PRINT_HASH_PAIR(curr_node->page_hash));
-                    }else{
-                        if (!curr_node->chain.prev) {
-                            ERR_LOG_AND_STOP("[KSM] Invalid stable node type: %d\n", curr_node->chain.type);
-                        }
+    for (int l = 0; l < nr_lanes; l++) {
+        for (; posted[l] > 0; posted[l]--) {
+            if (wait_lane_cq_event_and_poll(cb, lanes[l]->cq, lanes[l]->comp_chan, CQ_PHASE_PAGE_READ, "[SERVER CHANGED PAGE READ]")) {
+                ret = -1;
+            }
+        }
+    }
+    bask_stats_since(BASK_PHASE_RDMA_READ, start);
+END_TIMER(rdma_read_timer);
+    return ret ? -1 : pages_read;
+}
 
-                        while (curr_node->chain.prev) {
-                            curr_node = curr_node->chain.prev;
-                        }
+void* ksm_page_worker(void * arg) {
+    unsigned long start;
 
-                        if (curr_node->chain.type != HEAD) {
-                            ERR_LOG_AND_STOP("[KSM] Invalid stable node type: %d\n", curr_node->chain.type);
-                        }
+    struct rdma_cb* cb = (struct rdma_cb*)arg;
+    struct worker_job* work = &cb->worker_todo;
 
-                        g_hash_table_remove(metadata->stable_hash_table, curr_node);
-                        
-                        curr_node->page_hash = curr_hash;
-                        g_tree_foreach(curr_node->sharing_item_tree, update_item_checksum, &curr_hash);
+    while(1) {
+        pthread_mutex_lock(&cb->page_worker_mutex);
 
-                        chain_node = curr_node->chain.next;
-                        while (chain_node) {
-                            chain_node->page_hash = curr_hash;
-                            g_tree_foreach(chain_node->sharing_item_tree, update_item_checksum, &curr_hash);
+        while (work->status != DATA_READY && work->status != EXIT) {
+            pthread_cond_wait(&cb->page_worker_cond, &cb->page_worker_mutex);
+        }
 
-                            chain_node = chain_node->chain.next;
-                        }
+        if (work->status == EXIT) {
+            pthread_mutex_unlock(&cb->page_worker_mutex);
+            return NULL;
+        }
 
-                        g_hash_table_insert(metadata->stable_hash_table, curr_node, curr_node);
-                        
-                        DEBUG_LOG("Chain Node checksum updated: %lx%lx%lx%lx\n", PRINT_HASH_PAIR(curr_node->page_hash));
-                    }
-                }
-            }
+        if (work->status == DATA_READY) {
+            tenant_sched_acquire(&cb->tenant);
+            start = get_time_ns();
 
-            if (curr_item->volatility_score > 0) {
-                curr_item->volatility_score -= 1;
-            }
-            
-            break;
+            ksm_scan_pages(work);
 
-        case Volatile:
-            DEBUG_LOG("[KSM] Volatile item.\n");
-            volatile_items_cnt += 1;
-            curr_item->age += 1;
+            cb->tenant.stats.busy_ns += get_time_ns() - start;
+            tenant_sched_release(&cb->tenant, work->num_pages);
 
-            if (should_skip_item(curr_item)) {
-                DEBUG_LOG("[KSM] Skipping volatile item: %llx(%d) skip count: %d\n", curr_item->va, curr_item->mm_id, curr_item->skip_cnt);
-                skipped_cnt += 1;
-                return 0;
-            } else {
-                DEBUG_LOG("[KSM] Not Skipped volatile item: %llx(%d) skip count: %d\n", curr_item->va, curr_item->mm_id, curr_item->skip_cnt);
-            }
+            work->status = WORK_DONE;
+            pthread_cond_broadcast(&cb->page_worker_cond);
+START_TIMER(rdma_read_wait_timer);
+        }
+        pthread_mutex_unlock(&cb->page_worker_mutex);
+    }
+}
 
-            START_TIMER(big_hash_timer);
-            curr_hash = calculate_hash_pair(page);
-            END_TIMER(big_hash_timer);
+static int start_page_worker(struct rdma_cb* cb) {
+    pthread_mutex_init(&cb->page_worker_mutex, NULL);
+    pthread_cond_init(&cb->page_worker_cond, NULL);
 
-            if (compare_hash_pair_equal(&curr_item->old_hash, &curr_hash)) {
-                if (curr_item->volatility_score > 0) {
-                    curr_item->volatility_score -= 1;
-                }
+    memset(&cb->worker_todo, 0, sizeof(cb->worker_todo));
+    cb->worker_todo.mm_id = -1;
+    cb->worker_todo.status = WORKER_READY;
 
-                // Try to find a match in stable nodes
-                stable_node = cmp_with_stable(metadata, page, curr_hash);
+    if (pthread_create(&cb->page_worker, NULL, ksm_page_worker, cb)) {
+        fprintf(stderr, "[Server] pthread_create for page worker failed.\n");
+        cb->worker_todo.status = NO_WORKER;
+        return -1;
+    }
 
-                if (stable_node) {
-                    if (stable_node->shared_cnt >= MAX_PAGE_SHARING) {
-                        ERR_LOG_AND_STOP( "[KSM] Invalid shared count for stable node: %d\n", stable_node->shared_cnt);
-                    }
+    return 0;
+}
 
-                    if (curr_item->volatility_score > 0) {
-                        highly_volatile_but_stable_merged_cnt += 1;
-                    }
+static void stop_page_worker(struct rdma_cb* cb) {
+    if (cb->worker_todo.status == NO_WORKER) {
+        return;
+    }
 
-                    // Merge with stable node                
-                    insert_item_to_node(stable_node, curr_item);
-                    log_stable_merge(log_table, curr_item, stable_node);
-
-                    DEBUG_LOG("[KSM] %llx(%d) Merged with stable node %lu Shared count: %d\n", curr_item->va, curr_item->mm_id, stable_node->pfn, stable_node->shared_cnt);
-                }else{
-                    curr_item->old_hash = curr_hash;
-                    // Checksum matches with old checksum
-                    // Try to find a match in unstable nodes
-                    unstable_node = cmp_with_unstable(metadata,  curr_item);
-                    if (unstable_node) {
-                        // Merge with unstable node. Promote to stable
-                        stable_node = (struct stable_node*) malloc(sizeof(struct stable_node));
-                        if (!stable_node) {
-                            fprintf(stderr, "[Server] malloc for stable_node failed.\n");
-                            return -1;
-                        }
-                        memset(stable_node, 0, sizeof(struct stable_node));
-
-                        stable_node->shared_cnt = 0;
-                        stable_node->page_hash = curr_hash;
-                        stable_node->pfn = curr_item->pfn;
-                        stable_node->sharing_item_tree = g_tree_new(rmap_item_compare);
-                        
-                        insert_stable_node(metadata, stable_node);
-
-                        insert_item_to_node(stable_node, unstable_node);
-                        insert_item_to_node(stable_node, curr_item);
-
-                        log_unstable_merge(log_table, curr_item, unstable_node);
-
-                        if (curr_item->volatility_score > 0 || unstable_node->volatility_score > 0) {
-                            highly_volatile_but_unstable_merged_cnt += 1;
-                        }
-
-                        DEBUG_LOG("[KSM] %llx(%d) and %llx(%d) Merged into stable node %lu Shared count: %d\n", curr_item->va, curr_item->mm_id, unstable_node->va, unstable_node->mm_id, stable_node->pfn, stable_node->shared_cnt);
-
-                    }else{
-                        curr_item->old_hash = curr_hash;                        
-                        curr_item->state = Unstable;
-                        insert_unstable_node(metadata, curr_item);                                
-                    }
-                }
-            } else {
-                if (!compare_hash_pair_equal(&curr_item->old_hash, &null_hash)) {
-                    curr_item->volatility_score += 1;
-                }
+    pthread_mutex_lock(&cb->page_worker_mutex);
+    while (cb->worker_todo.status == DATA_READY) {
+        pthread_cond_wait(&cb->page_worker_cond, &cb->page_worker_mutex);
+    }
+    cb->worker_todo.status = EXIT;
+    pthread_cond_broadcast(&cb->page_worker_cond);
+    pthread_mutex_unlock(&cb->page_worker_mutex);
+
+    pthread_join(cb->page_worker, NULL);
+    pthread_cond_destroy(&cb->page_worker_cond);
+    pthread_mutex_destroy(&cb->page_worker_mutex);
+    cb->worker_todo.status = NO_WORKER;
+}
 
-                curr_item->old_hash = curr_hash;
-            }
+// Wait for the page worker to finish its chunk and park it, returns the pages it scanned
+static int drain_page_worker(struct rdma_cb *cb)
+{
+    int num_pages;
 
-            break;
+    pthread_mutex_lock(&cb->page_worker_mutex);
+    while ((cb->worker_todo.status != WORK_DONE) && (cb->worker_todo.status != WORKER_READY)) {
+        pthread_cond_wait(&cb->page_worker_cond, &cb->page_worker_mutex);
     }
-
-    return 0;
+    ABORT_TIMER(rdma_read_wait_timer);
+    num_pages = cb->worker_todo.num_pages;
+
+    cb->worker_todo.metadata = NULL;
+    cb->worker_todo.log_table = NULL;
+    cb->worker_todo.mm_id = -1;
+    cb->worker_todo.va2dma_map = NULL;
+    cb->worker_todo.pages_buf = NULL;
+    cb->worker_todo.num_pages = 0;
+    cb->worker_todo.idx_adjust = 0;
+    cb->worker_todo.status = WORKER_READY;
+
+    pthread_mutex_unlock(&cb->page_worker_mutex);
+    return num_pages;
 }
 
-int cmp_and_merge_one_old(struct ksm_metadata* metadata, struct ksm_log_table* log_table,
-    void* page, rmap_item* curr_item, unsigned int rkey, dma_addr_t addr) {
-    struct stable_node* stable_node, *chain_node;
-    rmap_item* unstable_node;
-    struct ksm_event_log result_entry;
-    hash_pair curr_hash;
-    hash_pair node_hash;
-
-again:
-    switch (curr_item->state) {
-        case None:
-        case Unstable:
-            ERR_LOG_AND_STOP( "[KSM] Invalid state for item : %d\n", curr_item->state);
-            break;
-        
-        case Stable:
-            DEBUG_LOG("[KSM] Already merged stable item.\n");
-            
-            struct stable_node* curr_node = curr_item->stable_node;
-            if (curr_node->pfn != curr_item->pfn) {
-                DEBUG_LOG("[KSM] PFN mismatch implies mapping change: %lu vs %lu\n", curr_node->pfn, curr_item->pfn);
+static int do_ksm_v3(struct rdma_cb* cb, struct metadata_descriptor* meta_desc) {
+    int scanned_cnt = 0, i, j, err;
+    struct shadow_pt_descriptor* pt_desc;
+    struct shadow_pt* pt = NULL;
+    struct ibv_mr *map_mr = NULL;
 
-                remove_item_from_node(curr_node, curr_item);
-                reset_item_state(curr_item);
-                
-                if (curr_node->shared_cnt == 0) {
-                    remove_stale_node_and_log(metadata, curr_node, curr_item, log_table);
-                } else {
-                    log_item_state_change(log_table, curr_item, curr_node);
-                }
+    struct shadow_pte* va2dma_map;
+    
+    struct ibv_mr *page_mr = NULL;
+    void *page_buf = NULL, *page;
+    dma_addr_t page_addr;
 
-                goto again;
-            } else {
-                /* Additional error check logic required to avoid stale stable node */
-                // PFN이 안 바뀌었는데, checksum이 달라진 경우 (리눅스 Page fault는 항상 새 page로 변경함)
-                // => unstable merge가 성공한 시점에서, page contents는 지금 checksum이 올바름
-                START_TIMER(big_hash_timer);
-                curr_hash = calculate_hash_pair(page);
-                END_TIMER(big_hash_timer);
-
-                if (!compare_hash_pair_equal(&curr_hash, &curr_item->old_hash)) {
-                    if (!compare_hash_pair_equal(&curr_item->old_hash, &curr_node->page_hash)) {
-                        ERR_LOG_AND_STOP( "[KSM] Checksum mismatch in Stable item: %lx%lx%lx%lx vs %lx%lx%lx%lx and node %lx%lx%lx%lx\n",
-                            PRINT_HASH_PAIR(curr_item->old_hash),
-                            PRINT_HASH_PAIR(curr_hash),
-                            PRINT_HASH_PAIR(curr_node->page_hash));
-                    }
+    rmap_item* curr_item;
+
+    void *prev_page_buf = NULL;
+    struct ibv_mr *prev_page_mr = NULL;
+   
+    for (i = 0; i < meta_desc->pt_cnt; i++) {
+        pt_desc = &meta_desc->pt_descs[i];
 
-                    if (curr_node->chain.type == HEAD) {
-                        g_hash_table_remove(metadata->stable_hash_table, curr_node);
+        printf("[Server] KSM working on %d-th mm: %d\n", i, pt_desc->mm_id);
+        
+        pt = (struct shadow_pt*) malloc(sizeof(struct shadow_pt));
+        if (!pt) {
+            fprintf(stderr, "[Server] malloc for pt failed.\n");
+            return -1;
+        }
 
-                        curr_node->page_hash = curr_hash;
-                        g_tree_foreach(curr_node->sharing_item_tree, update_item_checksum, &curr_hash);
+        pt->mm_id = pt_desc->mm_id;
+        pt->entry_cnt = pt_desc->entry_cnt;
+        pt->va2dma_map = NULL;
 
-                        chain_node = curr_node->chain.next;
-                        while (chain_node) {
-                            chain_node->page_hash = curr_hash;
-                            g_tree_foreach(chain_node->sharing_item_tree, update_item_checksum, &curr_hash);
+        va2dma_map = (struct shadow_pte*) calloc(pt->entry_cnt, sizeof(struct shadow_pte));
+        if (!va2dma_map) {
+            fprintf(stderr, "[Server] calloc for va2dma_map failed.\n");
+            goto err;
+        }
 
-                            chain_node = chain_node->chain.next;
-                        }
+        pt->va2dma_map = va2dma_map;
 
-                        g_hash_table_insert(metadata->stable_hash_table, curr_node, curr_node);
-                        
-                        DEBUG_LOG("Head Node checksum updated: %lx%lx%lx%lx\n", PRINT_HASH_PAIR(curr_node->page_hash));
-                    }else{
-                        if (!curr_node->chain.prev) {
-                            ERR_LOG_AND_STOP("[KSM] Invalid stable node type: %d\n", curr_node->chain.type);
-                        }
+        map_mr = ibv_reg_mr(cb->pd, va2dma_map, sizeof(struct shadow_pte) * pt->entry_cnt,
+                            IBV_ACCESS_LOCAL_WRITE);
 
-                        while (curr_node->chain.prev) {
-                            curr_node = curr_node->chain.prev;
-                        }
+        if (!map_mr) {
+            fprintf(stderr, "[Server] ibv_reg_mr for pt->va2dma_map failed.\n");
+            goto err;
+        }
 
-                        if (curr_node->chain.type != HEAD) {
-                            ERR_LOG_AND_STOP("[KSM] Invalid stable node type: %d\n", curr_node->chain.type);
-                        }
+        // Read the page table
+        if (rdma_read_memory(cb, CQ_PHASE_PT_READ, map_mr, pt_desc->map_rkey, pt_desc->pt_base_addr,
+                sizeof(struct shadow_pte) * pt->entry_cnt, va2dma_map)) {
+            fprintf(stderr, "[Server] rdma_read_memory failed.\n");
+            fprintf(stderr, "[Server] Failed to read pt %llx\n", pt_desc->pt_base_addr);
+            goto err;
+        }
 
-                        g_hash_table_remove(metadata->stable_hash_table, curr_node);
-                        
-                        curr_node->page_hash = curr_hash;
-                        g_tree_foreach(curr_node->sharing_item_tree, update_item_checksum, &curr_hash);
+        if (pt->va2dma_map[0].va == 0) {
+            fprintf(stderr, "[Server] Invalid page table read.\n");
+            goto err;
+        }
 
-                        chain_node = curr_node->chain.next;
-                        while (chain_node) {
-                            chain_node->page_hash = curr_hash;
-                            g_tree_foreach(chain_node->sharing_item_tree, update_item_checksum, &curr_hash);
+        if (cb->trace) {
+            bask_trace_write(cb->trace, BASK_TRACE_MM, pt->mm_id, 0, pt->entry_cnt, pt->va2dma_map, sizeof(struct shadow_pte));
+        }
 
-                            chain_node = chain_node->chain.next;
-                        }
+        int sgl_nums = DIV_ROUND_UP(pt->entry_cnt, MAX_PAGES_IN_SGL);
 
-                        g_hash_table_insert(metadata->stable_hash_table, curr_node, curr_node);
-                        
-                        DEBUG_LOG("Chain Node checksum updated: %lx%lx%lx%lx\n", PRINT_HASH_PAIR(curr_node->page_hash));
-                    }
+        for (int sgl_idx = 0; sgl_idx < sgl_nums; sgl_idx++) {
+            unsigned long long this_sgl_size = sgl_idx == (sgl_nums - 1) ? pt->entry_cnt - sgl_idx * MAX_PAGES_IN_SGL : MAX_PAGES_IN_SGL;
+            page_buf = malloc(PAGE_SIZE * this_sgl_size);
+            if (!page_buf) {
+                fprintf(stderr, "[Server] calloc for page_buf failed.\n");
+                goto err;
+            }
+            memset(page_buf, 0, PAGE_SIZE * this_sgl_size);
+            DEBUG_LOG("[Server] Reading pages batched size %llu\n", PAGE_SIZE * this_sgl_size);
+        
+            page_mr = ibv_reg_mr(cb->pd, page_buf, PAGE_SIZE * this_sgl_size, IBV_ACCESS_LOCAL_WRITE);
+            if (!page_mr) {
+                fprintf(stderr, "[Server] ibv_reg_mr for page_buf failed.\n");
+                goto err;
+            }
+
+            page_addr = pt_desc->desc_entries[sgl_idx].pages_base_addr;
+            uint64_t unchanged_cnt = 0;
+            for (uint64_t k = 0; meta_desc->dirty_tracking && k < this_sgl_size; k++) {
+                unchanged_cnt += !!(pt->va2dma_map[sgl_idx * MAX_PAGES_IN_SGL + k].va & SHADOW_PTE_UNCHANGED);
+            }
+
+            if (unchanged_cnt) {
+                long pages_read = rdma_read_changed_pages(cb, page_mr, pt_desc->desc_entries[sgl_idx].pages_rkey, page_addr,
+                    pt->va2dma_map + sgl_idx * MAX_PAGES_IN_SGL, this_sgl_size, page_buf);
+                if (pages_read < 0) {
+                    fprintf(stderr, "[Server][%d] rdma failed for changed pages at dma addr %llx\n", cb->metadata.iteration, page_addr);
+                    goto err;
                 }
+                DEBUG_LOG("[Server] Read %ld of %llu pages, the others are unchanged\n", pages_read, this_sgl_size);
+            } else if (rdma_read_memory(cb, CQ_PHASE_PAGE_READ, page_mr, pt_desc->desc_entries[sgl_idx].pages_rkey, page_addr, PAGE_SIZE * this_sgl_size, page_buf)) {
+                fprintf(stderr, "[Server][%d] rdma failed for dma addr %llx, size %llu\n", cb->metadata.iteration, page_addr, PAGE_SIZE * this_sgl_size);
+                goto err;
             }
 
-            break;
+            if (cb->trace) {
+                bask_trace_write_pages(cb->trace, pt->mm_id, sgl_idx * MAX_PAGES_IN_SGL, page_buf, this_sgl_size);
+            }
+
+            pthread_mutex_lock(&cb->page_worker_mutex);
+            while ((cb->worker_todo.status != WORK_DONE) && (cb->worker_todo.status != WORKER_READY)) {
+                pthread_cond_wait(&cb->page_worker_cond, &cb->page_worker_mutex);
+            }
+            scanned_cnt += cb->worker_todo.num_pages;
+
+            cb->worker_todo.metadata = &cb->metadata;
+            cb->worker_todo.log_table = &cb->log_table;
+            cb->worker_todo.mm_id = pt->mm_id;
+            cb->worker_todo.va2dma_map = pt->va2dma_map;
+            cb->worker_todo.pages_buf = page_buf;
+            cb->worker_todo.num_pages = this_sgl_size;
+            cb->worker_todo.idx_adjust = sgl_idx * MAX_PAGES_IN_SGL;
+            cb->worker_todo.rkey = pt_desc->desc_entries[sgl_idx].pages_rkey;
+            cb->worker_todo.pages_addr = pt_desc->desc_entries[sgl_idx].pages_base_addr;
+            cb->worker_todo.status = DATA_READY;
             
-        case Volatile:
-            DEBUG_LOG("[KSM] Volatile item.\n");
-            START_TIMER(big_hash_timer);
-            curr_hash = calculate_hash_pair(page);
-            END_TIMER(big_hash_timer);
-            // Try to find a match in stable nodes
-            stable_node = cmp_with_stable(metadata, page, curr_hash);
-
-            if (stable_node) {
-                if (stable_node->shared_cnt >= MAX_PAGE_SHARING) {
-                    ERR_LOG_AND_STOP( "[KSM] Invalid shared count for stable node: %d\n", stable_node->shared_cnt);
-                }
+            if (IS_TIMER_START(rdma_read_wait_timer)) {
+                END_TIMER(rdma_read_wait_timer);
+            }
 
-                // Merge with stable node                
-                insert_item_to_node(stable_node, curr_item);
-                log_stable_merge(log_table, curr_item, stable_node);
-
-                DEBUG_LOG("[KSM] %llx(%d) Merged with stable node %lu Shared count: %d\n", curr_item->va, curr_item->mm_id, stable_node->pfn, stable_node->shared_cnt);
-            }else{
-                // curr_checksum = XXH64(page, PAGE_SIZE, 0);
-
-                if (compare_hash_pair_equal(&curr_item->old_hash, &curr_hash)) {
-                    curr_item->old_hash = curr_hash;
-                    // Checksum matches with old checksum
-                    // Try to find a match in unstable nodes
-                    unstable_node = cmp_with_unstable(metadata,  curr_item);
-                    if (unstable_node) {
-                        if (!compare_hash_pair_equal(&unstable_node->old_hash, &curr_hash)) {
-                            ERR_LOG_AND_STOP("[KSM] Checksum mismatch: %lx%lx%lx%lx vs %lx%lx%lx%lx", 
-                                PRINT_HASH_PAIR(unstable_node->old_hash), PRINT_HASH_PAIR(curr_hash));
-                        }
-
-                        // Merge with unstable node. Promote to stable
-                        stable_node = (struct stable_node*) malloc(sizeof(struct stable_node));
-                        if (!stable_node) {
-                            fprintf(stderr, "[Server] malloc for stable_node failed.\n");
-                            return -1;
-                        }
-                        memset(stable_node, 0, sizeof(struct stable_node));
-
-                        stable_node->shared_cnt = 0;
-                        stable_node->page_hash = curr_hash;
-                        stable_node->pfn = curr_item->pfn;
-                        stable_node->sharing_item_tree = g_tree_new(rmap_item_compare);
-                        
-                        insert_stable_node(metadata, stable_node);
-
-                        insert_item_to_node(stable_node, unstable_node);
-                        insert_item_to_node(stable_node, curr_item);
-
-                        log_unstable_merge(log_table, curr_item, unstable_node);
-
-                        DEBUG_LOG("[KSM] %llx(%d) and %llx(%d) Merged into stable node %lu Shared count: %d\n", curr_item->va, curr_item->mm_id, unstable_node->va, unstable_node->mm_id, stable_node->pfn, stable_node->shared_cnt);
-
-                        // free(unstable_node);
-                    }else{
-                        curr_item->old_hash = curr_hash;
-                        // Insert as new unstable node
-                        // unstable_node = (struct unstable_node*) malloc(sizeof(struct unstable_node));
-                        // if (!unstable_node) {
-                        //     fprintf(stderr, "[Server] malloc for unstable_node failed.\n");
-                        //     return -1;
-                        // }
-                        // unstable_node->item = curr_item;
-                        
-                        curr_item->state = Unstable;
-                        // curr_item->unstable_node = unstable_node;
-                        insert_unstable_node(metadata, curr_item);                                
-                    }
+            pthread_cond_broadcast(&cb->page_worker_cond);
+            pthread_mutex_unlock(&cb->page_worker_mutex);
 
-                } else {
-                    // Not a merge candidate
-                    curr_item->old_hash = curr_hash;
-                }
+            if (prev_page_buf) {
+                ibv_dereg_mr(prev_page_mr);
+                free(prev_page_buf);
             }
 
-            break;
+            prev_page_buf = page_buf;
+            prev_page_mr = page_mr;
+            page_buf = NULL;
+            page_mr = NULL;
+        }
+
+        scanned_cnt += drain_page_worker(cb);
+
+        if (prev_page_buf) {
+            ibv_dereg_mr(prev_page_mr);
+            free(prev_page_buf);
+            prev_page_buf = NULL;
+        }
+
+        ibv_dereg_mr(map_mr);
+        map_mr = NULL;
+        free(pt->va2dma_map);
+        free(pt);
+
+        printf("[KSM] Current Metadata status: %d items, %d stable nodes, %d unstable nodes\n",
+            g_tree_nnodes(cb->metadata.rmap_tree), g_hash_table_size(cb->metadata.stable_hash_table), g_hash_table_size(cb->metadata.unstable_hash_table));
     }
+    ksm_finish_iteration(&cb->metadata, &cb->log_table);
 
-    return 0;
+    bask_stats_gauge(cb->tenant.id, BASK_GAUGE_RMAP_ITEMS, g_tree_nnodes(cb->metadata.rmap_tree));
+    bask_stats_gauge(cb->tenant.id, BASK_GAUGE_STABLE_NODES, g_hash_table_size(cb->metadata.stable_hash_table));
+    bask_stats_gauge(cb->tenant.id, BASK_GAUGE_UNSTABLE_NODES, g_hash_table_size(cb->metadata.unstable_hash_table));
+    bask_stats_gauge(cb->tenant.id, BASK_GAUGE_LOG_CAPACITY, cb->log_table.capacity);
+    return scanned_cnt;
+
+err:
+    // The worker may still be scanning prev_page_buf against pt->va2dma_map
+    drain_page_worker(cb);
+    if (page_mr) {
+        ibv_dereg_mr(page_mr);
+    }
+    free(page_buf);
+    if (prev_page_buf) {
+        ibv_dereg_mr(prev_page_mr);
+        free(prev_page_buf);
+    }
+    if (map_mr) {
+        ibv_dereg_mr(map_mr);
+    }
+    free(pt->va2dma_map);
+    free(pt);
+    return -1;
 }
 
 int do_handle_error(struct rdma_cb* cb, struct error_table_descriptor* et_desc) {
-    int i, j, total_log_cnt = 0, this_log_cnt = 0, undo_cnt;
+    int i, j, total_log_cnt = 0, this_log_cnt = 0;
     unsigned long this_sgl_size, total_sgl_entries;
     void* buf;
     struct ibv_mr* buf_mr;
 
-    rmap_item lookup_item, *item, *from_item, *to_item;
-    struct stable_node* curr_node;
-    struct ksm_event_log result_entry;
-
     total_log_cnt = et_desc->total_cnt;
     total_sgl_entries = DIV_ROUND_UP(et_desc->total_cnt * sizeof(struct ksm_event_log), PAGE_SIZE);
     for (i = 0; i < et_desc->desc_cnt; i++) {
@@ -975,129 +1083,384 @@ int do_handle_error(struct rdma_cb* cb, struct error_table_descriptor* et_desc)
             return -1;
         }
 
-        if (rdma_read_memory(cb, buf_mr, et_desc->entries[i].rkey, et_desc->entries[i].base_addr,
+        if (rdma_read_memory(cb, CQ_PHASE_ERROR_READ, buf_mr, et_desc->entries[i].rkey, et_desc->entries[i].base_addr,
                              PAGE_SIZE * this_sgl_size, buf)) {
             fprintf(stderr, "[Server] rdma_read_memory failed.\n");
             return -1;
         }
 
         this_log_cnt = MIN(total_log_cnt, this_sgl_size * PAGE_SIZE / sizeof(struct ksm_event_log));
+        if (cb->trace) {
+            bask_trace_write(cb->trace, BASK_TRACE_ERRORS, -1, 0, this_log_cnt, buf, sizeof(struct ksm_event_log));
+        }
         for (j = 0; j < this_log_cnt; j++) {
             struct ksm_event_log* entry = (struct ksm_event_log*) (buf + j * sizeof(struct ksm_event_log));
-            switch (entry->type) {
-                case HOST_STALE_STABLE_NODE:
-                    ERR_LOG_AND_STOP( "[KSM][%d-th] HOST_STALE_STABLE_NODE: %lu\n", j, entry->stale_node.kpfn);
-                    break;
-                case HOST_NO_STABLE_NODE:
-                    ERR_LOG_AND_STOP( "[KSM][%d-th] HOST_NO_STABLE_NODE - currently unreachable\n", i);
-                    break;
-                case HOST_MERGE_ONE_FAILED:
-                DEBUG_LOG("[KSM][%d-th] HOST_MERGE_ONE_FAILED: %llx(%d) -> %lu\n", j,
-                    entry->stable_merge.from_va, entry->stable_merge.from_mm_id, entry->stable_merge.kpfn);
-                    
-                    lookup_item.mm_id = entry->stable_merge.from_mm_id;
-                    lookup_item.va = entry->stable_merge.from_va;
-
-                    item = g_tree_lookup(cb->metadata.rmap_tree, &lookup_item);
-                    if (!item) {
-                        ERR_LOG_AND_STOP( "[KSM] lookup_rmap_item failed: %d->%llx\n", lookup_item.mm_id, lookup_item.va);
-                    }
+            ksm_apply_error_log(&cb->metadata, &cb->log_table, entry, j);
+        }
+        total_log_cnt -= this_log_cnt;
 
-                    curr_node = item->stable_node;
-                    if (!curr_node) {
-                        ERR_LOG_AND_STOP( "[KSM] Invalid stable node for item in merge one: %llx(%d)\n", entry->stable_merge.from_va, entry->stable_merge.from_mm_id);
-                    }
+        ibv_dereg_mr(buf_mr);
+        free(buf);
+    }
+    return 0;
+}
 
-                    if (curr_node->pfn != entry->stable_merge.kpfn) {
-                        ERR_LOG_AND_STOP( "[KSM] Unexpected pfn while undoing stable merge: %lu vs %lu\n", curr_node->pfn, entry->stable_merge.kpfn);
-                    }
+// Pairs read per batch: two READs each, so one lane never holds more than MAX_SEND_WR / 2
+#define VERIFY_BATCH_PAIRS (MAX_SEND_WR / 4)
 
-                    if (curr_node->shared_cnt < 1) {
-                        ERR_LOG_AND_STOP("[KSM] Invalid shared count for stable node: %lu - %d\n", curr_node->pfn, curr_node->shared_cnt);
-                    }
+// Both pages of @cnt pairs into buf, pair j at page slots 2j and 2j + 1, one READ per page spread over the lanes
+static int rdma_read_verify_pairs(struct rdma_cb* cb, struct ibv_mr* mr, const struct ksm_event_log* pairs, int cnt, void* buf) {
+    struct ibv_send_wr read_wr, *bad_wr = NULL;
+    struct ibv_sge sge;
+    struct rdma_lane *lanes[MAX_LANES];
+    int posted[MAX_LANES] = { 0 };
+    int nr_lanes = 0, n = 0;
+    int ret = 0;
+    uint64_t start = bask_stats_now();
 
-                    remove_item_from_node(curr_node, item);
-                    reset_item_state(item);
-                    item->volatility_score += 1;
+START_TIMER(rdma_read_timer);
+    for (int i = 0; i < MAX_LANES; i++) {
+        if (atomic_load(&cb->lanes[i].ready)) {
+            lanes[nr_lanes++] = &cb->lanes[i];
+        }
+    }
+    if (nr_lanes == 0) {
+        fprintf(stderr, "[Server] No connected lane to read from.\n");
+        return -1;
+    }
 
-                    if (curr_node->shared_cnt == 0) {
-                        remove_stale_node_and_log(&cb->metadata, curr_node, item, &cb->log_table);
-                    }
+    for (int i = 0; i < cnt * 2 && !ret; i++) {
+        const struct ksm_event_log *pair = &pairs[i / 2];
+        int lane = n++ % nr_lanes;
 
-                    break;
-                case HOST_MERGE_TWO_FAILED:
-                    DEBUG_LOG("[KSM][%d-th] HOST_MERGE_TWO_FAILED: %llx(%d) -> %llx(%d)\n", j,
-                    entry->unstable_merge.from_va, entry->unstable_merge.from_mm_id, entry->unstable_merge.to_va, entry->unstable_merge.to_mm_id);
-
-                    undo_cnt = 0;
-                    lookup_item.mm_id = entry->unstable_merge.from_mm_id;
-                    lookup_item.va = entry->unstable_merge.from_va;
-                    from_item = g_tree_lookup(cb->metadata.rmap_tree, &lookup_item);
-                    if (!from_item) {
-                        ERR_LOG_AND_STOP( "[KSM] lookup_rmap_item failed: %d->%llx\n", lookup_item.mm_id, lookup_item.va);
-                    }
+        read_shaper_acquire(&cb->shaper, PAGE_SIZE);
 
-                    curr_node = from_item->stable_node;
-                    if (!curr_node) {
-                        ERR_LOG_AND_STOP( "[KSM] Invalid stable node for item in merge two: %llx(%d)\n", entry->unstable_merge.from_va, entry->unstable_merge.from_mm_id);
-                    }
-                    
-                    g_tree_foreach(curr_node->sharing_item_tree, reset_each_item_state, &undo_cnt);
-                    
-                    DEBUG_LOG("    Undo merge related to stable node %lu - %d\n", curr_node->pfn, undo_cnt);
+        memset(&sge, 0, sizeof(sge));
+        sge.addr = (uintptr_t) buf + (uint64_t) i * PAGE_SIZE;
+        sge.length = PAGE_SIZE;
+        sge.lkey = mr->lkey;
 
-                    remove_stable_node_no_item(&cb->metadata, curr_node);
-                    break;
-                default:
-                    ERR_LOG_AND_STOP( "[KSM] Invalid event type: %d\n", entry->type);
-                    break;
+        memset(&read_wr, 0, sizeof(read_wr));
+        read_wr.wr_id = WR_READ_PAGE;
+        read_wr.opcode = IBV_WR_RDMA_READ;
+        read_wr.sg_list = &sge;
+        read_wr.num_sge = 1;
+        read_wr.send_flags = IBV_SEND_SIGNALED;
+        read_wr.wr.rdma.remote_addr = pair->verify_pair.addr[i % 2];
+        read_wr.wr.rdma.rkey = pair->verify_pair.rkey[i % 2];
+
+        if (ibv_post_send(lanes[lane]->qp, &read_wr, &bad_wr)) {
+            fprintf(stderr, "[Server] ibv_post_send failed on lane %d.\n", lane);
+            ret = -1;
+            break;
+        }
+        posted[lane]++;
+        cb->rdma_read_bytes += PAGE_SIZE;
+        bask_stats_count(BASK_CNT_BYTES_READ, PAGE_SIZE);
+    }
+
+    for (int i = 0; i < nr_lanes; i++) {
+        for (int j = 0; j < posted[i]; j++) {
+            if (wait_lane_cq_event_and_poll(cb, lanes[i]->cq, lanes[i]->comp_chan, CQ_PHASE_PAGE_READ, "[SERVER VERIFY READ]")) {
+                ret = -1;
             }
         }
-        total_log_cnt -= this_log_cnt;
+    }
+    bask_stats_since(BASK_PHASE_RDMA_READ, start);
+END_TIMER(rdma_read_timer);
+    return ret;
+}
+
+/*
+ * Verify round of the host's commit: read both pages of every HOST_VERIFY_PAIR,
+ * which the host keeps write-protected, and answer each in order with
+ * DPU_VERIFY_SAME or DPU_VERIFY_DIFF. The engine state is not touched.
+ * Returns the number of pairs that differ, -1 on failure.
+ */
+int do_verify_pairs(struct rdma_cb* cb, struct error_table_descriptor* vt_desc) {
+    int i, j, k, batch, same, total_pair_cnt, this_pair_cnt;
+    unsigned long this_sgl_size, total_sgl_entries;
+    void *buf, *pages;
+    struct ibv_mr *buf_mr, *pages_mr;
+    int diff_cnt = 0, ret = 0;
+
+    pages = malloc(PAGE_SIZE * 2 * VERIFY_BATCH_PAIRS);
+    if (!pages) {
+        fprintf(stderr, "[Server] malloc for verify pages failed.\n");
+        return -1;
+    }
+    pages_mr = ibv_reg_mr(cb->pd, pages, PAGE_SIZE * 2 * VERIFY_BATCH_PAIRS, IBV_ACCESS_LOCAL_WRITE);
+    if (!pages_mr) {
+        fprintf(stderr, "[Server] ibv_reg_mr for verify pages failed.\n");
+        free(pages);
+        return -1;
+    }
+
+    total_pair_cnt = vt_desc->total_cnt;
+    total_sgl_entries = DIV_ROUND_UP(vt_desc->total_cnt * sizeof(struct ksm_event_log), PAGE_SIZE);
+    for (i = 0; i < vt_desc->desc_cnt && !ret; i++) {
+        this_sgl_size = i == (vt_desc->desc_cnt - 1) ? total_sgl_entries - i * MAX_PAGES_IN_SGL : MAX_PAGES_IN_SGL;
+
+        buf = malloc(PAGE_SIZE * this_sgl_size);
+        if (!buf) {
+            fprintf(stderr, "[Server] malloc for buf failed.\n");
+            ret = -1;
+            break;
+        }
+
+        buf_mr = ibv_reg_mr(cb->pd, buf, PAGE_SIZE * this_sgl_size, IBV_ACCESS_LOCAL_WRITE);
+        if (!buf_mr) {
+            fprintf(stderr, "[Server] ibv_reg_mr for buf failed.\n");
+            free(buf);
+            ret = -1;
+            break;
+        }
+
+        if (rdma_read_memory(cb, CQ_PHASE_ERROR_READ, buf_mr, vt_desc->entries[i].rkey, vt_desc->entries[i].base_addr,
+                             PAGE_SIZE * this_sgl_size, buf)) {
+            fprintf(stderr, "[Server] rdma_read_memory failed.\n");
+            ret = -1;
+        }
+
+        this_pair_cnt = MIN(total_pair_cnt, this_sgl_size * PAGE_SIZE / sizeof(struct ksm_event_log));
+        for (j = 0; j < this_pair_cnt && !ret; j += batch) {
+            struct ksm_event_log* pairs = (struct ksm_event_log*) buf + j;
+
+            batch = MIN(this_pair_cnt - j, VERIFY_BATCH_PAIRS);
+            ret = rdma_read_verify_pairs(cb, pages_mr, pairs, batch, pages);
+            if (ret) {
+                fprintf(stderr, "[Server] rdma_read_verify_pairs for verify pairs %d-%d failed.\n", j, j + batch - 1);
+                break;
+            }
+            for (k = 0; k < batch; k++) {
+                void *page = pages + 2 * k * PAGE_SIZE;
+
+                same = !memcmp(page, page + PAGE_SIZE, PAGE_SIZE);
+                diff_cnt += !same;
+                log_verify_pair(&cb->log_table, &pairs[k], same);
+            }
+        }
+        total_pair_cnt -= this_pair_cnt;
 
         ibv_dereg_mr(buf_mr);
         free(buf);
     }
-    return 0;
-}
 
-/*=================================================================================================================*/
+    ibv_dereg_mr(pages_mr);
+    free(pages);
+    return ret ? ret : diff_cnt;
+}
+
+/*=================================================================================================================*/
+
+static char* server_ip = SERVER_IP;
+static int server_port = SERVER_PORT;
+
+static void start_listening(struct rdma_server *server)
+{
+    DEBUG_LOG("Creating event channel...");
+    server->ec = rdma_create_event_channel();
+    if (!server->ec)
+        die("rdma_create_event_channel");
+
+    DEBUG_LOG("Creating listening ID...");
+    if (rdma_create_id(server->ec, &server->listen_id, NULL, RDMA_PS_TCP))
+        die("rdma_create_id");
+
+    // Bind to configured IP/port (hard-coded SERVER_IP/SERVER_PORT by default)
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(server_port);
+
+    if (inet_pton(AF_INET, server_ip, &addr.sin_addr) <= 0)
+        die("inet_pton - invalid IP address");
+
+    DEBUG_LOG("Binding address...");
+    if (rdma_bind_addr(server->listen_id, (struct sockaddr*)&addr))
+        die("rdma_bind_addr");
+
+    DEBUG_LOG("Listening...");
+    if (rdma_listen(server->listen_id, tenant_sched.max_tenants))
+        die("rdma_listen");
+
+    printf("[Server] Listening on %s:%d. (max tenants %d)\n", server_ip, server_port, tenant_sched.max_tenants);
+}
+
+static struct rdma_cb* alloc_tenant_cb(void)
+{
+    struct rdma_cb* cb = calloc(1, sizeof(struct rdma_cb));
+    if (!cb) {
+        fprintf(stderr, "[Server] calloc for tenant cb failed.\n");
+        return NULL;
+    }
+
+    read_shaper_init(&cb->shaper);
+
+    if (ksm_metadata_init(&cb->metadata, &cb->log_table)) {
+        cleanup_rdma_cb(cb);
+        free(cb);
+        return NULL;
+    }
+
+    if (tenant_sched_attach(cb) < 0) {
+        fprintf(stderr, "[Server] No free tenant slot (max %d).\n", tenant_sched.max_tenants);
+        cleanup_rdma_cb(cb);
+        free(cb);
+        return NULL;
+    }
+
+    if (start_page_worker(cb)) {
+        tenant_sched_detach(cb);
+        cleanup_rdma_cb(cb);
+        free(cb);
+        return NULL;
+    }
+
+    if (init_pre_hash_pair_table(&cb->metadata.pre_hash, &cb->metadata.stats)) {
+        stop_page_worker(cb);
+        tenant_sched_detach(cb);
+        cleanup_rdma_cb(cb);
+        free(cb);
+        return NULL;
+    }
+
+    return cb;
+}
+
+static void free_tenant_cb(struct rdma_cb* cb)
+{
+    stop_pre_hash_pair_table(&cb->metadata.pre_hash);
+    stop_page_worker(cb);
+    tenant_sched_detach(cb);
+    cleanup_rdma_cb(cb);
+    free(cb);
+}
+
+static void print_tenant_stats(struct rdma_cb* cb)
+{
+    printf("[Tenant] %d, weight, %d, iterations, %lu, scanned, %lu, merge_logs, %lu, quota_skipped, %lu, rmap_items, %d, rmap_quota, %lu, sched_wait_ms, %.2f, busy_ms, %.2f\n",
+        cb->tenant.id, cb->tenant.weight, cb->tenant.stats.iterations, cb->tenant.stats.scanned_pages,
+        cb->tenant.stats.merge_logs, cb->tenant.stats.quota_skipped,
+        cb->metadata.rmap_tree ? g_tree_nnodes(cb->metadata.rmap_tree) : 0, cb->metadata.max_rmap_items,
+        cb->tenant.stats.sched_wait_ns / 1000000.0, cb->tenant.stats.busy_ns / 1000000.0);
+}
+
+/*
+ * READs a QP may keep in flight. The request carries the host's responder
+ * resources as our initiator depth, take as many as our device can issue.
+ */
+static uint8_t read_initiator_depth(struct ibv_context *verbs, uint8_t offered)
+{
+    struct ibv_device_attr attr;
+
+    if (ibv_query_device(verbs, &attr) || attr.max_qp_init_rd_atom < 1) {
+        return 1;
+    }
+    if (offered > attr.max_qp_init_rd_atom) {
+        offered = attr.max_qp_init_rd_atom;
+    }
+    return offered ? offered : 1;
+}
+
+static void on_lane_connect_request(struct rdma_cm_id *child_id, const struct ksm_conn_private *priv,
+    uint8_t offered_depth)
+{
+    struct rdma_cb *cb = NULL;
+    struct rdma_lane *lane;
+    int i;
+
+    pthread_mutex_lock(&tenant_sched.lock);
+    for (i = 0; i < tenant_sched.max_tenants; i++) {
+        if (tenant_sched.tenants[i] && tenant_sched.tenants[i]->session == priv->session) {
+            cb = tenant_sched.tenants[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&tenant_sched.lock);
+
+    if (!cb || priv->lane >= MAX_LANES || cb->lanes[priv->lane].conn_id || child_id->verbs != cb->verbs) {
+        fprintf(stderr, "[Server] Rejecting lane %d of unknown session %x.\n", priv->lane, priv->session);
+        rdma_reject(child_id, NULL, 0);
+        rdma_destroy_id(child_id);
+        return;
+    }
+
+    lane = &cb->lanes[priv->lane];
+    lane->conn_id = child_id;
+    child_id->context = cb;
 
-static void start_listening(struct rdma_cb *cb)
-{
-    DEBUG_LOG("Creating event channel...");
-    cb->ec = rdma_create_event_channel();
-    if (!cb->ec)
-        die("rdma_create_event_channel");
+    lane->comp_chan = ibv_create_comp_channel(child_id->verbs);
+    if (!lane->comp_chan) {
+        perror("ibv_create_comp_channel");
+        goto err;
+    }
 
-    DEBUG_LOG("Creating listening ID...");
-    if (rdma_create_id(cb->ec, &cb->listen_id, NULL, RDMA_PS_TCP))
-        die("rdma_create_id");
+    lane->cq = ibv_create_cq(cb->verbs, MAX_SEND_WR, NULL, lane->comp_chan, 0);
+    if (!lane->cq) {
+        fprintf(stderr, "[Server] ibv_create_cq for lane failed.\n");
+        goto err;
+    }
 
-    // Bind to hard-coded IP/port
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port   = htons(SERVER_PORT);
+    // Lanes only carry our READs, but share the tenant PD so the host rkeys and our MRs stay valid
+    struct ibv_qp_init_attr qp_init_attr = {
+        .send_cq = lane->cq,
+        .recv_cq = lane->cq,
+        .cap     = {
+            .max_send_wr  = MAX_SEND_WR,
+            .max_recv_wr  = 1,
+            .max_send_sge = MAX_SGE,
+            .max_recv_sge = 1,
+        },
+        .qp_type = IBV_QPT_RC
+    };
 
-    if (inet_pton(AF_INET, SERVER_IP, &addr.sin_addr) <= 0)
-        die("inet_pton - invalid IP address");
+    if (rdma_create_qp(child_id, cb->pd, &qp_init_attr)) {
+        fprintf(stderr, "[Server] rdma_create_qp for lane failed.\n");
+        goto err;
+    }
+    lane->qp = child_id->qp;
 
-    DEBUG_LOG("Binding address...");
-    if (rdma_bind_addr(cb->listen_id, (struct sockaddr*)&addr))
-        die("rdma_bind_addr");
+    struct rdma_conn_param conn_param;
+    memset(&conn_param, 0, sizeof(conn_param));
+    conn_param.responder_resources = 1;
+    conn_param.initiator_depth     = read_initiator_depth(child_id->verbs, offered_depth);
+    conn_param.rnr_retry_count     = 7;
 
-    DEBUG_LOG("Listening...");
-    if (rdma_listen(cb->listen_id, 1))
-        die("rdma_listen");
+    if (rdma_accept(child_id, &conn_param)) {
+        fprintf(stderr, "[Server] rdma_accept for lane failed.\n");
+        goto err;
+    }
 
-    printf("[Server] Listening on %s:%d.\n", SERVER_IP, SERVER_PORT);
+    printf("[Server] Lane %d/%d accepted for tenant %d.\n", priv->lane, priv->nr_lanes, cb->tenant.id);
+    return;
+
+err:
+    rdma_reject(child_id, NULL, 0);
+    cleanup_rdma_lane(lane);
 }
 
-static void on_connect_request(struct rdma_cb *cb, struct rdma_cm_id *child_id)
+static void on_connect_request(struct rdma_cm_id *child_id, const struct ksm_conn_private *priv,
+    uint8_t offered_depth)
 {
+    struct rdma_cb *cb;
+
+    if (priv && priv->lane > 0) {
+        on_lane_connect_request(child_id, priv, offered_depth);
+        return;
+    }
+
     printf("[Server] Got CONNECT_REQUEST.\n");
 
+    cb = alloc_tenant_cb();
+    if (!cb) {
+        rdma_reject(child_id, NULL, 0);
+        rdma_destroy_id(child_id);
+        return;
+    }
+
+    cb->conn_id = child_id;
+    child_id->context = cb;
     cb->verbs = child_id->verbs;
     cb->pd = ibv_alloc_pd(cb->verbs);
     if (!cb->pd) {
@@ -1118,6 +1481,18 @@ static void on_connect_request(struct rdma_cb *cb, struct rdma_cm_id *child_id)
         goto err;
     }
 
+    cb->recv_comp_chan = ibv_create_comp_channel(child_id->verbs);
+    if (!cb->recv_comp_chan) {
+        perror("ibv_create_comp_channel");
+        goto err;
+    }
+
+    cb->recv_cq = ibv_create_cq(cb->verbs, MAX_RECV_WR, NULL, cb->recv_comp_chan, 0);
+    if (!cb->recv_cq) {
+        fprintf(stderr, "[Server] ibv_create_cq for receives failed.\n");
+        goto err;
+    }
+
     // if (ibv_req_notify_cq(cb->cq, 0)) {
     //     fprintf(stderr, "[Server] ibv_req_notify_cq failed.\n");
     //     goto err;
@@ -1126,7 +1501,7 @@ static void on_connect_request(struct rdma_cb *cb, struct rdma_cm_id *child_id)
     // Create QP
     struct ibv_qp_init_attr qp_init_attr = {
         .send_cq = cb->cq,
-        .recv_cq = cb->cq,
+        .recv_cq = cb->recv_cq,
         .cap     = {
             .max_send_wr  = MAX_SEND_WR,
             .max_recv_wr  = MAX_RECV_WR,
@@ -1145,6 +1520,12 @@ static void on_connect_request(struct rdma_cb *cb, struct rdma_cm_id *child_id)
     cb->conn_id = child_id;
     cb->qp      = child_id->qp;
 
+    cb->session = priv ? priv->session : 0;
+    cb->lanes[0].conn_id   = child_id;
+    cb->lanes[0].qp        = cb->qp;
+    cb->lanes[0].cq        = cb->cq;
+    cb->lanes[0].comp_chan = cb->comp_chan;
+
     cb->md_desc_mr = ibv_reg_mr(cb->pd, &cb->md_desc_rx, sizeof(cb->md_desc_rx),
                                  IBV_ACCESS_LOCAL_WRITE);
     if (!cb->md_desc_mr) {
@@ -1168,7 +1549,7 @@ static void on_connect_request(struct rdma_cb *cb, struct rdma_cm_id *child_id)
 
     cb->single_op_result_mr = ibv_reg_mr(cb->pd, &cb->single_op_result_tx, sizeof(cb->single_op_result_tx),
                                 IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE);
-    if (!cb->ksm_result_mr) {
+    if (!cb->single_op_result_mr) {
         fprintf(stderr, "[Server] ibv_reg_mr for op_result failed.\n");
         goto err;
     }
@@ -1178,18 +1559,20 @@ static void on_connect_request(struct rdma_cb *cb, struct rdma_cm_id *child_id)
     struct ibv_recv_wr recv_wr, *bad_wr = NULL;
     switch (ksm_offload_mode) {
         case SINGLE_OPERATION_OFFLOAD:
-            sge.addr   = (uintptr_t)&cb->single_op_desc_rx;
-            sge.length = sizeof(cb->single_op_desc_rx);
-            sge.lkey   = cb->single_op_desc_mr->lkey;
-        
-            memset(&recv_wr, 0, sizeof(recv_wr));
-            recv_wr.wr_id   = WR_RECV_SINGLE_OP;
-            recv_wr.sg_list = &sge;
-            recv_wr.num_sge = 1;
-        
-            if (ibv_post_recv(cb->qp, &recv_wr, &bad_wr)) {
-                fprintf(stderr, "[Server] ibv_post_recv failed.\n");
-                goto err;
+            for (int i = 0; i < STYX_RX_DEPTH; i++) {
+                sge.addr   = (uintptr_t)&cb->single_op_desc_rx[i];
+                sge.length = sizeof(cb->single_op_desc_rx[i]);
+                sge.lkey   = cb->single_op_desc_mr->lkey;
+            
+                memset(&recv_wr, 0, sizeof(recv_wr));
+                recv_wr.wr_id   = WR_RECV_SINGLE_OP;
+                recv_wr.sg_list = &sge;
+                recv_wr.num_sge = 1;
+            
+                if (ibv_post_recv(cb->qp, &recv_wr, &bad_wr)) {
+                    fprintf(stderr, "[Server] ibv_post_recv failed.\n");
+                    goto err;
+                }
             }
 
             break;
@@ -1211,14 +1594,14 @@ static void on_connect_request(struct rdma_cb *cb, struct rdma_cm_id *child_id)
             break;
         default:
             fprintf(stderr, "[Server] Invalid server operation mode.\n");
-            break;
+            goto err;
     }
 
     // Accept
     struct rdma_conn_param conn_param;
     memset(&conn_param, 0, sizeof(conn_param));
     conn_param.responder_resources = 1;
-    conn_param.initiator_depth     = 1;
+    conn_param.initiator_depth     = read_initiator_depth(child_id->verbs, offered_depth);
     conn_param.rnr_retry_count     = 7;
 
     DEBUG_LOG("Accepting connection...");
@@ -1227,28 +1610,87 @@ static void on_connect_request(struct rdma_cb *cb, struct rdma_cm_id *child_id)
         goto err;
     }
 
-    printf("[Server] Connection accepted.\n");
+    printf("[Server] Connection accepted for tenant %d (weight %d).\n", cb->tenant.id, cb->tenant.weight);
     return;
 
 err:
-    cleanup_rdma_cb(cb);
+    rdma_reject(child_id, NULL, 0);
+    free_tenant_cb(cb);
 }
 
-static void on_established(struct rdma_cb *cb)
+// Expose the log table to the host and fill the result descriptor for it
+static struct ibv_mr* reg_result_table(struct rdma_cb *cb)
+{
+    struct ibv_mr *result_mr;
+
+    result_mr = ibv_reg_mr(cb->pd, cb->log_table.entries, 
+        sizeof(struct ksm_event_log) * cb->log_table.capacity, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+    if (!result_mr) {
+        fprintf(stderr, "[Server] ibv_reg_mr for result failed. size: %ld, error: %d(%s)\n", sizeof(struct ksm_event_log) * cb->log_table.cnt, errno, strerror(errno));
+        return NULL;
+    }
+    cb->result_desc_tx.rkey = result_mr->rkey;
+    cb->result_desc_tx.log_cnt = cb->log_table.cnt;
+    cb->result_desc_tx.result_table_addr = (uintptr_t)cb->log_table.entries;
+    return result_mr;
+}
+
+// Send the result descriptor and post the receive for the next metadata
+static int send_result(struct rdma_cb *cb)
 {
-    int err;
     struct ibv_sge sge_tx, sge_rx;
     struct ibv_recv_wr recv_wr, *bad_wr_recv = NULL;
     struct ibv_send_wr send_wr, *bad_wr_send = NULL;
 
+    // Send back the result
+    sge_tx.addr   = (uintptr_t)&cb->result_desc_tx;
+    sge_tx.length = sizeof(cb->result_desc_tx);
+    sge_tx.lkey   = cb->ksm_result_mr->lkey;
+    
+    memset(&send_wr, 0, sizeof(send_wr));
+    send_wr.wr_id   = WR_SEND_RESULT;
+    send_wr.sg_list = &sge_tx;
+    send_wr.opcode = IBV_WR_SEND;
+    send_wr.send_flags = IBV_SEND_SIGNALED;
+    send_wr.num_sge = 1;
+
+    if (ibv_post_send(cb->qp, &send_wr, &bad_wr_send)) {
+        fprintf(stderr, "[Server] ibv_post_send failed.\n");
+        return -1;
+    }
+
+    if (wait_cq_event_and_poll(cb, CQ_PHASE_RESULT_SEND, "[SERVER Result SEND]")) {
+        fprintf(stderr, "[Server] wait_cq_event_and_poll failed.\n");
+        return -1;
+    }
+
+    // Wait for receiving next metadata
+    sge_rx.addr   = (uintptr_t)&cb->md_desc_rx;
+    sge_rx.length = sizeof(cb->md_desc_rx);
+    sge_rx.lkey   = cb->md_desc_mr->lkey;
+    memset(&recv_wr, 0, sizeof(recv_wr));
+    recv_wr.wr_id   = WR_RECV_METADATA;
+    recv_wr.sg_list = &sge_rx;
+    recv_wr.num_sge = 1;
+
+    if (ibv_post_recv(cb->qp, &recv_wr, &bad_wr_recv)) {
+        fprintf(stderr, "[Server] ibv_post_recv failed.\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void on_established(struct rdma_cb *cb)
+{
+    int err;
+
     struct ibv_mr *result_mr = NULL;
 
-    printf("[Server] Connection ESTABLISHED.\n");
+    printf("[Server] Connection ESTABLISHED for tenant %d.\n", cb->tenant.id);
 
     cb->metadata.rdma_buf.temp_buf = malloc(PAGE_SIZE);
     if (!cb->metadata.rdma_buf.temp_buf) {
         fprintf(stderr, "[Server] malloc for temp buf failed.\n");
-        cleanup_rdma_cb(cb);
         return;
     }
 
@@ -1256,21 +1698,29 @@ static void on_established(struct rdma_cb *cb)
                                           IBV_ACCESS_LOCAL_WRITE);
     if (!cb->metadata.rdma_buf.temp_buf_mr) {
         fprintf(stderr, "[Server] ibv_reg_mr for temp buf failed.\n");
-        cleanup_rdma_cb(cb);
         return;
     }
 
     cb->metadata.rdma_buf.cb = cb;
 
+    if (record_prefix) {
+        char path[PATH_MAX];
+
+        snprintf(path, sizeof(path), "%s.%d.trace", record_prefix, cb->tenant.id);
+        cb->trace = bask_trace_create(path, record_full_pages ? BASK_TRACE_FULL_PAGES : 0);
+        if (cb->trace) {
+            printf("[Server] Recording tenant %d to %s\n", cb->tenant.id, path);
+        }
+    }
+
     printf("[Server] Intialization Done...\n");
 
     for (;;) {
         printf("[Server] Waiting for metadata...\n");
 
         // Receive metadata to operate on
-        if (wait_cq_event_and_poll(cb, "[SERVER Metadata RECV]")) {
+        if (wait_recv_cq_event_and_poll(cb, CQ_PHASE_METADATA_RECV, "[SERVER Metadata RECV]")) {
             fprintf(stderr, "[Server] wait_cq_event_and_poll failed.\n");
-            cleanup_rdma_cb(cb);
             return;
         }
         START_TIMER(total_snic_timer);
@@ -1291,12 +1741,52 @@ static void on_established(struct rdma_cb *cb)
             clear_log_table(&cb->log_table);
         }
 
+        // A verify round of the host's commit, not an iteration
+        if (cb->md_desc_rx.vt_descs.total_cnt) {
+            uint64_t pcie_start = read_pcie_in_bytes();
+            uint64_t rdma_read_start = cb->rdma_read_bytes;
+
+            err = do_verify_pairs(cb, &cb->md_desc_rx.vt_descs);
+            if (err < 0) {
+                fprintf(stderr, "[Server] do_verify_pairs failed.\n");
+                return;
+            }
+            printf("[Server] Verified %d pairs, %d differ\n", cb->md_desc_rx.vt_descs.total_cnt, err);
+
+            result_mr = reg_result_table(cb);
+            if (!result_mr) {
+                return;
+            }
+            // The host's advisor adds this round's reads to the iteration's
+            cb->result_desc_tx.pcie_read_bytes = pcie_counter_dir[0] ?
+                read_pcie_in_bytes() - pcie_start : cb->rdma_read_bytes - rdma_read_start;
+            if (send_result(cb)) {
+                return;
+            }
+            continue;
+        }
+
+        if (cb->md_desc_rx.read_rate_mbps == READ_RATE_UNSHAPED) {
+            read_shaper_set_rate(&cb->shaper, 0);
+        } else if (cb->md_desc_rx.read_rate_mbps) {
+            read_shaper_set_rate(&cb->shaper, cb->md_desc_rx.read_rate_mbps);
+        }
+        // Only hosts that know DPU_HOT_REGION ask for it
+        cb->metadata.hot_region_pct = cb->md_desc_rx.hot_region_pct;
+        cb->metadata.dirty_tracking = cb->md_desc_rx.dirty_tracking;
+
+        uint64_t pcie_start = read_pcie_in_bytes();
+        uint64_t rdma_read_start = cb->rdma_read_bytes;
+
+        if (cb->trace) {
+            bask_trace_write(cb->trace, BASK_TRACE_ITER_START, -1, cb->metadata.iteration, 0, NULL, 0);
+        }
+
         START_TIMER(revert_timer);
         // Apply error logs from host
         err = do_handle_error(cb, &cb->md_desc_rx.et_descs);
         if (err) {
             fprintf(stderr, "[Server] do_handle_error failed.\n");
-            cleanup_rdma_cb(cb);
             return;
         }
         END_TIMER(revert_timer);
@@ -1305,79 +1795,150 @@ static void on_established(struct rdma_cb *cb)
         cb->result_desc_tx.total_scanned_cnt = do_ksm_v3(cb, &cb->md_desc_rx); //rand() % 100;
         if (cb->result_desc_tx.total_scanned_cnt < 0) {
             fprintf(stderr, "[Server] do_ksm failed.\n");
-            cleanup_rdma_cb(cb);
             return;
         }
+        if (cb->trace) {
+            bask_trace_write(cb->trace, BASK_TRACE_ITER_END, -1, cb->result_desc_tx.total_scanned_cnt, 0, NULL, 0);
+            fflush(cb->trace->file);
+        }
         END_TIMER(total_snic_timer);
         print_bask_timer();
         
-        result_mr = ibv_reg_mr(cb->pd, cb->log_table.entries, 
-            sizeof(struct ksm_event_log) * cb->log_table.capacity, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+        result_mr = reg_result_table(cb);
         if (!result_mr) {
-            fprintf(stderr, "[Server] ibv_reg_mr for result failed. size: %ld, error: %d(%s)\n", sizeof(struct ksm_event_log) * cb->log_table.cnt, errno, strerror(errno));
-            cleanup_rdma_cb(cb);
             return;
         }
-        cb->result_desc_tx.rkey = result_mr->rkey;
-        cb->result_desc_tx.log_cnt = cb->log_table.cnt;
-        cb->result_desc_tx.result_table_addr = (uintptr_t)cb->log_table.entries;
-
-        printf("Pre hash effect: hit ,%lu, miss ,%lu\n", hit_count, miss_count);
-        printf("[Server][%d] KSM scanned %d pages and merged %d. Also %d rmap_itmes and skipped %ld items\n", iteration, 
-            cb->result_desc_tx.total_scanned_cnt, cb->result_desc_tx.log_cnt, g_tree_nnodes(cb->metadata.rmap_tree), skipped_cnt);
-        
-        printf("[Log] %d, %d, %ld, %ld, %ld, %ld, %ld\n", iteration, cb->result_desc_tx.total_scanned_cnt, skipped_cnt, volatile_items_cnt, highly_volatile_but_stable_merged_cnt, highly_volatile_but_unstable_merged_cnt, broken_merges);
+        // Feeds the host's offload advisor; bfperf counts all PCIe traffic into the NIC, not only this tenant's
+        cb->result_desc_tx.pcie_read_bytes = pcie_counter_dir[0] ?
+            read_pcie_in_bytes() - pcie_start : cb->rdma_read_bytes - rdma_read_start;
+
+        struct ksm_iter_stats* stats = &cb->metadata.stats;
+        printf("Pre hash effect: hit ,%lu, miss ,%lu\n", stats->pre_hash_hit_cnt, stats->pre_hash_miss_cnt);
+        if (cb->metadata.dirty_tracking) {
+            printf("[Server] Unchanged pages: %lu from old hash, %lu deferred\n", stats->unchanged_cnt, stats->unchanged_deferred_cnt);
+        }
+        printf("[Server][%d] KSM scanned %d pages and merged %d. Also %d rmap_itmes and skipped %ld items\n", cb->metadata.iteration, 
+            cb->result_desc_tx.total_scanned_cnt, cb->result_desc_tx.log_cnt, g_tree_nnodes(cb->metadata.rmap_tree), stats->skipped_cnt);
         
-        hit_count = 0;
-        miss_count = 0;
+        printf("[Log] %d, %d, %ld, %ld, %ld, %ld, %ld\n", cb->metadata.iteration, cb->result_desc_tx.total_scanned_cnt, stats->skipped_cnt, stats->volatile_items_cnt, stats->highly_volatile_but_stable_merged_cnt, stats->highly_volatile_but_unstable_merged_cnt, stats->broken_merges);
 
-        skipped_cnt = 0;
-        volatile_items_cnt = 0;
-        highly_volatile_but_stable_merged_cnt = 0;
-        highly_volatile_but_unstable_merged_cnt = 0;
-        broken_merges = 0;
+        cb->tenant.stats.iterations += 1;
+        cb->tenant.stats.scanned_pages += cb->result_desc_tx.total_scanned_cnt;
+        cb->tenant.stats.merge_logs += cb->result_desc_tx.log_cnt;
+        cb->tenant.stats.quota_skipped += stats->quota_skipped_cnt;
+        print_tenant_stats(cb);
+        print_and_reset_cq_wait_stats(cb);
+        print_and_reset_read_shaper(cb);
 
-        // Send back the result
-        sge_tx.addr   = (uintptr_t)&cb->result_desc_tx;
-        sge_tx.length = sizeof(cb->result_desc_tx);
-        sge_tx.lkey   = cb->ksm_result_mr->lkey;
-        
-        memset(&send_wr, 0, sizeof(send_wr));
-        send_wr.wr_id   = WR_SEND_RESULT;
-        send_wr.sg_list = &sge_tx;
-        send_wr.opcode = IBV_WR_SEND;
-        send_wr.send_flags = IBV_SEND_SIGNALED;
-        send_wr.num_sge = 1;
+        memset(stats, 0, sizeof(*stats));
 
-        if (ibv_post_send(cb->qp, &send_wr, &bad_wr_send)) {
-            fprintf(stderr, "[Server] ibv_post_send failed.\n");
-            cleanup_rdma_cb(cb);
+        if (send_result(cb)) {
             return;
         }
 
-        if (wait_cq_event_and_poll(cb, "[SERVER Result SEND]")) {
-            fprintf(stderr, "[Server] wait_cq_event_and_poll failed.\n");
-            cleanup_rdma_cb(cb);
-            return;
-        }
+        cb->metadata.iteration += 1;
+    }
+}
 
-        // Wait for receiving next metadata
-        sge_rx.addr   = (uintptr_t)&cb->md_desc_rx;
-        sge_rx.length = sizeof(cb->md_desc_rx);
-        sge_rx.lkey   = cb->md_desc_mr->lkey;
-        memset(&recv_wr, 0, sizeof(recv_wr));
-        recv_wr.wr_id   = WR_RECV_METADATA;
-        recv_wr.sg_list = &sge_rx;
-        recv_wr.num_sge = 1;
+/*
+ * Dataplane batches: the pages of a batch arrive in one read, then the ops
+ * are split into slices and run on a shared pool next to the tenant thread.
+ */
+static int batch_workers = 1;
+static GThreadPool* batch_op_pool = NULL;
+
+struct batch_done {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int remaining;
+};
 
-        if (ibv_post_recv(cb->qp, &recv_wr, &bad_wr_recv)) {
-            fprintf(stderr, "[Server] ibv_post_recv failed.\n");
-            cleanup_rdma_cb(cb);
-            return;
+struct batch_slice {
+    struct batch_operation_descriptor* desc;
+    struct batch_operation_result* result;
+    char* pages;
+    int start, end;
+    struct batch_done* done;
+};
+
+static void run_batch_ops(struct batch_operation_descriptor* desc, char* pages,
+    struct batch_operation_result* result, int start, int end)
+{
+    for (int i = start; i < end; i++) {
+        struct batch_op* op = &desc->ops[i];
+
+        if (op->page_idx[0] < 0 || op->page_idx[0] >= desc->page_num ||
+            (op->cmd == PAGE_COMPARE && (op->page_idx[1] < 0 || op->page_idx[1] >= desc->page_num))) {
+            ERR_LOG_AND_STOP("[BATCH] Invalid page index in op %d\n", i);
         }
 
-        iteration += 1;
+        switch (op->cmd) {
+            case PAGE_COMPARE:
+                result->results[i].value = memcmp(pages + op->page_idx[0] * PAGE_SIZE,
+                    pages + op->page_idx[1] * PAGE_SIZE, PAGE_SIZE);
+                break;
+            case PAGE_HASH:
+                result->results[i].xxhash = XXH64(pages + op->page_idx[0] * PAGE_SIZE, PAGE_SIZE, 0);
+                break;
+            default:
+                ERR_LOG_AND_STOP("[BATCH] Invalid operation cmd %d\n", op->cmd);
+                break;
+        }
+    }
+}
+
+static void batch_slice_worker(gpointer data, gpointer user_data)
+{
+    struct batch_slice* slice = (struct batch_slice*)data;
+
+    run_batch_ops(slice->desc, slice->pages, slice->result, slice->start, slice->end);
+
+    pthread_mutex_lock(&slice->done->lock);
+    if (--slice->done->remaining == 0) {
+        pthread_cond_signal(&slice->done->cond);
+    }
+    pthread_mutex_unlock(&slice->done->lock);
+}
+
+static void execute_batch_ops(struct batch_operation_descriptor* desc, char* pages,
+    struct batch_operation_result* result)
+{
+    struct batch_slice slices[MAX_BATCH_OPS];
+    struct batch_done done;
+    int nr_slices = MIN(batch_workers, desc->op_cnt);
+    int per_slice, i;
+
+    if (nr_slices <= 1 || !batch_op_pool) {
+        run_batch_ops(desc, pages, result, 0, desc->op_cnt);
+        return;
+    }
+
+    per_slice = DIV_ROUND_UP(desc->op_cnt, nr_slices);
+    nr_slices = DIV_ROUND_UP(desc->op_cnt, per_slice);
+
+    pthread_mutex_init(&done.lock, NULL);
+    pthread_cond_init(&done.cond, NULL);
+    done.remaining = nr_slices - 1;
+
+    // Slice 0 runs on the tenant thread
+    for (i = 1; i < nr_slices; i++) {
+        slices[i] = (struct batch_slice) {
+            .desc = desc, .result = result, .pages = pages,
+            .start = i * per_slice, .end = MIN((i + 1) * per_slice, desc->op_cnt),
+            .done = &done,
+        };
+        g_thread_pool_push(batch_op_pool, &slices[i], NULL);
+    }
+    run_batch_ops(desc, pages, result, 0, per_slice);
+
+    pthread_mutex_lock(&done.lock);
+    while (done.remaining > 0) {
+        pthread_cond_wait(&done.cond, &done.lock);
     }
+    pthread_mutex_unlock(&done.lock);
+
+    pthread_cond_destroy(&done.cond);
+    pthread_mutex_destroy(&done.lock);
 }
 
 static void on_established_ops_offload_mode(struct rdma_cb *cb)
@@ -1387,8 +1948,9 @@ static void on_established_ops_offload_mode(struct rdma_cb *cb)
     struct ibv_recv_wr recv_wr, *bad_wr_recv = NULL;
     struct ibv_send_wr send_wr, *bad_wr_send = NULL;
     uint64_t result;
+    int rx_idx = 0;
 
-    printf("[Server] Connection ESTABLISHED.\n");
+    printf("[Server] Connection ESTABLISHED for tenant %d.\n", cb->tenant.id);
 
     void* memcmp_buf = malloc(PAGE_SIZE * 2);
     if (!memcmp_buf) {
@@ -1414,18 +1976,36 @@ static void on_established_ops_offload_mode(struct rdma_cb *cb)
         return;
     }
 
+    void* batch_buf = malloc(PAGE_SIZE * MAX_BATCH_OPS * 2);
+    if (!batch_buf) {
+        fprintf(stderr, "[Server] malloc for batch buf failed.\n");
+        return;
+    }
+
+    struct ibv_mr *batch_mr = ibv_reg_mr(cb->pd, batch_buf, PAGE_SIZE * MAX_BATCH_OPS * 2, IBV_ACCESS_LOCAL_WRITE);
+    if (!batch_mr) {
+        fprintf(stderr, "[Server] ibv_reg_mr failed for batch_mr");
+        return;
+    }
+
     printf("[Server] Intialization Done...\n");
 
     for (;;) {
         DEBUG_LOG("[Server] Waiting for operation request...\n");
 
         // Receive metadata to operate on
-        if (wait_cq_event_and_poll(cb, "[SERVER Single operation RECV]")) {
+        // Requests complete in the order their buffers were posted
+        struct batch_operation_descriptor *desc = &cb->single_op_desc_rx[rx_idx];
+        if (wait_recv_cq_event_and_poll(cb, CQ_PHASE_SINGLE_OP, "[SERVER Single operation RECV]")) {
             fprintf(stderr, "[Server] wait_cq_event_and_poll failed.\n");
-            cleanup_rdma_cb(cb);
             return;
         }
 
+        if (cb->metadata.iteration > 0 && cb->metadata.iteration % 100000 == 0) {
+            print_and_reset_cq_wait_stats(cb);
+            print_and_reset_read_shaper(cb);
+        }
+
         // if (iteration % 100000 == 0) {
         //     PRINT_AND_RESET_TIMER(read_4k_timer, "[Server] 4K Read time");
         //     PRINT_AND_RESET_TIMER(read_8k_timer, "[Server] 8K Read time");
@@ -1435,14 +2015,14 @@ static void on_established_ops_offload_mode(struct rdma_cb *cb)
         // }
 START_TIMER(total_timer);
         DEBUG_LOG("[Server] Operation request received: CMD: %d, ID: %d\n", 
-            cb->single_op_desc_rx.cmd, cb->single_op_desc_rx.id);
+            desc->cmd, desc->id);
         memset(&cb->single_op_result_tx, 0, sizeof(cb->single_op_result_tx));
 
-        uint64_t rkey = cb->single_op_desc_rx.rkey;
-        uint64_t iova = cb->single_op_desc_rx.iova;
-        uint64_t page_num = cb->single_op_desc_rx.page_num;
+        uint64_t iova = desc->iova;
+        uint64_t page_num = desc->page_num;
+        uint32_t result_len = sizeof(struct operation_result);
 
-        switch (cb->single_op_desc_rx.cmd) {
+        switch (desc->cmd) {
             case PAGE_COMPARE:
                 if (page_num != 2) {
                     ERR_LOG_AND_STOP("[SINGLE] Invalid page cnt\n");
@@ -1450,16 +2030,16 @@ START_TIMER(total_timer);
                 memset(memcmp_buf, 0, PAGE_SIZE * 2);
                 
             //START_TIMER(read_8k_timer);
-                if (rdma_read_memory(cb, memcmp_mr, rkey, iova, PAGE_SIZE * 2, memcmp_buf)) {
-                    ERR_LOG_AND_STOP("[Server][%d] rdma failed for dma addr %llx\n", iteration, iova);
+                if (rdma_read_desc_pages(cb, CQ_PHASE_SINGLE_OP, memcmp_mr, desc, memcmp_buf)) {
+                    ERR_LOG_AND_STOP("[Server][%d] rdma failed for dma addr %llx\n", cb->metadata.iteration, iova);
                 }
             //END_TIMER(read_8k_timer);
 
             //START_TIMER(memcmp_timer);
-                cb->single_op_result_tx.value = memcmp(&memcmp_buf[0], &memcmp_buf[PAGE_SIZE], PAGE_SIZE);
+                cb->single_op_result_tx.results[0].value = memcmp(&memcmp_buf[0], &memcmp_buf[PAGE_SIZE], PAGE_SIZE);
             //END_TIMER(memcmp_timer);
 
-                DEBUG_LOG("[SINGLE] Memcmp result: %d\n", cb->single_op_result_tx.value);
+                DEBUG_LOG("[SINGLE] Memcmp result: %d\n", cb->single_op_result_tx.results[0].value);
                 break;
             case PAGE_HASH:
                 if (page_num != 1) {
@@ -1468,28 +2048,42 @@ START_TIMER(total_timer);
                 memset(hash_buf, 0, PAGE_SIZE);
 
             //START_TIMER(read_4k_timer);
-                if (rdma_read_page(cb, hash_mr, rkey, iova, hash_buf)) {
-                    ERR_LOG_AND_STOP("[Server][%d] rdma failed for dma addr %llx\n", iteration, iova);
+                if (rdma_read_desc_pages(cb, CQ_PHASE_PAGE_READ, hash_mr, desc, hash_buf)) {
+                    ERR_LOG_AND_STOP("[Server][%d] rdma failed for dma addr %llx\n", cb->metadata.iteration, iova);
                 }
             //END_TIMER(read_4k_timer);
 
             //START_TIMER(hash_timer);
-                cb->single_op_result_tx.xxhash = XXH64(hash_buf, PAGE_SIZE, 0);
+                cb->single_op_result_tx.results[0].xxhash = XXH64(hash_buf, PAGE_SIZE, 0);
             //END_TIMER(hash_timer);
 
-                DEBUG_LOG("[SINGLE] Hash result: %llx\n", cb->single_op_result_tx.xxhash);
+                DEBUG_LOG("[SINGLE] Hash result: %llx\n", cb->single_op_result_tx.results[0].xxhash);
+                break;
+            case PAGE_BATCH:
+                if (desc->op_cnt <= 0 || desc->op_cnt > MAX_BATCH_OPS ||
+                    page_num == 0 || page_num > MAX_BATCH_OPS * 2) {
+                    ERR_LOG_AND_STOP("[BATCH] Invalid batch, %d ops, %llu pages\n", desc->op_cnt, page_num);
+                }
+
+                if (rdma_read_desc_pages(cb, CQ_PHASE_SINGLE_OP, batch_mr, desc, batch_buf)) {
+                    ERR_LOG_AND_STOP("[Server][%d] rdma failed for dma addr %llx\n", cb->metadata.iteration, iova);
+                }
+
+                execute_batch_ops(desc, batch_buf, &cb->single_op_result_tx);
+                result_len = offsetof(struct batch_operation_result, results) +
+                    desc->op_cnt * sizeof(union operation_value);
                 break;
             default:
                 ERR_LOG_AND_STOP("[SINGLE] Invalid operation cmd\n");
                 break;
         }
 END_TIMER(total_timer);
-        cb->single_op_result_tx.cmd = cb->single_op_desc_rx.cmd;
-        cb->single_op_result_tx.id = cb->single_op_desc_rx.id;
+        cb->single_op_result_tx.cmd = desc->cmd;
+        cb->single_op_result_tx.id = desc->id;
 
         // Send back the result
         sge_tx.addr   = (uintptr_t)&cb->single_op_result_tx;
-        sge_tx.length = sizeof(cb->single_op_result_tx);
+        sge_tx.length = result_len;
         sge_tx.lkey   = cb->single_op_result_mr->lkey;
         
         memset(&send_wr, 0, sizeof(send_wr));
@@ -1501,19 +2095,18 @@ END_TIMER(total_timer);
 
         if (ibv_post_send(cb->qp, &send_wr, &bad_wr_send)) {
             fprintf(stderr, "[Server] ibv_post_send failed.\n");
-            cleanup_rdma_cb(cb);
             return;
         }
 
-        if (wait_cq_event_and_poll(cb, "[SERVER Result SEND]")) {
+        if (wait_cq_event_and_poll(cb, CQ_PHASE_RESULT_SEND, "[SERVER Result SEND]")) {
             fprintf(stderr, "[Server] wait_cq_event_and_poll failed.\n");
-            cleanup_rdma_cb(cb);
             return;
         }
 
-        // Wait for receiving next metadata
-        sge_rx.addr   = (uintptr_t)&cb->single_op_desc_rx;
-        sge_rx.length = sizeof(cb->single_op_desc_rx);
+        // Wait for receiving next metadata, single ops do not overwrite the batch fields
+        memset(desc, 0, sizeof(*desc));
+        sge_rx.addr   = (uintptr_t)desc;
+        sge_rx.length = sizeof(*desc);
         sge_rx.lkey   = cb->single_op_desc_mr->lkey;
         memset(&recv_wr, 0, sizeof(recv_wr));
         recv_wr.wr_id   = WR_RECV_SINGLE_OP;
@@ -1522,54 +2115,179 @@ END_TIMER(total_timer);
 
         if (ibv_post_recv(cb->qp, &recv_wr, &bad_wr_recv)) {
             fprintf(stderr, "[Server] ibv_post_recv failed.\n");
-            cleanup_rdma_cb(cb);
             return;
         }
+        rx_idx = (rx_idx + 1) % STYX_RX_DEPTH;
+
+        cb->metadata.iteration += 1;
+    }
+}
+
+
+static void* tenant_thread(void* arg)
+{
+    struct rdma_cb *cb = (struct rdma_cb *)arg;
+
+    if (ksm_offload_mode == SINGLE_OPERATION_OFFLOAD) {
+        on_established_ops_offload_mode(cb);
+    } else {
+        on_established(cb);
+    }
+
+    // Failed on our side: let the host (and our event loop) see the disconnect
+    if (!atomic_load(&cb->stopping)) {
+        rdma_disconnect(cb->conn_id);
+    }
 
-        iteration += 1;
+    // Last touch of cb, the event loop may free it from here on
+    atomic_store(&cb->tenant.exited, 1);
+    return NULL;
+}
+
+static void on_tenant_established(struct rdma_cb *cb)
+{
+    atomic_store(&cb->lanes[0].ready, 1);
+    if (pthread_create(&cb->tenant.thread, NULL, tenant_thread, cb)) {
+        fprintf(stderr, "[Server] pthread_create for tenant %d failed.\n", cb->tenant.id);
+        rdma_disconnect(cb->conn_id);
+        return;
     }
+    cb->tenant.thread_started = 1;
 }
 
+// Disconnected tenants whose thread may still be finishing an iteration
+static struct rdma_cb *reap_list;
 
+/*
+ * Joining a tenant thread right on its DISCONNECTED event would hold up the CM
+ * events of every other tenant until it finishes its iteration. It goes on the
+ * reap list instead, and the event loop frees it once the thread has returned.
+ */
 static void on_disconnect(struct rdma_cb *cb)
 {
-    printf("[Server] DISCONNECTED event.\n");
-    cleanup_rdma_cb(cb);
+    printf("[Server] DISCONNECTED event for tenant %d.\n", cb->tenant.id);
+
+    atomic_store(&cb->stopping, 1);
+    cb->reap_next = reap_list;
+    reap_list = cb;
+}
+
+// Free the tenants on the reap list whose thread has returned, returns how many
+static int reap_tenants(void)
+{
+    struct rdma_cb **pcb = &reap_list, *cb;
+    int reaped = 0;
+
+    while ((cb = *pcb)) {
+        if (cb->tenant.thread_started && !atomic_load(&cb->tenant.exited)) {
+            pcb = &cb->reap_next;
+            continue;
+        }
+        *pcb = cb->reap_next;
+
+        if (cb->tenant.thread_started) {
+            pthread_join(cb->tenant.thread, NULL);
+            cb->tenant.thread_started = 0;
+        }
+        print_tenant_stats(cb);
+        print_and_reset_cq_wait_stats(cb);
+        free_tenant_cb(cb);
+        reaped++;
+    }
+    return reaped;
+}
+
+static struct rdma_lane *find_lane(struct rdma_cb *cb, struct rdma_cm_id *id)
+{
+    for (int i = 1; i < MAX_LANES; i++) {
+        if (cb->lanes[i].conn_id == id) {
+            return &cb->lanes[i];
+        }
+    }
+    return NULL;
+}
+
+static int active_tenants(void)
+{
+    int i, cnt = 0;
+
+    pthread_mutex_lock(&tenant_sched.lock);
+    for (i = 0; i < tenant_sched.max_tenants; i++) {
+        if (tenant_sched.tenants[i]) cnt++;
+    }
+    pthread_mutex_unlock(&tenant_sched.lock);
+
+    return cnt;
 }
 
-static void run_event_loop(struct rdma_cb *cb)
+// How often the event loop checks on disconnected tenants while no CM event comes
+#define REAP_POLL_MS 100
+
+static void run_event_loop(struct rdma_server *server)
 {
     while (1) {
+        // Single-tenant server keeps the old behavior and exits with its host
+        if (reap_tenants() && tenant_sched.max_tenants == 1 && active_tenants() == 0) {
+            return;
+        }
+        if (reap_list) {
+            struct pollfd pfd = { .fd = server->ec->fd, .events = POLLIN };
+
+            if (poll(&pfd, 1, REAP_POLL_MS) <= 0) {
+                continue;
+            }
+        }
+
         struct rdma_cm_event *event = NULL;
-        if (rdma_get_cm_event(cb->ec, &event)) {
+        if (rdma_get_cm_event(server->ec, &event)) {
             fprintf(stderr, "[Server] rdma_get_cm_event failed: %s\n",
                 strerror(errno));
             break;
         }
         struct rdma_cm_event event_copy = *event;
+        struct ksm_conn_private priv;
+        int has_priv = 0;
+
+        // Private data lives in the event, copy it before acking
+        if (event->event == RDMA_CM_EVENT_CONNECT_REQUEST &&
+            event->param.conn.private_data_len >= sizeof(priv)) {
+            memcpy(&priv, event->param.conn.private_data, sizeof(priv));
+            has_priv = priv.magic == KSM_CONN_MAGIC;
+        }
         rdma_ack_cm_event(event);
 
         DEBUG_LOG("Got RDMA event %d (status=%d)", event_copy.event, event_copy.status);
 
+        struct rdma_cb *cb = (struct rdma_cb *)event_copy.id->context;
+        struct rdma_lane *lane = (cb && event_copy.id != cb->conn_id) ? find_lane(cb, event_copy.id) : NULL;
+
         switch (event_copy.event) {
         case RDMA_CM_EVENT_CONNECT_REQUEST:
-            on_connect_request(cb, event_copy.id);
+            on_connect_request(event_copy.id, has_priv ? &priv : NULL, event_copy.param.conn.initiator_depth);
             break;
 
         case RDMA_CM_EVENT_ESTABLISHED:
-            if (ksm_offload_mode == SINGLE_OPERATION_OFFLOAD) {
-                on_established_ops_offload_mode(cb);
-            } else {
-                on_established(cb);
+            if (lane) {
+                atomic_store(&lane->ready, 1);
+                printf("[Server] Lane %ld ESTABLISHED for tenant %d.\n", (long)(lane - cb->lanes), cb->tenant.id);
+            } else if (cb) {
+                on_tenant_established(cb);
             }
-            
             break;
 
         case RDMA_CM_EVENT_DISCONNECTED:
         case RDMA_CM_EVENT_TIMEWAIT_EXIT:
+            if (lane) {
+                // Stop striping over it, resources go away with the tenant
+                atomic_store(&lane->ready, 0);
+                break;
+            }
+            if (!cb) {
+                break;
+            }
+            event_copy.id->context = NULL;
             on_disconnect(cb);
-            // single-connection server -> break
-            return;
+            break;
 
         default:
             printf("[Server] Got unhandled event %d (status=%d).\n",
@@ -1579,13 +2297,30 @@ static void run_event_loop(struct rdma_cb *cb)
     }
 }
 
+static void parse_tenant_weights(const char* arg)
+{
+    char* buf = strdup(arg);
+    char* saveptr = NULL;
+    char* tok;
+    int i = 0;
+
+    if (!buf) {
+        return;
+    }
+
+    for (tok = strtok_r(buf, ",", &saveptr); tok && i < MAX_TENANTS; tok = strtok_r(NULL, ",", &saveptr)) {
+        tenant_sched.weights[i++] = atoi(tok) > 0 ? atoi(tok) : 1;
+    }
+
+    free(buf);
+}
+
 int main(int argc, char **argv)
 {
     setbuf(stdout, NULL);
     char zero_buf[PAGE_SIZE] = { 0 };
 
-    // Optionally parse a single argument: debug=0 or debug=1
-    // e.g.  ./server debug=1
+    // Optionally parse arguments, e.g.  ./server debug=1 tenants=4 weights=2,1,1,1
     if (argc > 1) {
         for (int i = 1; i < argc; i++) {
             if (strncmp(argv[i], "debug=1", 7) == 0) {
@@ -1600,52 +2335,73 @@ int main(int argc, char **argv)
                 ksm_ops = cmp_and_merge_one_old;
                 smart_scan_opt = 0;
                 pre_hash_opt = 0;
+            } else if (strncmp(argv[i], "poll_budget_us=", 15) == 0) {
+                long budget_us = atol(argv[i] + 15);
+                poll_budget_ns = budget_us < 0 ? -1 : budget_us * 1000;
+            } else if (strncmp(argv[i], "addr=", 5) == 0) {
+                server_ip = argv[i] + 5;
+            } else if (strncmp(argv[i], "port=", 5) == 0) {
+                server_port = atoi(argv[i] + 5);
+            } else if (strncmp(argv[i], "tenants=", 8) == 0) {
+                tenant_sched.max_tenants = MIN(MAX(atoi(argv[i] + 8), 1), MAX_TENANTS);
+            } else if (strncmp(argv[i], "weights=", 8) == 0) {
+                parse_tenant_weights(argv[i] + 8);
+            } else if (strncmp(argv[i], "cores=", 6) == 0) {
+                tenant_sched.cores = MAX(atoi(argv[i] + 6), 1);
+            } else if (strncmp(argv[i], "read_rate_mbps=", 15) == 0) {
+                read_rate_mbps = strtoull(argv[i] + 15, NULL, 10);
+            } else if (strncmp(argv[i], "read_burst_kb=", 14) == 0) {
+                read_burst_kb = MAX(strtoull(argv[i] + 14, NULL, 10), 4);
+            } else if (strncmp(argv[i], "batch_workers=", 14) == 0) {
+                batch_workers = MIN(MAX(atoi(argv[i] + 14), 1), MAX_BATCH_OPS);
+            } else if (strncmp(argv[i], "stats_sock=", 11) == 0) {
+                stats_sock_path = argv[i] + 11;
+            } else if (strncmp(argv[i], "record=", 7) == 0) {
+                record_prefix = argv[i] + 7;
+            } else if (strncmp(argv[i], "record_pages=1", 14) == 0) {
+                record_full_pages = 1;
+            } else if (strncmp(argv[i], "mem_mb=", 7) == 0) {
+                tenant_sched.mem_budget_items = strtoul(argv[i] + 7, NULL, 10) * 1024 * 1024 / AVG_RMAP_ITEM_FOOTPRINT;
             } else {
                 printf("Unknown argument: %s\n", argv[i]);
             }
         }
         printf("[Server] Final config: debug=%d, no_skip_opt=%d, no_pre_hash_opt=%d, styx=%d\n",
                debug, !smart_scan_opt, !pre_hash_opt, ksm_offload_mode == SINGLE_OPERATION_OFFLOAD);
+        printf("[Server] Tenant config: tenants=%d, cores=%d, rmap budget=%lu items\n",
+               tenant_sched.max_tenants, tenant_sched.cores, tenant_sched.mem_budget_items);
+        if (tenant_sched.max_tenants > 1) {
+            measure_time_on = 0;
+            printf("[Server] BASK Breakdown timers are off with more than one tenant\n");
+        }
+        printf("[Server] CQ busy-poll budget: %ld us\n", poll_budget_ns < 0 ? -1 : poll_budget_ns / 1000);
+        printf("[Server] Read shaping: %lu MB/s (0=off), burst %lu KB\n", (unsigned long)read_rate_mbps, (unsigned long)read_burst_kb);
     }
     printf("[Server] debug=%d\n", debug);
 
     zero_hash = XXH64(&zero_buf, PAGE_SIZE, 0);
     printf("Zero page hash: %lx\n", zero_hash);
 
-    struct rdma_cb cb;
-    memset(&cb, 0, sizeof(cb));
-
-    cb.metadata.rmap_tree = g_tree_new(rmap_item_compare);
-    cb.metadata.stable_hash_table = g_hash_table_new(stable_node_hash, stable_node_equal);
-    cb.metadata.unstable_hash_table = g_hash_table_new(unstable_node_hash, unstable_node_equal);
-        
-    cb.log_table.entries = calloc(1024, sizeof(struct ksm_event_log));
-    cb.log_table.capacity = 1024;
-
-    pthread_t worker;
+    find_pcie_counters();
 
-    if (pthread_create(&worker, NULL, ksm_page_worker, NULL)) {
-        fprintf(stderr, "[Server] pthread_create failed.\n");
-        return -1;
-    }
-
-    init_pre_hash_pair_table();
-
-    if (pthread_detach(worker)) {
-        fprintf(stderr, "[Server] pthread_detach failed.\n");
-        return -1;
+    if (stats_sock_path && bask_stats_start_server(stats_sock_path)) {
+        fprintf(stderr, "[Server] Stats endpoint disabled.\n");
     }
 
-    worker_todo.status = WORKER_READY;
+    struct rdma_server server;
+    memset(&server, 0, sizeof(server));
 
     //table_cleaner_pool = g_thread_pool_new(cleaner_destroy_unstable_bucket, NULL, THREAD_POOL_MAX, TRUE, NULL);
     //g_thread_pool_set_max_idle_time(60);
 
-    start_listening(&cb);
-    run_event_loop(&cb);
-    cleanup_rdma_cb(&cb);
+    if (batch_workers > 1) {
+        batch_op_pool = g_thread_pool_new(batch_slice_worker, NULL, batch_workers - 1, TRUE, NULL);
+    }
+
+    start_listening(&server);
+    run_event_loop(&server);
+    cleanup_rdma_server(&server);
 
     printf("[Server] Exiting.\n");
     return 0;
 }
-
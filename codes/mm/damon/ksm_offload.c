@@ -0,0 +1,372 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * DAMON-based Hot Memory Hints for the KSM Offload
+ *
+ * Finds hot physical memory with a DAMOS_STAT scheme and publishes it as a
+ * sorted list of ranges.  The KSM offload leaves pages in the ranges out of
+ * most iterations, as their merges would be broken by the next write anyway.
+ */
+
+#define pr_fmt(fmt) "damon-ksm-offload: " fmt
+
+#include <linux/damon.h>
+#include <linux/kstrtox.h>
+#include <linux/module.h>
+#include <linux/spinlock.h>
+
+#include "modules-common.h"
+#include "ksm_offload.h"
+
+#ifdef MODULE_PARAM_PREFIX
+#undef MODULE_PARAM_PREFIX
+#endif
+#define MODULE_PARAM_PREFIX "damon_ksm_offload."
+
+/*
+ * Enable or disable DAMON_KSM_OFFLOAD.
+ *
+ * You can enable DAMON_KSM_OFFLOAD by setting the value of this parameter as
+ * ``Y``.  Setting it as ``N`` disables DAMON_KSM_OFFLOAD and empties the hot
+ * ranges, so that the KSM offload exports every page again.
+ */
+static bool enabled __read_mostly;
+
+/*
+ * Make DAMON_KSM_OFFLOAD reads the input parameters again, except ``enabled``.
+ *
+ * Input parameters that updated while DAMON_KSM_OFFLOAD is running are not
+ * applied by default.  Once this parameter is set as ``Y``, DAMON_KSM_OFFLOAD
+ * reads values of parametrs except ``enabled`` again.  Once the re-reading is
+ * done, this parameter is set as ``N``.  If invalid parameters are found while
+ * the re-reading, DAMON_KSM_OFFLOAD will be disabled.
+ */
+static bool commit_inputs __read_mostly;
+module_param(commit_inputs, bool, 0600);
+
+/*
+ * Access frequency threshold for hot memory regions identification in permil.
+ *
+ * If a memory region is accessed in frequency of this or higher,
+ * DAMON_KSM_OFFLOAD reports the region as hot.  20% by default.
+ */
+static unsigned long hot_thres_access_freq = 200;
+module_param(hot_thres_access_freq, ulong, 0600);
+
+static struct damos_quota damon_ksm_offload_quota = {
+	/* Report up to 1 GiB of hot memory per 100 ms, by default */
+	.ms = 0,
+	.sz = 1024 * 1024 * 1024,
+	.reset_interval = 100,
+	/* Within the quota, report hotter regions first. */
+	.weight_sz = 0,
+	.weight_nr_accesses = 1,
+	.weight_age = 0,
+};
+DEFINE_DAMON_MODULES_DAMOS_QUOTAS(damon_ksm_offload_quota);
+
+static struct damos_watermarks damon_ksm_offload_wmarks = {
+	.metric = DAMOS_WMARK_FREE_MEM_RATE,
+	.interval = 5000000,	/* 5 seconds */
+	.high = 1000,		/* 100 percent */
+	.mid = 1000,		/* 100 percent */
+	.low = 0,		/* 0 percent */
+};
+DEFINE_DAMON_MODULES_WMARKS_PARAMS(damon_ksm_offload_wmarks);
+
+static struct damon_attrs damon_ksm_offload_mon_attrs = {
+	.sample_interval = 5000,	/* 5 ms */
+	.aggr_interval = 100000,	/* 100 ms */
+	.ops_update_interval = 0,
+	.min_nr_regions = 10,
+	.max_nr_regions = 1000,
+};
+DEFINE_DAMON_MODULES_MON_ATTRS_PARAMS(damon_ksm_offload_mon_attrs);
+
+/*
+ * Start of the target memory region in physical address.
+ *
+ * The start physical address of memory region that DAMON_KSM_OFFLOAD will
+ * monitor.  By default, biggest System RAM is used as the region.
+ */
+static unsigned long monitor_region_start __read_mostly;
+module_param(monitor_region_start, ulong, 0600);
+
+/*
+ * End of the target memory region in physical address.
+ *
+ * The end physical address of memory region that DAMON_KSM_OFFLOAD will
+ * monitor.  By default, biggest System RAM is used as the region.
+ */
+static unsigned long monitor_region_end __read_mostly;
+module_param(monitor_region_end, ulong, 0600);
+
+/*
+ * PID of the DAMON thread
+ *
+ * If DAMON_KSM_OFFLOAD is enabled, this becomes the PID of the worker thread.
+ * Else, -1.
+ */
+static int kdamond_pid __read_mostly = -1;
+module_param(kdamond_pid, int, 0400);
+
+/*
+ * Number of hot ranges in the last published list.
+ */
+static int nr_hot_ranges __read_mostly;
+module_param(nr_hot_ranges, int, 0400);
+
+static struct damos_stat damon_ksm_offload_hot_stat;
+DEFINE_DAMON_MODULES_DAMOS_STATS_PARAMS(damon_ksm_offload_hot_stat,
+		ksm_offload_tried_hot_regions, ksm_offload_hot_regions,
+		hot_quota_exceeds);
+
+static struct damon_ctx *ctx;
+static struct damon_target *target;
+
+/*
+ * Hot ranges found by the current round of scheme applying, filled by kdamond
+ * only, and the list published by the previous round.
+ */
+static struct damon_ksm_offload_range building[DAMON_KSM_OFFLOAD_MAX_RANGES];
+static int nr_building;
+static struct damon_ksm_offload_range published[DAMON_KSM_OFFLOAD_MAX_RANGES];
+static DEFINE_SPINLOCK(published_lock);
+
+/**
+ * damon_ksm_offload_hot_ranges() - Copy the latest hot ranges.
+ * @ranges:	array to copy the ranges into
+ * @max:	size of @ranges
+ *
+ * The ranges are sorted by address and do not overlap.
+ *
+ * Return: the number of ranges copied, 0 if DAMON_KSM_OFFLOAD is disabled.
+ */
+int damon_ksm_offload_hot_ranges(struct damon_ksm_offload_range *ranges,
+		int max)
+{
+	int nr;
+
+	spin_lock(&published_lock);
+	nr = min(nr_hot_ranges, max);
+	memcpy(ranges, published, nr * sizeof(*ranges));
+	spin_unlock(&published_lock);
+	return nr;
+}
+
+static void damon_ksm_offload_publish(void)
+{
+	spin_lock(&published_lock);
+	memcpy(published, building, nr_building * sizeof(*published));
+	nr_hot_ranges = nr_building;
+	spin_unlock(&published_lock);
+	nr_building = 0;
+}
+
+static struct damos *damon_ksm_offload_new_scheme(void)
+{
+	struct damos_access_pattern pattern = {
+		/* Find regions having PAGE_SIZE or larger size */
+		.min_sz_region = PAGE_SIZE,
+		.max_sz_region = ULONG_MAX,
+		/* and accessed for more than the threshold */
+		.min_nr_accesses = damon_max_nr_accesses(
+				&damon_ksm_offload_mon_attrs) *
+			hot_thres_access_freq / 1000,
+		.max_nr_accesses = UINT_MAX,
+		/* no matter its age */
+		.min_age_region = 0,
+		.max_age_region = UINT_MAX,
+	};
+
+	return damon_new_scheme(
+			/* find the pattern, and */
+			&pattern,
+			/* only record it, from before_damos_apply() */
+			DAMOS_STAT,
+			/* for each aggregation interval */
+			0,
+			/* under the quota. */
+			&damon_ksm_offload_quota,
+			/* (De)activate this according to the watermarks. */
+			&damon_ksm_offload_wmarks);
+}
+
+static void damon_ksm_offload_copy_quota_status(struct damos_quota *dst,
+		struct damos_quota *src)
+{
+	dst->total_charged_sz = src->total_charged_sz;
+	dst->total_charged_ns = src->total_charged_ns;
+	dst->charged_sz = src->charged_sz;
+	dst->charged_from = src->charged_from;
+	dst->charge_target_from = src->charge_target_from;
+	dst->charge_addr_from = src->charge_addr_from;
+}
+
+static int damon_ksm_offload_apply_parameters(void)
+{
+	struct damos *scheme, *old_scheme = NULL;
+	int err = 0;
+
+	err = damon_set_attrs(ctx, &damon_ksm_offload_mon_attrs);
+	if (err)
+		return err;
+
+	damon_for_each_scheme(scheme, ctx)
+		old_scheme = scheme;
+
+	scheme = damon_ksm_offload_new_scheme();
+	if (!scheme)
+		return -ENOMEM;
+	if (old_scheme)
+		damon_ksm_offload_copy_quota_status(&scheme->quota,
+				&old_scheme->quota);
+	damon_set_schemes(ctx, &scheme, 1);
+
+	return damon_set_region_biggest_system_ram_default(target,
+					&monitor_region_start,
+					&monitor_region_end);
+}
+
+static int damon_ksm_offload_turn(bool on)
+{
+	int err;
+
+	if (!on) {
+		err = damon_stop(&ctx, 1);
+		if (!err) {
+			kdamond_pid = -1;
+			nr_building = 0;
+			damon_ksm_offload_publish();
+		}
+		return err;
+	}
+
+	err = damon_ksm_offload_apply_parameters();
+	if (err)
+		return err;
+
+	nr_building = 0;
+	err = damon_start(&ctx, 1, true);
+	if (err)
+		return err;
+	kdamond_pid = ctx->kdamond->pid;
+	return 0;
+}
+
+static int damon_ksm_offload_enabled_store(const char *val,
+		const struct kernel_param *kp)
+{
+	bool is_enabled = enabled;
+	bool enable;
+	int err;
+
+	err = kstrtobool(val, &enable);
+	if (err)
+		return err;
+
+	if (is_enabled == enable)
+		return 0;
+
+	/* Called before init function.  The function will handle this. */
+	if (!ctx)
+		goto set_param_out;
+
+	err = damon_ksm_offload_turn(enable);
+	if (err)
+		return err;
+
+set_param_out:
+	enabled = enable;
+	return err;
+}
+
+static const struct kernel_param_ops enabled_param_ops = {
+	.set = damon_ksm_offload_enabled_store,
+	.get = param_get_bool,
+};
+
+module_param_cb(enabled, &enabled_param_ops, &enabled, 0600);
+MODULE_PARM_DESC(enabled,
+	"Enable or disable DAMON_KSM_OFFLOAD (default: disabled)");
+
+static int damon_ksm_offload_handle_commit_inputs(void)
+{
+	int err;
+
+	if (!commit_inputs)
+		return 0;
+
+	err = damon_ksm_offload_apply_parameters();
+	commit_inputs = false;
+	return err;
+}
+
+/*
+ * Regions come in address order and within the quota, hottest first.  Ranges
+ * past DAMON_KSM_OFFLOAD_MAX_RANGES are dropped, and their pages exported.
+ */
+static int damon_ksm_offload_before_damos_apply(struct damon_ctx *c,
+		struct damon_target *t, struct damon_region *r,
+		struct damos *s)
+{
+	struct damon_ksm_offload_range *last;
+
+	if (nr_building) {
+		last = &building[nr_building - 1];
+		if (last->end == r->ar.start) {
+			last->end = r->ar.end;
+			return 0;
+		}
+	}
+	if (nr_building < DAMON_KSM_OFFLOAD_MAX_RANGES) {
+		building[nr_building].start = r->ar.start;
+		building[nr_building].end = r->ar.end;
+		nr_building++;
+	}
+	return 0;
+}
+
+static int damon_ksm_offload_after_aggregation(struct damon_ctx *c)
+{
+	struct damos *s;
+
+	/* update the stats parameter */
+	damon_for_each_scheme(s, c)
+		damon_ksm_offload_hot_stat = s->stat;
+
+	/* Schemes are applied right after this, publish the previous round */
+	damon_ksm_offload_publish();
+
+	return damon_ksm_offload_handle_commit_inputs();
+}
+
+/* Called only while the watermarks keep the scheme deactivated */
+static int damon_ksm_offload_after_wmarks_check(struct damon_ctx *c)
+{
+	nr_building = 0;
+	damon_ksm_offload_publish();
+
+	return damon_ksm_offload_handle_commit_inputs();
+}
+
+static int __init damon_ksm_offload_init(void)
+{
+	int err = damon_modules_new_paddr_ctx_target(&ctx, &target);
+
+	if (err)
+		return err;
+
+	ctx->callback.after_wmarks_check =
+		damon_ksm_offload_after_wmarks_check;
+	ctx->callback.after_aggregation = damon_ksm_offload_after_aggregation;
+	ctx->callback.before_damos_apply =
+		damon_ksm_offload_before_damos_apply;
+
+	/* 'enabled' has set before this function, probably via command line */
+	if (enabled)
+		err = damon_ksm_offload_turn(true);
+
+	return err;
+}
+
+module_init(damon_ksm_offload_init);
@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * DAMON-based Hot Memory Hints for the KSM Offload
+ */
+
+#ifndef _MM_DAMON_KSM_OFFLOAD_H
+#define _MM_DAMON_KSM_OFFLOAD_H
+
+#define DAMON_KSM_OFFLOAD_MAX_RANGES	1024
+
+/* A physical address range DAMON_KSM_OFFLOAD found hot, [start, end) */
+struct damon_ksm_offload_range {
+	unsigned long start;
+	unsigned long end;
+};
+
+#ifdef CONFIG_DAMON_KSM_OFFLOAD
+int damon_ksm_offload_hot_ranges(struct damon_ksm_offload_range *ranges,
+		int max);
+#else
+static inline int damon_ksm_offload_hot_ranges(
+		struct damon_ksm_offload_range *ranges, int max)
+{
+	return 0;
+}
+#endif
+
+#endif /* _MM_DAMON_KSM_OFFLOAD_H */
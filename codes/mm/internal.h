@@ -1266,4 +1266,25 @@ static inline void shrinker_debugfs_remove(struct dentry *debugfs_entry,
 }
 #endif /* CONFIG_SHRINKER_DEBUG */
 
+/*
+ * mm/ksm.c, called by khugepaged: ranges it has collapsed, and how
+ * often a collapse and a KSM merge went after the same range.
+ */
+#ifdef CONFIG_KSM
+void ksm_thp_mark_candidate(struct mm_struct *mm, unsigned long haddr);
+void ksm_thp_collapse_blocked(void);
+void ksm_thp_collapse_unmerged(int nr);
+#else
+static inline void ksm_thp_mark_candidate(struct mm_struct *mm,
+					  unsigned long haddr)
+{
+}
+static inline void ksm_thp_collapse_blocked(void)
+{
+}
+static inline void ksm_thp_collapse_unmerged(int nr)
+{
+}
+#endif /* CONFIG_KSM */
+
 #endif	/* __MM_INTERNAL_H */
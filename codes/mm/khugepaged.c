@@ -88,6 +88,11 @@ static DECLARE_WAIT_QUEUE_HEAD(khugepaged_wait);
 static unsigned int khugepaged_max_ptes_none __read_mostly;
 static unsigned int khugepaged_max_ptes_swap __read_mostly;
 static unsigned int khugepaged_max_ptes_shared __read_mostly;
+/*
+ * KSM-merged ptes (KSM pages and KSM zero pages) a collapse may undo. Above
+ * it, the memory dedup saves outweighs the TLB reach of a huge page.
+ */
+static unsigned int khugepaged_max_ptes_ksm __read_mostly;
 
 #define MM_SLOTS_HASH_BITS 10
 static DEFINE_READ_MOSTLY_HASHTABLE(mm_slots_hash, MM_SLOTS_HASH_BITS);
@@ -327,11 +332,38 @@ static ssize_t max_ptes_shared_store(struct kobject *kobj,
 static struct kobj_attribute khugepaged_max_ptes_shared_attr =
 	__ATTR_RW(max_ptes_shared);
 
+static ssize_t max_ptes_ksm_show(struct kobject *kobj,
+				 struct kobj_attribute *attr,
+				 char *buf)
+{
+	return sysfs_emit(buf, "%u\n", khugepaged_max_ptes_ksm);
+}
+
+static ssize_t max_ptes_ksm_store(struct kobject *kobj,
+				  struct kobj_attribute *attr,
+				  const char *buf, size_t count)
+{
+	int err;
+	unsigned long max_ptes_ksm;
+
+	err  = kstrtoul(buf, 10, &max_ptes_ksm);
+	if (err || max_ptes_ksm > HPAGE_PMD_NR)
+		return -EINVAL;
+
+	khugepaged_max_ptes_ksm = max_ptes_ksm;
+
+	return count;
+}
+
+static struct kobj_attribute khugepaged_max_ptes_ksm_attr =
+	__ATTR_RW(max_ptes_ksm);
+
 static struct attribute *khugepaged_attr[] = {
 	&khugepaged_defrag_attr.attr,
 	&khugepaged_max_ptes_none_attr.attr,
 	&khugepaged_max_ptes_swap_attr.attr,
 	&khugepaged_max_ptes_shared_attr.attr,
+	&khugepaged_max_ptes_ksm_attr.attr,
 	&pages_to_scan_attr.attr,
 	&pages_collapsed_attr.attr,
 	&full_scans_attr.attr,
@@ -396,6 +428,7 @@ int __init khugepaged_init(void)
 	khugepaged_max_ptes_none = HPAGE_PMD_NR - 1;
 	khugepaged_max_ptes_swap = HPAGE_PMD_NR / 8;
 	khugepaged_max_ptes_shared = HPAGE_PMD_NR / 2;
+	khugepaged_max_ptes_ksm = HPAGE_PMD_NR / 8;
 
 	return 0;
 }
@@ -1252,7 +1285,7 @@ static int hpage_collapse_scan_pmd(struct mm_struct *mm,
 	pmd_t *pmd;
 	pte_t *pte, *_pte;
 	int result = SCAN_FAIL, referenced = 0;
-	int none_or_zero = 0, shared = 0;
+	int none_or_zero = 0, shared = 0, ksm = 0;
 	struct page *page = NULL;
 	struct folio *folio = NULL;
 	unsigned long _address;
@@ -1299,6 +1332,8 @@ static int hpage_collapse_scan_pmd(struct mm_struct *mm,
 		}
 		if (pte_none(pteval) || is_zero_pfn(pte_pfn(pteval))) {
 			++none_or_zero;
+			if (is_ksm_zero_pte(pteval))
+				++ksm;
 			if (!userfaultfd_armed(vma) &&
 			    (!cc->is_khugepaged ||
 			     none_or_zero <= khugepaged_max_ptes_none)) {
@@ -1341,6 +1376,9 @@ static int hpage_collapse_scan_pmd(struct mm_struct *mm,
 			}
 		}
 
+		if (PageKsm(page))
+			++ksm;
+
 		folio = page_folio(page);
 		/*
 		 * Record which node the original page is from and save this
@@ -1398,6 +1436,10 @@ static int hpage_collapse_scan_pmd(struct mm_struct *mm,
 		   (!referenced ||
 		    (unmapped && referenced < HPAGE_PMD_NR / 2))) {
 		result = SCAN_LACK_REFERENCED_PAGE;
+	} else if (cc->is_khugepaged && ksm > khugepaged_max_ptes_ksm) {
+		/* The trace labels know no KSM result, thp_collapse_blocked counts these */
+		result = SCAN_EXCEED_SHARED_PTE;
+		ksm_thp_collapse_blocked();
 	} else {
 		result = SCAN_SUCCEED;
 	}
@@ -1408,6 +1450,12 @@ out_unmap:
 					    unmapped, cc);
 		/* collapse_huge_page will return with the mmap_lock released */
 		*mmap_locked = false;
+		if (result == SCAN_SUCCEED && cc->is_khugepaged) {
+			/* Keep the KSM offload from splitting the new huge page */
+			ksm_thp_mark_candidate(mm, address);
+			if (ksm)
+				ksm_thp_collapse_unmerged(ksm);
+		}
 	}
 out:
 	trace_mm_khugepaged_scan_pmd(mm, &folio->page, writable, referenced,
@@ -41,6 +41,7 @@
 #include <linux/oom.h>
 #include <linux/numa.h>
 #include <linux/pagewalk.h>
+#include <linux/workqueue.h>
 
 #include <asm/tlbflush.h>
 #include "internal.h"
@@ -49,9 +50,11 @@
 #include "time_util.h"
 #include <linux/pagewalk.h>
 #include "ksm.h"
+#include "damon/ksm_offload.h"
 
 #define CREATE_TRACE_POINTS
 #include <trace/events/ksm.h>
+#include "ksm_offload_trace.h"
 
 #ifdef CONFIG_NUMA
 #define NUMA(x)		(x)
@@ -63,6 +66,14 @@
 
 
 static void apply_result(struct list_head *shadow_pt_list, struct result_table* result); // Forward declaration
+static void offload_hot_region_add(int mm_id, unsigned long va, int backoff);
+static void offload_hot_region_expire(int iter);
+static void offload_dirty_tracking_start(int iter);
+static void offload_lru_drain_start(void);
+static void offload_damon_hot_start(int iter);
+static void offload_thp_start(void);
+static void offload_thp_queue_split(struct list_head *shadow_pt_list, struct ksm_event_log *log_entry);
+static void offload_thp_split_queued(void);
 static bool prepare_metadata(struct ksm_cb* ksm_cb);
 static void destroy_metadata(bool disconnected, int curr_iteration);
 static void prune_stable_tree(void);
@@ -233,6 +244,7 @@ DEBUG_EVENT_TIMER_EXPORT_SYMBOL(bask_destroy_mm);
  * @head: (overlaying parent) &migrate_nodes indicates temporarily on that list
  * @hlist_dup: linked into the stable_node->hlist with a stable_node chain
  * @list: linked into migrate_nodes, pending placement in the proper node tree
+ * @fp: fingerprint of the content from the offload, when in stable_fp_hash
  * @hlist: hlist head of rmap_items using this ksm page
  * @kpfn: page frame number of this ksm page (perhaps temporarily on wrong nid)
  * @chain_prune_time: time of the last full garbage collection
@@ -317,6 +329,15 @@ static struct rb_root *root_unstable_tree = one_unstable_tree;
 static LIST_HEAD(migrate_nodes);
 #define STABLE_NODE_DUP_HEAD ((struct list_head *)&migrate_nodes.prev)
 
+/*
+ * Stable nodes created by the offload, hashed by the NIC's fingerprint of
+ * their content rather than sorted in the stable tree. They are linked by
+ * hlist_dup, and their head is the table itself, which no node can alias.
+ */
+#define STABLE_FP_HASH_BITS 16
+static DEFINE_HASHTABLE(stable_fp_hash, STABLE_FP_HASH_BITS);
+#define STABLE_NODE_FP_HEAD ((struct list_head *)stable_fp_hash)
+
 #define MM_SLOTS_HASH_BITS 10
 static DEFINE_HASHTABLE(mm_slots_hash, MM_SLOTS_HASH_BITS);
 
@@ -355,6 +376,9 @@ static unsigned long ksm_stable_node_chains;
 /* The number of stable_node dups linked to the stable_node chains */
 static unsigned long ksm_stable_node_dups;
 
+/* The number of stable_nodes in stable_fp_hash */
+static unsigned long ksm_stable_fp_nodes;
+
 /* Delay in pruning stale stable_node_dups in the stable_node_chains */
 static unsigned int ksm_stable_node_chains_prune_millisecs = 2000;
 
@@ -377,6 +401,9 @@ static bool ksm_use_zero_pages __read_mostly;
 /* Default to true at least temporarily, for testing */
 static bool ksm_smart_scan = false;
 
+/* Dataplane offload: pages hashed on the NIC per round trip (<= 1 disables batching) */
+static unsigned int ksm_styx_batch_size = MAX_BATCH_OPS;
+
 /* The number of zero pages which is placed by KSM */
 unsigned long ksm_zero_pages;
 
@@ -417,9 +444,210 @@ static struct advisor_ctx advisor_ctx;
 enum ksm_advisor_type {
 	KSM_ADVISOR_NONE,
 	KSM_ADVISOR_SCAN_TIME,
+	KSM_ADVISOR_OFFLOAD,
 };
 static enum ksm_advisor_type ksm_advisor;
 
+/* PCIe budget in MB/s for the NIC reading host memory, 0 means no budget */
+static unsigned long ksm_advisor_offload_max_pcie_mbps;
+
+/* Newly shared pages per 1000 scanned below which offload iterations back off */
+static unsigned long ksm_advisor_offload_target_yield = 10;
+
+/* Host CPU time to prepare and commit one offload iteration, bounds its scope */
+static unsigned long ksm_advisor_offload_max_commit_ms = 100;
+
+/* Longest pause between two offload iterations */
+static unsigned long ksm_advisor_offload_max_sleep_ms = 10000;
+
+#define KSM_ADVISOR_OFFLOAD_MIN_SLEEP_MS 20
+
+/* mm slots registered per offload iteration, 0 registers all of them */
+static unsigned int ksm_offload_scan_mms;
+
+/*
+ * Cap on the NIC's reads of host memory in MB/s, 0 leaves the server's setting,
+ * READ_RATE_UNSHAPED ("off") lifts it
+ */
+static unsigned long ksm_offload_read_rate_mbps;
+
+/* % of changed pages that makes the server report a region hot, 0 disables it */
+static unsigned int ksm_offload_hot_region_pct;
+
+/*
+ * Clear pte dirty bits in the shadow walk and tag pages that stayed clean, so
+ * the NIC only reads written pages. Every Nth iteration reads all pages anyway,
+ * 0 turns it off.
+ */
+static unsigned int ksm_offload_dirty_tracking;
+/* This iteration's share of it, set by ksmd before the walk */
+static bool offload_clean_dirty, offload_tag_unchanged;
+static unsigned long offload_dirty_cleaned, offload_unchanged;
+
+/*
+ * Drain every CPU's LRU batches before an offload iteration only once this
+ * many merges of the last one failed on a page held in such a batch, 0
+ * drains before every iteration. Those merges go back to the server as
+ * failed and are tried again, so most iterations need no drain IPIs.
+ */
+static unsigned int ksm_offload_lru_drain_min = 16;
+static unsigned long offload_lru_cached;	/* merges that failed on one */
+static bool offload_lru_drained;
+/* Shadow walks that changed no pte and so did not flush the mm */
+static unsigned long offload_flushes_skipped;
+
+/*
+ * Pages the shadow walk visits per mmap_lock hold, it drops the lock and
+ * resumes after each chunk. 0 walks a whole mm under one hold.
+ */
+static unsigned int ksm_offload_walk_chunk = 4096;
+
+/*
+ * Walk up to this many mms at a time on ksm_offload_prep_wq, one work item
+ * per mm, 0 walks them one by one on ksmd. The workqueue is unbound and in
+ * sysfs, its cpumask keeps the walks on housekeeping CPUs.
+ */
+static unsigned int ksm_offload_prep_workers = 4;
+static struct workqueue_struct *ksm_offload_prep_wq;
+static unsigned long offload_prep_queued;	/* mms walked on it */
+/*
+ * Walks of different mms share the trees their stale rmap_items are on and
+ * the rmap_item counters. A walk queues those items and counts its new ones,
+ * and settles both under this lock after each chunk.
+ */
+static DEFINE_MUTEX(offload_rmap_lock);
+
+/*
+ * Export pages in the physical ranges DAMON_KSM_OFFLOAD found hot only every
+ * Nth iteration, 0 exports them every time
+ */
+static unsigned int ksm_offload_damon_hot_sample;
+/* This iteration's copy of the ranges, empty when hot pages are exported */
+static struct damon_ksm_offload_range offload_damon_hot[DAMON_KSM_OFFLOAD_MAX_RANGES];
+static int offload_damon_hot_nr;
+static unsigned long offload_damon_hot_skipped;
+
+/*
+ * Export PMD-mapped THPs as subpages without splitting them, and split one
+ * once the server finds this % of its subpages would merge. 0 leaves the walk
+ * splitting every PMD mapping, as before.
+ */
+static unsigned int ksm_offload_thp_split_pct;
+/* This iteration's share of it, set by ksmd before the walk */
+static unsigned int offload_thp_pct;
+static unsigned long offload_thp_exported, offload_thp_split_nr;
+
+/* THPs to split once destroy_metadata() dropped the walk's pins */
+#define OFFLOAD_THP_SPLIT_MAX 512
+static struct offload_thp_split {
+	struct mm_struct *mm;
+	unsigned long addr;
+} offload_thp_splits[OFFLOAD_THP_SPLIT_MAX];
+static int offload_thp_splits_nr;
+
+/*
+ * Ranges khugepaged has just collapsed, left out of the offload walk for a
+ * while so merges and the collapse do not undo each other. A lossy cache,
+ * colliding ranges replace each other.
+ */
+#define KSM_THP_CANDIDATE_BITS 8
+#define KSM_THP_CANDIDATE_TTL (60 * HZ)
+static struct ksm_thp_candidate {
+	struct mm_struct *mm;
+	unsigned long haddr;
+	unsigned long expires;
+} ksm_thp_candidates[1 << KSM_THP_CANDIDATE_BITS];
+static DEFINE_SPINLOCK(ksm_thp_candidate_lock);
+
+/* Collapse versus merge conflicts, see ksm_thp_collapse_blocked() */
+static atomic_long_t ksm_thp_collapse_blocked_nr = ATOMIC_LONG_INIT(0);
+static atomic_long_t ksm_thp_collapse_unmerged_nr = ATOMIC_LONG_INIT(0);
+static unsigned long ksm_thp_merge_deferred_nr;
+
+/*
+ * Keep stable nodes of unstable merges in stable_fp_hash under the NIC's
+ * fingerprint, instead of walking the stable tree to insert them
+ */
+static unsigned int ksm_offload_stable_fp = 1;
+/* Inserts whose fingerprint already had a stable node, in the current iteration */
+static unsigned long offload_fp_dups;
+
+/*
+ * Batch the commit's TLB flushes per mm: write-protect the pages of one page
+ * table under one notifier range and flush, and hold back replace_page()'s
+ * flushes until a batch of unmapped pages is put
+ */
+static unsigned int ksm_offload_commit_batch = 1;
+static unsigned long offload_batch_protected, offload_batch_deferred;
+static unsigned long offload_batch_flushes;
+
+/* Pages of one page table to write-protect together */
+static struct offload_wp_entry {
+	struct ksm_rmap_item *rmap_item;
+	struct vm_area_struct *vma;	/* NULL when left to write_protect_page() */
+	pte_t orig_pte;
+	bool cleared;
+} offload_wp_batch[PTRS_PER_PTE];
+static int offload_wp_batch_nr;
+
+/* Pages replace_page() unmapped from mm, put after its one flush */
+#define OFFLOAD_TLB_GATHER_MAX 512
+static struct offload_tlb_gather {
+	struct mm_struct *mm;
+	int nr;
+	struct folio *folios[OFFLOAD_TLB_GATHER_MAX];
+} offload_tlb_gather;
+static bool offload_tlb_gathering;	/* set by apply_result() */
+
+/*
+ * Leave the commit's byte compares to the NIC: once the batch has
+ * write-protected the pages, the server compares each merge's pair in one
+ * more round trip, and the host merges the pairs it confirmed without
+ * pages_identical(). Needs ksm_offload_commit_batch.
+ */
+static unsigned int ksm_offload_nic_verify;
+static unsigned long offload_verify_pairs, offload_verify_diff;
+
+/* The server's answer for the pair of each result entry */
+enum offload_verdict {
+	OFFLOAD_UNVERIFIED,
+	OFFLOAD_VERIFIED_SAME,
+	OFFLOAD_VERIFIED_DIFF,
+};
+static u8 *offload_verdicts;
+/*
+ * The pages try_to_merge_one_page() is about to compare were equal when the
+ * NIC read them, cleared by write_protect_page() if they were writable since
+ */
+static bool offload_nic_verified;
+
+/* Hot regions reported by the server, see struct offload_hot_region */
+#define OFFLOAD_HOT_REGION_HASH_BITS 10
+static DEFINE_HASHTABLE(offload_hot_region_hash, OFFLOAD_HOT_REGION_HASH_BITS);
+static unsigned long offload_hot_regions_nr;
+static unsigned long offload_hot_regions_skipped;	/* in the current iteration */
+
+/**
+ * struct offload_advisor_ctx - metadata for the KSM offload advisor
+ * @start: start time of the current iteration
+ * @cpu_time: ksmd cpu time at the start of the current iteration
+ * @pages_scanned: ksm_pages_scanned at the start of the current iteration
+ * @pages_sharing: ksm_pages_sharing at the start of the current iteration
+ * @nr_mms: mm slots registered by the current iteration
+ * @nr_slots: mm slots on the ksm list during the current iteration
+ * @user_sleep_ms: sleep_millisecs to restore when the advisor is turned off
+ */
+struct offload_advisor_ctx {
+	ktime_t start;
+	unsigned long long cpu_time;
+	unsigned long pages_scanned;
+	unsigned long pages_sharing;
+	unsigned int nr_mms;
+	unsigned int nr_slots;
+	unsigned int user_sleep_ms;
+};
+static struct offload_advisor_ctx offload_advisor_ctx;
+
 #ifdef CONFIG_SYSFS
 /*
  * Only called through the sysfs control interface:
@@ -435,6 +663,11 @@ static void set_advisor_defaults(void)
 	} else if (ksm_advisor == KSM_ADVISOR_SCAN_TIME) {
 		advisor_ctx = (const struct advisor_ctx){ 0 };
 		ksm_thread_pages_to_scan = ksm_advisor_min_pages_to_scan;
+	} else if (ksm_advisor == KSM_ADVISOR_OFFLOAD) {
+		offload_advisor_ctx = (const struct offload_advisor_ctx){
+			.user_sleep_ms = ksm_thread_sleep_millisecs,
+		};
+		ksm_offload_scan_mms = 0;
 	}
 }
 #endif /* CONFIG_SYSFS */
@@ -549,6 +782,210 @@ static void advisor_stop_scan(void)
 		scan_time_advisor();
 }
 
+static inline void offload_advisor_start(void)
+{
+	if (ksm_advisor != KSM_ADVISOR_OFFLOAD)
+		return;
+
+	offload_advisor_ctx.start = ktime_get();
+	offload_advisor_ctx.cpu_time = task_sched_runtime(current);
+	offload_advisor_ctx.pages_scanned = ksm_pages_scanned;
+	offload_advisor_ctx.pages_sharing = ksm_pages_sharing;
+	offload_advisor_ctx.nr_mms = 0;
+	offload_advisor_ctx.nr_slots = 0;
+}
+
+/*
+ * The offload advisor paces whole offload iterations, where the scan itself
+ * runs on the NIC and the host pays for building the metadata and committing
+ * the merges. It picks the pause before the next iteration so that, averaged
+ * over iteration plus pause,
+ *
+ *      ksmd cpu time   <= advisor_max_cpu percent
+ *      NIC reads       <= advisor_offload_max_pcie_mbps
+ *
+ * and doubles the pause while an iteration shares fewer than
+ * advisor_offload_target_yield pages per 1000 scanned, since there is little
+ * left to gain. Pauses only shrink through an exponentially weighted moving
+ * average, so one cheap iteration does not start a burst.
+ *
+ * The scope, the number of mm slots registered per iteration, bounds how long
+ * a single commit keeps ksmd busy: it shrinks in proportion when an iteration
+ * needs more than advisor_offload_max_commit_ms of cpu and grows back when
+ * it needs less than half of it.
+ */
+static void offload_advisor(u64 pcie_bytes)
+{
+	unsigned long iter_ms, cpu_ms, scanned, shared, yield;
+	unsigned long sleep_ms, prev_sleep_ms, need_ms;
+	unsigned int scope = ksm_offload_scan_mms;
+
+	if (ksm_advisor != KSM_ADVISOR_OFFLOAD)
+		return;
+
+	iter_ms = max_t(s64, ktime_ms_delta(ktime_get(), offload_advisor_ctx.start), 1);
+	cpu_ms = (task_sched_runtime(current) - offload_advisor_ctx.cpu_time) / NSEC_PER_MSEC;
+	scanned = ksm_pages_scanned - offload_advisor_ctx.pages_scanned;
+	shared = ksm_pages_sharing > offload_advisor_ctx.pages_sharing ?
+		 ksm_pages_sharing - offload_advisor_ctx.pages_sharing : 0;
+	yield = scanned ? shared * 1000 / scanned : 0;
+
+	/* Pause that keeps the cpu share of iteration plus pause under the cap */
+	need_ms = cpu_ms * 100 / max(ksm_advisor_max_cpu, 1U);
+	sleep_ms = need_ms > iter_ms ? need_ms - iter_ms : 0;
+
+	/* Same for the PCIe budget: MB/s is bytes per millisecond / 1000 */
+	if (ksm_advisor_offload_max_pcie_mbps) {
+		need_ms = div64_u64(pcie_bytes, ksm_advisor_offload_max_pcie_mbps * 1000);
+		if (need_ms > iter_ms)
+			sleep_ms = max(sleep_ms, need_ms - iter_ms);
+	}
+
+	prev_sleep_ms = READ_ONCE(ksm_thread_sleep_millisecs);
+	if (yield < ksm_advisor_offload_target_yield)
+		sleep_ms = max(sleep_ms, prev_sleep_ms * 2);
+	else if (sleep_ms < prev_sleep_ms)
+		sleep_ms = ewma(prev_sleep_ms, sleep_ms);
+
+	sleep_ms = clamp_t(unsigned long, sleep_ms, KSM_ADVISOR_OFFLOAD_MIN_SLEEP_MS,
+			   max(ksm_advisor_offload_max_sleep_ms, (unsigned long)KSM_ADVISOR_OFFLOAD_MIN_SLEEP_MS));
+
+	if (offload_advisor_ctx.nr_mms) {
+		if (cpu_ms > ksm_advisor_offload_max_commit_ms)
+			scope = max_t(unsigned long, 1,
+				      offload_advisor_ctx.nr_mms * ksm_advisor_offload_max_commit_ms / cpu_ms);
+		else if (scope && cpu_ms < ksm_advisor_offload_max_commit_ms / 2)
+			scope = scope * 2 >= offload_advisor_ctx.nr_slots ? 0 : scope * 2;
+	}
+
+	WRITE_ONCE(ksm_thread_sleep_millisecs, sleep_ms);
+	WRITE_ONCE(ksm_offload_scan_mms, scope);
+
+	OFFLOAD_LOG("[Log] Offload advisor, iter ,%lu, ms, cpu ,%lu, ms, pcie ,%llu, MB/s, yield ,%lu, sleep ,%lu, ms, mms ,%u\n",
+		iter_ms, cpu_ms, div64_u64(pcie_bytes, iter_ms * 1000), yield, sleep_ms, scope);
+}
+
+enum offload_phase {
+	OFFLOAD_PHASE_PREPARE,
+	OFFLOAD_PHASE_REGISTER,
+	OFFLOAD_PHASE_SEND,
+	OFFLOAD_PHASE_WAIT,
+	OFFLOAD_PHASE_RECV,
+	OFFLOAD_PHASE_APPLY,
+	OFFLOAD_PHASE_DESTROY,
+	OFFLOAD_PHASE_NUM,
+};
+
+static const char * const offload_phase_str[OFFLOAD_PHASE_NUM] = {
+	"prepare_us", "register_us", "send_us", "wait_us", "recv_us", "apply_us", "destroy_us",
+};
+
+/**
+ * struct offload_iter_stats - one offload iteration, as shown in offload_stats
+ * @iter: iteration number, as in the "[Log] KSM offload iteration" line
+ * @phase_ns: host time spent in each phase
+ * @nr_mms: mms with a shadow page table
+ * @nr_ptes: shadow ptes registered for NIC reads
+ * @metadata_bytes: host memory used by the shadow page tables
+ * @result_bytes: size of the result table read back
+ * @pcie_read_bytes: host memory read by the NIC
+ * @pages_scanned: pages the NIC scanned
+ * @stable_merges: merges into a stable node
+ * @unstable_merges: merges of two unstable pages
+ * @failures: merges that failed and went into the error table
+ * @unstable_aborts: unstable merges dropped because a page had changed
+ * @fail_reasons: snapshot of fail_reason_cnts
+ * @disconnected: the server went away during this iteration
+ */
+struct offload_iter_stats {
+	int iter;
+	u64 phase_ns[OFFLOAD_PHASE_NUM];
+	unsigned int nr_mms;
+	unsigned long nr_ptes;
+	unsigned long metadata_bytes;
+	unsigned long result_bytes;
+	unsigned long pcie_read_bytes;
+	unsigned long pages_scanned;
+	int stable_merges;
+	int unstable_merges;
+	int failures;
+	int unstable_aborts;
+	long fail_reasons[ARRAY_SIZE(fail_reason_cnts)];
+	bool disconnected;
+	unsigned int walk_chunks;	/* mmap_lock holds of the shadow walks */
+	u64 walk_hold_max_ns;		/* longest of them */
+};
+
+/* Iterations kept for offload_stats, one line each must fit in a sysfs page */
+#define OFFLOAD_STATS_NR 10
+
+static struct offload_iter_stats offload_stats_ring[OFFLOAD_STATS_NR];
+static unsigned long offload_stats_nr;	/* iterations recorded so far */
+static DEFINE_MUTEX(offload_stats_lock);
+/* Iteration in progress, only touched by ksmd */
+static struct offload_iter_stats offload_cur;
+
+static void offload_stats_start(int iter)
+{
+	offload_cur = (const struct offload_iter_stats){ .iter = iter };
+}
+
+/* Charge the time since @start to @phase, returns the current time */
+static u64 offload_phase_add(enum offload_phase phase, u64 start)
+{
+	u64 now = ktime_get_ns();
+
+	offload_cur.phase_ns[phase] += now - start;
+	return now;
+}
+
+static void offload_phase_trace(enum offload_phase phase, unsigned long count)
+{
+	int iter = offload_cur.iter;
+	u64 ns = offload_cur.phase_ns[phase];
+
+	switch (phase) {
+	case OFFLOAD_PHASE_PREPARE:
+		trace_ksm_offload_prepare_metadata(iter, ns, count);
+		break;
+	case OFFLOAD_PHASE_REGISTER:
+		trace_ksm_offload_register(iter, ns, count);
+		break;
+	case OFFLOAD_PHASE_SEND:
+		trace_ksm_offload_send(iter, ns, count);
+		break;
+	case OFFLOAD_PHASE_WAIT:
+		trace_ksm_offload_wait(iter, ns, count);
+		break;
+	case OFFLOAD_PHASE_RECV:
+		trace_ksm_offload_recv(iter, ns, count);
+		break;
+	case OFFLOAD_PHASE_APPLY:
+		trace_ksm_offload_apply(iter, ns, count);
+		break;
+	case OFFLOAD_PHASE_DESTROY:
+		trace_ksm_offload_destroy(iter, ns, count);
+		break;
+	default:
+		break;
+	}
+}
+
+static void offload_stats_finish(unsigned long pages_scanned)
+{
+	offload_cur.pages_scanned = pages_scanned;
+	offload_cur.disconnected = offload_server_status == DISCONNECTED;
+
+	trace_ksm_offload_iteration(offload_cur.iter, pages_scanned,
+				    offload_cur.stable_merges, offload_cur.unstable_merges,
+				    offload_cur.failures, offload_cur.disconnected);
+
+	mutex_lock(&offload_stats_lock);
+	offload_stats_ring[offload_stats_nr % OFFLOAD_STATS_NR] = offload_cur;
+	offload_stats_nr++;
+	mutex_unlock(&offload_stats_lock);
+}
+
 #ifdef CONFIG_NUMA
 /* Zeroed when merging across nodes is not allowed */
 static unsigned int ksm_merge_across_nodes = 1;
@@ -616,6 +1053,18 @@ static __always_inline bool is_stable_node_dup(struct ksm_stable_node *dup)
 	return dup->head == STABLE_NODE_DUP_HEAD;
 }
 
+static __always_inline bool is_stable_node_fp(struct ksm_stable_node *stable_node)
+{
+	return stable_node->head == STABLE_NODE_FP_HEAD;
+}
+
+static inline void stable_node_fp_del(struct ksm_stable_node *stable_node)
+{
+	VM_BUG_ON(!is_stable_node_fp(stable_node));
+	hash_del(&stable_node->hlist_dup);
+	ksm_stable_fp_nodes--;
+}
+
 static inline void stable_node_chain_add_dup(struct ksm_stable_node *dup,
 					     struct ksm_stable_node *chain)
 {
@@ -638,6 +1087,8 @@ static inline void stable_node_dup_del(struct ksm_stable_node *dup)
 	VM_BUG_ON(is_stable_node_chain(dup));
 	if (is_stable_node_dup(dup))
 		__stable_node_dup_del(dup);
+	else if (is_stable_node_fp(dup))
+		stable_node_fp_del(dup);
 	else
 		rb_erase(&dup->node, root_stable_tree + NUMA(dup->nid));
 #ifdef CONFIG_DEBUG_VM
@@ -1261,7 +1712,8 @@ static int remove_stable_node_chain(struct ksm_stable_node *stable_node,
 static int remove_all_stable_nodes(void)
 {
 	struct ksm_stable_node *stable_node, *next;
-	int nid;
+	struct hlist_node *tmp;
+	int nid, bkt;
 	int err = 0;
 
 	for (nid = 0; nid < ksm_nr_node_ids; nid++) {
@@ -1276,6 +1728,11 @@ static int remove_all_stable_nodes(void)
 			cond_resched();
 		}
 	}
+	hash_for_each_safe(stable_fp_hash, bkt, tmp, stable_node, hlist_dup) {
+		if (remove_stable_node(stable_node))
+			err = -EBUSY;
+		cond_resched();
+	}
 	list_for_each_entry_safe(stable_node, next, &migrate_nodes, list) {
 		if (remove_stable_node(stable_node))
 			err = -EBUSY;
@@ -1365,104 +1822,465 @@ static u32 calc_checksum(struct page *page)
 	return checksum;
 }
 
-static int write_protect_page(struct vm_area_struct *vma, struct page *page,
-			      pte_t *orig_pte)
+static void offload_tlb_gather_flush(void)
 {
-	struct mm_struct *mm = vma->vm_mm;
-	DEFINE_PAGE_VMA_WALK(pvmw, page, vma, 0, 0);
-	int swapped;
-	int err = -EFAULT;
+	struct offload_tlb_gather *gather = &offload_tlb_gather;
+	int i;
+
+	if (!gather->mm)
+		return;
+
+	flush_tlb_mm(gather->mm);
+	dec_tlb_flush_pending(gather->mm);
+	for (i = 0; i < gather->nr; i++)
+		folio_put(gather->folios[i]);
+	mmdrop(gather->mm);
+	offload_batch_flushes++;
+
+	gather->mm = NULL;
+	gather->nr = 0;
+}
+
+/*
+ * Whether replace_page() may hold back its flush for @mm, with room for one
+ * more page. Must be called before the page table lock is taken.
+ */
+static bool offload_tlb_gather_mm(struct mm_struct *mm)
+{
+	struct offload_tlb_gather *gather = &offload_tlb_gather;
+
+	if (!offload_tlb_gathering)
+		return false;
+
+	if (gather->mm != mm || gather->nr == OFFLOAD_TLB_GATHER_MAX)
+		offload_tlb_gather_flush();
+	if (!gather->mm) {
+		mmgrab(mm);
+		inc_tlb_flush_pending(mm);
+		gather->mm = mm;
+	}
+	return true;
+}
+
+/*
+ * The flush the gather holds back only leaves read-only entries for pages
+ * that are no longer mapped, so it does not count for write_protect_page().
+ */
+static bool offload_tlb_flush_pending(struct mm_struct *mm)
+{
+	if (offload_tlb_gather.mm == mm)
+		return mm_tlb_flush_nested(mm);
+	return mm_tlb_flush_pending(mm);
+}
+
+/*
+ * Write-protect the batched pages of one page table as write_protect_page()
+ * does one, with one notifier range and one flush for all of them. Pages it
+ * leaves alone go through write_protect_page() as before.
+ */
+static void offload_wp_batch_flush(void)
+{
+	struct offload_wp_entry *entry;
+	struct vm_area_struct *flush_vma = NULL;
 	struct mmu_notifier_range range;
-	bool anon_exclusive;
-	pte_t entry;
+	struct mm_struct *mm;
+	struct page *page;
+	unsigned long start, end, addr;
+	pte_t *pte, *ptep, pteval;
+	spinlock_t *ptl;
+	pmd_t *pmd, pmde;
+	int i, nr = offload_wp_batch_nr;
+	int swapped;
 
-	pvmw.address = page_address_in_vma(page, vma);
-	if (pvmw.address == -EFAULT)
-	{
-		DEBUG_LOG("page_address_in_vma failed\n");
-		fail_reason_cnts[Page_address_in_vma_failed]++;
-		goto out;
+	offload_wp_batch_nr = 0;
+	if (!nr)
+		return;
+
+	mm = offload_wp_batch[0].rmap_item->mm;
+	start = ULONG_MAX;
+	end = 0;
+
+	mmap_read_lock(mm);
+	for (i = 0; i < nr; i++) {
+		entry = &offload_wp_batch[i];
+		page = entry->rmap_item->page;
+		addr = entry->rmap_item->address & PAGE_MASK;
+		entry->cleared = false;
+		entry->vma = find_mergeable_vma(mm, addr);
+		if (!entry->vma)
+			continue;
+		if (!PageAnon(page) || PageTransCompound(page) ||
+		    !trylock_page(page)) {
+			entry->vma = NULL;
+			continue;
+		}
+		start = min(start, addr);
+		end = max(end, addr + PAGE_SIZE);
 	}
+	if (start >= end)
+		goto out;
 
-	BUG_ON(PageTransCompound(page));
+	pmd = mm_find_pmd(mm, start);
+	if (!pmd)
+		goto out_unlock_pages;
+	pmde = pmdp_get_lockless(pmd);
+	if (!pmd_present(pmde) || pmd_trans_huge(pmde))
+		goto out_unlock_pages;
 
-	mmu_notifier_range_init(&range, MMU_NOTIFY_CLEAR, 0, mm, pvmw.address,
-				pvmw.address + PAGE_SIZE);
+	mmu_notifier_range_init(&range, MMU_NOTIFY_CLEAR, 0, mm, start, end);
 	mmu_notifier_invalidate_range_start(&range);
 
-	if (!page_vma_mapped_walk(&pvmw))
-	{
-		DEBUG_LOG("page_vma_mapped_walk failed\n");
+	pte = pte_offset_map_lock(mm, pmd, start, &ptl);
+	if (!pte)
 		goto out_mn;
+
+	for (i = 0; i < nr; i++) {
+		entry = &offload_wp_batch[i];
+		if (!entry->vma)
+			continue;
+		page = entry->rmap_item->page;
+		addr = entry->rmap_item->address & PAGE_MASK;
+		ptep = pte + ((addr - start) >> PAGE_SHIFT);
+		pteval = ptep_get(ptep);
+		if (!pte_present(pteval) || pte_pfn(pteval) != page_to_pfn(page))
+			continue;
+		if (!pte_write(pteval) && !pte_dirty(pteval) &&
+		    !PageAnonExclusive(page))
+			continue;
+
+		flush_cache_page(entry->vma, addr, page_to_pfn(page));
+		entry->orig_pte = ptep_get_and_clear(mm, addr, ptep);
+		entry->cleared = true;
+		if (!flush_vma)
+			flush_vma = entry->vma;
 	}
-	if (WARN_ONCE(!pvmw.pte, "Unexpected PMD mapping?"))
-	{
-		DEBUG_LOG("pvmw.pte is NULL\n");
-		fail_reason_cnts[Pvmw_pte_is_null]++;
-		goto out_unlock;
+
+	if (flush_vma) {
+		/* No O_DIRECT or GUP-fast can start on the pages from here */
+		flush_tlb_range(flush_vma, start, end);
+		offload_batch_flushes++;
 	}
 
-	anon_exclusive = PageAnonExclusive(page);
-	entry = ptep_get(pvmw.pte);
-	if (pte_write(entry) || pte_dirty(entry) ||
-	    anon_exclusive || mm_tlb_flush_pending(mm)) {
+	for (i = 0; i < nr; i++) {
+		entry = &offload_wp_batch[i];
+		if (!entry->cleared)
+			continue;
+		page = entry->rmap_item->page;
+		addr = entry->rmap_item->address & PAGE_MASK;
+		ptep = pte + ((addr - start) >> PAGE_SHIFT);
+		pteval = entry->orig_pte;
+
 		swapped = PageSwapCache(page);
-		flush_cache_page(vma, pvmw.address, page_to_pfn(page));
-		/*
-		 * Ok this is tricky, when get_user_pages_fast() run it doesn't
-		 * take any lock, therefore the check that we are going to make
-		 * with the pagecount against the mapcount is racy and
-		 * O_DIRECT can happen right after the check.
-		 * So we clear the pte and flush the tlb before the check
-		 * this assure us that no O_DIRECT can happen after the check
-		 * or in the middle of the check.
-		 *
-		 * No need to notify as we are downgrading page table to read
-		 * only not changing it to point to a new page.
-		 *
-		 * See Documentation/mm/mmu_notifier.rst
-		 */
-		entry = ptep_clear_flush(vma, pvmw.address, pvmw.pte);
-		/*
-		 * Check that no O_DIRECT or similar I/O is in progress on the
-		 * page
-		 */
+		/* write_protect_page() retries it and counts an LRU cached page */
 		if (page_mapcount(page) + 1 + swapped != page_count(page)) {
-			set_pte_at(mm, pvmw.address, pvmw.pte, entry);
-			DEBUG_LOG("page_mapcount(%d) + 1 + swapped(%d) != page_count(%d)\n",
-				page_mapcount(page), swapped,
-				page_count(page));
-			fail_reason_cnts[Page_mapcount_unequal]++;
-			goto out_unlock;
+			set_pte_at(mm, addr, ptep, pteval);
+			continue;
 		}
-
-		/* See folio_try_share_anon_rmap_pte(): clear PTE first. */
-		if (anon_exclusive &&
+		if (PageAnonExclusive(page) &&
 		    folio_try_share_anon_rmap_pte(page_folio(page), page)) {
-			set_pte_at(mm, pvmw.address, pvmw.pte, entry);
-			DEBUG_LOG("anon_exclusive page is shared\n");
-			fail_reason_cnts[Page_is_shared]++;
-			goto out_unlock;
+			set_pte_at(mm, addr, ptep, pteval);
+			continue;
 		}
 
-		if (pte_dirty(entry))
+		if (pte_dirty(pteval))
 			set_page_dirty(page);
-		entry = pte_mkclean(entry);
-
-		if (pte_write(entry))
-			entry = pte_wrprotect(entry);
-
-		set_pte_at_notify(mm, pvmw.address, pvmw.pte, entry);
+		pteval = pte_mkclean(pteval);
+		if (pte_write(pteval))
+			pteval = pte_wrprotect(pteval);
+		set_pte_at_notify(mm, addr, ptep, pteval);
+		offload_batch_protected++;
 	}
-	*orig_pte = entry;
-	err = 0;
-
-out_unlock:
-	page_vma_mapped_walk_done(&pvmw);
+	pte_unmap_unlock(pte, ptl);
 out_mn:
 	mmu_notifier_invalidate_range_end(&range);
+out_unlock_pages:
+	for (i = 0; i < nr; i++) {
+		if (offload_wp_batch[i].vma)
+			unlock_page(offload_wp_batch[i].rmap_item->page);
+	}
 out:
-	return err;
+	mmap_read_unlock(mm);
+}
+
+static void offload_wp_batch_add(struct ksm_rmap_item *rmap_item)
+{
+	struct ksm_rmap_item *first = offload_wp_batch[0].rmap_item;
+
+	if (!rmap_item || !rmap_item->page)
+		return;
+
+	if (offload_wp_batch_nr &&
+	    (first->mm != rmap_item->mm ||
+	     (first->address & PMD_MASK) != (rmap_item->address & PMD_MASK) ||
+	     offload_wp_batch_nr == PTRS_PER_PTE))
+		offload_wp_batch_flush();
+
+	offload_wp_batch[offload_wp_batch_nr++].rmap_item = rmap_item;
+}
+
+static struct ksm_rmap_item *offload_wp_batch_lookup(struct list_head *shadow_pt_list,
+						      int mm_id, unsigned long va)
+{
+	struct shadow_mm *shadow = get_shadow_mm(shadow_pt_list, mm_id);
+
+	return shadow ? shadow_mm_lookup(shadow, va) : NULL;
+}
+
+/*
+ * Write-protect every page the result merges before apply_result() does, a
+ * page table at a time. The server logs merges in the order it scanned the
+ * shadow mms, so pages of one page table mostly come together.
+ */
+static void offload_wrprotect_batch(struct list_head *shadow_pt_list,
+				    struct result_table *result)
+{
+	struct ksm_event_log *log_entry;
+	int i;
+
+	for (i = 0; i < result->total_cnt; i++) {
+		log_entry = &result->entry_tables[i / MAX_RESULT_TABLE_ENTRIES]
+						 [i % MAX_RESULT_TABLE_ENTRIES];
+
+		switch (log_entry->type) {
+		case DPU_STABLE_MERGE:
+			offload_wp_batch_add(offload_wp_batch_lookup(shadow_pt_list,
+					log_entry->stable_merge.from_mm_id,
+					log_entry->stable_merge.from_va));
+			break;
+		case DPU_UNSTABLE_MERGE:
+			offload_wp_batch_add(offload_wp_batch_lookup(shadow_pt_list,
+					log_entry->unstable_merge.from_mm_id,
+					log_entry->unstable_merge.from_va));
+			offload_wp_batch_add(offload_wp_batch_lookup(shadow_pt_list,
+					log_entry->unstable_merge.to_mm_id,
+					log_entry->unstable_merge.to_va));
+			break;
+		default:
+			break;
+		}
+		cond_resched();
+	}
+	offload_wp_batch_flush();
+}
+
+/* Where the NIC reads an exported page: its slot in the shadow mm's page MRs */
+static bool offload_verify_addr(struct list_head *shadow_pt_list, int mm_id,
+				unsigned long va, u32 *rkey, u64 *addr)
+{
+	struct shadow_mm *shadow = get_shadow_mm(shadow_pt_list, mm_id);
+	struct ib_mr *mr;
+	int idx;
+
+	if (!shadow)
+		return false;
+
+	/* Pages are registered in the order of their entries */
+	idx = shadow_mm_index(shadow, va);
+	if (idx < 0)
+		return false;
+
+	mr = shadow->pages_mr[idx / MAX_PAGES_IN_SGL];
+	*rkey = mr->rkey;
+	*addr = mr->iova + (u64)(idx % MAX_PAGES_IN_SGL) * PAGE_SIZE;
+	return true;
+}
+
+/*
+ * Ask the server to compare the pages of every merge in the result, after
+ * offload_wrprotect_batch() and while the shadow mms are still registered.
+ * A stable merge's kpage is not exported, so it is named by its physical
+ * address, which needs the PD's global rkey; without it the host compares.
+ */
+static void offload_nic_verify(struct list_head *shadow_pt_list,
+			       struct result_table *result)
+{
+	struct ib_pd *pd = ksm_cb->pd;
+	bool global_rkey = pd->flags & IB_PD_UNSAFE_GLOBAL_RKEY;
+	struct ksm_event_log *log_entry, *answer, pair;
+	struct result_table *answers;
+	int i, nr = 0, *pair_idx;
+	bool ok;
+
+	if (!result->total_cnt)
+		return;
+
+	offload_verdicts = kvcalloc(result->total_cnt, sizeof(*offload_verdicts),
+				    GFP_KERNEL);
+	pair_idx = kvmalloc_array(result->total_cnt, sizeof(*pair_idx), GFP_KERNEL);
+	if (!offload_verdicts || !pair_idx)
+		goto out;
+
+	for (i = 0; i < result->total_cnt; i++) {
+		log_entry = &result->entry_tables[i / MAX_RESULT_TABLE_ENTRIES]
+						 [i % MAX_RESULT_TABLE_ENTRIES];
+
+		memset(&pair, 0, sizeof(pair));
+		switch (log_entry->type) {
+		case DPU_STABLE_MERGE:
+			ok = global_rkey &&
+			     offload_verify_addr(shadow_pt_list,
+						 log_entry->stable_merge.from_mm_id,
+						 log_entry->stable_merge.from_va,
+						 &pair.verify_pair.rkey[0],
+						 &pair.verify_pair.addr[0]);
+			pair.verify_pair.rkey[1] = pd->unsafe_global_rkey;
+			pair.verify_pair.addr[1] = PFN_PHYS(log_entry->stable_merge.kpfn);
+			break;
+		case DPU_UNSTABLE_MERGE:
+			ok = offload_verify_addr(shadow_pt_list,
+						 log_entry->unstable_merge.from_mm_id,
+						 log_entry->unstable_merge.from_va,
+						 &pair.verify_pair.rkey[0],
+						 &pair.verify_pair.addr[0]) &&
+			     offload_verify_addr(shadow_pt_list,
+						 log_entry->unstable_merge.to_mm_id,
+						 log_entry->unstable_merge.to_va,
+						 &pair.verify_pair.rkey[1],
+						 &pair.verify_pair.addr[1]);
+			break;
+		default:
+			ok = false;
+			break;
+		}
+		if (!ok)
+			continue;
+		if (insert_error_log(ksm_verify_table, HOST_VERIFY_PAIR, &pair))
+			break;
+		pair_idx[nr++] = i;
+	}
+	if (!nr)
+		goto out;
+
+	answers = rdma_verify_pairs();
+	if (!answers)
+		goto out;
+
+	for (i = 0; i < nr; i++) {
+		answer = &answers->entry_tables[i / MAX_RESULT_TABLE_ENTRIES]
+					       [i % MAX_RESULT_TABLE_ENTRIES];
+		if (answer->type == DPU_VERIFY_SAME) {
+			offload_verdicts[pair_idx[i]] = OFFLOAD_VERIFIED_SAME;
+		} else {
+			offload_verdicts[pair_idx[i]] = OFFLOAD_VERIFIED_DIFF;
+			offload_verify_diff++;
+		}
+	}
+	offload_verify_pairs = nr;
+	/* The verify round's reads count against the iteration's PCIe budget */
+	offload_cur.pcie_read_bytes += answers->pcie_read_bytes;
+	free_result_table(answers);
+out:
+	kvfree(pair_idx);
+}
+
+static enum offload_verdict offload_verdict(int idx)
+{
+	return offload_verdicts ? offload_verdicts[idx] : OFFLOAD_UNVERIFIED;
+}
+
+static int write_protect_page(struct vm_area_struct *vma, struct page *page,
+			      pte_t *orig_pte)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	DEFINE_PAGE_VMA_WALK(pvmw, page, vma, 0, 0);
+	int swapped;
+	int err = -EFAULT;
+	struct mmu_notifier_range range;
+	bool anon_exclusive;
+	pte_t entry;
+
+	pvmw.address = page_address_in_vma(page, vma);
+	if (pvmw.address == -EFAULT)
+	{
+		DEBUG_LOG("page_address_in_vma failed\n");
+		fail_reason_cnts[Page_address_in_vma_failed]++;
+		goto out;
+	}
+
+	BUG_ON(PageTransCompound(page));
+
+	mmu_notifier_range_init(&range, MMU_NOTIFY_CLEAR, 0, mm, pvmw.address,
+				pvmw.address + PAGE_SIZE);
+	mmu_notifier_invalidate_range_start(&range);
+
+	if (!page_vma_mapped_walk(&pvmw))
+	{
+		DEBUG_LOG("page_vma_mapped_walk failed\n");
+		goto out_mn;
+	}
+	if (WARN_ONCE(!pvmw.pte, "Unexpected PMD mapping?"))
+	{
+		DEBUG_LOG("pvmw.pte is NULL\n");
+		fail_reason_cnts[Pvmw_pte_is_null]++;
+		goto out_unlock;
+	}
+
+	anon_exclusive = PageAnonExclusive(page);
+	entry = ptep_get(pvmw.pte);
+	if (pte_write(entry) || pte_dirty(entry) ||
+	    anon_exclusive || offload_tlb_flush_pending(mm)) {
+		/* It may have changed after the NIC compared it */
+		offload_nic_verified = false;
+		swapped = PageSwapCache(page);
+		flush_cache_page(vma, pvmw.address, page_to_pfn(page));
+		/*
+		 * Ok this is tricky, when get_user_pages_fast() run it doesn't
+		 * take any lock, therefore the check that we are going to make
+		 * with the pagecount against the mapcount is racy and
+		 * O_DIRECT can happen right after the check.
+		 * So we clear the pte and flush the tlb before the check
+		 * this assure us that no O_DIRECT can happen after the check
+		 * or in the middle of the check.
+		 *
+		 * No need to notify as we are downgrading page table to read
+		 * only not changing it to point to a new page.
+		 *
+		 * See Documentation/mm/mmu_notifier.rst
+		 */
+		entry = ptep_clear_flush(vma, pvmw.address, pvmw.pte);
+		/*
+		 * Check that no O_DIRECT or similar I/O is in progress on the
+		 * page
+		 */
+		if (page_mapcount(page) + 1 + swapped != page_count(page)) {
+			/* Likely the reference of a per-cpu LRU batch */
+			if (!PageLRU(page))
+				offload_lru_cached++;
+			set_pte_at(mm, pvmw.address, pvmw.pte, entry);
+			DEBUG_LOG("page_mapcount(%d) + 1 + swapped(%d) != page_count(%d)\n",
+				page_mapcount(page), swapped,
+				page_count(page));
+			fail_reason_cnts[Page_mapcount_unequal]++;
+			goto out_unlock;
+		}
+
+		/* See folio_try_share_anon_rmap_pte(): clear PTE first. */
+		if (anon_exclusive &&
+		    folio_try_share_anon_rmap_pte(page_folio(page), page)) {
+			set_pte_at(mm, pvmw.address, pvmw.pte, entry);
+			DEBUG_LOG("anon_exclusive page is shared\n");
+			fail_reason_cnts[Page_is_shared]++;
+			goto out_unlock;
+		}
+
+		if (pte_dirty(entry))
+			set_page_dirty(page);
+		entry = pte_mkclean(entry);
+
+		if (pte_write(entry))
+			entry = pte_wrprotect(entry);
+
+		set_pte_at_notify(mm, pvmw.address, pvmw.pte, entry);
+	}
+	*orig_pte = entry;
+	err = 0;
+
+out_unlock:
+	page_vma_mapped_walk_done(&pvmw);
+out_mn:
+	mmu_notifier_invalidate_range_end(&range);
+out:
+	return err;
 }
 
 /**
@@ -1488,6 +2306,7 @@ static int replace_page(struct vm_area_struct *vma, struct page *page,
 	unsigned long addr;
 	int err = -EFAULT;
 	struct mmu_notifier_range range;
+	bool gather;
 
 	addr = page_address_in_vma(page, vma);
 	if (addr == -EFAULT)
@@ -1505,6 +2324,8 @@ static int replace_page(struct vm_area_struct *vma, struct page *page,
 	if (!pmd_present(pmde) || pmd_trans_huge(pmde))
 		goto out;
 
+	gather = offload_tlb_gather_mm(mm);
+
 	mmu_notifier_range_init(&range, MMU_NOTIFY_CLEAR, 0, mm, addr,
 				addr + PAGE_SIZE);
 	mmu_notifier_invalidate_range_start(&range);
@@ -1552,15 +2373,25 @@ static int replace_page(struct vm_area_struct *vma, struct page *page,
 	 * read only page with the same content.
 	 *
 	 * See Documentation/mm/mmu_notifier.rst
+	 *
+	 * When gathering, the old page stays held until the flush instead.
 	 */
-	ptep_clear_flush(vma, addr, ptep);
+	if (gather)
+		ptep_get_and_clear(mm, addr, ptep);
+	else
+		ptep_clear_flush(vma, addr, ptep);
 	set_pte_at_notify(mm, addr, ptep, newpte);
 
 	folio = page_folio(page);
 	folio_remove_rmap_pte(folio, page, vma);
 	if (!folio_mapped(folio))
 		folio_free_swap(folio);
-	folio_put(folio);
+	if (gather) {
+		offload_tlb_gather.folios[offload_tlb_gather.nr++] = folio;
+		offload_batch_deferred++;
+	} else {
+		folio_put(folio);
+	}
 
 	pte_unmap_unlock(ptep, ptl);
 	err = 0;
@@ -1639,7 +2470,7 @@ static int try_to_merge_one_page(struct vm_area_struct *vma,
 			if (!PageDirty(page))
 				SetPageDirty(page);
 			err = 0;
-		} else if (pages_identical(page, kpage)) {
+		} else if (offload_nic_verified || pages_identical(page, kpage)) {
 			err = replace_page(vma, page, kpage, orig_pte);
 		} else {
 			DEBUG_LOG("Pages are not identical\n");
@@ -2302,6 +3133,65 @@ again:
 	return stable_node_dup;
 }
 
+/*
+ * stable_tree_insert_fp - insert a stable node for a page the offload merged
+ * into stable_fp_hash, under the fingerprint the NIC sent with the merge.
+ *
+ * The NIC already matched the content, so unlike stable_tree_insert() this
+ * walks no tree and compares no pages. A node already under the fingerprint
+ * is counted as a dup stable_tree_insert() would have chained, a 32-bit
+ * fingerprint rarely collides.
+ */
+static struct ksm_stable_node *stable_tree_insert_fp(struct page *kpage, u32 fp)
+{
+	int nid;
+	unsigned long kpfn;
+	struct ksm_stable_node *stable_node;
+
+	kpfn = page_to_pfn(kpage);
+	nid = get_kpfn_nid(kpfn);
+
+	hash_for_each_possible(stable_fp_hash, stable_node, hlist_dup, fp) {
+		if (stable_node->fp == fp && NUMA(stable_node->nid) == nid) {
+			offload_fp_dups++;
+			break;
+		}
+	}
+
+	stable_node = alloc_stable_node();
+	if (!stable_node)
+		return NULL;
+
+	INIT_HLIST_HEAD(&stable_node->hlist);
+	stable_node->kpfn = kpfn;
+	set_page_stable_node(kpage, stable_node);
+	stable_node->rmap_hlist_len = 0;
+	DO_NUMA(stable_node->nid = nid);
+	stable_node->head = STABLE_NODE_FP_HEAD;
+	stable_node->fp = fp;
+	hash_add(stable_fp_hash, &stable_node->hlist_dup, fp);
+	ksm_stable_fp_nodes++;
+
+	return stable_node;
+}
+
+/*
+ * Hand the nodes in stable_fp_hash over to the stable tree once ksmd scans on
+ * the CPU again: cmp_and_merge_page() places nodes from migrate_nodes.
+ */
+static void stable_fp_release(void)
+{
+	struct ksm_stable_node *stable_node;
+	struct hlist_node *tmp;
+	int bkt;
+
+	hash_for_each_safe(stable_fp_hash, bkt, tmp, stable_node, hlist_dup) {
+		stable_node_fp_del(stable_node);
+		stable_node->head = &migrate_nodes;
+		list_add(&stable_node->list, stable_node->head);
+	}
+}
+
 /*
  * unstable_tree_search_insert - search for identical page,
  * else insert rmap_item into the unstable tree.
@@ -2430,8 +3320,10 @@ static void stable_tree_append(struct ksm_rmap_item *rmap_item,
  *
  * @page: the page that we are searching identical page to.
  * @rmap_item: the reverse mapping into the virtual address of this page
+ * @precomputed_checksum: checksum already taken in a dataplane batch, or NULL
  */
-static void cmp_and_merge_page(struct page *page, struct ksm_rmap_item *rmap_item)
+static void cmp_and_merge_page(struct page *page, struct ksm_rmap_item *rmap_item,
+			       const u32 *precomputed_checksum)
 {
 	struct mm_struct *mm = rmap_item->mm;
 	struct ksm_rmap_item *tree_rmap_item;
@@ -2496,7 +3388,8 @@ static void cmp_and_merge_page(struct page *page, struct ksm_rmap_item *rmap_ite
 	 * don't want to insert it in the unstable tree, and we don't want
 	 * to waste our time searching for something identical to it there.
 	 */
-	checksum = do_calc_checksum(page);
+	checksum = precomputed_checksum ? *precomputed_checksum :
+					  do_calc_checksum(page);
 	if (rmap_item->oldchecksum != checksum) {
 		rmap_item->oldchecksum = checksum;
 		return;
@@ -2878,59 +3771,310 @@ static int iter_cnt = 0;
  * ksm_do_scan  - the ksm scanner main worker function.
  * @scan_npages:  number of pages we want to scan before we return.
  */
-static void ksm_do_scan(unsigned int scan_npages)
+/*
+ * Dataplane offload: collect a run of rmap_items and hash all their pages on
+ * the NIC in one round trip, then merge them one by one as usual. Each item
+ * pins its mm, so an exiting mm cannot free the batched rmap_items under us.
+ *
+ * Two batches are kept: while the NIC hashes one, the previous one is merged
+ * on the host, so the round trip is hidden behind cmp_and_merge_page().
+ */
+struct styx_scan_batch {
+	struct ksm_rmap_item *rmap_items[MAX_BATCH_OPS];
+	struct page *pages[MAX_BATCH_OPS];
+	struct mm_struct *mms[MAX_BATCH_OPS];
+	int cnt;
+	bool submitted;
+	bool hashed;
+	struct styx_batch ops;
+};
+
+/*
+ * A third batch stands in for one that timed out: the NIC may still read its
+ * pages and the CQ handler still writes its results, so it keeps its page and
+ * mm references until the completion comes in.
+ */
+static struct styx_scan_batch styx_scan_batches[3];
+static struct styx_scan_batch *styx_scan_orphan;
+static DECLARE_WAIT_QUEUE_HEAD(styx_scan_wait);
+
+/* Called from the CQ handler */
+static void styx_scan_batch_done(struct styx_batch *batch)
+{
+	wake_up(&styx_scan_wait);
+}
+
+/* Returns false once the scan has no more rmap_items to give */
+static bool styx_scan_batch_fill(struct styx_scan_batch *sb, unsigned int *npages,
+				 unsigned int batch_size)
 {
 	struct ksm_rmap_item *rmap_item;
 	struct page *page;
-	unsigned int npages = scan_npages;
 
-	if (is_ksm_offload()) {
-		struct result_table* result;
-		struct list_head *shadow_pt_list;
+	sb->cnt = 0;
+	sb->submitted = false;
+	while (sb->cnt < batch_size && *npages) {
+		cond_resched();
+		rmap_item = scan_get_next_rmap_item(&page);
+		if (!rmap_item)
+			return false;
+		(*npages)--;
 
-		lru_add_drain_all();
-		// prune_stable_tree();
-		DEBUG_TIME_START(bask_create_mm);
-		if (prepare_metadata(get_ksm_cb())) {
-			DEBUG_TIME_END(bask_create_mm);
-			// pr_info("Sleep for a while, break the mapping now\n");
-			// msleep(30);
-			
-			DEBUG_TIME_START(bask_iteration_time);
-			shadow_pt_list = rdma_send_metadata();
-			
-			result = recv_offload_result(&ksm_pages_scanned);  
-			DEBUG_TIME_END(bask_iteration_time);
+		/*
+		 * Exiting mm: its rmap_items go away on the next scan step,
+		 * which may run before this batch is merged, so drop it here.
+		 */
+		if (!mmget_not_zero(rmap_item->mm)) {
+			put_page(page);
+			break;
+		}
 
-			DEBUG_TIME_START(bask_destroy_mm);
-			rdma_unregister_error_table();
-			clear_error_table();
-			DEBUG_TIME_END(bask_destroy_mm);
+		sb->rmap_items[sb->cnt] = rmap_item;
+		sb->pages[sb->cnt] = page;
+		sb->mms[sb->cnt] = rmap_item->mm;
+		sb->ops.ops[sb->cnt].cmd = PAGE_HASH;
+		sb->ops.ops[sb->cnt].pages[0] = page;
+		sb->cnt++;
+	}
+	return true;
+}
 
-			if (result) {
-				DEBUG_TIME_START(bask_commit_time);
-				apply_result(shadow_pt_list, result);
-				DEBUG_TIME_END(bask_commit_time);
-				pr_info("Result table size, %lu\n", 
-					result->total_cnt * sizeof(struct ksm_event_log) + result->tables_cnt * KMALLOC_MAX_SIZE);
-				DEBUG_TIME_START(bask_destroy_mm);
-				free_result_table(result);
-				DEBUG_TIME_END(bask_destroy_mm);
-			} else {
-				offload_server_status = DISCONNECTED;
-				ksm_smart_scan = false;
-				pr_info("Offload server is disconnected\n");
-			}
+static void styx_scan_batch_submit(struct styx_scan_batch *sb)
+{
+	if (!sb->cnt)
+		return;
 
-			DEBUG_TIME_START(bask_destroy_mm);
-			destroy_metadata(offload_server_status == DISCONNECTED, iter_cnt);
+	sb->ops.op_cnt = sb->cnt;
+	sb->ops.done = styx_scan_batch_done;
+	sb->ops.private = sb;
+	sb->submitted = rdma_styx_batch_submit &&
+			!rdma_styx_batch_submit(ksm_cb, &sb->ops);
+}
+
+static void styx_scan_batch_put(struct styx_scan_batch *sb)
+{
+	int i;
+
+	for (i = 0; i < sb->cnt; i++) {
+		put_page(sb->pages[i]);
+		mmput_async(sb->mms[i]);
+	}
+	sb->cnt = 0;
+}
+
+/* Drop the timed out batch's references once the NIC is done with it */
+static void styx_scan_orphan_reap(void)
+{
+	if (styx_scan_orphan &&
+	    smp_load_acquire(&styx_scan_orphan->ops.status) != -EINPROGRESS) {
+		styx_scan_batch_put(styx_scan_orphan);
+		styx_scan_orphan = NULL;
+	}
+}
+
+/* The batch that is neither @a nor @b */
+static struct styx_scan_batch *styx_scan_spare(struct styx_scan_batch *a,
+					       struct styx_scan_batch *b)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(styx_scan_batches); i++) {
+		if (&styx_scan_batches[i] != a && &styx_scan_batches[i] != b)
+			return &styx_scan_batches[i];
+	}
+	return NULL;
+}
+
+static void styx_scan_batch_wait(struct styx_scan_batch *sb)
+{
+	sb->hashed = false;
+	if (sb->submitted) {
+		/* A dead link never completes the batch: merge without the hashes */
+		wait_event_timeout(styx_scan_wait,
+				   smp_load_acquire(&sb->ops.status) != -EINPROGRESS, HZ);
+		if (smp_load_acquire(&sb->ops.status) == -EINPROGRESS) {
+			/* Only one batch is in flight, a previous orphan is complete */
+			styx_scan_orphan_reap();
+			styx_scan_orphan = sb;
+			return;
+		}
+		sb->hashed = !sb->ops.status;
+	} else if (sb->cnt && rdma_styx_batch) {
+		/* Async path unavailable, fall back to a synchronous round trip */
+		sb->ops.op_cnt = sb->cnt;
+		sb->hashed = !rdma_styx_batch(ksm_cb, &sb->ops);
+	}
+}
+
+static void styx_scan_batch_merge(struct styx_scan_batch *sb)
+{
+	int i;
+
+	for (i = 0; i < sb->cnt; i++) {
+		u32 checksum = sb->ops.ops[i].value;
+
+		cmp_and_merge_page(sb->pages[i], sb->rmap_items[i],
+				   sb->hashed ? &checksum : NULL);
+	}
+	if (sb != styx_scan_orphan)
+		styx_scan_batch_put(sb);
+}
+
+static unsigned int ksm_do_scan_styx_batch(unsigned int npages)
+{
+	struct styx_scan_batch *cur, *next;
+	unsigned int batch_size = min_t(unsigned int, ksm_styx_batch_size, MAX_BATCH_OPS);
+	bool more;
+
+	styx_scan_orphan_reap();
+	cur = styx_scan_spare(styx_scan_orphan, NULL);
+	next = styx_scan_spare(styx_scan_orphan, cur);
+
+	more = styx_scan_batch_fill(cur, &npages, batch_size);
+	styx_scan_batch_submit(cur);
+
+	while (cur->cnt) {
+		/* Stop prefetching at the end of a round, the next one resets the trees */
+		next->cnt = 0;
+		if (more && npages)
+			more = styx_scan_batch_fill(next, &npages, batch_size);
+
+		/* Only one batch can be in flight: submit next once cur is back */
+		styx_scan_batch_wait(cur);
+		styx_scan_batch_submit(next);
+		styx_scan_batch_merge(cur);
+		/* Leave a timed out batch alone, refill the third one instead */
+		if (cur == styx_scan_orphan)
+			cur = styx_scan_spare(cur, next);
+		swap(cur, next);
+	}
+
+	return npages;
+}
+
+static void ksm_do_scan(unsigned int scan_npages)
+{
+	struct ksm_rmap_item *rmap_item;
+	struct page *page;
+	unsigned int npages = scan_npages;
+
+	if (is_ksm_offload()) {
+		struct result_table* result;
+		struct list_head *shadow_pt_list;
+		unsigned long scanned_before = ksm_pages_scanned;
+		u64 t;
+
+		offload_advisor_start();
+		offload_stats_start(iter_cnt);
+		offload_hot_region_expire(iter_cnt);
+		offload_dirty_tracking_start(iter_cnt);
+		offload_damon_hot_start(iter_cnt);
+		offload_thp_start();
+		offload_lru_drain_start();
+		// prune_stable_tree();
+		DEBUG_TIME_START(bask_create_mm);
+		if (prepare_metadata(get_ksm_cb())) {
+			DEBUG_TIME_END(bask_create_mm);
+			// pr_info("Sleep for a while, break the mapping now\n");
+			// msleep(30);
+			
+			DEBUG_TIME_START(bask_iteration_time);
+			get_ksm_cb()->md_desc_tx.read_rate_mbps = READ_ONCE(ksm_offload_read_rate_mbps);
+			get_ksm_cb()->md_desc_tx.hot_region_pct = READ_ONCE(ksm_offload_hot_region_pct);
+			get_ksm_cb()->md_desc_tx.dirty_tracking = offload_clean_dirty;
+			t = ktime_get_ns();
+			shadow_pt_list = rdma_send_metadata();
+			t = offload_phase_add(OFFLOAD_PHASE_SEND, t);
+			offload_phase_trace(OFFLOAD_PHASE_SEND, offload_cur.metadata_bytes);
+			
+			result = recv_offload_result(&ksm_pages_scanned);  
+			if (result) {
+				/* Waiting for the server ends when its result descriptor arrives */
+				offload_cur.pcie_read_bytes = result->pcie_read_bytes;
+				offload_cur.phase_ns[OFFLOAD_PHASE_WAIT] = result->arrived_ns - t;
+				offload_phase_trace(OFFLOAD_PHASE_WAIT, result->pcie_read_bytes);
+				offload_phase_add(OFFLOAD_PHASE_RECV, result->arrived_ns);
+				offload_phase_trace(OFFLOAD_PHASE_RECV, result->total_cnt);
+			} else {
+				offload_phase_add(OFFLOAD_PHASE_WAIT, t);
+				offload_phase_trace(OFFLOAD_PHASE_WAIT, 0);
+			}
+			DEBUG_TIME_END(bask_iteration_time);
+
+			t = ktime_get_ns();
+			DEBUG_TIME_START(bask_destroy_mm);
+			rdma_unregister_error_table();
+			clear_error_table();
+			DEBUG_TIME_END(bask_destroy_mm);
+			offload_phase_add(OFFLOAD_PHASE_DESTROY, t);
+
+			if (result) {
+				t = ktime_get_ns();
+				DEBUG_TIME_START(bask_commit_time);
+				apply_result(shadow_pt_list, result);
+				DEBUG_TIME_END(bask_commit_time);
+				offload_phase_add(OFFLOAD_PHASE_APPLY, t);
+				offload_phase_trace(OFFLOAD_PHASE_APPLY,
+						    offload_cur.stable_merges + offload_cur.unstable_merges);
+
+				offload_cur.result_bytes = result->total_cnt * sizeof(struct ksm_event_log) +
+							   result->tables_cnt * KMALLOC_MAX_SIZE;
+				OFFLOAD_LOG("Result table size, %lu\n", offload_cur.result_bytes);
+				t = ktime_get_ns();
+				DEBUG_TIME_START(bask_destroy_mm);
+				free_result_table(result);
+				DEBUG_TIME_END(bask_destroy_mm);
+				offload_phase_add(OFFLOAD_PHASE_DESTROY, t);
+			} else {
+				offload_server_status = DISCONNECTED;
+				ksm_smart_scan = false;
+				stable_fp_release();
+				pr_info("Offload server is disconnected\n");
+			}
+
+			t = ktime_get_ns();
+			DEBUG_TIME_START(bask_destroy_mm);
+			destroy_metadata(offload_server_status == DISCONNECTED, iter_cnt);
 			DEBUG_TIME_END(bask_destroy_mm);
+			offload_phase_add(OFFLOAD_PHASE_DESTROY, t);
+			offload_phase_trace(OFFLOAD_PHASE_DESTROY, offload_cur.nr_mms);
+			offload_thp_split_queued();
 			// msleep(3000);
 		} else {
 			DEBUG_TIME_END(bask_create_mm);
 		}
-		pr_info("[Log] KSM offload iteration, %d, scanned ,%lu, pages\n",
+		OFFLOAD_LOG("[Log] KSM offload iteration, %d, scanned ,%lu, pages\n",
 			iter_cnt, ksm_pages_scanned);
+		if (READ_ONCE(ksm_offload_hot_region_pct))
+			OFFLOAD_LOG("[Log] Hot regions, %lu, skipped, %lu, tracked\n",
+				    offload_hot_regions_skipped, offload_hot_regions_nr);
+		if (offload_clean_dirty)
+			OFFLOAD_LOG("[Log] Dirty tracking, %lu, cleaned, %lu, unchanged\n",
+				    offload_dirty_cleaned, offload_unchanged);
+		OFFLOAD_LOG("[Log] Prepare IPIs, %d, lru drained, %lu, lru cached, %lu, flushes skipped\n",
+			    offload_lru_drained, offload_lru_cached, offload_flushes_skipped);
+		if (offload_prep_queued)
+			OFFLOAD_LOG("[Log] Prepare workers, %u, max active, %lu, mms walked\n",
+				    READ_ONCE(ksm_offload_prep_workers), offload_prep_queued);
+		if (READ_ONCE(ksm_offload_damon_hot_sample))
+			OFFLOAD_LOG("[Log] DAMON hot pages, %lu, skipped, %d, ranges\n",
+				    offload_damon_hot_skipped, offload_damon_hot_nr);
+		if (offload_thp_pct)
+			OFFLOAD_LOG("[Log] THP, %lu, exported, %lu, split\n",
+				    offload_thp_exported, offload_thp_split_nr);
+		if (READ_ONCE(ksm_offload_stable_fp))
+			OFFLOAD_LOG("[Log] Stable fingerprints, %lu, nodes, %lu, dups\n",
+				    ksm_stable_fp_nodes, offload_fp_dups);
+		if (READ_ONCE(ksm_offload_commit_batch))
+			OFFLOAD_LOG("[Log] Commit batching, %lu, protected, %lu, deferred, %lu, flushes\n",
+				    offload_batch_protected, offload_batch_deferred,
+				    offload_batch_flushes);
+		if (READ_ONCE(ksm_offload_nic_verify))
+			OFFLOAD_LOG("[Log] NIC verify, %lu, pairs, %lu, differ\n",
+				    offload_verify_pairs, offload_verify_diff);
+		offload_stats_finish(ksm_pages_scanned - scanned_before);
+		if (offload_server_status != DISCONNECTED)
+			offload_advisor(offload_cur.pcie_read_bytes);
 		print_bask_timers();
 		iter_cnt++;
 		return;
@@ -2938,6 +4082,11 @@ static void ksm_do_scan(unsigned int scan_npages)
 
 DEBUG_TIME_START(ksm_iteration_time);
 
+	if (is_styx_offload() && ksm_styx_batch_size > 1) {
+		npages = ksm_do_scan_styx_batch(scan_npages);
+		goto out;
+	}
+
 	//  && likely(!freezing(current))
 	while (npages--) {
 		cond_resched();
@@ -2947,7 +4096,7 @@ DEBUG_TIME_START(ksm_iteration_time);
 			DEBUG_TIME_END(ksm_ops);
 			goto out;
 		}
-		cmp_and_merge_page(page, rmap_item);
+		cmp_and_merge_page(page, rmap_item, NULL);
 		put_page(page);
 		DEBUG_TIME_END(ksm_ops);
 	}
@@ -3514,8 +4663,9 @@ static void ksm_check_stable_tree(unsigned long start_pfn,
 				  unsigned long end_pfn)
 {
 	struct ksm_stable_node *stable_node, *next;
+	struct hlist_node *tmp;
 	struct rb_node *node;
-	int nid;
+	int nid, bkt;
 
 	for (nid = 0; nid < ksm_nr_node_ids; nid++) {
 		node = rb_first(root_stable_tree + nid);
@@ -3531,6 +4681,12 @@ static void ksm_check_stable_tree(unsigned long start_pfn,
 			cond_resched();
 		}
 	}
+	hash_for_each_safe(stable_fp_hash, bkt, tmp, stable_node, hlist_dup) {
+		if (stable_node->kpfn >= start_pfn &&
+		    stable_node->kpfn < end_pfn)
+			remove_node_from_stable_tree(stable_node);
+		cond_resched();
+	}
 	list_for_each_entry_safe(stable_node, next, &migrate_nodes, list) {
 		if (stable_node->kpfn >= start_pfn &&
 		    stable_node->kpfn < end_pfn)
@@ -3617,6 +4773,9 @@ static ssize_t sleep_millisecs_store(struct kobject *kobj,
 	unsigned int msecs;
 	int err;
 
+	if (ksm_advisor == KSM_ADVISOR_OFFLOAD)
+		return -EINVAL;
+
 	err = kstrtouint(buf, 10, &msecs);
 	if (err)
 		return -EINVAL;
@@ -3641,7 +4800,7 @@ static ssize_t pages_to_scan_store(struct kobject *kobj,
 	unsigned int nr_pages;
 	int err;
 
-	if (ksm_advisor != KSM_ADVISOR_NONE)
+	if (ksm_advisor == KSM_ADVISOR_SCAN_TIME)
 		return -EINVAL;
 
 	err = kstrtouint(buf, 10, &nr_pages);
@@ -3882,6 +5041,27 @@ static ssize_t ksm_zero_pages_show(struct kobject *kobj,
 }
 KSM_ATTR_RO(ksm_zero_pages);
 
+static ssize_t thp_collapse_blocked_show(struct kobject *kobj,
+					 struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%ld\n", atomic_long_read(&ksm_thp_collapse_blocked_nr));
+}
+KSM_ATTR_RO(thp_collapse_blocked);
+
+static ssize_t thp_collapse_unmerged_show(struct kobject *kobj,
+					  struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%ld\n", atomic_long_read(&ksm_thp_collapse_unmerged_nr));
+}
+KSM_ATTR_RO(thp_collapse_unmerged);
+
+static ssize_t thp_merge_deferred_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%lu\n", ksm_thp_merge_deferred_nr);
+}
+KSM_ATTR_RO(thp_merge_deferred);
+
 static ssize_t general_profit_show(struct kobject *kobj,
 				   struct kobj_attribute *attr, char *buf)
 {
@@ -3908,6 +5088,13 @@ static ssize_t stable_node_chains_show(struct kobject *kobj,
 }
 KSM_ATTR_RO(stable_node_chains);
 
+static ssize_t stable_fp_nodes_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%lu\n", ksm_stable_fp_nodes);
+}
+KSM_ATTR_RO(stable_fp_nodes);
+
 static ssize_t
 stable_node_chains_prune_millisecs_show(struct kobject *kobj,
 					struct kobj_attribute *attr,
@@ -3963,15 +5150,39 @@ static ssize_t smart_scan_store(struct kobject *kobj,
 }
 KSM_ATTR(smart_scan);
 
+static ssize_t styx_batch_size_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", ksm_styx_batch_size);
+}
+
+static ssize_t styx_batch_size_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
+{
+	int err;
+	unsigned int value;
+
+	err = kstrtouint(buf, 10, &value);
+	if (err || value > MAX_BATCH_OPS)
+		return -EINVAL;
+
+	ksm_styx_batch_size = value;
+	return count;
+}
+KSM_ATTR(styx_batch_size);
+
 static ssize_t advisor_mode_show(struct kobject *kobj,
 				 struct kobj_attribute *attr, char *buf)
 {
 	const char *output;
 
 	if (ksm_advisor == KSM_ADVISOR_NONE)
-		output = "[none] scan-time";
+		output = "[none] scan-time offload";
 	else if (ksm_advisor == KSM_ADVISOR_SCAN_TIME)
-		output = "none [scan-time]";
+		output = "none [scan-time] offload";
+	else if (ksm_advisor == KSM_ADVISOR_OFFLOAD)
+		output = "none scan-time [offload]";
 
 	return sysfs_emit(buf, "%s\n", output);
 }
@@ -3984,11 +5195,19 @@ static ssize_t advisor_mode_store(struct kobject *kobj,
 
 	if (sysfs_streq("scan-time", buf))
 		ksm_advisor = KSM_ADVISOR_SCAN_TIME;
+	else if (sysfs_streq("offload", buf))
+		ksm_advisor = KSM_ADVISOR_OFFLOAD;
 	else if (sysfs_streq("none", buf))
 		ksm_advisor = KSM_ADVISOR_NONE;
 	else
 		return -EINVAL;
 
+	/* Hand the pause and the scope back to the user */
+	if (curr_advisor == KSM_ADVISOR_OFFLOAD && ksm_advisor != KSM_ADVISOR_OFFLOAD) {
+		ksm_thread_sleep_millisecs = offload_advisor_ctx.user_sleep_ms;
+		ksm_offload_scan_mms = 0;
+	}
+
 	/* Set advisor default values */
 	if (curr_advisor != ksm_advisor)
 		set_advisor_defaults();
@@ -4087,130 +5306,620 @@ static ssize_t advisor_target_scan_time_store(struct kobject *kobj,
 }
 KSM_ATTR(advisor_target_scan_time);
 
-static struct attribute *ksm_attrs[] = {
-	&sleep_millisecs_attr.attr,
-	&pages_to_scan_attr.attr,
-	&run_attr.attr,
-	&pages_scanned_attr.attr,
-	&pages_shared_attr.attr,
-	&pages_sharing_attr.attr,
-	&pages_unshared_attr.attr,
-	&pages_volatile_attr.attr,
-	&pages_skipped_attr.attr,
-	&ksm_zero_pages_attr.attr,
-	&full_scans_attr.attr,
-#ifdef CONFIG_NUMA
-	&merge_across_nodes_attr.attr,
-#endif
-	&max_page_sharing_attr.attr,
-	&stable_node_chains_attr.attr,
-	&stable_node_dups_attr.attr,
-	&stable_node_chains_prune_millisecs_attr.attr,
-	&use_zero_pages_attr.attr,
-	&general_profit_attr.attr,
-	&smart_scan_attr.attr,
-	&advisor_mode_attr.attr,
-	&advisor_max_cpu_attr.attr,
-	&advisor_min_pages_to_scan_attr.attr,
-	&advisor_max_pages_to_scan_attr.attr,
-	&advisor_target_scan_time_attr.attr,
-	NULL,
-};
-
-static const struct attribute_group ksm_attr_group = {
-	.attrs = ksm_attrs,
-	.name = "ksm",
-};
-#endif /* CONFIG_SYSFS */
+static ssize_t advisor_offload_max_pcie_mbps_show(struct kobject *kobj,
+						  struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%lu\n", ksm_advisor_offload_max_pcie_mbps);
+}
 
-static int __init ksm_init(void)
+static ssize_t advisor_offload_max_pcie_mbps_store(struct kobject *kobj,
+						   struct kobj_attribute *attr,
+						   const char *buf, size_t count)
 {
-	struct task_struct *ksm_thread;
 	int err;
+	unsigned long value;
 
-	/* The correct value depends on page size and endianness */
-	zero_checksum = do_calc_checksum(ZERO_PAGE(0));
-	/* Default to false for backwards compatibility */
-	ksm_use_zero_pages = false;
-
-	err = ksm_slab_init();
+	err = kstrtoul(buf, 10, &value);
 	if (err)
-		goto out;
+		return -EINVAL;
 
-	ksm_thread = kthread_run(ksm_scan_thread, NULL, "ksmd");
-	if (IS_ERR(ksm_thread)) {
-		pr_err("ksm: creating kthread failed\n");
-		err = PTR_ERR(ksm_thread);
-		goto out_free;
-	}
+	ksm_advisor_offload_max_pcie_mbps = value;
 
-#ifdef CONFIG_SYSFS
-	err = sysfs_create_group(mm_kobj, &ksm_attr_group);
-	if (err) {
-		pr_err("ksm: register sysfs failed\n");
-		kthread_stop(ksm_thread);
-		goto out_free;
-	}
-#else
-	ksm_run = KSM_RUN_MERGE;	/* no way for user to start it */
+	return count;
+}
+KSM_ATTR(advisor_offload_max_pcie_mbps);
 
-#endif /* CONFIG_SYSFS */
+static ssize_t advisor_offload_target_yield_show(struct kobject *kobj,
+						 struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%lu\n", ksm_advisor_offload_target_yield);
+}
 
-#ifdef CONFIG_MEMORY_HOTREMOVE
-	/* There is no significance to this priority 100 */
-	hotplug_memory_notifier(ksm_memory_callback, KSM_CALLBACK_PRI);
-#endif
-	return 0;
+static ssize_t advisor_offload_target_yield_store(struct kobject *kobj,
+						  struct kobj_attribute *attr,
+						  const char *buf, size_t count)
+{
+	int err;
+	unsigned long value;
 
-out_free:
-	ksm_slab_free();
-out:
-	return err;
-}
-subsys_initcall(ksm_init);
+	err = kstrtoul(buf, 10, &value);
+	if (err || value > 1000)
+		return -EINVAL;
 
+	ksm_advisor_offload_target_yield = value;
 
-static void apply_result(struct list_head *shadow_pt_list, struct result_table* result) {
-	int i, j, err;
-	int from_mm_id, to_mm_id;
-	enum event_tag type;
-	struct ksm_rmap_item *from_item, *to_item;
-	struct ksm_event_log* log_entry;
-	int stable_merge_cnt = 0, unstable_merge_cnt = 0;
+	return count;
+}
+KSM_ATTR(advisor_offload_target_yield);
 
-	uint64_t from_va, to_va;
+static ssize_t advisor_offload_max_commit_ms_show(struct kobject *kobj,
+						  struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%lu\n", ksm_advisor_offload_max_commit_ms);
+}
 
-	struct ksm_stable_node *stable_node;
-	struct page *kpage;
-	bool split;
-	u32 checksum;
+static ssize_t advisor_offload_max_commit_ms_store(struct kobject *kobj,
+						   struct kobj_attribute *attr,
+						   const char *buf, size_t count)
+{
+	int err;
+	unsigned long value;
 
-	int table_idx, entry_idx;
+	err = kstrtoul(buf, 10, &value);
+	if (err || value < 1)
+		return -EINVAL;
 
-	int unstable_abort = 0;
+	ksm_advisor_offload_max_commit_ms = value;
 
-	// unsigned long *failed_unstable_merges = kmalloc(KMALLOC_MAX_SIZE, GFP_KERNEL);
-	// unsigned long failed_unstable_merge_cnt = 0;
+	return count;
+}
+KSM_ATTR(advisor_offload_max_commit_ms);
 
-	fail_reason_cnts[0] = 0;
-	fail_reason_cnts[1] = 0;
-	fail_reason_cnts[2] = 0;
-	fail_reason_cnts[3] = 0;
-	fail_reason_cnts[4] = 0;
-	fail_reason_cnts[5] = 0;
-	fail_reason_cnts[6] = 0;
-	fail_reason_cnts[7] = 0;
-	fail_reason_cnts[8] = 0;
-	fail_reason_cnts[9] = 0;
-	fail_reason_cnts[10] = 0;
+static ssize_t advisor_offload_max_sleep_ms_show(struct kobject *kobj,
+						 struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%lu\n", ksm_advisor_offload_max_sleep_ms);
+}
 
-	for (i = 0; i < result->total_cnt; i++) {
-		table_idx = i / MAX_RESULT_TABLE_ENTRIES;
-		entry_idx = i % MAX_RESULT_TABLE_ENTRIES;
+static ssize_t advisor_offload_max_sleep_ms_store(struct kobject *kobj,
+						  struct kobj_attribute *attr,
+						  const char *buf, size_t count)
+{
+	int err;
+	unsigned long value;
 
-		log_entry = &result->entry_tables[table_idx][entry_idx];
+	err = kstrtoul(buf, 10, &value);
+	if (err || value < KSM_ADVISOR_OFFLOAD_MIN_SLEEP_MS)
+		return -EINVAL;
 
-		type = log_entry->type;
+	ksm_advisor_offload_max_sleep_ms = value;
+
+	return count;
+}
+KSM_ATTR(advisor_offload_max_sleep_ms);
+
+static ssize_t offload_scan_mms_show(struct kobject *kobj,
+				     struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", ksm_offload_scan_mms);
+}
+
+static ssize_t offload_scan_mms_store(struct kobject *kobj,
+				      struct kobj_attribute *attr,
+				      const char *buf, size_t count)
+{
+	unsigned int value;
+	int err;
+
+	if (ksm_advisor == KSM_ADVISOR_OFFLOAD)
+		return -EINVAL;
+
+	err = kstrtouint(buf, 10, &value);
+	if (err)
+		return -EINVAL;
+
+	ksm_offload_scan_mms = value;
+
+	return count;
+}
+KSM_ATTR(offload_scan_mms);
+
+static ssize_t offload_read_rate_mbps_show(struct kobject *kobj,
+					   struct kobj_attribute *attr, char *buf)
+{
+	if (ksm_offload_read_rate_mbps == READ_RATE_UNSHAPED)
+		return sysfs_emit(buf, "off\n");
+	return sysfs_emit(buf, "%lu\n", ksm_offload_read_rate_mbps);
+}
+
+static ssize_t offload_read_rate_mbps_store(struct kobject *kobj,
+					    struct kobj_attribute *attr,
+					    const char *buf, size_t count)
+{
+	unsigned long value;
+	int err;
+
+	if (sysfs_streq("off", buf)) {
+		WRITE_ONCE(ksm_offload_read_rate_mbps, READ_RATE_UNSHAPED);
+		return count;
+	}
+
+	err = kstrtoul(buf, 10, &value);
+	if (err)
+		return -EINVAL;
+
+	WRITE_ONCE(ksm_offload_read_rate_mbps, value);
+
+	return count;
+}
+KSM_ATTR(offload_read_rate_mbps);
+
+static ssize_t offload_hot_region_pct_show(struct kobject *kobj,
+					   struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", ksm_offload_hot_region_pct);
+}
+
+static ssize_t offload_hot_region_pct_store(struct kobject *kobj,
+					    struct kobj_attribute *attr,
+					    const char *buf, size_t count)
+{
+	unsigned int value;
+	int err;
+
+	err = kstrtouint(buf, 10, &value);
+	if (err || value > 100)
+		return -EINVAL;
+
+	WRITE_ONCE(ksm_offload_hot_region_pct, value);
+
+	return count;
+}
+KSM_ATTR(offload_hot_region_pct);
+
+static ssize_t offload_dirty_tracking_show(struct kobject *kobj,
+					   struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", ksm_offload_dirty_tracking);
+}
+
+static ssize_t offload_dirty_tracking_store(struct kobject *kobj,
+					    struct kobj_attribute *attr,
+					    const char *buf, size_t count)
+{
+	unsigned int value;
+	int err;
+
+	err = kstrtouint(buf, 10, &value);
+	if (err)
+		return -EINVAL;
+
+	WRITE_ONCE(ksm_offload_dirty_tracking, value);
+
+	return count;
+}
+KSM_ATTR(offload_dirty_tracking);
+
+static ssize_t offload_lru_drain_min_show(struct kobject *kobj,
+					  struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", ksm_offload_lru_drain_min);
+}
+
+static ssize_t offload_lru_drain_min_store(struct kobject *kobj,
+					   struct kobj_attribute *attr,
+					   const char *buf, size_t count)
+{
+	unsigned int value;
+	int err;
+
+	err = kstrtouint(buf, 10, &value);
+	if (err)
+		return -EINVAL;
+
+	WRITE_ONCE(ksm_offload_lru_drain_min, value);
+
+	return count;
+}
+KSM_ATTR(offload_lru_drain_min);
+
+static ssize_t offload_walk_chunk_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", ksm_offload_walk_chunk);
+}
+
+static ssize_t offload_walk_chunk_store(struct kobject *kobj,
+					struct kobj_attribute *attr,
+					const char *buf, size_t count)
+{
+	unsigned int value;
+	int err;
+
+	err = kstrtouint(buf, 10, &value);
+	if (err)
+		return -EINVAL;
+
+	WRITE_ONCE(ksm_offload_walk_chunk, value);
+
+	return count;
+}
+KSM_ATTR(offload_walk_chunk);
+
+static ssize_t offload_prep_workers_show(struct kobject *kobj,
+					 struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", ksm_offload_prep_workers);
+}
+
+static ssize_t offload_prep_workers_store(struct kobject *kobj,
+					  struct kobj_attribute *attr,
+					  const char *buf, size_t count)
+{
+	unsigned int value;
+	int err;
+
+	err = kstrtouint(buf, 10, &value);
+	if (err)
+		return -EINVAL;
+	if (value > WQ_MAX_ACTIVE)
+		return -EINVAL;
+
+	if (value && ksm_offload_prep_wq)
+		workqueue_set_max_active(ksm_offload_prep_wq, value);
+	WRITE_ONCE(ksm_offload_prep_workers, value);
+
+	return count;
+}
+KSM_ATTR(offload_prep_workers);
+
+static ssize_t offload_damon_hot_sample_show(struct kobject *kobj,
+					     struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", ksm_offload_damon_hot_sample);
+}
+
+static ssize_t offload_damon_hot_sample_store(struct kobject *kobj,
+					      struct kobj_attribute *attr,
+					      const char *buf, size_t count)
+{
+	unsigned int value;
+	int err;
+
+	err = kstrtouint(buf, 10, &value);
+	if (err)
+		return -EINVAL;
+
+	WRITE_ONCE(ksm_offload_damon_hot_sample, value);
+
+	return count;
+}
+KSM_ATTR(offload_damon_hot_sample);
+
+static ssize_t offload_thp_split_pct_show(struct kobject *kobj,
+					  struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", ksm_offload_thp_split_pct);
+}
+
+static ssize_t offload_thp_split_pct_store(struct kobject *kobj,
+					   struct kobj_attribute *attr,
+					   const char *buf, size_t count)
+{
+	unsigned int value;
+	int err;
+
+	err = kstrtouint(buf, 10, &value);
+	if (err || value > 100)
+		return -EINVAL;
+
+	WRITE_ONCE(ksm_offload_thp_split_pct, value);
+
+	return count;
+}
+KSM_ATTR(offload_thp_split_pct);
+
+static ssize_t offload_stable_fp_show(struct kobject *kobj,
+				      struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", ksm_offload_stable_fp);
+}
+
+static ssize_t offload_stable_fp_store(struct kobject *kobj,
+				       struct kobj_attribute *attr,
+				       const char *buf, size_t count)
+{
+	unsigned int value;
+	int err;
+
+	err = kstrtouint(buf, 10, &value);
+	if (err || value > 1)
+		return -EINVAL;
+
+	WRITE_ONCE(ksm_offload_stable_fp, value);
+
+	return count;
+}
+KSM_ATTR(offload_stable_fp);
+
+static ssize_t offload_commit_batch_show(struct kobject *kobj,
+					 struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", ksm_offload_commit_batch);
+}
+
+static ssize_t offload_commit_batch_store(struct kobject *kobj,
+					  struct kobj_attribute *attr,
+					  const char *buf, size_t count)
+{
+	unsigned int value;
+	int err;
+
+	err = kstrtouint(buf, 10, &value);
+	if (err || value > 1)
+		return -EINVAL;
+
+	WRITE_ONCE(ksm_offload_commit_batch, value);
+
+	return count;
+}
+KSM_ATTR(offload_commit_batch);
+
+static ssize_t offload_nic_verify_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", ksm_offload_nic_verify);
+}
+
+static ssize_t offload_nic_verify_store(struct kobject *kobj,
+					struct kobj_attribute *attr,
+					const char *buf, size_t count)
+{
+	unsigned int value;
+	int err;
+
+	err = kstrtouint(buf, 10, &value);
+	if (err || value > 1)
+		return -EINVAL;
+
+	WRITE_ONCE(ksm_offload_nic_verify, value);
+
+	return count;
+}
+KSM_ATTR(offload_nic_verify);
+
+static ssize_t offload_log_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", ksm_offload_log);
+}
+
+static ssize_t offload_log_store(struct kobject *kobj,
+				 struct kobj_attribute *attr,
+				 const char *buf, size_t count)
+{
+	int err;
+	bool value;
+
+	err = kstrtobool(buf, &value);
+	if (err)
+		return -EINVAL;
+
+	WRITE_ONCE(ksm_offload_log, value);
+	return count;
+}
+KSM_ATTR(offload_log);
+
+/* The last OFFLOAD_STATS_NR offload iterations, oldest first, one per line */
+static ssize_t offload_stats_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	struct offload_iter_stats *st;
+	unsigned long first;
+	int len = 0, i;
+
+	len += sysfs_emit_at(buf, len, "iter");
+	for (i = 0; i < OFFLOAD_PHASE_NUM; i++)
+		len += sysfs_emit_at(buf, len, " %s", offload_phase_str[i]);
+	len += sysfs_emit_at(buf, len, " mms ptes metadata_bytes result_bytes pcie_bytes scanned"
+			     " stable unstable failures unstable_aborts disconnected");
+	for (i = 0; i < ARRAY_SIZE(fail_reason_cnts); i++)
+		len += sysfs_emit_at(buf, len, " %s", fail_reason_str[i]);
+	len += sysfs_emit_at(buf, len, " walk_chunks walk_hold_max_us\n");
+
+	mutex_lock(&offload_stats_lock);
+	first = offload_stats_nr > OFFLOAD_STATS_NR ? offload_stats_nr - OFFLOAD_STATS_NR : 0;
+	for (; first < offload_stats_nr; first++) {
+		st = &offload_stats_ring[first % OFFLOAD_STATS_NR];
+
+		len += sysfs_emit_at(buf, len, "%d", st->iter);
+		for (i = 0; i < OFFLOAD_PHASE_NUM; i++)
+			len += sysfs_emit_at(buf, len, " %llu", div_u64(st->phase_ns[i], NSEC_PER_USEC));
+		len += sysfs_emit_at(buf, len, " %u %lu %lu %lu %lu %lu %d %d %d %d %d",
+				     st->nr_mms, st->nr_ptes, st->metadata_bytes, st->result_bytes,
+				     st->pcie_read_bytes, st->pages_scanned, st->stable_merges,
+				     st->unstable_merges, st->failures, st->unstable_aborts,
+				     st->disconnected);
+		for (i = 0; i < ARRAY_SIZE(st->fail_reasons); i++)
+			len += sysfs_emit_at(buf, len, " %ld", st->fail_reasons[i]);
+		len += sysfs_emit_at(buf, len, " %u %llu\n", st->walk_chunks,
+				     div_u64(st->walk_hold_max_ns, NSEC_PER_USEC));
+	}
+	mutex_unlock(&offload_stats_lock);
+
+	return len;
+}
+KSM_ATTR_RO(offload_stats);
+
+static struct attribute *ksm_attrs[] = {
+	&sleep_millisecs_attr.attr,
+	&pages_to_scan_attr.attr,
+	&run_attr.attr,
+	&pages_scanned_attr.attr,
+	&pages_shared_attr.attr,
+	&pages_sharing_attr.attr,
+	&pages_unshared_attr.attr,
+	&pages_volatile_attr.attr,
+	&pages_skipped_attr.attr,
+	&ksm_zero_pages_attr.attr,
+	&thp_collapse_blocked_attr.attr,
+	&thp_collapse_unmerged_attr.attr,
+	&thp_merge_deferred_attr.attr,
+	&full_scans_attr.attr,
+#ifdef CONFIG_NUMA
+	&merge_across_nodes_attr.attr,
+#endif
+	&max_page_sharing_attr.attr,
+	&stable_node_chains_attr.attr,
+	&stable_node_dups_attr.attr,
+	&stable_fp_nodes_attr.attr,
+	&stable_node_chains_prune_millisecs_attr.attr,
+	&use_zero_pages_attr.attr,
+	&general_profit_attr.attr,
+	&smart_scan_attr.attr,
+	&styx_batch_size_attr.attr,
+	&advisor_mode_attr.attr,
+	&advisor_max_cpu_attr.attr,
+	&advisor_min_pages_to_scan_attr.attr,
+	&advisor_max_pages_to_scan_attr.attr,
+	&advisor_target_scan_time_attr.attr,
+	&advisor_offload_max_pcie_mbps_attr.attr,
+	&advisor_offload_target_yield_attr.attr,
+	&advisor_offload_max_commit_ms_attr.attr,
+	&advisor_offload_max_sleep_ms_attr.attr,
+	&offload_scan_mms_attr.attr,
+	&offload_read_rate_mbps_attr.attr,
+	&offload_hot_region_pct_attr.attr,
+	&offload_dirty_tracking_attr.attr,
+	&offload_lru_drain_min_attr.attr,
+	&offload_walk_chunk_attr.attr,
+	&offload_prep_workers_attr.attr,
+	&offload_damon_hot_sample_attr.attr,
+	&offload_thp_split_pct_attr.attr,
+	&offload_stable_fp_attr.attr,
+	&offload_commit_batch_attr.attr,
+	&offload_nic_verify_attr.attr,
+	&offload_log_attr.attr,
+	&offload_stats_attr.attr,
+	NULL,
+};
+
+static const struct attribute_group ksm_attr_group = {
+	.attrs = ksm_attrs,
+	.name = "ksm",
+};
+#endif /* CONFIG_SYSFS */
+
+static int __init ksm_init(void)
+{
+	struct task_struct *ksm_thread;
+	int err;
+
+	/* The correct value depends on page size and endianness */
+	zero_checksum = do_calc_checksum(ZERO_PAGE(0));
+	/* Default to false for backwards compatibility */
+	ksm_use_zero_pages = false;
+
+	err = ksm_slab_init();
+	if (err)
+		goto out;
+
+	ksm_offload_prep_wq = alloc_workqueue("ksm_offload_prep", WQ_UNBOUND | WQ_SYSFS,
+					      ksm_offload_prep_workers);
+	if (!ksm_offload_prep_wq)
+		pr_warn("ksm: no offload prepare workqueue, walking mms on ksmd\n");
+
+	ksm_thread = kthread_run(ksm_scan_thread, NULL, "ksmd");
+	if (IS_ERR(ksm_thread)) {
+		pr_err("ksm: creating kthread failed\n");
+		err = PTR_ERR(ksm_thread);
+		goto out_free;
+	}
+
+#ifdef CONFIG_SYSFS
+	err = sysfs_create_group(mm_kobj, &ksm_attr_group);
+	if (err) {
+		pr_err("ksm: register sysfs failed\n");
+		kthread_stop(ksm_thread);
+		goto out_free;
+	}
+#else
+	ksm_run = KSM_RUN_MERGE;	/* no way for user to start it */
+
+#endif /* CONFIG_SYSFS */
+
+#ifdef CONFIG_MEMORY_HOTREMOVE
+	/* There is no significance to this priority 100 */
+	hotplug_memory_notifier(ksm_memory_callback, KSM_CALLBACK_PRI);
+#endif
+	return 0;
+
+out_free:
+	ksm_slab_free();
+out:
+	return err;
+}
+subsys_initcall(ksm_init);
+
+
+static void apply_result(struct list_head *shadow_pt_list, struct result_table* result) {
+	int i, j, err;
+	int from_mm_id, to_mm_id;
+	enum event_tag type;
+	struct ksm_rmap_item *from_item, *to_item;
+	struct ksm_event_log* log_entry;
+	int stable_merge_cnt = 0, unstable_merge_cnt = 0;
+
+	uint64_t from_va, to_va;
+
+	struct ksm_stable_node *stable_node;
+	struct page *kpage;
+	bool split;
+	u32 checksum;
+
+	int table_idx, entry_idx;
+
+	int unstable_abort = 0;
+	bool use_fp = READ_ONCE(ksm_offload_stable_fp);
+	bool batch = READ_ONCE(ksm_offload_commit_batch);
+	bool verify = batch && READ_ONCE(ksm_offload_nic_verify);
+	enum offload_verdict verdict;
+
+	// unsigned long *failed_unstable_merges = kmalloc(KMALLOC_MAX_SIZE, GFP_KERNEL);
+	// unsigned long failed_unstable_merge_cnt = 0;
+
+	fail_reason_cnts[0] = 0;
+	fail_reason_cnts[1] = 0;
+	fail_reason_cnts[2] = 0;
+	fail_reason_cnts[3] = 0;
+	fail_reason_cnts[4] = 0;
+	fail_reason_cnts[5] = 0;
+	fail_reason_cnts[6] = 0;
+	fail_reason_cnts[7] = 0;
+	fail_reason_cnts[8] = 0;
+	fail_reason_cnts[9] = 0;
+	fail_reason_cnts[10] = 0;
+	offload_fp_dups = 0;
+	offload_batch_protected = 0;
+	offload_batch_deferred = 0;
+	offload_batch_flushes = 0;
+	offload_verify_pairs = 0;
+	offload_verify_diff = 0;
+
+	if (batch) {
+		offload_wrprotect_batch(shadow_pt_list, result);
+		if (verify)
+			offload_nic_verify(shadow_pt_list, result);
+		offload_tlb_gathering = true;
+	}
+
+	for (i = 0; i < result->total_cnt; i++) {
+		table_idx = i / MAX_RESULT_TABLE_ENTRIES;
+		entry_idx = i % MAX_RESULT_TABLE_ENTRIES;
+
+		log_entry = &result->entry_tables[table_idx][entry_idx];
+
+		type = log_entry->type;
 
 		switch (type) {
 			case DPU_STABLE_MERGE:
@@ -4270,7 +5979,17 @@ static void apply_result(struct list_head *shadow_pt_list, struct result_table*
 
 				remove_rmap_item_from_tree(from_item);
 
-				err = try_to_merge_with_ksm_page(from_item, from_item->page, kpage);
+				verdict = offload_verdict(i);
+				if (verdict == OFFLOAD_VERIFIED_DIFF) {
+					fail_reason_cnts[Pages_are_not_identical]++;
+					err = -EFAULT;
+				} else {
+					/* The NIC read the kpage at kpfn */
+					offload_nic_verified = verdict == OFFLOAD_VERIFIED_SAME &&
+						page_to_pfn(kpage) == log_entry->stable_merge.kpfn;
+					err = try_to_merge_with_ksm_page(from_item, from_item->page, kpage);
+					offload_nic_verified = false;
+				}
 				if (!err) {
 					lock_page(kpage);
 					stable_tree_append(from_item, page_stable_node(kpage), false);
@@ -4304,15 +6023,26 @@ static void apply_result(struct list_head *shadow_pt_list, struct result_table*
 				DEBUG_LOG("UNSTABLE_MERGE: %llx(%d) -> %llx(%d)\n", from_va, from_mm_id, to_va, to_mm_id);
 				DEBUG_LOG("  %lx(%lu) -> %lx\n", (uintptr_t) from_item->page, page_to_pfn(from_item->page), (uintptr_t) to_item->page);
 
-				kpage = try_to_merge_two_pages(from_item, from_item->page, 
-					to_item, to_item->page);
+				verdict = offload_verdict(i);
+				if (verdict == OFFLOAD_VERIFIED_DIFF) {
+					fail_reason_cnts[Pages_are_not_identical]++;
+					kpage = NULL;
+				} else {
+					offload_nic_verified = verdict == OFFLOAD_VERIFIED_SAME;
+					kpage = try_to_merge_two_pages(from_item, from_item->page,
+						to_item, to_item->page);
+					offload_nic_verified = false;
+				}
 
 				split = PageTransCompound(from_item->page)
 					&& compound_head(from_item->page) == compound_head(to_item->page);
 
 				if (kpage) {
 					lock_page(kpage);
-					stable_node = stable_tree_insert(kpage);
+					if (use_fp)
+						stable_node = stable_tree_insert_fp(kpage, log_entry->fp);
+					else
+						stable_node = stable_tree_insert(kpage);
 					if (stable_node) {
 						stable_tree_append(to_item, stable_node, false);
 						stable_tree_append(from_item, stable_node, false);
@@ -4372,84 +6102,495 @@ static void apply_result(struct list_head *shadow_pt_list, struct result_table*
 					DEBUG_ERR("KPfn mismatch in STALE_NODE: %lu vs %lu\n", stable_node->kpfn, log_entry->stale_node.kpfn);
 				}
 
-				kpage = get_ksm_page(stable_node, GET_KSM_PAGE_LOCK);
-				if (!kpage) {
-					DEBUG_ERR("Invalid page in stale stable node\n");
-				}
+				kpage = get_ksm_page(stable_node, GET_KSM_PAGE_LOCK);
+				if (!kpage) {
+					DEBUG_ERR("Invalid page in stale stable node\n");
+				}
+
+				if (!page_mapped(kpage)) {
+					set_page_stable_node(kpage, NULL);
+					remove_node_from_stable_tree(stable_node);
+				} else {
+					DEBUG_ERR("Page is still mapped in STALE_STABLE_NODE\n");
+				}
+
+				unlock_page(kpage);
+				put_page(kpage);
+
+				break;
+			case DPU_ITEM_STATE_CHANGE:
+				to_mm_id = log_entry->stable_merge.from_mm_id;
+				to_va = log_entry->stable_merge.from_va;
+
+				DEBUG_LOG("ITEM_STATE_CHANGE: %llx(%d)\n", to_va, to_mm_id);
+
+				to_item = shadow_mm_lookup(get_shadow_mm(shadow_pt_list, to_mm_id), to_va);
+
+				if (!to_item) {
+					DEBUG_ERR("Failed to get to_entry in ITEM_STATE_CHANGE\n");
+				}
+
+				if (!(to_item->address & STABLE_FLAG)) {
+					DEBUG_LOG("Not a stable Item: %lx\n", to_item->address);
+					DEBUG_ERR("KPFN info: %lu(cnt: %d) vs %lu(cnt: %d)\n", stable_node->kpfn, stable_node->rmap_hlist_len, 
+						log_entry->stable_merge.kpfn, log_entry->stable_merge.shared_cnt);
+				}
+
+				remove_rmap_item_from_tree(to_item);
+
+				break;
+			case DPU_HOT_REGION:
+				DEBUG_LOG("HOT_REGION: %llx(%d) for %d iterations\n", log_entry->hot_region.va,
+					log_entry->hot_region.mm_id, log_entry->hot_region.backoff);
+
+				offload_hot_region_add(log_entry->hot_region.mm_id, log_entry->hot_region.va,
+						       log_entry->hot_region.backoff);
+				break;
+			case DPU_THP_SUMMARY:
+				DEBUG_LOG("THP_SUMMARY: %llx(%d) stable %u, zero %u, dup %u\n", log_entry->thp_summary.va,
+					log_entry->thp_summary.mm_id, log_entry->thp_summary.stable,
+					log_entry->thp_summary.zero, log_entry->thp_summary.dup);
+
+				offload_thp_queue_split(shadow_pt_list, log_entry);
+				break;
+			default:
+				DEBUG_ERR("Invalid merge type: %d\n", type);
+				break;
+		}
+
+		cond_resched();
+	}
+
+	offload_tlb_gather_flush();
+	offload_tlb_gathering = false;
+	kvfree(offload_verdicts);
+	offload_verdicts = NULL;
+
+	offload_cur.stable_merges = stable_merge_cnt;
+	offload_cur.unstable_merges = unstable_merge_cnt;
+	offload_cur.failures = ksm_error_table->total_cnt;
+	offload_cur.unstable_aborts = unstable_abort;
+	memcpy(offload_cur.fail_reasons, fail_reason_cnts, sizeof(offload_cur.fail_reasons));
+
+	if (!READ_ONCE(ksm_offload_log))
+		return;
+
+	pr_info("Merged %d stable nodes, %d unstable nodes, and %d failures, unstable abort\n", stable_merge_cnt, unstable_merge_cnt, ksm_error_table->total_cnt);
+	pr_info("[Failure Statistics], %d, %d, %d, %d\n", stable_merge_cnt, unstable_merge_cnt, ksm_error_table->total_cnt, unstable_abort);
+
+	pr_info("Merge failure reasons:\n");
+	for (i = 0; i < 10; i++) {
+		if (fail_reason_cnts[i] > 0) {
+			pr_info("  [%s], %lu\n", fail_reason_str[i], fail_reason_cnts[i]);
+		}
+	}
+
+	// kfree(failed_unstable_merges);
+	return;
+}
+
+/**
+ * struct offload_hot_region - a write-hot region left out of the shadow mms
+ * @node: link in offload_hot_region_hash
+ * @mm_id: owner pid of the mm, as in the shadow mm
+ * @region: virtual address >> HOT_REGION_SHIFT
+ * @until: last offload iteration that skips the region
+ *
+ * The server reports a region with DPU_HOT_REGION when most of its pages
+ * changed since the last scan, with a backoff that doubles while it stays hot.
+ */
+struct offload_hot_region {
+	struct hlist_node node;
+	int mm_id;
+	unsigned long region;
+	int until;
+};
+
+static struct offload_hot_region *offload_hot_region_lookup(int mm_id, unsigned long region)
+{
+	struct offload_hot_region *hot;
+
+	hash_for_each_possible(offload_hot_region_hash, hot, node, region ^ mm_id) {
+		if (hot->mm_id == mm_id && hot->region == region)
+			return hot;
+	}
+	return NULL;
+}
+
+static void offload_hot_region_add(int mm_id, unsigned long va, int backoff)
+{
+	unsigned long region = va >> HOT_REGION_SHIFT;
+	struct offload_hot_region *hot = offload_hot_region_lookup(mm_id, region);
+
+	if (!hot) {
+		hot = kmalloc(sizeof(*hot), GFP_KERNEL);
+		if (!hot)
+			return;
+		hot->mm_id = mm_id;
+		hot->region = region;
+		hash_add(offload_hot_region_hash, &hot->node, region ^ mm_id);
+		offload_hot_regions_nr++;
+	}
+	/* The result is applied after iter_cnt's walk, so skipping starts with the next one */
+	hot->until = iter_cnt + backoff;
+}
+
+static bool offload_hot_region_skip(int mm_id, unsigned long addr)
+{
+	struct offload_hot_region *hot;
+
+	hot = offload_hot_region_lookup(mm_id, addr >> HOT_REGION_SHIFT);
+	return hot && hot->until >= iter_cnt;
+}
+
+/* Drop regions whose backoff ended, or all of them once the knob is cleared */
+static void offload_hot_region_expire(int iter)
+{
+	struct offload_hot_region *hot;
+	struct hlist_node *tmp;
+	bool all = !READ_ONCE(ksm_offload_hot_region_pct);
+	int bkt;
+
+	offload_hot_regions_skipped = 0;
+	if (!offload_hot_regions_nr)
+		return;
+
+	hash_for_each_safe(offload_hot_region_hash, bkt, tmp, hot, node) {
+		if (all || hot->until < iter) {
+			hash_del(&hot->node);
+			kfree(hot);
+			offload_hot_regions_nr--;
+		}
+	}
+}
+
+static struct ksm_thp_candidate *ksm_thp_candidate_slot(struct mm_struct *mm, unsigned long haddr)
+{
+	return &ksm_thp_candidates[hash_long(haddr ^ (unsigned long)mm, KSM_THP_CANDIDATE_BITS)];
+}
+
+/**
+ * ksm_thp_mark_candidate - khugepaged has collapsed a range
+ * @mm: the mm of the range
+ * @haddr: huge page aligned start of the range
+ */
+void ksm_thp_mark_candidate(struct mm_struct *mm, unsigned long haddr)
+{
+	struct ksm_thp_candidate *candidate = ksm_thp_candidate_slot(mm, haddr);
+
+	spin_lock(&ksm_thp_candidate_lock);
+	candidate->mm = mm;
+	candidate->haddr = haddr;
+	candidate->expires = jiffies + KSM_THP_CANDIDATE_TTL;
+	spin_unlock(&ksm_thp_candidate_lock);
+}
+
+/* A mm pointer may be reused after exit, which only costs the range a few scans */
+static bool ksm_thp_is_candidate(struct mm_struct *mm, unsigned long haddr)
+{
+	struct ksm_thp_candidate *candidate = ksm_thp_candidate_slot(mm, haddr);
+	bool ret;
+
+	spin_lock(&ksm_thp_candidate_lock);
+	ret = candidate->mm == mm && candidate->haddr == haddr &&
+	      time_before(jiffies, candidate->expires);
+	spin_unlock(&ksm_thp_candidate_lock);
+	return ret;
+}
+
+/**
+ * ksm_thp_collapse_blocked - khugepaged left a range alone for its KSM ptes
+ *
+ * A range with more than khugepaged's max_ptes_ksm merged ptes saves more
+ * memory deduplicated than it would gain as a huge page.
+ */
+void ksm_thp_collapse_blocked(void)
+{
+	atomic_long_inc(&ksm_thp_collapse_blocked_nr);
+}
+
+/**
+ * ksm_thp_collapse_unmerged - khugepaged collapsed a range over KSM ptes
+ * @nr: the KSM pages and KSM zero pages the collapse replaced
+ */
+void ksm_thp_collapse_unmerged(int nr)
+{
+	atomic_long_add(nr, &ksm_thp_collapse_unmerged_nr);
+}
+
+static void offload_thp_start(void)
+{
+	offload_thp_pct = READ_ONCE(ksm_offload_thp_split_pct);
+	offload_thp_exported = 0;
+	offload_thp_split_nr = 0;
+}
+
+/*
+ * Queue a THP for splitting when the server found enough of its subpages
+ * equal to a stable node, the zero page or another page. Splitting trades the
+ * huge page's TLB reach for the memory its subpages free once merged.
+ */
+static void offload_thp_queue_split(struct list_head *shadow_pt_list, struct ksm_event_log *log_entry)
+{
+	unsigned int matches = log_entry->thp_summary.stable + log_entry->thp_summary.zero +
+			       log_entry->thp_summary.dup;
+	struct shadow_mm *shadow;
+	struct ksm_rmap_item *rmap_item;
+
+	if (!offload_thp_pct || matches * 100 < offload_thp_pct * (PMD_SIZE >> PAGE_SHIFT))
+		return;
+	if (offload_thp_splits_nr >= OFFLOAD_THP_SPLIT_MAX)
+		return;	/* reported again next iteration */
+
+	shadow = get_shadow_mm(shadow_pt_list, log_entry->thp_summary.mm_id);
+	rmap_item = shadow ? shadow_mm_lookup(shadow, log_entry->thp_summary.va) : NULL;
+	if (!rmap_item) {
+		DEBUG_ERR("Failed to get item in THP_SUMMARY: %llx(%d)\n", log_entry->thp_summary.va,
+			  log_entry->thp_summary.mm_id);
+		return;
+	}
+
+	mmgrab(rmap_item->mm);
+	offload_thp_splits[offload_thp_splits_nr].mm = rmap_item->mm;
+	offload_thp_splits[offload_thp_splits_nr].addr = log_entry->thp_summary.va;
+	offload_thp_splits_nr++;
+}
+
+/*
+ * split_huge_page() fails while the walk pins the subpages, so splitting waits
+ * for destroy_metadata(). The subpages are plain pages in the next walk.
+ */
+static void offload_thp_split_queued(void)
+{
+	struct vm_area_struct *vma;
+	struct page *page;
+	int i;
+
+	for (i = 0; i < offload_thp_splits_nr; i++) {
+		struct mm_struct *mm = offload_thp_splits[i].mm;
+		unsigned long addr = offload_thp_splits[i].addr;
+
+		if (mmget_not_zero(mm)) {
+			mmap_read_lock(mm);
+			vma = vma_lookup(mm, addr);
+			page = vma ? follow_page(vma, addr, FOLL_GET) : NULL;
+			if (!IS_ERR_OR_NULL(page)) {
+				if (PageTransCompound(page) && trylock_page(page)) {
+					if (!split_huge_page(page))
+						offload_thp_split_nr++;
+					unlock_page(page);
+				}
+				put_page(page);
+			}
+			mmap_read_unlock(mm);
+			mmput(mm);
+		}
+		mmdrop(mm);
+		cond_resched();
+	}
+	offload_thp_splits_nr = 0;
+}
+
+int anon_test_walk(unsigned long addr, unsigned long next, struct mm_walk *walk) {
+    struct vm_area_struct* vma = walk->vma;
+
+    if (!(vma->vm_flags & VM_MERGEABLE) || !vma->anon_vma) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static void offload_dirty_tracking_start(int iter)
+{
+	unsigned int every = READ_ONCE(ksm_offload_dirty_tracking);
+
+	offload_clean_dirty = every;
+	offload_dirty_cleaned = 0;
+	offload_unchanged = 0;
+	/* A full read now and then catches what a clean pte can not tell */
+	offload_tag_unchanged = every > 1 && iter % every;
+}
+
+/*
+ * The dirty bit is only ours to clear on swap backed anon pages that are not
+ * in the swap cache: reclaim would drop a clean lazyfree page, and writes to a
+ * swap cache page must reach the swap slot. A PMD with such a pte is wrapped
+ * in a soft dirty notifier range, and create_shadow_mm() flushes the TLB once
+ * per mm after the walk, before the NIC reads anything.
+ */
+static bool offload_dirty_cleanable(struct page *page)
+{
+	return PageSwapBacked(page) && !PageSwapCache(page);
+}
+
+static void offload_dirty_range_end(struct mm_walk_args *walk_args)
+{
+	if (!walk_args->dirty_range_open)
+		return;
+	mmu_notifier_invalidate_range_end(&walk_args->dirty_range);
+	walk_args->dirty_range_open = false;
+}
+
+/*
+ * As clear_refs does for soft dirty: secondary MMUs drop their writable
+ * mappings of the PMD, so a KVM guest write dirties the pte again. A PMD
+ * without a dirty pte to clean is left alone, and scan_pte_entry() only
+ * cleans inside an open range. A pte dirtied after this look keeps its bit
+ * until the next iteration.
+ */
+static void offload_dirty_range_start(pmd_t *pmd, unsigned long addr,
+				      unsigned long next, struct mm_walk *walk)
+{
+	struct mm_walk_args *walk_args = walk->private;
+	pte_t *start_pte, *pte;
+	struct page *page;
+	spinlock_t *ptl;
+	unsigned long va;
+	bool dirty = false;
 
-				if (!page_mapped(kpage)) {
-					set_page_stable_node(kpage, NULL);
-					remove_node_from_stable_tree(stable_node);
-				} else {
-					DEBUG_ERR("Page is still mapped in STALE_STABLE_NODE\n");
-				}
+	start_pte = pte = pte_offset_map_lock(walk->mm, pmd, addr, &ptl);
+	if (!pte)
+		return;
+	for (va = addr; va < next && !dirty; va += PAGE_SIZE, pte++) {
+		pte_t ptent = ptep_get(pte);
 
-				unlock_page(kpage);
-				put_page(kpage);
+		if (!pte_present(ptent) || !pte_dirty(ptent))
+			continue;
+		page = vm_normal_page(walk->vma, va, ptent);
+		dirty = page && PageAnon(page) && offload_dirty_cleanable(page);
+	}
+	pte_unmap_unlock(start_pte, ptl);
+	if (!dirty)
+		return;
 
-				break;
-			case DPU_ITEM_STATE_CHANGE:
-				to_mm_id = log_entry->stable_merge.from_mm_id;
-				to_va = log_entry->stable_merge.from_va;
+	mmu_notifier_range_init(&walk_args->dirty_range, MMU_NOTIFY_SOFT_DIRTY, 0,
+				walk->mm, addr, next);
+	mmu_notifier_invalidate_range_start(&walk_args->dirty_range);
+	walk_args->dirty_range_open = true;
+}
 
-				DEBUG_LOG("ITEM_STATE_CHANGE: %llx(%d)\n", to_va, to_mm_id);
+/*
+ * The local drain needs no IPI. Pages the other CPUs still hold fail their
+ * merge and are retried, see ksm_offload_lru_drain_min.
+ */
+static void offload_lru_drain_start(void)
+{
+	unsigned int min = READ_ONCE(ksm_offload_lru_drain_min);
 
-				to_item = shadow_mm_lookup(get_shadow_mm(shadow_pt_list, to_mm_id), to_va);
+	offload_lru_drained = !min || offload_lru_cached >= min;
+	if (offload_lru_drained)
+		lru_add_drain_all();
+	else
+		lru_add_drain();
+	offload_lru_cached = 0;
+	offload_flushes_skipped = 0;
+}
 
-				if (!to_item) {
-					DEBUG_ERR("Failed to get to_entry in ITEM_STATE_CHANGE\n");
-				}
+static void offload_damon_hot_start(int iter)
+{
+	unsigned int every = READ_ONCE(ksm_offload_damon_hot_sample);
 
-				if (!(to_item->address & STABLE_FLAG)) {
-					DEBUG_LOG("Not a stable Item: %lx\n", to_item->address);
-					DEBUG_ERR("KPFN info: %lu(cnt: %d) vs %lu(cnt: %d)\n", stable_node->kpfn, stable_node->rmap_hlist_len, 
-						log_entry->stable_merge.kpfn, log_entry->stable_merge.shared_cnt);
-				}
+	offload_damon_hot_skipped = 0;
+	offload_damon_hot_nr = 0;
+	/* Hot pages still get a scan now and then, a region may have cooled down */
+	if (every > 1 && iter % every)
+		offload_damon_hot_nr = damon_ksm_offload_hot_ranges(offload_damon_hot,
+								    DAMON_KSM_OFFLOAD_MAX_RANGES);
+}
 
-				remove_rmap_item_from_tree(to_item);
+static bool offload_damon_hot_page(struct page *page)
+{
+	unsigned long paddr = PFN_PHYS(page_to_pfn(page));
+	int lo = 0, hi = offload_damon_hot_nr;
 
-				break;
-			default:
-				DEBUG_ERR("Invalid merge type: %d\n", type);
-				break;
-		}
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
 
-		cond_resched();
+		if (paddr >= offload_damon_hot[mid].end)
+			lo = mid + 1;
+		else if (paddr < offload_damon_hot[mid].start)
+			hi = mid;
+		else
+			return true;
 	}
+	return false;
+}
 
-	pr_info("Merged %d stable nodes, %d unstable nodes, and %d failures, unstable abort\n", stable_merge_cnt, unstable_merge_cnt, ksm_error_table->total_cnt);
-	pr_info("[Failure Statistics], %d, %d, %d, %d\n", stable_merge_cnt, unstable_merge_cnt, ksm_error_table->total_cnt, unstable_abort);
+/* Unlink the items below @addr, their ranges are no longer mapped */
+static void offload_stale_rmap_items(struct mm_walk_args *walk_args, unsigned long addr)
+{
+	struct ksm_rmap_item *rmap_item;
 
-	pr_info("Merge failure reasons:\n");
-	for (i = 0; i < 10; i++) {
-		if (fail_reason_cnts[i] > 0) {
-			pr_info("  [%s], %lu\n", fail_reason_str[i], fail_reason_cnts[i]);
-		}
+	while ((rmap_item = *walk_args->rmap_list) && rmap_item->address < addr) {
+		*walk_args->rmap_list = rmap_item->rmap_list;
+		rmap_item->rmap_list = walk_args->stale;
+		walk_args->stale = rmap_item;
 	}
+}
 
-	// kfree(failed_unstable_merges);
-	return;
+/*
+ * get_next_rmap_item() for the shadow walk, which holds the pte lock and runs
+ * beside the walks of other mms: stale items are only unlinked, and a new one
+ * is allocated without sleeping. offload_settle_rmap_items() does the rest.
+ */
+static struct ksm_rmap_item *offload_next_rmap_item(struct mm_walk_args *walk_args,
+						    unsigned long addr)
+{
+	struct ksm_rmap_item *rmap_item;
+
+	offload_stale_rmap_items(walk_args, addr);
+	rmap_item = *walk_args->rmap_list;
+	if (rmap_item && (rmap_item->address & PAGE_MASK) == addr)
+		return rmap_item;
+
+	rmap_item = kmem_cache_zalloc(rmap_item_cache, GFP_NOWAIT | __GFP_NOWARN);
+	if (rmap_item) {
+		rmap_item->mm = walk_args->mm_slot->slot.mm;
+		rmap_item->mm->ksm_rmap_items++;
+		rmap_item->address = addr;
+		rmap_item->rmap_list = *walk_args->rmap_list;
+		*walk_args->rmap_list = rmap_item;
+		walk_args->rmap_items_new++;
+	}
+	return rmap_item;
 }
 
-int anon_test_walk(unsigned long addr, unsigned long next, struct mm_walk *walk) {
-    struct vm_area_struct* vma = walk->vma;
+/* After a chunk, out of the pte lock: free its stale items, count its new ones */
+static void offload_settle_rmap_items(struct mm_walk_args *walk_args)
+{
+	struct ksm_rmap_item *rmap_item;
 
-    if (!(vma->vm_flags & VM_MERGEABLE) || !vma->anon_vma) {
-        return 1;
-    }
+	if (!walk_args->stale && !walk_args->rmap_items_new)
+		return;
 
-    return 0;
+	mutex_lock(&offload_rmap_lock);
+	ksm_rmap_items += walk_args->rmap_items_new;
+	walk_args->rmap_items_new = 0;
+	while ((rmap_item = walk_args->stale)) {
+		walk_args->stale = rmap_item->rmap_list;
+		remove_rmap_item_from_tree(rmap_item);
+		free_rmap_item(rmap_item);
+	}
+	mutex_unlock(&offload_rmap_lock);
 }
 
 int scan_pte_entry(pte_t *pte, unsigned long addr, unsigned long end, struct mm_walk *walk) {
 	struct vm_area_struct *vma = walk->vma;
 	struct mm_walk_args* walk_args = walk->private;
-	struct ksm_mm_slot *slot = walk_args->mm_slot;
 	struct shadow_mm* shadow = walk_args->shadow_mm;
 	pte_t pte_val = *pte;
 
     struct page* page;
 	struct ksm_rmap_item* rmap_item = NULL;
+	unsigned long va;
+
+	/* Chunk done, create_shadow_mm() resumes here after dropping the lock */
+	if (walk_args->nr_pages >= walk_args->budget) {
+		walk_args->resume = addr;
+		return 1;
+	}
+	walk_args->nr_pages++;
 
     if (!pte_present(pte_val) || pte_special(pte_val)) {
         return 0;
@@ -4467,27 +6608,55 @@ int scan_pte_entry(pte_t *pte, unsigned long addr, unsigned long end, struct mm_
         flush_anon_page(vma,page, addr);
         flush_dcache_page(page);
 
-		ksm_scan.address = addr;
-		rmap_item = get_next_rmap_item(slot,
-			ksm_scan.rmap_list, ksm_scan.address);
-		if (rmap_item) {
-			ksm_scan.rmap_list = &rmap_item->rmap_list;
-		} else {
+		walk_args->address = addr;
+		rmap_item = offload_next_rmap_item(walk_args, walk_args->address);
+		if (!rmap_item) {
 			DEBUG_ERR("Failed to get rmap item: va %lx\n", addr);
+			put_page(page);
+			return 0;
 		}
+		walk_args->rmap_list = &rmap_item->rmap_list;
 
 		if (!((rmap_item->address & PAGE_MASK) == addr)) {
 			DEBUG_ERR("Address mismatch: %lx, %lx\n", rmap_item->address, addr);
 		}
 
-		rmap_item->page = page;
+		/*
+		 * A hot page stays out of the shadow mm and keeps its rmap_item here.
+		 * The server prunes its own item once the page went unexported for two
+		 * iterations, the page is hashed anew when it comes back. KSM pages
+		 * are always exported so the server keeps their stable nodes.
+		 */
+		if (offload_damon_hot_nr && !PageKsm(page) && offload_damon_hot_page(page)) {
+			walk_args->damon_hot_skipped++;
+			put_page(page);
+			return 0;
+		}
 
-		insert_entry_to_shadow_mm(shadow, addr, page_to_pfn(page) ,rmap_item);
+		va = addr;
+		if (offload_clean_dirty) {
+			if (offload_tag_unchanged && !pte_dirty(pte_val) &&
+			    rmap_item->page == page && !PageSwapCache(page)) {
+				va |= SHADOW_PTE_UNCHANGED;
+				walk_args->unchanged++;
+			}
+			if (walk_args->dirty_range_open && pte_dirty(pte_val) &&
+			    offload_dirty_cleanable(page)) {
+				pte_t old_pte = ptep_modify_prot_start(vma, addr, pte);
+
+				ptep_modify_prot_commit(vma, addr, pte, old_pte, pte_mkclean(old_pte));
+				walk_args->dirty_cleaned++;
+				walk_args->ptes_cleaned = true;
+			}
+		}
 
-		// if (pte_dirty(pte_val)) {
-		// 	pte_val = pte_mkclean(pte_val);
-		// 	set_pte_at(slot->mm, addr, pte, pte_val);
-		// }
+		/* Not exported: the next walk must neither tag it unchanged nor put it */
+		if (insert_entry_to_shadow_mm(shadow, va, page_to_pfn(page), rmap_item)) {
+			rmap_item->page = NULL;
+			put_page(page);
+			return 0;
+		}
+		rmap_item->page = page;
 
     } else {
 		put_page(page);
@@ -4496,23 +6665,129 @@ int scan_pte_entry(pte_t *pte, unsigned long addr, unsigned long end, struct mm_
     return 0;
 }
 
+/*
+ * Step over a skipped region's rmap_items without freeing them. The server
+ * keeps its items only for the hot regions it reported: those of a range
+ * khugepaged holds or of a DAMON hot THP are pruned there after two
+ * iterations, and the pages are hashed anew once exported again. Items
+ * below @addr are stale, as in offload_next_rmap_item().
+ */
+static void skip_rmap_items(struct mm_walk_args *walk_args, unsigned long addr,
+			    unsigned long next)
+{
+	struct ksm_rmap_item *rmap_item;
+
+	offload_stale_rmap_items(walk_args, addr);
+	while ((rmap_item = *walk_args->rmap_list) && rmap_item->address < next)
+		walk_args->rmap_list = &rmap_item->rmap_list;
+}
+
+/*
+ * Export a PMD-mapped THP as its subpages tagged SHADOW_PTE_THP, instead of
+ * letting the walk split the mapping. The server does not merge them, it
+ * reports how many would merge with DPU_THP_SUMMARY.
+ */
+static bool scan_thp_pmd(pmd_t *pmd, unsigned long addr, unsigned long next, struct mm_walk *walk)
+{
+	struct mm_walk_args *walk_args = walk->private;
+	struct ksm_rmap_item *rmap_item;
+	struct page *head, *page;
+	spinlock_t *ptl;
+	int i;
+
+	if (next - addr != HPAGE_PMD_SIZE)
+		return false;
+
+	ptl = pmd_trans_huge_lock(pmd, walk->vma);
+	if (!ptl)
+		return false;
+	head = pmd_trans_huge(*pmd) ? vm_normal_page_pmd(walk->vma, addr, *pmd) : NULL;
+	if (!head || !PageAnon(head)) {
+		spin_unlock(ptl);
+		return false;
+	}
+	if (offload_damon_hot_nr && offload_damon_hot_page(head)) {
+		spin_unlock(ptl);
+		skip_rmap_items(walk_args, addr, next);
+		walk_args->damon_hot_skipped += HPAGE_PMD_NR;
+		return true;
+	}
+	/* One pin per subpage, as destroy_metadata() puts every exported page */
+	folio_ref_add(page_folio(head), HPAGE_PMD_NR);
+	spin_unlock(ptl);
+
+	for (i = 0; i < HPAGE_PMD_NR; i++) {
+		page = nth_page(head, i);
+		walk_args->address = addr + i * PAGE_SIZE;
+		rmap_item = offload_next_rmap_item(walk_args, walk_args->address);
+		if (!rmap_item) {
+			DEBUG_ERR("Failed to get rmap item: va %lx\n", walk_args->address);
+			put_page(page);
+			continue;
+		}
+		walk_args->rmap_list = &rmap_item->rmap_list;
+		if (insert_entry_to_shadow_mm(walk_args->shadow_mm, walk_args->address | SHADOW_PTE_THP,
+					      page_to_pfn(page), rmap_item)) {
+			rmap_item->page = NULL;
+			put_page(page);
+			continue;
+		}
+		rmap_item->page = page;
+	}
+	walk_args->thp_exported++;
+	walk_args->nr_pages += HPAGE_PMD_NR;
+	return true;
+}
+
+int scan_pmd_entry(pmd_t *pmd, unsigned long addr, unsigned long next, struct mm_walk *walk) {
+	struct mm_walk_args* walk_args = walk->private;
+
+	offload_dirty_range_end(walk_args);
+	if (walk_args->nr_pages >= walk_args->budget) {
+		walk_args->resume = addr;
+		return 1;
+	}
+
+	if (!offload_hot_regions_nr || !offload_hot_region_skip(walk_args->shadow_mm->mm_id, addr)) {
+		if (!ksm_thp_is_candidate(walk->mm, addr & PMD_MASK)) {
+			/* The ptes are inserted under the pte lock, every other one may start a run */
+			if (shadow_mm_reserve(walk_args->shadow_mm, PTRS_PER_PTE, PTRS_PER_PTE / 2)) {
+				skip_rmap_items(walk_args, addr, next);
+				walk->action = ACTION_CONTINUE;
+				return 0;
+			}
+			if (offload_thp_pct && pmd_trans_huge(*pmd) && scan_thp_pmd(pmd, addr, next, walk))
+				walk->action = ACTION_CONTINUE;
+			else if (offload_clean_dirty)
+				offload_dirty_range_start(pmd, addr, next, walk);
+			return 0;
+		}
+		/* khugepaged is after the range, a merge now would only be undone */
+		walk_args->thp_deferred++;
+	} else {
+		walk_args->regions_skipped++;
+	}
+
+	/* No pin, no MR entry and no NIC read for the region this iteration */
+	skip_rmap_items(walk_args, addr, next);
+	walk->action = ACTION_CONTINUE;
+	return 0;
+}
+
 static const struct mm_walk_ops scan_walk_ops = {
+    .pmd_entry = scan_pmd_entry,
     .pte_entry = scan_pte_entry,
     .test_walk = anon_test_walk,
 };
 
-int create_shadow_mm(struct ksm_cb* ksm_cb,  struct mm_slot *slot, struct shadow_mm** shadow_mm) {
+int create_shadow_mm(struct ksm_cb* ksm_cb,  struct mm_slot *slot, struct mm_walk_args* walk_args) {
     struct shadow_mm* shadow_pt = create_empty(ksm_cb);
     pid_t pid = -1;
 	struct mm_struct *mm =slot->mm;
 	struct task_struct *task;
-
-	struct ksm_mm_slot *mm_slot = mm_slot_entry(slot, struct ksm_mm_slot, slot);
-
-	struct mm_walk_args walk_args = {
-		.mm_slot = mm_slot,
-		.shadow_mm = shadow_pt,
-	};
+	unsigned int chunk = READ_ONCE(ksm_offload_walk_chunk);
+	unsigned long start = 0;
+	u64 hold_start = ktime_get_ns(), hold_ns;
 
 	// struct vm_area_struct *vma;
 	// struct rmap_item *rmap_item;
@@ -4535,8 +6810,38 @@ int create_shadow_mm(struct ksm_cb* ksm_cb,  struct mm_slot *slot, struct shadow
     }
     rcu_read_unlock();
     shadow_pt->mm_id = pid;
+	walk_args->shadow_mm = shadow_pt;
+
+	/*
+	 * Walk in chunks and let faults and mmap writers in between. The rmap_list
+	 * cursor stays valid without the lock, only this walk changes the list.
+	 */
+	if (offload_clean_dirty)
+		inc_tlb_flush_pending(mm);
+	for (;;) {
+		walk_args->nr_pages = 0;
+		walk_args->budget = chunk ? chunk : ULONG_MAX;
+		walk_args->resume = TASK_SIZE;
+		walk_page_range(mm, start, TASK_SIZE, &scan_walk_ops, walk_args);
+		/* The last PMD's range, scan_pmd_entry() closed the others */
+		offload_dirty_range_end(walk_args);
+		offload_settle_rmap_items(walk_args);
+		start = walk_args->resume;
+
+		hold_ns = ktime_get_ns() - hold_start;
+		walk_args->chunks++;
+		walk_args->hold_max_ns = max(walk_args->hold_max_ns, hold_ns);
+		trace_ksm_offload_walk_chunk(offload_cur.iter, hold_ns, walk_args->nr_pages);
+		if (start >= TASK_SIZE)
+			break;
 
-    walk_page_range(mm, 0, TASK_SIZE, &scan_walk_ops, &walk_args);
+		mmap_read_unlock(mm);
+		cond_resched();
+		mmap_read_lock(mm);
+		hold_start = ktime_get_ns();
+		if (ksm_test_exit(mm))
+			break;
+	}
 
 	// vma = find_vma(mm, ksm_scan.address);
 
@@ -4596,14 +6901,16 @@ int create_shadow_mm(struct ksm_cb* ksm_cb,  struct mm_slot *slot, struct shadow
 	// 	}
 	// }
 
-	flush_tlb_mm(mm);
+	/* A walk that only read the ptes has nothing to flush */
+	if (walk_args->ptes_cleaned)
+		flush_tlb_mm(mm);
+	if (offload_clean_dirty)
+		dec_tlb_flush_pending(mm);
 
-	*shadow_mm = shadow_pt;
     return shadow_pt->pt_map.cnt;
 }
 
-bool init_shadow_for_mm(struct ksm_cb* ksm_cb, struct mm_slot *mm_slot) {
-	struct shadow_mm* shadow_mm = NULL;
+bool init_shadow_for_mm(struct ksm_cb* ksm_cb, struct mm_slot *mm_slot, struct mm_walk_args* walk_args) {
 	int cnt;
 
 	if (ksm_test_exit(mm_slot->mm)) {
@@ -4611,78 +6918,182 @@ bool init_shadow_for_mm(struct ksm_cb* ksm_cb, struct mm_slot *mm_slot) {
 		return false;
 	}
 
-	cnt = create_shadow_mm(ksm_cb, mm_slot, &shadow_mm);
+	cnt = create_shadow_mm(ksm_cb, mm_slot, walk_args);
 
-    if (!shadow_mm) {
+    if (!walk_args->shadow_mm) {
         DEBUG_ERR("Failed to create shadow page table\n");
         return false;
     }
 
 	if (cnt == 0 ) {
-		free_shadow_mm(shadow_mm, false, 0);
+		free_shadow_mm(walk_args->shadow_mm, false, 0);
+		walk_args->shadow_mm = NULL;
 		return false;
 	}
 
-    list_add(&shadow_mm->list, &ksm_cb->shadow_pt_list);
-
-    DEBUG_LOG("Registered shadow page table for mm %d\n", shadow_mm->mm_id);
+    DEBUG_LOG("Registered shadow page table for mm %d\n", walk_args->shadow_mm->mm_id);
 	return true;
 }
 
+/* One mm's shadow walk, run on ksmd or on ksm_offload_prep_wq */
+struct offload_prep {
+	struct work_struct work;
+	struct list_head list;		/* prepare_metadata()'s, in slot order */
+	struct ksm_cb *ksm_cb;
+	struct mm_slot *slot;
+	struct mm_struct *mm;
+	struct mm_walk_args walk_args;
+	bool registered;
+};
+
+static void offload_prep_init(struct offload_prep *prep, struct ksm_cb *ksm_cb,
+			      struct mm_slot *slot)
+{
+	struct ksm_mm_slot *mm_slot = mm_slot_entry(slot, struct ksm_mm_slot, slot);
+
+	memset(prep, 0, sizeof(*prep));
+	prep->ksm_cb = ksm_cb;
+	prep->slot = slot;
+	prep->mm = slot->mm;
+	prep->walk_args.mm_slot = mm_slot;
+	prep->walk_args.rmap_list = &mm_slot->rmap_list;
+}
+
+static void offload_prep_walk(struct work_struct *work)
+{
+	struct offload_prep *prep = container_of(work, struct offload_prep, work);
+
+	mmap_read_lock(prep->mm);
+	prep->registered = init_shadow_for_mm(prep->ksm_cb, prep->slot, &prep->walk_args);
+	mmap_read_unlock(prep->mm);
+}
+
+/*
+ * On ksmd once the walk is done: add up its counts and queue its shadow mm,
+ * or drop the rmap_items it left behind and the slot once it has none.
+ */
+static bool offload_prep_finish(struct offload_prep *prep)
+{
+	struct mm_walk_args *walk_args = &prep->walk_args;
+	struct ksm_mm_slot *mm_slot = walk_args->mm_slot;
+	struct mm_struct *mm = prep->mm;
+
+	offload_dirty_cleaned += walk_args->dirty_cleaned;
+	offload_unchanged += walk_args->unchanged;
+	offload_damon_hot_skipped += walk_args->damon_hot_skipped;
+	offload_hot_regions_skipped += walk_args->regions_skipped;
+	offload_thp_exported += walk_args->thp_exported;
+	ksm_thp_merge_deferred_nr += walk_args->thp_deferred;
+	offload_cur.walk_chunks += walk_args->chunks;
+	offload_cur.walk_hold_max_ns = max(offload_cur.walk_hold_max_ns, walk_args->hold_max_ns);
+	if (walk_args->chunks && !walk_args->ptes_cleaned)
+		offload_flushes_skipped++;
+
+	if (prep->registered) {
+		list_add(&walk_args->shadow_mm->list, &prep->ksm_cb->shadow_pt_list);
+		offload_advisor_ctx.nr_mms++;
+		offload_cur.nr_mms++;
+		return true;
+	}
+
+	mmap_read_lock(mm);
+	if (ksm_test_exit(mm)) {
+		walk_args->address = 0;
+		walk_args->rmap_list = &mm_slot->rmap_list;
+	}
+
+	mutex_lock(&offload_rmap_lock);
+	remove_trailing_rmap_items(walk_args->rmap_list);
+	mutex_unlock(&offload_rmap_lock);
+
+	if (walk_args->address == 0) {
+		hash_del(&mm_slot->slot.hash);
+		list_del(&mm_slot->slot.mm_node);
+
+		mm_slot_free(mm_slot_cache, mm_slot);
+		clear_bit(MMF_VM_MERGEABLE, &mm->flags);
+		clear_bit(MMF_VM_MERGE_ANY, &mm->flags);
+		mmap_read_unlock(mm);
+		mmdrop(mm);
+	} else {
+		mmap_read_unlock(mm);
+	}
+	return false;
+}
+
+/* First mm slot of the next offload iteration when the advisor limits its scope */
+static unsigned int offload_mm_cursor;
+
 static bool prepare_metadata(struct ksm_cb* ksm_cb) {
 	struct mm_slot *slot, *next;
-	struct ksm_mm_slot *mm_slot;
-	struct mm_struct *mm;
+	struct offload_prep *prep, *spare, *tmp_prep, seq;
+	LIST_HEAD(preps);
 	bool any_registered = false;
+	unsigned int scope = READ_ONCE(ksm_offload_scan_mms);
+	unsigned int idx = 0, taken = 0;
 
 	unsigned long total_metadata_size = 0;
 	struct shadow_mm* entry, *tmp;
+	u64 t = ktime_get_ns();
+
+	/* Allocated ahead, a slot takes it under ksm_mmlist_lock */
+	spare = ksm_offload_prep_wq && READ_ONCE(ksm_offload_prep_workers) ?
+		kzalloc(sizeof(*spare), GFP_KERNEL) : NULL;
+	offload_prep_queued = 0;
 
 	spin_lock(&ksm_mmlist_lock);
 	// TODO: check empty list
 
 	list_for_each_entry_safe(slot, next, &ksm_mm_head.slot.mm_node, mm_node) {
-		spin_unlock(&ksm_mmlist_lock);
-		// TODO: check if the mm is already registered
-
-		mm_slot = mm_slot_entry(slot, struct ksm_mm_slot, slot);
-
-		ksm_scan.mm_slot = mm_slot;
-		ksm_scan.address = 0;
-		ksm_scan.rmap_list = &mm_slot->rmap_list;
-
-		mm = slot->mm;
-		mmap_read_lock(mm);
+		/* Limited scope: take the next @scope slots, round robin across iterations */
+		if (scope && (idx++ < offload_mm_cursor || taken >= scope))
+			continue;
+		taken++;
 
-		if (init_shadow_for_mm(ksm_cb, slot)) {
-			any_registered = true;
-			mmap_read_unlock(mm);
-		} else {
-			if (ksm_test_exit(mm)) {
-				ksm_scan.address = 0;
-				ksm_scan.rmap_list = &mm_slot->rmap_list;
-			}
+		/*
+		 * A pinned mm cannot exit, so its slot outlives the worker's walk.
+		 * Exiting mms are walked and cleaned up on ksmd, as without workers.
+		 */
+		if (spare && mmget_not_zero(slot->mm)) {
+			prep = spare;
+			offload_prep_init(prep, ksm_cb, slot);
+			list_add_tail(&prep->list, &preps);
+			spin_unlock(&ksm_mmlist_lock);
 
-			remove_trailing_rmap_items(ksm_scan.rmap_list);
+			INIT_WORK(&prep->work, offload_prep_walk);
+			queue_work(ksm_offload_prep_wq, &prep->work);
+			offload_prep_queued++;
+			spare = kzalloc(sizeof(*spare), GFP_KERNEL);
 
-			if (ksm_scan.address == 0) {
-				hash_del(&mm_slot->slot.hash);
-				list_del(&mm_slot->slot.mm_node);
-				
-				mm_slot_free(mm_slot_cache, mm_slot);
-				clear_bit(MMF_VM_MERGEABLE, &mm->flags);
-				clear_bit(MMF_VM_MERGE_ANY, &mm->flags);
-				mmap_read_unlock(mm);
-				mmdrop(mm);
-			}else{
-				mmap_read_unlock(mm);
-			}
+			spin_lock(&ksm_mmlist_lock);
+			continue;
 		}
+		spin_unlock(&ksm_mmlist_lock);
+		// TODO: check if the mm is already registered
+
+		offload_prep_init(&seq, ksm_cb, slot);
+		ksm_scan.mm_slot = seq.walk_args.mm_slot;
+		offload_prep_walk(&seq.work);
+		any_registered |= offload_prep_finish(&seq);
 
 		spin_lock(&ksm_mmlist_lock);
 	}
 	spin_unlock(&ksm_mmlist_lock);
-	
+	kfree(spare);
+
+	/* Join the workers, nothing is registered before every walk is done */
+	if (!list_empty(&preps))
+		flush_workqueue(ksm_offload_prep_wq);
+	list_for_each_entry(prep, &preps, list)
+		any_registered |= offload_prep_finish(prep);
+
+	offload_advisor_ctx.nr_slots = scope ? idx : taken;
+	/* Wrap around once the window ran past the last slot */
+	offload_mm_cursor = scope && taken == scope && offload_mm_cursor + taken < idx ?
+			    offload_mm_cursor + taken : 0;
+
+	t = offload_phase_add(OFFLOAD_PHASE_PREPARE, t);
+	offload_phase_trace(OFFLOAD_PHASE_PREPARE, offload_cur.nr_mms);
 
 	if (any_registered) {
 		rdma_register_shadow_mms();
@@ -4694,13 +7105,21 @@ static bool prepare_metadata(struct ksm_cb* ksm_cb) {
 	ksm_scan.mm_slot = &ksm_mm_head;
 	spin_unlock(&ksm_mmlist_lock);
 
+	/* Unpinned only now, an mm exiting here looks at ksm_scan.mm_slot */
+	list_for_each_entry_safe(prep, tmp_prep, &preps, list) {
+		mmput(prep->mm);
+		kfree(prep);
+	}
+
 	total_metadata_size = sizeof(struct ksm_cb);
 	list_for_each_entry_safe(entry, tmp, &ksm_cb->shadow_pt_list, list) {
-		total_metadata_size += sizeof(struct shadow_mm);
-		total_metadata_size += entry->pt_map.va_array_cnt * (KMALLOC_MAX_SIZE);
-		total_metadata_size += entry->pt_map.cnt * (sizeof(struct shadow_pte) + sizeof(struct scatterlist));
+		total_metadata_size += shadow_mm_size(entry);
+		offload_cur.nr_ptes += entry->pt_map.cnt;
 	}
-	pr_info("Total metadata size, %lu\n", total_metadata_size);
+	offload_cur.metadata_bytes = total_metadata_size;
+	offload_phase_add(OFFLOAD_PHASE_REGISTER, t);
+	offload_phase_trace(OFFLOAD_PHASE_REGISTER, offload_cur.nr_ptes);
+	OFFLOAD_LOG("Total metadata size, %lu\n", total_metadata_size);
 
 	return any_registered;
 }
@@ -4711,8 +7130,10 @@ static void destroy_metadata(bool disconnected, int curr_iteration) {
 
 static void prune_stable_tree(void) {
 	struct ksm_stable_node *stable_node, *dup, *any;
+	struct hlist_node *tmp;
 	struct page *page;
 	struct rb_node* node;
+	int bkt;
 
 	for (node = rb_first(root_stable_tree); node; node = rb_next(node)) {
 		stable_node = rb_entry(node, struct ksm_stable_node, node);
@@ -4723,6 +7144,13 @@ static void prune_stable_tree(void) {
 			put_page(page);
 		cond_resched();
 	}
+
+	hash_for_each_safe(stable_fp_hash, bkt, tmp, stable_node, hlist_dup) {
+		page = get_ksm_page(stable_node, GET_KSM_PAGE_NOLOCK);
+		if (page)
+			put_page(page);
+		cond_resched();
+	}
 }
 
 static void try_mms_cleanup(void) {
@@ -54,7 +54,10 @@ typedef u8 rmap_age_t;
 			struct list_head *head;
 			struct {
 				struct hlist_node hlist_dup;
-				struct list_head list;
+				union {
+					struct list_head list;
+					u32 fp;	/* when in stable_fp_hash */
+				};
 			};
 		};
 	};
@@ -146,11 +149,13 @@ enum remote_status {
 
 extern struct ksm_cb* ksm_cb;
 extern struct error_table* ksm_error_table;
+extern struct error_table* ksm_verify_table;
 extern bool is_offload_decided;
 extern enum offload_mode *current_mode;
 extern enum remote_status offload_server_status;
 extern char* fail_reason_str[11];
 extern long fail_reason_cnts[11];
+extern bool ksm_offload_log;
 
 bool is_rdma_initialized(void);
 bool is_ksm_offload(void);
@@ -161,5 +166,7 @@ bool is_styx_offload(void);
 
 #define DEBUG_LOG(fmt, args...) do { if (DEBUG_PRINT_FLAG) pr_info(fmt, ##args); } while (0)
 #define DEBUG_ERR(fmt, args...) do { pr_err(fmt, ##args); debug_stop(); } while (0)
+/* Per-iteration offload logs, silenced through /sys/kernel/mm/ksm/offload_log */
+#define OFFLOAD_LOG(fmt, args...) do { if (READ_ONCE(ksm_offload_log)) pr_info(fmt, ##args); } while (0)
 
 #endif
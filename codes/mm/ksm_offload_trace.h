@@ -0,0 +1,124 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Tracepoints for the host side of a BASK offload iteration. Every phase
+ * event fires once the phase is done, with its duration and a phase specific
+ * count (mms, shadow ptes, bytes or log entries, see the TP_printk).
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ksm_offload
+
+#if !defined(_KSM_OFFLOAD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _KSM_OFFLOAD_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(ksm_offload_phase,
+
+	TP_PROTO(int iter, u64 ns, unsigned long count),
+
+	TP_ARGS(iter, ns, count),
+
+	TP_STRUCT__entry(
+		__field(int,		iter)
+		__field(u64,		ns)
+		__field(unsigned long,	count)
+	),
+
+	TP_fast_assign(
+		__entry->iter	= iter;
+		__entry->ns	= ns;
+		__entry->count	= count;
+	),
+
+	TP_printk("iter %d ns %llu count %lu",
+		  __entry->iter, __entry->ns, __entry->count)
+);
+
+/* count: mms with a shadow page table */
+DEFINE_EVENT(ksm_offload_phase, ksm_offload_prepare_metadata,
+	TP_PROTO(int iter, u64 ns, unsigned long count),
+	TP_ARGS(iter, ns, count)
+);
+
+/* ns: one mmap_lock hold of the shadow walk, count: pages it visited */
+DEFINE_EVENT(ksm_offload_phase, ksm_offload_walk_chunk,
+	TP_PROTO(int iter, u64 ns, unsigned long count),
+	TP_ARGS(iter, ns, count)
+);
+
+/* count: shadow ptes registered for NIC reads */
+DEFINE_EVENT(ksm_offload_phase, ksm_offload_register,
+	TP_PROTO(int iter, u64 ns, unsigned long count),
+	TP_ARGS(iter, ns, count)
+);
+
+/* count: metadata bytes described to the server */
+DEFINE_EVENT(ksm_offload_phase, ksm_offload_send,
+	TP_PROTO(int iter, u64 ns, unsigned long count),
+	TP_ARGS(iter, ns, count)
+);
+
+/* count: host memory read by the NIC, in bytes */
+DEFINE_EVENT(ksm_offload_phase, ksm_offload_wait,
+	TP_PROTO(int iter, u64 ns, unsigned long count),
+	TP_ARGS(iter, ns, count)
+);
+
+/* count: log entries read back */
+DEFINE_EVENT(ksm_offload_phase, ksm_offload_recv,
+	TP_PROTO(int iter, u64 ns, unsigned long count),
+	TP_ARGS(iter, ns, count)
+);
+
+/* count: merges done */
+DEFINE_EVENT(ksm_offload_phase, ksm_offload_apply,
+	TP_PROTO(int iter, u64 ns, unsigned long count),
+	TP_ARGS(iter, ns, count)
+);
+
+/* count: mms unregistered */
+DEFINE_EVENT(ksm_offload_phase, ksm_offload_destroy,
+	TP_PROTO(int iter, u64 ns, unsigned long count),
+	TP_ARGS(iter, ns, count)
+);
+
+TRACE_EVENT(ksm_offload_iteration,
+
+	TP_PROTO(int iter, unsigned long scanned, int stable, int unstable,
+		 int failures, bool disconnected),
+
+	TP_ARGS(iter, scanned, stable, unstable, failures, disconnected),
+
+	TP_STRUCT__entry(
+		__field(int,		iter)
+		__field(unsigned long,	scanned)
+		__field(int,		stable)
+		__field(int,		unstable)
+		__field(int,		failures)
+		__field(bool,		disconnected)
+	),
+
+	TP_fast_assign(
+		__entry->iter		= iter;
+		__entry->scanned	= scanned;
+		__entry->stable		= stable;
+		__entry->unstable	= unstable;
+		__entry->failures	= failures;
+		__entry->disconnected	= disconnected;
+	),
+
+	TP_printk("iter %d scanned %lu stable %d unstable %d failures %d disconnected %d",
+		  __entry->iter, __entry->scanned, __entry->stable,
+		  __entry->unstable, __entry->failures, __entry->disconnected)
+);
+
+#endif /* _KSM_OFFLOAD_TRACE_H */
+
+/* The header lives next to ksm.c rather than in include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ksm_offload_trace
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
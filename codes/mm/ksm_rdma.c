@@ -1,7 +1,6 @@
 #include "linux/math.h"
 #include "linux/printk.h"
 #include "linux/types.h"
-#include "linux/xarray.h"
 #include <linux/err.h>
 #include <linux/highmem.h>
 #include <linux/mm.h>
@@ -45,6 +44,14 @@ const char *ksm_wr_tag_str(enum ksm_wr_tag tag) {
         return "WR_SEND_SINGLE_RESULT";
 	case WR_RECV_SINGLE_RESULT:
         return "WR_RECV_SINGLE_RESULT";
+	case WR_INVALIDATE_MR:
+        return "WR_INVALIDATE_MR";
+	case WR_ASYNC_REG_MR:
+        return "WR_ASYNC_REG_MR";
+	case WR_RECV_ASYNC_RESULT:
+        return "WR_RECV_ASYNC_RESULT";
+	case WR_SEND_REAP:
+        return "WR_SEND_REAP";
 	default:
 		return "WR_UNKNOWN";
 	}
@@ -57,6 +64,8 @@ int (*rdma_reg_mr)(struct ksm_cb* cb, struct ib_mr* mr, int access) = NULL;
 void (*rdma_print_timer)(void) = NULL;
 int (*rdma_styx_memcmp)(struct ksm_cb* cb, void *page1, void *page2) = NULL;
 unsigned long long (*rdma_styx_hash)(struct ksm_cb* cb, void *page) = NULL;
+int (*rdma_styx_batch)(struct ksm_cb* cb, struct styx_batch *batch) = NULL;
+int (*rdma_styx_batch_submit)(struct ksm_cb* cb, struct styx_batch *batch) = NULL;
 
 struct ib_mr *(*do_mlx_ib_alloc_mr)(struct ib_pd *pd, enum ib_mr_type mr_type, u32 max_num_sg) = NULL;
 int (*do_mlx_ib_dereg_mr)(struct ib_mr *mr) = NULL;
@@ -96,6 +105,8 @@ bool try_update_api_function(void) {
     LOOKUP_KSM_RDMA_(print_timer);
     LOOKUP_KSM_RDMA_(styx_memcmp);
     LOOKUP_KSM_RDMA_(styx_hash);
+    LOOKUP_KSM_RDMA_(styx_batch);
+    LOOKUP_KSM_RDMA_(styx_batch_submit);
 
     ksm_huge_alloc_init = (void *) kallsyms_lookup_name("ksm_rdma_huge_alloc_init"); \
     if (!ksm_huge_alloc_init) { \
@@ -142,7 +153,9 @@ bool is_offload_decided = false;
 enum remote_status offload_server_status = UNINITIALIZED;
 struct ksm_cb* ksm_cb = NULL;
 struct error_table* ksm_error_table = NULL;
+struct error_table* ksm_verify_table = NULL;
 long fail_reason_cnts[11] = {0};
+bool ksm_offload_log = true;
 char *fail_reason_str[11] = {
     "No_mergeable_vma_found",
     "Failed_to_lock_page",
@@ -208,6 +221,11 @@ void init_cb(void) {
         pr_err("Failed to create error table\n");
         return;
     }
+    ksm_verify_table = create_error_table();
+    if (!ksm_verify_table) {
+        pr_err("Failed to create verify table\n");
+        return;
+    }
 
     rdma_create_connection(ksm_cb);
 
@@ -258,8 +276,6 @@ void rdma_register_shadow_mms(void) {
     DEBUG_LOG("Start registering shadow page tables\n");
        
     list_for_each_entry_safe(entry, tmp, &ksm_cb->shadow_pt_list, list) {
-        XA_STATE(xa_iter, &entry->pt_map.page_xa, 0);
-
         pt_idx = ksm_cb->md_desc_tx.pt_cnt++;
 
         if (entry->pt_map.cnt > MAX_PAGES_DESCS * MAX_PAGES_IN_SGL) {
@@ -309,7 +325,7 @@ void rdma_register_shadow_mms(void) {
                         pr_err("Address not ascending: %lx vs %lx\n", prev_va, this_va);
                     }
 
-                    item = xas_next_entry(&xa_iter, ULONG_MAX);
+                    item = shadow_mm_item_at(entry, va_idx);
                     if (!item) {
                         pr_err("Failed to find %d-th Page\n", i + registered);
                         debug_stop();
@@ -373,7 +389,7 @@ void rdma_register_shadow_mms(void) {
         entry->pages_sgt_cnt = sgl_num;
 
         {
-            BUG_ON(entry->pt_map.va_array_cnt > MAX_VA_ARRAYS);
+            BUG_ON(entry->pt_map.va_array_cnt > MAX_VA_ARRAYS + SHADOW_CHUNK_GROWN);
 
             map_pages_cnt = (entry->pt_map.capacity * sizeof(struct shadow_pte)) / PAGE_SIZE;
             entry->map_mr = do_mlx_ib_alloc_mr(ksm_cb->pd, IB_MR_TYPE_MEM_REG, map_pages_cnt);
@@ -409,13 +425,18 @@ void rdma_register_shadow_mms(void) {
 
             registered = 0;
             for (i = 0; i < entry->pt_map.va_array_cnt; i++) {
-                this_size = i == (entry->pt_map.va_array_cnt - 1) ? entry->pt_map.capacity - i * MAX_CAPACITY_PER_TABLE : MAX_CAPACITY_PER_TABLE;
+                this_size = shadow_chunk_entries(i);
 
                 for (j = 0; j < this_size; j += (PAGE_SIZE / sizeof(struct shadow_pte))) {
-                    if (virt_addr_valid(&entry->pt_map.va_arrays[i][j]) == 0) {
-                        pr_err("Invalid address: %lx\n", (uintptr_t) &entry->pt_map.va_arrays[i][j]);
+                    /* Large chunks may come from kvmalloc()'s vmalloc fallback */
+                    if (is_vmalloc_addr(&entry->pt_map.va_arrays[i][j])) {
+                        map_page = vmalloc_to_page(&entry->pt_map.va_arrays[i][j]);
+                    } else {
+                        if (virt_addr_valid(&entry->pt_map.va_arrays[i][j]) == 0) {
+                            pr_err("Invalid address: %lx\n", (uintptr_t) &entry->pt_map.va_arrays[i][j]);
+                        }
+                        map_page = virt_to_page(&entry->pt_map.va_arrays[i][j]);
                     }
-                    map_page = virt_to_page(&entry->pt_map.va_arrays[i][j]);
                     
                     sg_set_page(&map_sg[registered], map_page, PAGE_SIZE, 0);
                     registered++;
@@ -504,7 +525,7 @@ void rdma_unregister_shadow_mms(bool disconnected, int curr_iteration) {
     DEBUG_LOG("Unregistered all shadow page tables\n");
 }
 
-void rdma_register_error_table(void) {
+static void rdma_register_table(struct error_table *table, struct error_table_descriptor *desc) {
     struct scatterlist *first_sgt, *prev_sgt, *curr_sgt;
     int i, nents, err, entry_pos, array_idx, entry_idx;
     int registered, iter_cnt, iters, this_size, this_sgl_size, total_entries, remaining_size;
@@ -516,8 +537,8 @@ void rdma_register_error_table(void) {
         return;
     }
 
-    ksm_error_table->registered = ksm_error_table->total_cnt;
-    total_entries = DIV_ROUND_UP(ksm_error_table->registered * sizeof(struct ksm_event_log), PAGE_SIZE);
+    table->registered = table->total_cnt;
+    total_entries = DIV_ROUND_UP(table->registered * sizeof(struct ksm_event_log), PAGE_SIZE);
     
     sgl_num = DIV_ROUND_UP(total_entries, MAX_PAGES_IN_SGL);
     for (sgl_idx = 0; sgl_idx < sgl_num; sgl_idx++) {
@@ -555,7 +576,7 @@ void rdma_register_error_table(void) {
                 array_idx = entry_pos / MAX_RESULT_TABLE_ENTRIES;
                 entry_idx = entry_pos % MAX_RESULT_TABLE_ENTRIES;
 
-                page = virt_to_page(&ksm_error_table->entry_tables[array_idx][entry_idx]);
+                page = virt_to_page(&table->entry_tables[array_idx][entry_idx]);
 
                 sg_set_page(&curr_sgt[i], page, PAGE_SIZE, 0);
             }
@@ -574,43 +595,43 @@ void rdma_register_error_table(void) {
             DEBUG_LOG("  -> %lx\n", curr_sgt[this_size - 1].page_link);
         }
 
-        ksm_error_table->rdma.mr[sgl_idx] = do_mlx_ib_alloc_mr(ksm_cb->pd, IB_MR_TYPE_MEM_REG, this_sgl_size);
-        if (IS_ERR(ksm_error_table->rdma.mr[sgl_idx])) {
+        table->rdma.mr[sgl_idx] = do_mlx_ib_alloc_mr(ksm_cb->pd, IB_MR_TYPE_MEM_REG, this_sgl_size);
+        if (IS_ERR(table->rdma.mr[sgl_idx])) {
             pr_err("Failed to allocate mr\n");
         }
 
-        nents = do_mlx_ib_dma_map_sg(ksm_error_table->rdma.mr[sgl_idx]->device, first_sgt, this_sgl_size, DMA_BIDIRECTIONAL);
+        nents = do_mlx_ib_dma_map_sg(table->rdma.mr[sgl_idx]->device, first_sgt, this_sgl_size, DMA_BIDIRECTIONAL);
         if (nents <= 0) {
             pr_err("Failed to map sg_table %d\n", nents);
         }
 
-        err = do_mlx_ib_map_mr_sg(ksm_error_table->rdma.mr[sgl_idx], first_sgt, nents, NULL, PAGE_SIZE);
+        err = do_mlx_ib_map_mr_sg(table->rdma.mr[sgl_idx], first_sgt, nents, NULL, PAGE_SIZE);
         if (err != nents) {
             pr_err("ib_map_mr_sg failed %d vs %d\n", err, nents);
         }
 
-        err = rdma_reg_mr(ksm_cb, ksm_error_table->rdma.mr[sgl_idx], IB_ACCESS_LOCAL_WRITE | IB_ACCESS_REMOTE_READ);
+        err = rdma_reg_mr(ksm_cb, table->rdma.mr[sgl_idx], IB_ACCESS_LOCAL_WRITE | IB_ACCESS_REMOTE_READ);
         if (err) {
             pr_err("Failed to register mr: %d\n", err);
         }
 
-        if (ksm_error_table->rdma.mr[sgl_idx]->length != PAGE_SIZE * this_sgl_size) {
-            pr_err("Page mr size mismatch: %llu\n", ksm_error_table->rdma.mr[sgl_idx]->length);
+        if (table->rdma.mr[sgl_idx]->length != PAGE_SIZE * this_sgl_size) {
+            pr_err("Page mr size mismatch: %llu\n", table->rdma.mr[sgl_idx]->length);
         }
 
-        ksm_error_table->rdma.sgt[sgl_idx] = first_sgt;
-        ksm_cb->md_desc_tx.et_descs.entries[sgl_idx].rkey = ksm_error_table->rdma.mr[sgl_idx]->rkey;
-        ksm_cb->md_desc_tx.et_descs.entries[sgl_idx].base_addr = ksm_error_table->rdma.mr[sgl_idx]->iova;
+        table->rdma.sgt[sgl_idx] = first_sgt;
+        desc->entries[sgl_idx].rkey = table->rdma.mr[sgl_idx]->rkey;
+        desc->entries[sgl_idx].base_addr = table->rdma.mr[sgl_idx]->iova;
     }
-    ksm_error_table->rdma.sgt_cnt = sgl_num;
-    ksm_cb->md_desc_tx.et_descs.total_cnt = ksm_error_table->registered;
-    ksm_cb->md_desc_tx.et_descs.desc_cnt = sgl_num;
+    table->rdma.sgt_cnt = sgl_num;
+    desc->total_cnt = table->registered;
+    desc->desc_cnt = sgl_num;
 
-    pr_info("Registered error table with %d entries with total %d pages\n", ksm_error_table->registered, total_entries);
+    DEBUG_LOG("Registered table with %d entries with total %d pages\n", table->registered, total_entries);
     return;
 }
 
-void rdma_unregister_error_table(void) {
+static void rdma_unregister_table(struct error_table *table) {
     int err, i, total_entries;
     int iter_cnt, iters, this_size, this_sgl_size, remaining_size, freed;
     struct scatterlist *sg, *curr_sgt, *next_sgt;
@@ -620,14 +641,14 @@ void rdma_unregister_error_table(void) {
         return;
     }
 
-    total_entries = DIV_ROUND_UP(ksm_error_table->registered * sizeof(struct ksm_event_log), PAGE_SIZE);
-    for (i = 0; i < ksm_error_table->rdma.sgt_cnt; i++) {
+    total_entries = DIV_ROUND_UP(table->registered * sizeof(struct ksm_event_log), PAGE_SIZE);
+    for (i = 0; i < table->rdma.sgt_cnt; i++) {
         freed = 0;
-        this_sgl_size = i == (ksm_error_table->rdma.sgt_cnt - 1) ? total_entries - i * MAX_PAGES_IN_SGL : MAX_PAGES_IN_SGL;
-        curr_sgt = ksm_error_table->rdma.sgt[i];
+        this_sgl_size = i == (table->rdma.sgt_cnt - 1) ? total_entries - i * MAX_PAGES_IN_SGL : MAX_PAGES_IN_SGL;
+        curr_sgt = table->rdma.sgt[i];
 
-        do_mlx_ib_dma_unmap_sg(ksm_cb->pd->device, ksm_error_table->rdma.sgt[i], this_sgl_size, DMA_BIDIRECTIONAL);
-        err = do_mlx_ib_dereg_mr(ksm_error_table->rdma.mr[i]);
+        do_mlx_ib_dma_unmap_sg(ksm_cb->pd->device, table->rdma.sgt[i], this_sgl_size, DMA_BIDIRECTIONAL);
+        err = do_mlx_ib_dereg_mr(table->rdma.mr[i]);
         if (err) {
             pr_err("Failed to deregister mr: %d\n", err);
         }
@@ -654,7 +675,7 @@ void rdma_unregister_error_table(void) {
                 kfree(curr_sgt);
                 break;
             } else {
-                pr_err("Invalid scatterlist: %d, %d, %d, %d\n", i, iter_cnt, this_size, ksm_error_table->rdma.sgt_cnt);
+                pr_err("Invalid scatterlist: %d, %d, %d, %d\n", i, iter_cnt, this_size, table->rdma.sgt_cnt);
                 pr_err("  ->%lx\n", sg->page_link);
                 debug_stop();
             }
@@ -663,7 +684,54 @@ void rdma_unregister_error_table(void) {
         }
     }
 
-    pr_info("Unregistered error table\n");
+    DEBUG_LOG("Unregistered table\n");
+}
+
+void rdma_register_error_table(void) {
+    rdma_register_table(ksm_error_table, &ksm_cb->md_desc_tx.et_descs);
+    OFFLOAD_LOG("Registered error table with %d entries\n", ksm_error_table->registered);
+}
+
+void rdma_unregister_error_table(void) {
+    rdma_unregister_table(ksm_error_table);
+    OFFLOAD_LOG("Unregistered error table\n");
+}
+
+/*
+ * Verify round of the commit: expose the HOST_VERIFY_PAIR entries of
+ * ksm_verify_table and wait for the server to answer each of them. The shadow
+ * mms stay registered, so the pairs may name their pages. Empties the table.
+ */
+struct result_table* rdma_verify_pairs(void) {
+    struct result_table* result;
+    unsigned long scanned = 0;
+    int err;
+
+    if (!ksm_cb) {
+        pr_err("ksm_cb not initialized\n");
+        return NULL;
+    }
+
+    rdma_register_table(ksm_verify_table, &ksm_cb->md_desc_tx.vt_descs);
+
+    ksm_cb->state = KSM_CONNECTED;
+    err = rdma_meta_send(ksm_cb);
+    result = err ? NULL : rdma_result_recv(ksm_cb, &scanned);
+    if (!result) {
+        pr_err("Failed to verify pairs\n");
+    } else if (result->total_cnt != ksm_verify_table->registered) {
+        pr_err("Verify answered %d of %d pairs\n", result->total_cnt, ksm_verify_table->registered);
+        free_result_table(result);
+        result = NULL;
+    }
+
+    rdma_unregister_table(ksm_verify_table);
+    memset(&ksm_cb->md_desc_tx.vt_descs, 0, sizeof(struct error_table_descriptor));
+    ksm_verify_table->registered = 0;
+    ksm_verify_table->total_cnt = 0;
+
+    OFFLOAD_LOG("Verified pairs\n");
+    return result;
 }
 
 struct list_head* send_meta_desc(void) {
@@ -679,7 +747,7 @@ struct list_head* send_meta_desc(void) {
         pr_err("Failed to send meta desc\n");
     }
 
-    pr_info("Sent metadata descriptor\n");
+    OFFLOAD_LOG("Sent metadata descriptor\n");
     return &ksm_cb->shadow_pt_list;
 }
 
@@ -697,7 +765,7 @@ struct result_table* recv_offload_result(unsigned long* ksm_pages_scanned) {
         return NULL;
     }
 
-    pr_info("Received result table\n");
+    OFFLOAD_LOG("Received result table\n");
 
     return result;
 }
@@ -2,6 +2,7 @@
 #include <rdma/ib_verbs.h>
 #include <rdma/rdma_cm.h>
 #include "linux/xarray.h"
+#include <linux/mmu_notifier.h>
 
 #define LOOKUP_KSM_RDMA_(func) \
     do { \
@@ -27,6 +28,12 @@
 #define MAX_PAGES_IN_SGL 65536 // => Covers 65536 * 8 = 512KB pages = 2GB
 
 #define MAX_CAPACITY_PER_TABLE ((KMALLOC_MAX_SIZE / sizeof(struct shadow_pte)) / 2)
+/*
+ * va_arrays[i] holds SHADOW_CHUNK_MIN << i entries until that reaches
+ * MAX_CAPACITY_PER_TABLE, every later chunk holds MAX_CAPACITY_PER_TABLE
+ */
+#define SHADOW_CHUNK_MIN (PAGE_SIZE / sizeof(struct shadow_pte))
+#define SHADOW_CHUNK_GROWN ilog2(MAX_CAPACITY_PER_TABLE / SHADOW_CHUNK_MIN)
 #define MAX_VA_ARRAYS (MAX_PAGES_IN_SGL * PAGE_SIZE / KMALLOC_MAX_SIZE)
 #define MAX_RESULT_TABLE_ENTRIES ((KMALLOC_MAX_SIZE / sizeof(struct ksm_event_log)))
 
@@ -44,6 +51,9 @@ enum ksm_wr_tag {
 	WR_SEND_SINGLE_RESULT,
 	WR_RECV_SINGLE_RESULT,
 	WR_INVALIDATE_MR,
+	WR_ASYNC_REG_MR,
+	WR_RECV_ASYNC_RESULT,
+	WR_SEND_REAP,
 };
 
 enum ksm_rdma_state {
@@ -73,8 +83,22 @@ enum event_tag {
 	HOST_NO_STABLE_NODE,
 	HOST_MERGE_ONE_FAILED,
 	HOST_MERGE_TWO_FAILED,
+	DPU_HOT_REGION,
+	DPU_THP_SUMMARY,
+	HOST_VERIFY_PAIR,
+	DPU_VERIFY_SAME,
+	DPU_VERIFY_DIFF,
 };
 
+/* In shadow_pte.va: the pte stayed clean since the last export of the same page */
+#define SHADOW_PTE_UNCHANGED 0x1UL
+/* In shadow_pte.va: a subpage of a PMD-mapped THP, reported with DPU_THP_SUMMARY instead of merged */
+#define SHADOW_PTE_THP 0x2UL
+#define SHADOW_PTE_FLAGS (SHADOW_PTE_UNCHANGED | SHADOW_PTE_THP)
+
+/* Granularity of the server's volatility feedback, a PMD with 4K pages */
+#define HOT_REGION_SHIFT 21
+
 struct shadow_pte {
     unsigned long va;
 	unsigned long pfn;
@@ -102,6 +126,8 @@ struct shadow_pt {
 // WARNING: Make it 32 byte size
 struct ksm_event_log {
 	enum event_tag type;
+	/* DPU_UNSTABLE_MERGE: fingerprint of the merged content, in the padding */
+	uint32_t fp;
 	union {
 		// Unstable merge related
 		struct {
@@ -123,6 +149,25 @@ struct ksm_event_log {
 			unsigned long kpfn;
 			int last_mm_id;
 		} stale_node;
+		// Write-hot region the host leaves out of the next backoff iterations
+		struct {
+			uint64_t va;
+			int mm_id;
+			int backoff;
+		} hot_region;
+		// Subpages of a PMD-mapped THP with a match, for the host's split decision
+		struct {
+			uint64_t va;
+			int mm_id;
+			unsigned short stable;	/* equal to a stable node */
+			unsigned short zero;
+			unsigned short dup;	/* equal to another scanned page */
+		} thp_summary;
+		// Two pages the host write-protected, for the NIC to compare before it merges them
+		struct {
+			uint64_t addr[2];
+			uint32_t rkey[2];
+		} verify_pair;
 	};
 };
 
@@ -150,15 +195,23 @@ struct error_table_descriptor {
 	struct error_table_desc_entry entries[MAX_PAGES_DESCS];
 };
 
+/* read_rate_mbps that turns the server's read shaping off for the iteration */
+#define READ_RATE_UNSHAPED (~0ULL)
+
 struct metadata_descriptor {
     uint64_t pt_cnt;
     struct shadow_pt_descriptor pt_descs[MAX_MM_DESCS];
 	struct error_table_descriptor et_descs;
+	uint64_t read_rate_mbps;	/* NIC read shaping for this iteration, 0 keeps the server's rate, READ_RATE_UNSHAPED lifts it */
+	uint32_t hot_region_pct;	/* % of changed pages that makes a region hot, 0 disables DPU_HOT_REGION */
+	uint32_t dirty_tracking;	/* the host clears pte dirty bits, va may carry SHADOW_PTE_UNCHANGED */
+	struct error_table_descriptor vt_descs;	/* HOST_VERIFY_PAIR entries, only set in a verify round */
 };
 
 enum operation_cmd {
     PAGE_COMPARE,
     PAGE_HASH,
+    PAGE_BATCH,
 };
 
 struct operation_descriptor {
@@ -178,12 +231,63 @@ struct operation_result {
 	};
 };
 
+#define MAX_BATCH_OPS 64
+
+#define STYX_OP_PHYS_ADDR	0x1
+
+struct batch_op {
+	enum operation_cmd cmd;
+	int page_idx[2];
+	uint64_t addr[2];
+};
+
+struct batch_operation_descriptor {
+	enum operation_cmd cmd;
+	int id;
+	uint64_t rkey;
+	uint64_t iova;
+	uint64_t page_num;
+	int op_cnt;
+	int flags;
+	struct batch_op ops[MAX_BATCH_OPS];
+};
+
+union operation_value {
+	uint64_t xxhash;
+	int value;
+};
+
+struct batch_operation_result {
+	enum operation_cmd cmd;
+	int id;
+	union operation_value results[MAX_BATCH_OPS];
+};
+
+/* Host side of a dataplane batch, results are filled in place */
+struct styx_batch_op {
+	enum operation_cmd cmd;
+	struct page *pages[2];
+	int value;	/* memcmp result or 32-bit checksum */
+};
+
+struct styx_batch {
+	int op_cnt;
+	/*
+	 * Asynchronous submission only: called from the CQ handler (atomic
+	 * context) once the results are in, status is 0 on success.
+	 */
+	void (*done)(struct styx_batch *batch);
+	void *private;
+	int status;
+	struct styx_batch_op ops[MAX_BATCH_OPS];
+};
+
 struct result_desc {
 	int total_scanned_cnt;
 	int merged_cnt;
 	uint64_t rkey;
 	uint64_t result_table_addr;
-	uint64_t pad;
+	uint64_t pcie_read_bytes;	/* host memory read by the NIC this iteration */
 };
 
 struct result_table {
@@ -191,6 +295,8 @@ struct result_table {
 	struct ksm_event_log **entry_tables;
 	int tables_cnt;
 	int total_cnt;
+	u64 arrived_ns;		/* ktime when the server's result descriptor was seen */
+	u64 pcie_read_bytes;	/* copied out, result_desc is cleared for the next iteration */
 };
 
 int insert_error_log(struct error_table* error_table, enum event_tag tag, struct ksm_event_log* log);
@@ -234,13 +340,17 @@ struct ksm_cb {
 	struct ib_mr *single_op_desc_mr;
 	struct ib_sge single_op_desc_sgl;
 	u64          single_op_desc_dma_addr;
-	struct operation_descriptor single_op_desc_tx __aligned(16);
+	struct batch_operation_descriptor single_op_desc_tx __aligned(16);
 
 	struct ib_recv_wr single_op_recv_wr;
 	struct ib_mr *single_op_result_mr;
 	struct ib_sge single_op_result_sgl;
 	u64          single_op_result_dma_addr;
-	struct operation_result single_op_result_rx __aligned(16);
+	struct batch_operation_result single_op_result_rx __aligned(16);
+
+	struct ksm_lane *lanes;	/* extra connections for server reads */
+	int nr_lanes;
+	u32 session;
 
 	int tag;
 };
@@ -252,6 +362,8 @@ extern int (*rdma_reg_mr)(struct ksm_cb* cb, struct ib_mr* mr, int access);
 extern void (*rdma_print_timer)(void);
 extern int (*rdma_styx_memcmp)(struct ksm_cb* cb, void *page1, void *page2);
 extern unsigned long long (*rdma_styx_hash)(struct ksm_cb* cb, void *page);
+extern int (*rdma_styx_batch)(struct ksm_cb* cb, struct styx_batch *batch);
+extern int (*rdma_styx_batch_submit)(struct ksm_cb* cb, struct styx_batch *batch);
 
 extern struct ib_mr *(*do_mlx_ib_alloc_mr)(struct ib_pd *pd, enum ib_mr_type mr_type,
 			  u32 max_num_sg);
@@ -292,17 +404,28 @@ void rdma_unregister_shadow_mms(bool disconnected, int curr_iteration);
 struct list_head* send_meta_desc(void);
 struct result_table* recv_offload_result(unsigned long* ksm_pages_scanned);
 void free_result_table(struct result_table* result);
+struct result_table* rdma_verify_pairs(void);
 
 bool okay_to_run(void);
 
 /* Shadow MM related structures */
 
+/* Entries of pages at consecutive vas, va_arrays are in ascending va order */
+struct shadow_run {
+    unsigned long va;
+	unsigned int idx;	/* of the entry of the first page */
+	unsigned int nr;
+};
+
 struct address_to_page_map {
     struct shadow_pte **va_arrays;
-	struct xarray page_xa;
+	struct ksm_rmap_item ***item_arrays;	/* rmap_item of each entry, same chunks */
+	struct shadow_run *runs;
     size_t cnt;
     size_t capacity;
 	size_t va_array_cnt;
+	size_t run_cnt;
+	size_t run_capacity;
 };
 
 struct shadow_mm {
@@ -326,11 +449,35 @@ struct shadow_mm {
 struct mm_walk_args {
 	struct shadow_mm* shadow_mm;
 	struct ksm_mm_slot* mm_slot;
+	struct ksm_rmap_item** rmap_list;	/* the walk's cursor, as ksm_scan.rmap_list */
+	unsigned long address;	/* of the last rmap_item the walk took */
+	bool ptes_cleaned;	/* the walk cleared a dirty bit, the mm needs a flush */
+	bool dirty_range_open;	/* dirty_range covers the PMD being walked */
+	struct mmu_notifier_range dirty_range;
+	unsigned long nr_pages;	/* visited in the current chunk */
+	unsigned long budget;	/* pages the current chunk may visit */
+	unsigned long resume;	/* where the next chunk starts, TASK_SIZE when done */
+	struct ksm_rmap_item *stale;	/* unlinked under the pte lock, freed after the chunk */
+	unsigned long rmap_items_new;	/* not yet added to ksm_rmap_items */
+	/* Counted per walk, ksmd adds them up once the walks of all mms are done */
+	unsigned long dirty_cleaned;
+	unsigned long unchanged;
+	unsigned long damon_hot_skipped;
+	unsigned long regions_skipped;
+	unsigned long thp_exported;
+	unsigned long thp_deferred;
+	unsigned int chunks;
+	u64 hold_max_ns;
 };
 
 struct shadow_mm* create_empty(struct ksm_cb* cb);
+int shadow_mm_reserve(struct shadow_mm* shadow_mm, size_t entries, size_t runs);
 int insert_entry_to_shadow_mm(struct shadow_mm* shadow_mm, unsigned long va, unsigned long kpfn, void* rmap_item);
 void free_shadow_mm(struct shadow_mm* shadow_mm, bool disconnected, int curr_iteration);
 struct shadow_mm* get_shadow_mm(struct list_head* shadow_pt_list, int mm_id);
 struct ksm_rmap_item* shadow_mm_lookup(struct shadow_mm* shadow_mm, unsigned long va);
+int shadow_mm_index(struct shadow_mm* shadow_mm, unsigned long va);
+struct ksm_rmap_item* shadow_mm_item_at(struct shadow_mm* shadow_mm, size_t idx);
 unsigned long get_va_at(struct shadow_mm* shadow_mm, int idx);
+size_t shadow_chunk_entries(size_t chunk);
+size_t shadow_mm_size(struct shadow_mm* shadow_mm);
@@ -1,100 +1,174 @@
 #include "ksm.h"
 #include "linux/scatterlist.h"
-#include "linux/xarray.h"
 
 #define GROWTH_FACTOR 2
+#define MIN_RUNS 16
+
+size_t shadow_chunk_entries(size_t chunk) {
+    return chunk < SHADOW_CHUNK_GROWN ? SHADOW_CHUNK_MIN << chunk : MAX_CAPACITY_PER_TABLE;
+}
+
+/* Chunk of the idx-th entry, and the entry's index in it */
+static size_t shadow_chunk_of(size_t idx, size_t* idx_in_array) {
+    size_t grown = SHADOW_CHUNK_MIN * ((1UL << SHADOW_CHUNK_GROWN) - 1);
+    size_t array_idx;
+
+    if (idx >= grown) {
+        *idx_in_array = (idx - grown) % MAX_CAPACITY_PER_TABLE;
+        return SHADOW_CHUNK_GROWN + (idx - grown) / MAX_CAPACITY_PER_TABLE;
+    }
+
+    array_idx = ilog2(idx / SHADOW_CHUNK_MIN + 1);
+    *idx_in_array = idx - SHADOW_CHUNK_MIN * ((1UL << array_idx) - 1);
+    return array_idx;
+}
 
 struct shadow_mm* create_empty(struct ksm_cb* cb) {
-    int capacity;
     struct shadow_mm* shadow_page_table;
     if (!cb) {
         pr_err("ksm_cb not initialized\n");
         return NULL;
     }
 
-    capacity = PAGE_SIZE / sizeof(struct shadow_pte);
-    
-    shadow_page_table = (struct shadow_mm*) kmalloc(sizeof(struct shadow_mm), GFP_KERNEL);
+    /* The first chunk comes with the first entry */
+    shadow_page_table = (struct shadow_mm*) kzalloc(sizeof(struct shadow_mm), GFP_KERNEL);
     if (!shadow_page_table) {
         return NULL;
     }
 
-    shadow_page_table->pt_map.va_arrays = kmalloc(sizeof(struct shadow_pte*), GFP_KERNEL);
-    if (!shadow_page_table->pt_map.va_arrays) {
-        kfree(shadow_page_table);
-        return NULL;
-    }
-    
-    shadow_page_table->pt_map.va_arrays[0] = kmalloc(capacity * sizeof(struct shadow_pte), GFP_KERNEL);
-    if (!shadow_page_table->pt_map.va_arrays[0]) {
-        kfree(shadow_page_table);
-        return NULL;
-    }
-
-    xa_init(&shadow_page_table->pt_map.page_xa);
-
-    shadow_page_table->pt_map.va_array_cnt = 1;
-    shadow_page_table->pt_map.cnt = 0;
-    shadow_page_table->pt_map.capacity = capacity;
     shadow_page_table->connected_cb = cb;
 
     return shadow_page_table;
 }
 
-void grow_shadow_page_table(struct shadow_mm* shadow_page_table) {
-    struct shadow_pte* new_va_array;
+/* Adds a chunk, entries already in the map do not move */
+static int grow_shadow_page_table(struct shadow_mm* shadow_page_table) {
+    struct address_to_page_map* map = &shadow_page_table->pt_map;
+    size_t chunk = map->va_array_cnt;
+    size_t entries = shadow_chunk_entries(chunk);
+    struct shadow_pte** va_arrays;
+    struct ksm_rmap_item*** item_arrays;
+
+    va_arrays = krealloc(map->va_arrays, (chunk + 1) * sizeof(*va_arrays), GFP_KERNEL);
+    if (!va_arrays) {
+        return -ENOMEM;
+    }
+    map->va_arrays = va_arrays;
 
-    size_t curr_capacity = shadow_page_table->pt_map.capacity - MAX_CAPACITY_PER_TABLE * (shadow_page_table->pt_map.va_array_cnt - 1); 
-    size_t new_capacity = curr_capacity * GROWTH_FACTOR;
+    item_arrays = krealloc(map->item_arrays, (chunk + 1) * sizeof(*item_arrays), GFP_KERNEL);
+    if (!item_arrays) {
+        return -ENOMEM;
+    }
+    map->item_arrays = item_arrays;
+
+    /* A power of two of pages, so page aligned for the map MR either way */
+    va_arrays[chunk] = kvmalloc_array(entries, sizeof(struct shadow_pte), GFP_KERNEL);
+    item_arrays[chunk] = kvmalloc_array(entries, sizeof(struct ksm_rmap_item*), GFP_KERNEL);
+    if (!va_arrays[chunk] || !item_arrays[chunk]) {
+        pr_err("Faild to alloc va_array: size %ld\n", entries * sizeof(struct shadow_pte));
+        kvfree(va_arrays[chunk]);
+        kvfree(item_arrays[chunk]);
+        return -ENOMEM;
+    }
 
-    if (new_capacity > MAX_CAPACITY_PER_TABLE) {
-        new_va_array = kmalloc(PAGE_SIZE, GFP_KERNEL);
-        if (!new_va_array) {
-            return;
-        }
-        shadow_page_table->pt_map.va_arrays = krealloc(shadow_page_table->pt_map.va_arrays, (shadow_page_table->pt_map.va_array_cnt + 1) * sizeof(struct shadow_pte*), GFP_KERNEL);
+    map->va_array_cnt++;
+    map->capacity += entries;
+    return 0;
+}
 
-        shadow_page_table->pt_map.va_arrays[shadow_page_table->pt_map.va_array_cnt++] = new_va_array;
-        shadow_page_table->pt_map.capacity += PAGE_SIZE / sizeof(struct shadow_pte);
-        return;
-    } else {
-        new_va_array = krealloc(shadow_page_table->pt_map.va_arrays[shadow_page_table->pt_map.va_array_cnt - 1], new_capacity * sizeof(struct shadow_pte), GFP_KERNEL);
-        if (!new_va_array) {
-            pr_err("Faild to realloc va_array: size %ld\n", new_capacity * sizeof(struct shadow_pte));
-            return;
+static int grow_shadow_runs(struct address_to_page_map* map, size_t needed) {
+    struct shadow_run* runs;
+    size_t capacity = map->run_capacity ? map->run_capacity : MIN_RUNS;
+
+    while (capacity < needed) {
+        capacity *= GROWTH_FACTOR;
+    }
+    runs = kvmalloc_array(capacity, sizeof(*runs), GFP_KERNEL);
+    if (!runs) {
+        return -ENOMEM;
+    }
+    if (map->run_cnt) {
+        memcpy(runs, map->runs, map->run_cnt * sizeof(*runs));
+    }
+    kvfree(map->runs);
+    map->runs = runs;
+    map->run_capacity = capacity;
+    return 0;
+}
+
+/*
+ * Make room for @entries more entries and @runs more runs. The walk inserts
+ * under the pte lock, where nothing may sleep, so it reserves each PMD's worth
+ * before taking the lock.
+ */
+int shadow_mm_reserve(struct shadow_mm* shadow_mm, size_t entries, size_t runs) {
+    struct address_to_page_map* map = &shadow_mm->pt_map;
+
+    while (map->cnt + entries > map->capacity) {
+        if (grow_shadow_page_table(shadow_mm)) {
+            pr_err("Failed to grow shadow page table\n");
+            return -ENOMEM;
         }
-        shadow_page_table->pt_map.va_arrays[shadow_page_table->pt_map.va_array_cnt - 1] = new_va_array;
-        shadow_page_table->pt_map.capacity += (new_capacity - curr_capacity);
     }
+
+    if (map->run_cnt + runs > map->run_capacity && grow_shadow_runs(map, map->run_cnt + runs)) {
+        pr_err("Failed to grow shadow runs\n");
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/* Room for the run was reserved with shadow_mm_reserve() */
+static int add_shadow_run(struct address_to_page_map* map, unsigned long va) {
+    if (map->run_cnt == map->run_capacity) {
+        return -ENOMEM;
+    }
+
+    map->runs[map->run_cnt].va = va;
+    map->runs[map->run_cnt].idx = map->cnt;
+    map->runs[map->run_cnt].nr = 0;
+    map->run_cnt++;
+    return 0;
 }
 
+/*
+ * Entries must come in ascending va order, as the shadow walk emits them, and
+ * fit in what shadow_mm_reserve() set aside: this allocates nothing.
+ */
 int insert_entry_to_shadow_mm(struct shadow_mm* shadow_mm, unsigned long va, unsigned long kpfn, void* rmap_item) {
-    size_t cnt = shadow_mm->pt_map.cnt;
+    struct address_to_page_map* map = &shadow_mm->pt_map;
+    struct shadow_run* run = map->run_cnt ? &map->runs[map->run_cnt - 1] : NULL;
+    unsigned long page_va = va & PAGE_MASK;
+    unsigned long run_end = run ? run->va + ((unsigned long)run->nr << PAGE_SHIFT) : 0;
     size_t array_idx, idx;
-    int err;
-    
-    if (cnt >= shadow_mm->pt_map.capacity) {
-        grow_shadow_page_table(shadow_mm);
+
+    if (run && page_va < run_end) {
+        pr_err("Shadow page table entry not ascending: %lx vs %lx\n", page_va, run_end);
+        return -1;
     }
 
-    if (cnt >= shadow_mm->pt_map.capacity) {
-        pr_err("Failed to grow shadow page table\n");
+    if (map->cnt >= map->capacity) {
+        pr_err("Shadow page table full at %lx\n", page_va);
         return -1;
     }
 
-    array_idx = cnt / MAX_CAPACITY_PER_TABLE;
-    idx = cnt % MAX_CAPACITY_PER_TABLE;
+    /* A page right after the last one extends its run */
+    if (!run || page_va != run_end) {
+        if (add_shadow_run(map, page_va)) {
+            pr_err("Shadow runs full at %lx\n", page_va);
+            return -1;
+        }
+        run = &map->runs[map->run_cnt - 1];
+    }
 
-    shadow_mm->pt_map.va_arrays[array_idx][idx].va = va;
-    shadow_mm->pt_map.va_arrays[array_idx][idx].pfn = kpfn;
+    array_idx = shadow_chunk_of(map->cnt, &idx);
 
-    err = xa_insert(&shadow_mm->pt_map.page_xa, va >> PAGE_SHIFT, rmap_item, GFP_KERNEL);
-    if (err) {
-        pr_err("Failed to insert into xa\n");
-        return -1;
-    }
+    map->va_arrays[array_idx][idx].va = va;
+    map->va_arrays[array_idx][idx].pfn = kpfn;
+    map->item_arrays[array_idx][idx] = rmap_item;
 
-    shadow_mm->pt_map.cnt++;
+    run->nr++;
+    map->cnt++;
     return 0;
 }
 
@@ -105,12 +179,12 @@ void free_shadow_mm(struct shadow_mm* shadow_mm, bool disconnected, int curr_ite
     struct scatterlist *sgt, *next_sgt, *sg;
 
     struct ksm_rmap_item* entry;
-    unsigned long index;
 
     if (disconnected)
         pr_info("[BASK] Disconnect detected. We need to clean up shadow mm cleanly");
 
-    xa_for_each(&shadow_mm->pt_map.page_xa, index, entry) {
+    for (i = 0; i < shadow_mm->pt_map.cnt; i++) {
+        entry = shadow_mm_item_at(shadow_mm, i);
         if (!entry->page) {
             pr_err("Page is NULL at va %lx\n", entry->address);
         } else {
@@ -124,8 +198,6 @@ void free_shadow_mm(struct shadow_mm* shadow_mm, bool disconnected, int curr_ite
         }
     }
 
-    xa_destroy(&shadow_mm->pt_map.page_xa);
-
     for (j = 0; j < shadow_mm->pages_sgt_cnt; j++) {
         sgt = shadow_mm->pages_sgt[j];
         freed = 0;
@@ -161,19 +233,31 @@ void free_shadow_mm(struct shadow_mm* shadow_mm, bool disconnected, int curr_ite
     }
 
     for (i = 0; i < shadow_mm->pt_map.va_array_cnt; i++) {
-        kfree(shadow_mm->pt_map.va_arrays[i]);
+        kvfree(shadow_mm->pt_map.va_arrays[i]);
+        kvfree(shadow_mm->pt_map.item_arrays[i]);
     }
     kfree(shadow_mm->pt_map.va_arrays);
+    kfree(shadow_mm->pt_map.item_arrays);
+    kvfree(shadow_mm->pt_map.runs);
     kfree(shadow_mm);
 }
 
 unsigned long get_va_at(struct shadow_mm* shadow_mm, int idx) {
-    int array_idx = idx / MAX_CAPACITY_PER_TABLE;
-    int idx_in_array = idx - array_idx * MAX_CAPACITY_PER_TABLE;
+    size_t array_idx, idx_in_array;
+
+    BUG_ON(idx >= shadow_mm->pt_map.cnt);
+
+    array_idx = shadow_chunk_of(idx, &idx_in_array);
+    return shadow_mm->pt_map.va_arrays[array_idx][idx_in_array].va & PAGE_MASK;
+}
+
+struct ksm_rmap_item* shadow_mm_item_at(struct shadow_mm* shadow_mm, size_t idx) {
+    size_t array_idx, idx_in_array;
 
     BUG_ON(idx >= shadow_mm->pt_map.cnt);
 
-    return shadow_mm->pt_map.va_arrays[array_idx][idx_in_array].va;
+    array_idx = shadow_chunk_of(idx, &idx_in_array);
+    return shadow_mm->pt_map.item_arrays[array_idx][idx_in_array];
 }
 
 struct shadow_mm* get_shadow_mm(struct list_head* shadow_pt_list, int mm_id) {
@@ -186,8 +270,47 @@ struct shadow_mm* get_shadow_mm(struct list_head* shadow_pt_list, int mm_id) {
     return NULL;
 }
 
+/* Index of the entry of va, -1 if the map has none. Searches the runs, not the pages */
+int shadow_mm_index(struct shadow_mm* shadow_mm, unsigned long va) {
+    struct address_to_page_map* map = &shadow_mm->pt_map;
+    size_t lo = 0, hi = map->run_cnt, mid;
+    struct shadow_run* run;
+
+    va &= PAGE_MASK;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (map->runs[mid].va <= va) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (!lo) {
+        return -1;
+    }
+
+    run = &map->runs[lo - 1];
+    if (((va - run->va) >> PAGE_SHIFT) >= run->nr) {
+        return -1;
+    }
+    return run->idx + ((va - run->va) >> PAGE_SHIFT);
+}
+
 struct ksm_rmap_item* shadow_mm_lookup(struct shadow_mm* shadow_mm, unsigned long va) {
-    return xa_load(&shadow_mm->pt_map.page_xa, va >> PAGE_SHIFT);
+    int idx = shadow_mm_index(shadow_mm, va);
+
+    return idx < 0 ? NULL : shadow_mm_item_at(shadow_mm, idx);
+}
+
+/* Host memory of the map, with the page MRs' scatterlists */
+size_t shadow_mm_size(struct shadow_mm* shadow_mm) {
+    struct address_to_page_map* map = &shadow_mm->pt_map;
+
+    return sizeof(struct shadow_mm) +
+        map->capacity * (sizeof(struct shadow_pte) + sizeof(struct ksm_rmap_item*)) +
+        map->va_array_cnt * (sizeof(struct shadow_pte*) + sizeof(struct ksm_rmap_item**)) +
+        map->run_capacity * sizeof(struct shadow_run) +
+        map->cnt * sizeof(struct scatterlist);
 }
 
 /*===================================================================================*/